@@ -0,0 +1,248 @@
+/*!
+ * @file protocol_benchmark.cpp
+ *
+ * Measures how fast the firmware's UART module processes commands. The real
+ * uart.c is linked against the emulated registers, received bytes go through
+ * _U1RXInterrupt() and the event queue exactly like on the device, and the
+ * transmit queue is drained by emulating the TX interrupt.
+ *
+ * Usage: protocol_benchmark [iterations] [--min-commands-per-second N]
+ *
+ * Returns non-zero if the overall throughput drops below the given minimum,
+ * so it can be used as a regression gate for protocol changes.
+ */
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/event.h"
+#include "drv/hw.h"
+#include "drv/uart.h"
+#include "usr/pv_model.h"
+
+/* bytes are at most 0xFF, so this tells us whether the ISR wrote anything */
+#define TX_IDLE 0x100
+
+/* only hardware-emulation symbols from uart.c that aren't in a header */
+void _U1RXInterrupt(void);
+void _U1TXInterrupt(void);
+
+static unsigned long tx_bytes = 0;
+
+/* -------------------------------------------------------------------------- */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Emulates the TX interrupt for one byte. Returns 0 if the queue was empty */
+static int send_one_byte(void)
+{
+    U1TXREG = TX_IDLE;
+    _U1TXInterrupt();
+    if(U1TXREG == TX_IDLE)
+        return 0;
+    ++tx_bytes;
+    return 1;
+}
+
+/* Called by uart_send() while it waits for space in the transmit queue */
+void benchmark_tx_update(void)
+{
+    send_one_byte();
+}
+
+/* -------------------------------------------------------------------------- */
+static void receive(const char* command)
+{
+    for(; *command; ++command)
+    {
+        U1STAbits.PERR = 0;
+        U1STAbits.FERR = 0;
+        U1RXREG = (unsigned char)*command;
+        _U1RXInterrupt();
+        event_dispatch_all();
+    }
+
+    /*
+     * The shift register is always busy, only the TX interrupt sends. Some
+     * replies (config dump) continue over several dispatches, keep going
+     * until a dispatch doesn't produce anything.
+     */
+    while(send_one_byte())
+    {
+        while(send_one_byte()) {}
+        event_dispatch_all();
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+struct benchmark_t
+{
+    const char* name;
+    std::vector<std::string> commands;
+    std::vector<double> latencies;
+    unsigned long rx_bytes;
+    unsigned long tx_bytes;
+    double total_time;
+};
+
+static void run(struct benchmark_t* b, int iterations)
+{
+    unsigned long tx_start = tx_bytes;
+    int i;
+
+    b->latencies.clear();
+    b->rx_bytes = 0;
+    b->total_time = 0;
+
+    for(i = 0; i != iterations; ++i)
+    {
+        const std::string& command = b->commands[i % b->commands.size()];
+        double start = now();
+        receive(command.c_str());
+        double latency = now() - start;
+
+        b->latencies.push_back(latency);
+        b->total_time += latency;
+        b->rx_bytes += command.size();
+    }
+
+    b->tx_bytes = tx_bytes - tx_start;
+}
+
+/* -------------------------------------------------------------------------- */
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void report(const struct benchmark_t* b)
+{
+    std::vector<double> sorted(b->latencies);
+    std::sort(sorted.begin(), sorted.end());
+
+    printf("%-22s %10.0f %12.0f %12.0f %8.2f %8.2f %8.2f %8.2f\n",
+           b->name,
+           b->latencies.size() / b->total_time,
+           b->rx_bytes / b->total_time,
+           b->tx_bytes / b->total_time,
+           sorted.front() * 1e6,
+           percentile(sorted, 0.5) * 1e6,
+           percentile(sorted, 0.99) * 1e6,
+           sorted.back() * 1e6);
+}
+
+/* -------------------------------------------------------------------------- */
+static void create_panel(int cell_count)
+{
+    int i;
+    model_cell_remove_all();
+    for(i = 0; i != cell_count; ++i)
+    {
+        unsigned char id = model_cell_add();
+        model_set_open_circuit_voltage(id, 6 * 65536);
+        model_set_short_circuit_current(id, 3 * 65536);
+        model_set_thermal_voltage(id, 65536);
+        model_set_relative_solar_irradiation(id, 65536);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char** argv)
+{
+    int iterations = 20000;
+    double min_commands_per_second = 0;
+    int i;
+
+    for(i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--min-commands-per-second") == 0 && i + 1 < argc)
+            min_commands_per_second = atof(argv[++i]);
+        else
+            iterations = atoi(argv[i]);
+    }
+    if(iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations] [--min-commands-per-second N]\n", argv[0]);
+        return 2;
+    }
+
+    /* shift register is busy, so uart_send() never writes U1TXREG directly */
+    U1STAbits.TRMT = 0;
+    uart_init();
+    create_panel(16);
+
+    struct benchmark_t benchmarks[7];
+
+    benchmarks[0].name = "ping k";
+    benchmarks[0].commands.push_back("k");
+
+    benchmarks[1].name = "write cUIET";
+    {   char buf[64]; int id;
+        for(id = 1; id <= 16; ++id)
+        {
+            sprintf(buf, "c%dU%d\nc%dI3000\nc%dT2930\nc%dE%d\n",
+                    id, 4000 + id, id, id, id, 50 + id);
+            benchmarks[1].commands.push_back(buf);
+        }
+    }
+
+    benchmarks[2].name = "write #n cE (acked)";
+    {   char buf[32]; int n;
+        for(n = 0; n != 256; ++n)
+        {
+            sprintf(buf, "#%dc%dE%d\n", n, n % 16 + 1, n % 100);
+            benchmarks[2].commands.push_back(buf);
+        }
+    }
+
+    benchmarks[3].name = "remove r (miss)";
+    benchmarks[3].commands.push_back("r200\n");
+
+    benchmarks[4].name = "measure m";
+    benchmarks[4].commands.push_back("m\n");
+
+    benchmarks[5].name = "dump d (16 cells)";
+    benchmarks[5].commands.push_back("d\n");
+
+    benchmarks[6].name = "baud b (invalid)";
+    benchmarks[6].commands.push_back("b99\n");
+
+    printf("%-22s %10s %12s %12s %8s %8s %8s %8s\n",
+           "command", "cmds/s", "rx bytes/s", "tx bytes/s",
+           "min us", "p50 us", "p99 us", "max us");
+
+    double total_time = 0;
+    unsigned long total_commands = 0;
+    for(i = 0; i != 7; ++i)
+    {
+        run(&benchmarks[i], iterations);
+        report(&benchmarks[i]);
+        total_time += benchmarks[i].total_time;
+        total_commands += benchmarks[i].latencies.size();
+    }
+
+    double commands_per_second = total_commands / total_time;
+    printf("\noverall: %.0f commands/s\n", commands_per_second);
+
+    model_cell_remove_all();
+
+    if(commands_per_second < min_commands_per_second)
+    {
+        printf("FAILED: below the required %.0f commands/s\n",
+               min_commands_per_second);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*!
+ * @file string_benchmark.cpp
+ *
+ * Compares the number formatters of core/string.c with the division based
+ * ones they replaced, which are kept below for reference. The host compiler
+ * turns / 10 into a multiply by itself, so this mostly shows what the sink
+ * costs. On the dsPIC every / and % is a library call of ~20 cycles, which
+ * the new formatters don't make.
+ *
+ * Usage: string_benchmark [iterations] [--verify-all]
+ *
+ * --verify-all formats every one of the 2^32 _Q16 values with 5 decimals and
+ * checks that it reads back as the same value. This takes a few minutes, the
+ * unit tests cover a subset of it. Returns non-zero on a mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/string.h"
+
+/* -------------------------------------------------------------------------- */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The formatters as they were, with % and / per digit */
+static char* legacy_nitoa(char* dest, short digits, short number)
+{
+    char buffer[5], *ptr;
+    unsigned char is_negative = 0;
+
+    --digits;
+    if(number == 0)
+    {
+        *dest++ = '0';
+        *dest = '\0';
+        return dest;
+    }
+    if(number < 0)
+    {
+        number = -number;
+        is_negative = 1;
+    }
+    ptr = buffer;
+    while(number != 0)
+    {
+        short remainder = number % 10;
+        number /= 10;
+        *ptr++ = remainder + '0';
+    }
+    if(is_negative)
+    {
+        *dest++ = '-';
+        --digits;
+    }
+    while(ptr-- != buffer && digits --> 0)
+        *dest++ = *ptr;
+    *dest = '\0';
+    return dest;
+}
+
+static char* legacy_q16itoa(char* dest, short n, _Q16 value)
+{
+    char* ptr;
+    short before_decimal = value >> 16;
+    unsigned short after_decimal = (value & 0xFFFF) * 10000 / 65536;
+
+    if(after_decimal && before_decimal < 0)
+        ++before_decimal;
+    ptr = legacy_nitoa(dest, n, before_decimal);
+    n -= ptr - dest + 1;
+    if(n < 2)
+        return ptr;
+    *ptr++ = '.'; *ptr = '\0';
+    return legacy_nitoa(ptr, n, after_decimal);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Stands in for the transmit queue, so only the formatting is measured */
+struct checksum_sink_t
+{
+    struct str_sink_t sink;
+    unsigned long sum;
+};
+
+static void put_into_checksum(struct str_sink_t* sink, char c)
+{
+    ((struct checksum_sink_t*)sink)->sum += (unsigned char)c;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Values roughly like the measurements, spread over the whole range */
+static _Q16 sample(unsigned long i)
+{
+    return (_Q16)((i * 2654435761UL) >> 4) - (_Q16)0x08000000;
+}
+
+static void report(const char* name, double seconds, unsigned long iterations,
+                   double baseline)
+{
+    printf("%-36s %10.1f ns %8.2fx\n", name, seconds / iterations * 1e9,
+           baseline / seconds);
+}
+
+static int benchmark(unsigned long iterations)
+{
+    struct checksum_sink_t sink = { { put_into_checksum }, 0 };
+    unsigned long i;
+    char line[32];
+    double start, legacy;
+
+    printf("%-36s %13s %9s\n", "formatter", "per number", "speedup");
+
+    /*
+     * The buffered variants copy into the sink afterwards, the way
+     * uart_send() and lcd_writeline() copy into the queue and display buffer
+     */
+    start = now();
+    for(i = 0; i != iterations; ++i)
+    {
+        legacy_q16itoa(line, 7, sample(i));
+        str_put_string(&sink.sink, line);
+    }
+    legacy = now() - start;
+    report("q16 legacy, buffer + copy", legacy, iterations, legacy);
+
+    start = now();
+    for(i = 0; i != iterations; ++i)
+    {
+        str_q16itoa(line, 7, sample(i));
+        str_put_string(&sink.sink, line);
+    }
+    report("q16 str_q16itoa, buffer + copy", now() - start, iterations, legacy);
+
+    start = now();
+    for(i = 0; i != iterations; ++i)
+        str_put_q16(&sink.sink, sample(i), 6, 2);
+    report("q16 str_put_q16, into sink", now() - start, iterations, legacy);
+
+    /* the integers of the UART protocol */
+    start = now();
+    for(i = 0; i != iterations; ++i)
+    {
+        legacy_nitoa(line, 7, (short)sample(i));
+        str_put_string(&sink.sink, line);
+    }
+    legacy = now() - start;
+    report("int legacy, buffer + copy", legacy, iterations, legacy);
+
+    start = now();
+    for(i = 0; i != iterations; ++i)
+        str_put_int(&sink.sink, (short)sample(i), 0);
+    report("int str_put_int, into sink", now() - start, iterations, legacy);
+
+    /* keeps the compiler from dropping the loops */
+    printf("\nchecksum %lu\n", sink.sum);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static long long parse_q16(const char* s)
+{
+    long long integer = 0, fraction = 0;
+    const char* p = s + (*s == '-');
+    for(; *p != '.'; ++p)
+        integer = integer * 10 + *p - '0';
+    for(++p; *p; ++p)
+        fraction = fraction * 10 + *p - '0';
+    fraction = ((integer * 100000 + fraction) * 65536 + 50000) / 100000;
+    return *s == '-' ? -fraction : fraction;
+}
+
+static int verify_all(void)
+{
+    unsigned long long i;
+    char s[32];
+    struct str_buffer_t buffer;
+
+    for(i = 0; i != 0x100000000ULL; ++i)
+    {
+        _Q16 value = (_Q16)(unsigned int)i;
+        str_put_q16(str_buffer_init(&buffer, s, sizeof(s)), value, 0,
+                    STR_Q16_MAX_DECIMALS);
+        if(parse_q16(s) != value)
+        {
+            fprintf(stderr, "0x%08x formatted as %s\n", (unsigned int)value, s);
+            return 1;
+        }
+        if((i & 0xFFFFFFF) == 0xFFFFFFF)
+            fprintf(stderr, "\r%llu/16", (i >> 28) + 1);
+    }
+    fprintf(stderr, "\nall values read back exactly\n");
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char** argv)
+{
+    long iterations = 10000000;
+    int i, verify = 0;
+
+    for(i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--verify-all") == 0)
+            verify = 1;
+        else
+            iterations = atol(argv[i]);
+    }
+    if(iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations] [--verify-all]\n", argv[0]);
+        return 2;
+    }
+
+    if(benchmark((unsigned long)iterations))
+        return 1;
+    return verify ? verify_all() : 0;
+}
@@ -37,10 +37,17 @@ typedef enum
      *  means the device was unplugged, in which case the device has a short
      *  time to prepare for total power off. UVLO is triggered when the 36V
      *  rail sinks below 25V. The 3.3V rail remains stable until the 36V rail
-     *  reaches ~4V */
+     *  reaches ~4V. The interrupt saves the configuration before posting
+     *  this, see journal_uvlo(), listeners may not get to run at all */
     EVENT_UVLO,
     EVENT_DATA_RECEIVED,
     EVENT_CELL_VALUE_UPDATED,
+    /*! Posted by the UART driver to itself to send the next cell of a config
+     *  dump during the next dispatch, see uart.c */
+    EVENT_UART_DUMP_NEXT,
+    /*! Posted by the buck driver when a transient capture is complete, see
+     *  buck_transient_arm() */
+    EVENT_TRANSIENT_CAPTURED,
     /* ---------------------------------------------------------------------- */
     /*! The number of event IDs. Used to size the static table.
      *  NOTE: Keep this at the end of the enum! */
@@ -56,7 +63,10 @@ typedef enum
     BUTTON_TWISTED_RIGHT = 2,
     BUTTON_PRESSED = 3,
     BUTTON_PRESSED_LONGER = 4,
-    BUTTON_RELEASED = 5
+    BUTTON_RELEASED = 5,
+    /* twisted while the button is held down, instead of a press */
+    BUTTON_PRESSED_TWISTED_LEFT = 6,
+    BUTTON_PRESSED_TWISTED_RIGHT = 7
 } event_args_e;
 
 /*!
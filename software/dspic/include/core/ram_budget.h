@@ -0,0 +1,56 @@
+/*!
+ * @file ram_budget.h
+ *
+ * The dsPIC33EP16GS506 has 2 KB of RAM (0x1000 - 0x17FF) for the static
+ * variables, the heap and the stack. The heap holds the cells and the event
+ * listeners (heap-size of the Release configuration), the linker gives the
+ * stack whatever is left.
+ *
+ * Every buffer of more than a few dozen bytes has a budget here and checks
+ * its size against it with RAM_BUDGET_CHECK() next to its definition. The
+ * unit tests are compiled for the host, where sizes are at least what they
+ * are on the target, so a check that passes there passes on the device too.
+ * The sum of all budgets is checked below, growing a buffer means taking the
+ * bytes from another one.
+ */
+
+#ifndef RAM_BUDGET_H
+#define RAM_BUDGET_H
+
+/*!
+ * @brief Compile time check, usable at file scope.
+ * @param[in] name Unique name of the check.
+ */
+#define RAM_BUDGET_CHECK(name, size, budget) \
+    typedef char ram_budget_##name[((size) <= (budget)) ? 1 : -1]
+
+#define RAM_SIZE                2048
+#define RAM_HEAP                256     /* heap-size, Release */
+#define RAM_STACK               224     /* both ISR levels on the main loop */
+
+/* buck.c */
+#define RAM_BUDGET_TRANSIENT    138     /* 32 sample pairs */
+#define RAM_BUDGET_ADC_BLOCKS   64      /* two blocks of 8 sample pairs */
+#define RAM_BUDGET_STATS        100
+/* lcd.c */
+#define RAM_BUDGET_LCD_SHADOW   96      /* 4 x 20 characters and dirty bits */
+/* menu.c */
+#define RAM_BUDGET_MENU_LINES   24      /* keys of the 3 item rows */
+/* profile.c */
+#define RAM_BUDGET_PROFILE      104     /* 4 keyframes */
+
+/*
+ * Everything else, counted from the declarations for the target: event
+ * queue and listener table 302, LCD FIFO 270, UART 138, buck.c 83, journal
+ * 74, panels_db 52, calibration 40, boot 30, menu 30, pv_model 17, button 4.
+ */
+#define RAM_UNBUDGETED          1040
+
+RAM_BUDGET_CHECK(total,
+                 RAM_BUDGET_TRANSIENT + RAM_BUDGET_ADC_BLOCKS +
+                 RAM_BUDGET_STATS + RAM_BUDGET_LCD_SHADOW +
+                 RAM_BUDGET_MENU_LINES + RAM_BUDGET_PROFILE +
+                 RAM_UNBUDGETED + RAM_HEAP + RAM_STACK,
+                 RAM_SIZE);
+
+#endif /* RAM_BUDGET_H */
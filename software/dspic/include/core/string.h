@@ -14,6 +14,31 @@
 extern "C" {
 #endif
 
+/*!
+ * @brief Destination of the str_put_*() formatters. Characters are handed
+ * over one by one, so numbers can be written straight into a transmit queue
+ * or display buffer without a temporary string. Embed it as the first member
+ * of a struct holding whatever state the destination needs.
+ */
+struct str_sink_t
+{
+    void (*put)(struct str_sink_t* sink, char c);
+};
+
+/*!
+ * @brief Sink writing into a character array, see str_buffer_init().
+ */
+struct str_buffer_t
+{
+    struct str_sink_t sink;
+    char* write;
+    char* end;                  /* where the null terminator goes when full */
+    unsigned char truncated;    /* set when characters had to be dropped */
+};
+
+/* Maximum number of decimals str_put_q16() can show, 1/65536 needs 5 */
+#define STR_Q16_MAX_DECIMALS 5
+
 /*!
  * @brief Reverses the order of a null terminated character array.
  * @note The data is modified in-place. If you wish to keep the original
@@ -79,12 +104,70 @@ char* str_append(char* dest, short n, const char* src);
 char* str_nitoa(char* dest, short n, short number);
 
 /*!
- * @brief Converts a _Q16 fixed point type into a string.
- * @param[out] dest The destination buffer to write to. The size of this buffer
- * must be at least
+ * @brief Converts the first n digits of an unsigned integer into a string.
+ * @param[out] dest The destination buffer to write into. Must have space for
+ * **digits** characters, including the null terminator.
+ * @param[in] digits The number of characters to write, including the null
+ * terminator.
+ * @param[in] number The integer to convert into a string.
+ * @return Returns a pointer into the destination buffer pointing to the null
+ * terminator at the end of the string.
+ */
+char* str_nutoa(char* dest, short digits, unsigned short number);
+
+/*!
+ * @brief Converts a _Q16 fixed point type into a string, rounded to as many
+ * decimals (up to 4) as fit.
+ * @param[out] dest The destination buffer to write to.
+ * @param[in] n The destination buffer length, **including** null terminator.
+ * @param[in] value The number to convert.
+ * @return Returns a pointer into the destination buffer pointing to the null
+ * terminator at the end of the string.
  */
 char* str_q16itoa(char* dest, short n, _Q16 value);
 
+/*!
+ * @brief Sets up a sink writing into dest. The string is kept null
+ * terminated, characters that don't fit are dropped.
+ * @param[in] n The destination buffer length, **including** null terminator.
+ * @return Returns the sink to pass to the str_put_*() functions.
+ */
+struct str_sink_t* str_buffer_init(struct str_buffer_t* buffer,
+                                   char* dest,
+                                   short n);
+
+/*!
+ * @brief Writes a null terminated string to a sink.
+ */
+void str_put_string(struct str_sink_t* sink, const char* str);
+
+/*!
+ * @brief Writes an unsigned integer to a sink.
+ * @param[in] width Minimum number of characters, shorter numbers are padded
+ * with spaces on the left. 0 writes just the digits.
+ */
+void str_put_unsigned(struct str_sink_t* sink,
+                      unsigned short number,
+                      unsigned char width);
+
+/*!
+ * @brief Writes an integer to a sink, see str_put_unsigned().
+ */
+void str_put_int(struct str_sink_t* sink, short number, unsigned char width);
+
+/*!
+ * @brief Writes a _Q16 fixed point number to a sink with a fixed number of
+ * decimals, rounded half away from zero. With STR_Q16_MAX_DECIMALS, the
+ * output reads back as exactly the same _Q16.
+ * @param[in] width Minimum number of characters, see str_put_unsigned().
+ * @param[in] decimals Number of digits after the decimal point, at most
+ * STR_Q16_MAX_DECIMALS. 0 leaves out the decimal point.
+ */
+void str_put_q16(struct str_sink_t* sink,
+                 _Q16 value,
+                 unsigned char width,
+                 unsigned char decimals);
+
 #ifdef __cplusplus
 }
 #endif
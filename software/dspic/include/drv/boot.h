@@ -0,0 +1,58 @@
+/*!
+ * @file boot.h
+ *
+ * Records when each phase of the power-on sequence completes, so the time from
+ * reset to a live output can be measured on the real hardware and reported to
+ * the host. Timer 2/3 runs as a free running 32-bit counter from the very
+ * start of hw_init() and is only read when a phase is marked.
+ */
+
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*! @brief Phases in the order they usually complete. */
+typedef enum boot_phase_e
+{
+    BOOT_CLOCK_LOCKED = 0,  /* running from the PLL */
+    BOOT_ADC_READY,         /* ADC cores powered and calibrated */
+    BOOT_DRIVERS_READY,     /* drivers_init() returned */
+    BOOT_CALIBRATION_LOADED,/* conversion coefficients loaded from flash */
+    BOOT_MENU_READY,        /* panel database and menu initialised */
+    BOOT_LCD_READY,         /* configuration and first screen sent */
+    BOOT_OUTPUT_LIVE,       /* buck enabled for the first time */
+    BOOT_PHASE_COUNT
+} boot_phase_e;
+
+/*! @brief Returned by boot_get_time() for phases that were never reached. */
+#define BOOT_TIME_PENDING 0xFFFFFFFFUL
+
+/*!
+ * @brief Starts the boot timer. Must be called before the clock is switched to
+ * the PLL, see hw_init().
+ */
+void boot_timer_start(void);
+
+/*!
+ * @brief Records the current time for a phase. Only the first call per phase
+ * counts, later ones are ignored. Safe to call from interrupts. Marks taken
+ * after the 32-bit counter overflowed (about 70s) are dropped.
+ */
+void boot_mark(boot_phase_e phase);
+
+/*!
+ * @brief Returns the time between reset and the given phase in microseconds,
+ * or BOOT_TIME_PENDING if the phase hasn't been marked.
+ */
+uint32_t boot_get_time(boot_phase_e phase);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BOOT_H */
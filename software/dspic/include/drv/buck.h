@@ -9,21 +9,278 @@
 #define	BUCK_H
 
 #include <libq.h>
+#include <stdint.h>
 
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
+/*!
+ * @brief Coefficients to convert ADC readings to volts and amps:
+ *
+ *   value = (reading - offset) * gain >> BUCK_CALIBRATION_SHIFT
+ *
+ * Readings and offsets are in 12.4 format (ADC LSBs with 4 fractional bits),
+ * values in Q16, so the gains are in Q16 units per LSB with 4 fractional bits.
+ * Readings are taken relative to the 1.5V reference, see
+ * buck_get_reference_scale().
+ */
+struct buck_calibration_t
+{
+    uint16_t voltage_offset;
+    uint16_t voltage_gain;
+    uint16_t current_offset;
+    uint16_t current_gain;
+};
+
+#define BUCK_CALIBRATION_SHIFT      8
+#define BUCK_DEFAULT_VOLTAGE_OFFSET 0
+#define BUCK_DEFAULT_VOLTAGE_GAIN   (845 * 16)
+#define BUCK_DEFAULT_CURRENT_OFFSET (1862 * 16)
+#define BUCK_DEFAULT_CURRENT_GAIN   (330 * 16)
+
+/*!
+ * @brief Statistics of one channel over a window of conversions, see
+ * buck_get_stats(). All values are in Q16 volts or amps.
+ */
+struct buck_channel_stats_t
+{
+    _Q16 mean;
+    _Q16 min;
+    _Q16 max;
+    _Q16 ripple;                /* RMS of the deviation from the mean */
+};
+
+struct buck_stats_t
+{
+    struct buck_channel_stats_t voltage;
+    struct buck_channel_stats_t current;
+    _Q16 power;                 /* mean of voltage * current, Q16 watts */
+    _Q16 energy;                /* Q16 watt hours, see buck_reset_energy() */
+    unsigned short window;      /* counts completed windows, wraps */
+};
+
+/*! @brief Number of samples buck_transient_arm() records. */
+#define BUCK_TRANSIENT_DEPTH 32
+
+/*!
+ * @brief State of the transient capture. The order matters, states from
+ * BUCK_TRANSIENT_ARMED on record samples.
+ */
+typedef enum
+{
+    BUCK_TRANSIENT_IDLE = 0,
+    BUCK_TRANSIENT_DONE,
+    BUCK_TRANSIENT_ARMED,
+    BUCK_TRANSIENT_TRIGGERED
+} buck_transient_state_e;
+
 /*!
  * @brief Initialises the buck driver. Call this for the buck to work.
  */
 void buck_init(void);
 
+/*!
+ * @brief buck_init() in two halves. The first configures the driver and
+ * powers up the ADC cores, the second waits for them to warm up, calibrates
+ * them and starts the conversion interrupts. Other drivers can be initialised
+ * in between while the cores warm up, see drivers_init().
+ */
+void buck_init_begin(void);
+void buck_init_end(void);
+
 void buck_enable(void);
 void buck_disable(void);
 
+/*!
+ * @brief Gets the output voltage averaged over a block of conversions, see
+ * buck_set_averaging(). Use this for display and telemetry.
+ */
 _Q16 buck_get_voltage(void);
+
+/*!
+ * @brief Gets the output current averaged over a block of conversions, see
+ * buck_set_averaging(). Use this for display and telemetry.
+ */
 _Q16 buck_get_current(void);
+
+/*!
+ * @brief Gets the output voltage through a light low pass filter that only
+ * lags a few conversions behind. Use this for regulation.
+ */
+_Q16 buck_get_voltage_fast(void);
+
+/*!
+ * @brief Gets the output current through a light low pass filter that only
+ * lags a few conversions behind. Use this for regulation.
+ */
+_Q16 buck_get_current_fast(void);
+
+/*!
+ * @brief Sets the output voltage the buck should regulate to. If the
+ * regulator is disabled, this is the same as buck_set_voltage().
+ */
+void buck_regulator_set_target(_Q16 voltage);
+
+_Q16 buck_regulator_get_target(void);
+
+/*!
+ * @brief Limits how fast the output follows changes of the target.
+ * @param[in] volts_per_ms Largest change of the output voltage per
+ * millisecond, up to 64 V/ms. 0 follows the target right away, which is the
+ * default after buck_init().
+ */
+void buck_set_slew_rate(_Q16 volts_per_ms);
+
+_Q16 buck_get_slew_rate(void);
+
+/*!
+ * @brief Sets the gains of the PI regulator.
+ * @param[in] kp Proportional gain.
+ * @param[in] ki Integral gain, applied on every conversion (4 kHz).
+ */
+void buck_regulator_set_gains(_Q16 kp, _Q16 ki);
+
+_Q16 buck_regulator_get_kp(void);
+_Q16 buck_regulator_get_ki(void);
+
+/*!
+ * @brief Enables or disables the PI regulator. It is disabled after
+ * buck_init(), in which case the output only depends on the analog
+ * comparator loop.
+ */
+void buck_regulator_enable(unsigned char enable);
+
+unsigned char buck_regulator_is_enabled(void);
+
+/*!
+ * @brief Gets the raw averaged voltage reading (12.4 format) the value of
+ * buck_get_voltage() is calculated from. Used for calibration.
+ */
+uint16_t buck_get_voltage_reading(void);
+
+/*!
+ * @brief Gets the raw averaged current reading (12.4 format) the value of
+ * buck_get_current() is calculated from. Used for calibration.
+ */
+uint16_t buck_get_current_reading(void);
+
+/*!
+ * @brief Replaces the coefficients used to convert readings. buck_init()
+ * loads the nominal ones.
+ */
+void buck_set_calibration(const struct buck_calibration_t* coefficients);
+
+void buck_get_calibration(struct buck_calibration_t* coefficients);
+
+/*!
+ * @brief Gets the factor all readings are corrected by to make up for AVdd
+ * not being exactly 3.3V, as measured with the 1.5V reference on AN8.
+ * @return A Q16 value, 1.0 if the reference hasn't been sampled yet.
+ */
+_Q16 buck_get_reference_scale(void);
+
+/*!
+ * @brief Gets the peak to peak output voltage of the last block of
+ * conversions. Only updated while block capture is enabled.
+ */
+_Q16 buck_get_voltage_ripple(void);
+
+/*!
+ * @brief Gets the peak to peak output current of the last block of
+ * conversions. Only updated while block capture is enabled.
+ */
+_Q16 buck_get_current_ripple(void);
+
+/*!
+ * @brief Gets the statistics of the last completed window of conversions,
+ * which is as long as the block buck_get_voltage() averages over, see
+ * buck_set_averaging(). They are accumulated for every conversion, also with
+ * block capture, and only converted here. The fields are 0 until the first
+ * window is complete.
+ */
+void buck_get_stats(struct buck_stats_t* stats);
+
+/*!
+ * @brief Sets the energy counter of buck_get_stats() back to 0. It counts from
+ * buck_init() on otherwise.
+ */
+void buck_reset_energy(void);
+
+/*!
+ * @brief Switches between processing every conversion as it arrives and
+ * collecting conversions into blocks of 8 that are processed together.
+ * Block capture costs less per conversion and allows higher sample rates,
+ * but the regulator and the fast values are only updated once per block.
+ */
+void buck_set_block_capture(unsigned char enable);
+
+/*!
+ * @brief Gets the number of blocks dropped because the previous block was
+ * still being processed when they filled up.
+ */
+unsigned short buck_get_block_overruns(void);
+
+/*!
+ * @brief Sets the rate Timer1 triggers the ADC at. The default is 4 kHz.
+ * @note The regulator's integral gain is applied per conversion (or per
+ * block), so it has to be adjusted along with the rate.
+ */
+void buck_set_sample_rate(unsigned short hz);
+
+unsigned short buck_get_sample_rate(void);
+
+/*!
+ * @brief Starts recording voltage and current into the transient capture
+ * ring. Posts EVENT_TRANSIENT_CAPTURED once it has triggered and the ring is
+ * full, after which it holds the samples until buck_transient_release().
+ * @param[in] pre_trigger Number of samples to keep from before the trigger,
+ * up to BUCK_TRANSIENT_DEPTH - 1.
+ * @param[in] di_threshold Triggers on a current step of at least this many
+ * amps between two conversions. 0 only triggers on buck_transient_trigger()
+ * and UVLO.
+ */
+void buck_transient_arm(unsigned char pre_trigger, _Q16 di_threshold);
+
+/*!
+ * @brief Triggers an armed capture on the next conversion.
+ */
+void buck_transient_trigger(void);
+
+/*!
+ * @brief Discards the capture and stops recording.
+ */
+void buck_transient_release(void);
+
+buck_transient_state_e buck_transient_get_state(void);
+
+/*!
+ * @brief Gets the number of samples recorded. This is less than
+ * BUCK_TRANSIENT_DEPTH if it triggered before the ring was full.
+ */
+unsigned char buck_transient_get_length(void);
+
+/*!
+ * @brief Gets the index of the trigger sample. Equal to the length if the
+ * capture was cut short by UVLO.
+ */
+unsigned char buck_transient_get_trigger(void);
+
+/*!
+ * @brief Gets a recorded sample converted to volts and amps. Only valid once
+ * the capture is BUCK_TRANSIENT_DONE.
+ * @param[in] index 0 is the oldest sample.
+ */
+void buck_transient_get_sample(unsigned char index,
+                               _Q16* voltage, _Q16* current);
+
+/*!
+ * @brief Sets how many conversions buck_get_voltage(), buck_get_current() and
+ * the windows of buck_get_stats() average over.
+ * @param[in] log2 The block length is 2^log2 conversions, up to 2^10. The
+ * default is 2^8 (64ms at the 4 kHz trigger rate).
+ */
+void buck_set_averaging(unsigned char log2);
 void buck_set_voltage(_Q16 voltage);
 void buck_set_current(_Q16 current);
 
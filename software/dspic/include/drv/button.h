@@ -18,6 +18,14 @@ extern "C" {
  */
 void button_init(void);
 
+/*!
+ * @brief Returns the number of 10ms updates between the last twist and the
+ * one before it, or 255 if they were further apart or went in opposite
+ * directions. Lets listeners of BUTTON_TWISTED_* tell fast twists from slow
+ * ones.
+ */
+unsigned char button_get_twist_interval(void);
+
 #ifdef	__cplusplus
 }
 #endif
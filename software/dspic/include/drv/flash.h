@@ -0,0 +1,74 @@
+/*!
+ * @file flash.h
+ *
+ * Self-programming of the program flash, for data that has to survive a
+ * reset. Data is stored as 16-bit words in the lower half of each 24-bit
+ * instruction word, so one word takes up two program address units.
+ */
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t flash_address_t;
+
+/* Erase pages are 512 instruction words */
+#define FLASH_PAGE_SIZE         0x400
+#define FLASH_WORDS_PER_PAGE    (FLASH_PAGE_SIZE / 2)
+
+/*
+ * Pages set aside for data, at the top of the 0x2C00 program address units
+ * of the dsPIC33EP16GS506. They are reserved in flash.c so the linker won't
+ * place code there, except for the panel database, which the generated
+ * panels_db_image.c fills with the built-in image. The calibration lives in
+ * the journal pages, see journal_save_calibration(). That leaves code
+ * everything from the interrupt vectors up to 0x1BFF and the last page
+ * (0x2800), which also holds the configuration words and must never be
+ * erased.
+ */
+#define FLASH_PANELS_DB_PAGE    0x1C00
+#define FLASH_PANELS_DB_PAGES   1
+#define FLASH_PANELS_DB_WORDS   (FLASH_PANELS_DB_PAGES * FLASH_WORDS_PER_PAGE)
+#define FLASH_JOURNAL_PAGE_A    0x2000
+#define FLASH_JOURNAL_PAGE_B    0x2400
+
+/*!
+ * @brief Erases the page containing the given address, setting all words to
+ * 0xFFFF.
+ * @return Returns 1 if successful, 0 if the NVM controller reported an error.
+ */
+unsigned char flash_erase_page(flash_address_t address);
+
+/*!
+ * @brief Programs words into erased flash. Programming can only clear bits.
+ * @param[in] address Program memory address of the first word, must be a
+ * multiple of 4.
+ * @param[in] data The words to write.
+ * @param[in] count Number of words. Flash is programmed two words at a time,
+ * an odd count leaves the last word's partner erased.
+ * @return Returns 1 if successful, 0 if the NVM controller reported an error.
+ */
+unsigned char flash_write(flash_address_t address,
+                          const uint16_t* data,
+                          uint16_t count);
+
+/*!
+ * @brief Reads a single word.
+ */
+uint16_t flash_read_word(flash_address_t address);
+
+/*!
+ * @brief Reads count consecutive words into data.
+ */
+void flash_read(flash_address_t address, uint16_t* data, uint16_t count);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* FLASH_H */
@@ -8,20 +8,71 @@
 #ifndef LCD_H
 #define	LCD_H
 
+#include "core/string.h"
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
+/*!
+ * @brief Sink writing into a line of the display, see lcd_line_begin().
+ */
+struct lcd_line_t
+{
+    struct str_sink_t sink;
+    unsigned char line;
+    unsigned char column;
+};
+
 /*!
  * @brief Initialises the LCD driver. Call this before calling any other LCD
  * related functions.
  */
 void lcd_init(void);
 
+/*!
+ * @brief Takes the display out of reset and queues its configuration. Returns
+ * without waiting for it to be sent, lines written afterwards are queued
+ * behind it.
+ */
 void lcd_reset(void);
 short lcd_send(char is_command, unsigned char data);
+
+/*!
+ * @brief Sets a line of the display, padded with spaces to the full width.
+ * Only characters that differ from what the line shows already are sent.
+ * @return Returns the number of characters taken from the string.
+ */
 int lcd_writeline(unsigned char lineN, const char * string);
 
+/*!
+ * @brief Starts writing a line of the display. The str_put_*() functions
+ * write through the returned sink straight into the display buffer, only the
+ * characters that change get sent. Characters past the end of the line are
+ * dropped.
+ */
+struct str_sink_t* lcd_line_begin(struct lcd_line_t* line,
+                                  unsigned char lineN);
+
+/*!
+ * @brief Pads the rest of the line with spaces and sends the changes.
+ * @return Returns the number of characters written to the line.
+ */
+int lcd_line_end(struct lcd_line_t* line);
+
+/*!
+ * @brief Queues all changed characters that fit into the I2C FIFO. Called by
+ * lcd_writeline() and on every update, there is no need to call it directly.
+ */
+void lcd_flush(void);
+
+/*!
+ * @brief Gets the I2C traffic to the display during the last second.
+ * @param[out] transactions Number of start conditions.
+ * @param[out] bytes Number of bytes including address and control bytes.
+ */
+void lcd_get_traffic(unsigned short* transactions, unsigned short* bytes);
+
 
 #ifdef	__cplusplus
 }
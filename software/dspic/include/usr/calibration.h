@@ -0,0 +1,66 @@
+/*!
+ * @file calibration.h
+ *
+ * Per-unit calibration of the voltage and current measurements. The host
+ * applies known reference loads, tells the device the true value for each
+ * one, and the device fits offset and gain to the readings it took. The
+ * result is kept in the journal and loaded on boot.
+ */
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <libq.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+struct buck_calibration_t;
+
+/*!
+ * @brief Loads the calibration stored in flash into the buck driver, if
+ * there is a valid one. Call after drivers_init() and journal_init().
+ */
+void calibration_init(void);
+
+/*!
+ * @brief Records the present voltage reading as corresponding to the given
+ * voltage. Only the last two points are kept.
+ * @return Returns the number of points recorded so far (1 or 2).
+ */
+unsigned char calibration_add_voltage_point(_Q16 voltage);
+
+/*!
+ * @brief Records the present current reading as corresponding to the given
+ * current. Only the last two points are kept.
+ * @return Returns the number of points recorded so far (1 or 2).
+ */
+unsigned char calibration_add_current_point(_Q16 current);
+
+/*!
+ * @brief Fits new coefficients to the recorded points and hands them to the
+ * buck driver. With one point per channel only the offset is corrected, with
+ * two, offset and gain. Channels without points are left alone.
+ * @return Returns 1 if successful, 0 if the points don't give plausible
+ * coefficients, in which case nothing is changed.
+ */
+unsigned char calibration_apply(void);
+
+/*!
+ * @brief Writes the coefficients the buck driver is using to flash.
+ * @return Returns 1 if successful.
+ */
+unsigned char calibration_save(void);
+
+/*!
+ * @brief Goes back to the nominal coefficients, discards recorded points and
+ * forgets the stored calibration.
+ */
+void calibration_reset(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* CALIBRATION_H */
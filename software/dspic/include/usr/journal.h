@@ -0,0 +1,91 @@
+/*!
+ * @file journal.h
+ *
+ * Keeps the active panel and the global parameters in flash, so the device
+ * comes back up with the same output after a power cycle. Changes are only
+ * written once they have settled for a while, so twisting the knob or a host
+ * editing cells one by one ends up as a single record. What hasn't been
+ * written by the time power is lost is saved from the UVLO interrupt.
+ *
+ * The calibration coefficients are kept in the same flash pages, see
+ * usr/calibration.h.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*! @brief Panels with more cells than this are not journaled. */
+#define JOURNAL_MAX_CELLS 32
+
+/*! @brief Number of updates without a change before it is written. */
+#define JOURNAL_SETTLE_UPDATES 300
+
+/*! @brief Number of words journal_save_calibration() stores. */
+#define JOURNAL_CALIBRATION_WORDS 4
+
+/*!
+ * @brief Time journal_uvlo() may take, in us. The unit tests check it against
+ * the programming times of the emulated flash.
+ *
+ * It isn't measured, it is derived from the board with a wide margin. UVLO
+ * trips at 25V, and the 3.3V rail holds until the input is down to ~4V. The
+ * buck is off by then, see _INT2Interrupt(). C1 alone (47uF) holds
+ * 1/2 * 47uF * (25V^2 - 5V^2) = 14mJ. The controller, the OLED and the
+ * regulators take well under 0.6W from the input, so the rail stays up for
+ * at least 23ms. The budget is 1/20 of that. The hold-up time can be checked
+ * on the bench by scoping BUCK_UVLO against the 3.3V rail with the input
+ * pulled, from the rising edge of BUCK_UVLO to the rail dropping below the
+ * brown-out level.
+ */
+#define JOURNAL_UVLO_BUDGET_US 1000
+
+/*!
+ * @brief Loads the newest valid record into the model and starts watching
+ * the model for changes. Call once on boot, before menu_init().
+ * @return Returns the number of cells restored, 0 if there was nothing to
+ * restore.
+ */
+unsigned char journal_init(void);
+
+/*!
+ * @brief Writes pending changes right away instead of waiting for them to
+ * settle.
+ * @return Returns 0 if writing to flash failed, non-zero otherwise.
+ */
+unsigned char journal_flush(void);
+
+/*!
+ * @brief Writes what changed since the newest record into flash that was
+ * erased beforehand, so it is done well within JOURNAL_UVLO_BUDGET_US. Called
+ * from the UVLO interrupt, see _INT2Interrupt(). journal_init() applies it on
+ * the next boot.
+ */
+void journal_uvlo(void);
+
+/*!
+ * @brief Appends calibration coefficients. They are carried over when the
+ * journal moves on to its other page, so they don't need a page of their own.
+ * @param[in] coefficients JOURNAL_CALIBRATION_WORDS words, or NULL to forget
+ * the stored ones.
+ * @return Returns 0 if writing to flash failed, non-zero otherwise.
+ */
+unsigned char journal_save_calibration(const uint16_t* coefficients);
+
+/*!
+ * @brief Reads the newest calibration coefficients. Call after journal_init().
+ * @param[out] coefficients Receives JOURNAL_CALIBRATION_WORDS words.
+ * @return Returns 0 if there are none.
+ */
+unsigned char journal_load_calibration(uint16_t* coefficients);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* JOURNAL_H */
@@ -18,6 +18,20 @@ extern "C" {
  */
 void menu_init(void);
 
+/*!
+ * @brief Skips the panel selection after a panel was restored into the model,
+ * see journal_init(). Enables the buck and shows the global irradiation.
+ * @param[in] cell_count Number of cells in the restored panel.
+ */
+void menu_resume(unsigned char cell_count);
+
+/*!
+ * @brief Tells the menu that the panel database was replaced or erased, see
+ * panels_db_upload_begin(). The manufacturer and panel lists start over from
+ * the first manufacturer.
+ */
+void menu_panels_db_changed(void);
+
 #ifdef __cplusplus
 }
 #endif
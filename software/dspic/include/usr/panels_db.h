@@ -8,31 +8,58 @@
 #ifndef PANELS_DB_H
 #define PANELS_DB_H
 
+#include <stdint.h>
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
 struct pv_cell_t;
 
+/*
+ * Image format, shared with the generator in software/panels_db_gen. See
+ * panels_db.c for the layout.
+ */
+#define PANELS_DB_MAGIC             0xDB02
+#define PANELS_DB_HEADER_WORDS      8
+#define PANELS_DB_INDEX_WORDS       28
+#define PANELS_DB_MANUFACTURER_WORDS 2
+#define PANELS_DB_PANEL_WORDS       4
+#define PANELS_DB_CELL_WORDS        8
+
+/*! @brief Names are cut off after this many characters. */
+#define PANELS_DB_MAX_NAME_LENGTH   18
+
+/*! @brief Largest block accepted by panels_db_upload_write(). */
+#define PANELS_DB_BLOCK_WORDS       8
+
 /*!
  * @brief Initialises panel database. Call this before calling any other
- * db related functions.
+ * db related functions, and again after the image in flash was replaced.
+ * A damaged image reads as an empty database.
  */
 void panels_db_init(void);
 
 /*!
  * @brief Adds a new manufacturer.
+ * @note The image is only ever replaced as a whole, this always fails.
  */
 short panels_db_add_new_manufacturer(const char* name);
 
 /*!
- * @brief Adds a new
+ * @brief Adds a new panel.
+ * @note The image is only ever replaced as a whole, this always fails.
  */
 short panels_db_add_new_panel(short manufacturer_id,
                               const char* name);
 
 short panels_db_get_manufacturer_count(void);
 
+/*!
+ * @brief Names are copied out of flash into a buffer shared by
+ * panels_db_get_manufacturer_name() and panels_db_get_panel_name(). The
+ * returned string is only valid until the next call to either of them.
+ */
 const char* panels_db_get_manufacturer_name(short index);
 
 short panels_db_get_panel_count(short manufacturer_id);
@@ -43,10 +70,76 @@ const char* panels_db_get_panel_name(short manufacturer_id,
 short panels_db_get_cell_count(short manufacturer_id,
                                short panel_id);
 
+/*!
+ * @brief Maps the first character of a name to its entry in the alphabetical
+ * index. Letters are case insensitive and come between the names starting
+ * with anything before 'A' (0) and anything after 'Z' (27).
+ */
+unsigned char panels_db_letter_index(char c);
+
+/*!
+ * @brief Manufacturers and the panels of each manufacturer are sorted by
+ * panels_db_letter_index() of their names, then alphabetically. These return
+ * the first manufacturer or panel whose name is filed under the given letter
+ * index or a later one, or the number of manufacturers or panels if there is
+ * none.
+ */
+short panels_db_find_manufacturer(unsigned char letter);
+
+short panels_db_find_panel(short manufacturer_id,
+                           unsigned char letter);
+
+/*!
+ * @brief Decodes a cell. The returned parameters are only valid until the
+ * next call.
+ */
 const struct pv_cell_t* panels_db_get_cell(short manufacturer_id,
                                            short panel_id,
                                            short cell_id);
 
+/*!
+ * @brief Gets the database version. It is incremented whenever an upload
+ * starts or ends, and wraps at 65535.
+ */
+uint16_t panels_db_get_version(void);
+
+/*!
+ * @brief Starts replacing the image. Erases the database region, the database
+ * reads as empty until panels_db_upload_end() succeeds.
+ * @param[in] length Length of the new image in words.
+ * @param[in] checksum The last word of the new image. Only used to tell
+ * uploads apart, see panels_db_upload_get_state().
+ * @return Returns 0 if the length is out of range or erasing failed, non-zero
+ * otherwise.
+ */
+unsigned char panels_db_upload_begin(uint16_t length, uint16_t checksum);
+
+/*!
+ * @brief Programs the next block of the image. Blocks have to arrive in
+ * order, each one starting where the previous one ended, and all but the last
+ * one have to be an even number of words.
+ * @return Returns non-zero if the block was written, 0 if it was rejected.
+ */
+unsigned char panels_db_upload_write(uint16_t offset,
+                                     const uint16_t* words,
+                                     unsigned char count);
+
+/*!
+ * @brief Reports how far the upload got, so an interrupted transfer can be
+ * resumed from the first missing word. length is 0 if no upload is in
+ * progress.
+ */
+void panels_db_upload_get_state(uint16_t* received,
+                                uint16_t* length,
+                                uint16_t* checksum);
+
+/*!
+ * @brief Finishes the upload and switches to the new image.
+ * @return Returns non-zero if the complete image was received and is valid.
+ * A failed upload leaves the database empty until the next one.
+ */
+unsigned char panels_db_upload_end(void);
+
 #ifdef	__cplusplus
 }
 #endif
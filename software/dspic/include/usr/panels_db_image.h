@@ -0,0 +1,25 @@
+/*!
+ * @file panels_db_image.h
+ *
+ * The built-in panel database, generated into src/usr/panels_db_image.c by
+ * software/panels_db_gen. It is placed at FLASH_PANELS_DB_PAGE and only read
+ * through flash_read_word(), see panels_db.c.
+ */
+
+#ifndef PANELS_DB_IMAGE_H
+#define PANELS_DB_IMAGE_H
+
+#include <stdint.h>
+#include "drv/flash.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+extern const uint16_t panels_db_image[FLASH_PANELS_DB_WORDS];
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* PANELS_DB_IMAGE_H */
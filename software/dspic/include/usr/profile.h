@@ -0,0 +1,74 @@
+/*!
+ * @file profile.h
+ *
+ * Plays back irradiance profiles streamed by the host, e.g. cloud transients
+ * or ramps for testing the dynamic efficiency of an MPPT. The host pushes
+ * keyframes into a small ring and the profile interpolates between them on
+ * every update.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*! @brief Number of keyframes the ring holds, see RAM_BUDGET_PROFILE. */
+#define PROFILE_DEPTH 4
+
+/*! @brief Number of cells a keyframe can set individually, counted in the
+ * order they were added to the panel. */
+#define PROFILE_CELLS 4
+
+/*!
+ * @brief Irradiance of the panel at a point in time. All irradiances are in
+ * tenths of a percent.
+ */
+struct profile_keyframe_t
+{
+    uint16_t dt;                    /* ms after the previous keyframe */
+    uint16_t g;                     /* cells without a value of their own */
+    uint16_t cell_g[PROFILE_CELLS];
+    unsigned char mask;             /* bit n: cell n uses cell_g[n] */
+};
+
+/*!
+ * @brief Registers the update listener. Nothing plays until profile_start().
+ */
+void profile_init(void);
+
+/*!
+ * @brief Appends a keyframe to the ring. This is possible while playing.
+ * @return Returns 0 if the ring is full, non-zero otherwise.
+ */
+unsigned char profile_push(const struct profile_keyframe_t* keyframe);
+
+/*!
+ * @brief Applies the first keyframe right away and starts interpolating
+ * towards the ones after it. Playback stops at the last keyframe in the ring,
+ * so the host has to keep pushing them faster than they are played.
+ * @return Returns 0 if there is nothing to play, non-zero otherwise.
+ */
+unsigned char profile_start(void);
+
+/*!
+ * @brief Stops playback and drops all keyframes. The panel keeps the
+ * irradiance it had at that moment.
+ */
+void profile_stop(void);
+
+unsigned char profile_is_running(void);
+
+/*!
+ * @brief Gets the number of keyframes that can still be pushed.
+ */
+unsigned char profile_get_free(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* PROFILE_H */
@@ -0,0 +1,59 @@
+/*!
+ * @file pv_fract.h
+ *
+ * The cell model of pv_model.c in 16-bit fractional formats, evaluated on
+ * the DSP engine instead of with the 32-bit _Q16 library routines. Cells are
+ * converted once when their parameters change, see pv_fract.c.
+ */
+
+#ifndef PV_FRACT_H
+#define PV_FRACT_H
+
+#include <libq.h>
+#include <stdint.h>
+#include "usr/pv_model.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+struct pv_fract_cell_t
+{
+    int16_t exponent;           /* voc * log2(e) / vt, Q15 mantissa */
+    int16_t inverse_isc;        /* 1 / isc, Q15 mantissa */
+    signed char exponent_shift; /* exponent of the exponent's mantissa */
+    unsigned char isc_shift;    /* 10 - exponent of inverse_isc */
+};
+
+/*!
+ * @brief Converts the parameters of a cell for pv_fract_cell_voltage().
+ * @return Returns 0 if they don't fit the formats (voc has to be below 16V,
+ * isc above 1mA, vt positive and g between -16384 and 16384), the cell has
+ * to be evaluated with the _Q16 model then.
+ */
+unsigned char pv_fract_prepare(struct pv_fract_cell_t* fract,
+                               const struct pv_cell_t* cell);
+
+/*!
+ * @brief Converts a current for pv_fract_cell_voltage(). Negative currents
+ * become 0, currents of 16A and more saturate.
+ */
+int16_t pv_fract_current(_Q16 current);
+
+/*!
+ * @brief Calculates a cell's voltage at the specified current with the same
+ * bisection as the _Q16 model.
+ * @param[in] fract The cell as converted by pv_fract_prepare().
+ * @param[in] cell The same cell's parameters, voc and g are taken from here.
+ * @param[in] current The current in Q5.11, see pv_fract_current().
+ * @return Returns the voltage in Q5.11.
+ */
+int16_t pv_fract_cell_voltage(const struct pv_fract_cell_t* fract,
+                              const struct pv_cell_t* cell,
+                              int16_t current);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PV_FRACT_H */
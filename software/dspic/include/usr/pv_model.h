@@ -44,6 +44,29 @@ unsigned char model_cell_remove(unsigned char cell_id);
  */
 void model_cell_remove_all(void);
 
+/*!
+ * @brief Adds a cell to the shadow panel, which is built next to the active
+ * one and only replaces it with model_shadow_commit().
+ * @note Both panels come from the heap (RAM_HEAP in ram_budget.h), which also
+ * holds the event listeners. A cell takes 28 bytes on the target plus the
+ * allocator's header, so the old and the new panel together can have about
+ * 6 cells. Beyond that, this fails and the old panel has to be removed
+ * before the new one is built, with the output dropping in between.
+ * @return Will return a unique cell ID if successful, or 0 if unsuccessful.
+ */
+unsigned char model_shadow_cell_add(const struct pv_cell_t* params);
+
+/*!
+ * @brief Replaces the active panel with the shadow panel in one go and
+ * destroys the cells of the old one. The shadow panel is empty afterwards.
+ */
+void model_shadow_commit(void);
+
+/*!
+ * @brief Destroys the cells of the shadow panel.
+ */
+void model_shadow_discard(void);
+
 /*!
  * @brief Starts a new iteration and returns the first cell ID in the chain.
  *
@@ -63,6 +86,27 @@ unsigned char model_cell_begin_iteration(void);
  */
 unsigned char model_cell_get_next(void);
 
+/*!
+ * @brief Gets the cell with the smallest ID larger than after_id.
+ *
+ * Unlike model_cell_get_next() this doesn't keep any state, so it can be
+ * used as a cursor that survives cells being added or removed in between
+ * calls.
+ * @param[in] after_id Pass 0 to get the cell with the smallest ID.
+ * @param[out] params Receives a copy of the cell's parameters.
+ * @param[out] version Receives the model version of the cell's last change.
+ * @return Returns the cell's ID, or 0 if there are no more cells.
+ */
+unsigned char model_cell_find_next(unsigned char after_id,
+                                   struct pv_cell_t* params,
+                                   unsigned short* version);
+
+/*!
+ * @brief Gets the model version. It is incremented by every change to any
+ * cell and by adding or removing cells, and wraps at 65535.
+ */
+unsigned short model_get_version(void);
+
 /*!
  * @brief Sets the global thermal voltage. This is weighted together with each
  * individual cell's parameter.
@@ -105,6 +149,16 @@ void model_set_thermal_voltage(unsigned char cell_id, _Q16 vt);
  */
 void model_set_relative_solar_irradiation(unsigned char cell_id, _Q16 g);
 
+/*!
+ * @brief Sets the relative solar irradiation of all cells in one pass over
+ * the panel. Only cells whose value changes get a new version.
+ * @param[in] g Irradiation of the cells without a value of their own.
+ * @param[in] cell_g Irradiation of the first count cells, in the order they
+ * were added to the panel.
+ */
+void model_set_panel_irradiation(_Q16 g, const _Q16* cell_g,
+                                 unsigned char count);
+
 /*!
  * @brief Gets the open circuit voltage of the actively selected cell.
  */
@@ -125,6 +179,27 @@ _Q16 model_get_thermal_voltage(unsigned char cell_id);
  */
 _Q16 model_get_relative_solar_irradiation(unsigned char cell_id);
 
+/*!
+ * @brief Calculates the voltage of all cells in series at the specified
+ * current.
+ *
+ * Each cell's diode voltage is found with the same bisection calc_voltage()
+ * uses, so the result shows exactly what the fixed point model produces.
+ * Cells whose parameters fit the 16-bit formats of pv_fract.h are evaluated
+ * there, which is several times faster, the others with _Q16.
+ * @note This is expensive (10 iterations per cell), don't call it from an
+ * interrupt.
+ * @param[in] current The current flowing through the panel in amps.
+ * @return Returns the panel voltage in volts.
+ */
+_Q16 model_calc_panel_voltage(_Q16 current);
+
+/*!
+ * @brief Gets the largest short circuit current of all cells. Above this
+ * current, every cell's voltage is 0.
+ */
+_Q16 model_get_panel_short_circuit_current(void);
+
 #ifdef	__cplusplus
 }
 #endif
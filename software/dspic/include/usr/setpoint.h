@@ -0,0 +1,25 @@
+/*!
+ * @file setpoint.h
+ *
+ * Connects the PV model to the buck: the output voltage the model predicts
+ * for the current being drawn becomes the target of the regulator.
+ */
+
+#ifndef SETPOINT_H
+#define SETPOINT_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*!
+ * @brief Starts updating the buck's target voltage from the model on every
+ * update event.
+ */
+void setpoint_init(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* SETPOINT_H */
@@ -69,71 +69,190 @@ char* str_append(char* dest, short n, const char* src)
 }
 
 /* -------------------------------------------------------------------------- */
-char* str_nitoa(char* dest, short digits, short number)
+/*
+ * Numbers are formatted without dividing, the dsPIC has no divide instruction
+ * and the library call takes ~20 cycles per digit. n / 10 is n * 0xCCCD >> 19
+ * instead, a single 16x16 multiply, which is exact for every 16-bit n.
+ */
+#define DIV10(n) ((unsigned short)(((unsigned long)(n) * 0xCCCDu) >> 19))
+
+/* Writes the digits of a number into a buffer, least significant first */
+static unsigned char reverse_digits(char* digits, unsigned short number)
+{
+    unsigned char count = 0;
+    do
+    {
+        unsigned short quotient = DIV10(number);
+        digits[count++] = (char)('0' + (number - quotient * 10));
+        number = quotient;
+    } while(number != 0);
+    return count;
+}
+
+static void put_padding(struct str_sink_t* sink,
+                        unsigned char width,
+                        unsigned char length)
 {
-    char buffer[5], *ptr; /* enough to hold a short without null terminator */
-    unsigned char is_negative = 0;
+    for(; length < width; ++length)
+        sink->put(sink, ' ');
+}
 
-    --digits; /* always have space for null terminator */
+static void put_reversed(struct str_sink_t* sink,
+                         const char* digits,
+                         unsigned char count)
+{
+    while(count--)
+        sink->put(sink, digits[count]);
+}
 
-    /* handle 0 explicitly */
-    if(number == 0)
+/* -------------------------------------------------------------------------- */
+static void put_into_buffer(struct str_sink_t* sink, char c)
+{
+    struct str_buffer_t* buffer = (struct str_buffer_t*)sink;
+    if(buffer->write == buffer->end)
     {
-        *dest++ = '0';
-        *dest = '\0';
-        return dest;
+        buffer->truncated = 1;
+        return;
     }
+    *buffer->write++ = c;
+    *buffer->write = '\0';
+}
+
+struct str_sink_t* str_buffer_init(struct str_buffer_t* buffer,
+                                   char* dest,
+                                   short n)
+{
+    buffer->sink.put = put_into_buffer;
+    buffer->write = dest;
+    buffer->end = dest + (n > 0 ? n - 1 : 0);
+    buffer->truncated = 0;
+    if(n > 0)
+        *dest = '\0';
+    return &buffer->sink;
+}
+
+/* -------------------------------------------------------------------------- */
+void str_put_string(struct str_sink_t* sink, const char* str)
+{
+    while(*str)
+        sink->put(sink, *str++);
+}
+
+/* -------------------------------------------------------------------------- */
+void str_put_unsigned(struct str_sink_t* sink,
+                      unsigned short number,
+                      unsigned char width)
+{
+    char digits[5];
+    unsigned char count = reverse_digits(digits, number);
+    put_padding(sink, width, count);
+    put_reversed(sink, digits, count);
+}
+
+/* -------------------------------------------------------------------------- */
+void str_put_int(struct str_sink_t* sink, short number, unsigned char width)
+{
+    char digits[5];
+    unsigned char count = reverse_digits(digits,
+        number < 0 ? (unsigned short)-number : (unsigned short)number);
 
-    /* handle negative numbers */
+    put_padding(sink, width, count + (number < 0));
     if(number < 0)
+        sink->put(sink, '-');
+    put_reversed(sink, digits, count);
+}
+
+/* -------------------------------------------------------------------------- */
+void str_put_q16(struct str_sink_t* sink,
+                 _Q16 value,
+                 unsigned char width,
+                 unsigned char decimals)
+{
+    char digits[5], fraction_digits[STR_Q16_MAX_DECIMALS];
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : value;
+    unsigned short integer = (unsigned short)(magnitude >> 16);
+    unsigned short fraction = (unsigned short)magnitude;
+    unsigned char count, i;
+
+    if(decimals > STR_Q16_MAX_DECIMALS)
+        decimals = STR_Q16_MAX_DECIMALS;
+
+    /*
+     * Multiplying the fraction by 10 moves the next decimal into the upper
+     * word. This is exact, so whatever is left decides the rounding.
+     */
+    for(i = 0; i != decimals; ++i)
     {
-        number = -number;
-        is_negative = 1;
+        unsigned long shifted = (unsigned long)fraction * 10;
+        fraction_digits[i] = (char)('0' + (shifted >> 16));
+        fraction = (unsigned short)shifted;
     }
-
-    /* do conversion in reverse */
-    ptr = buffer;
-    while(number != 0)
+    if(fraction & 0x8000)
     {
-        short remainder = number % 10;
-        number /= 10;
-        *ptr++ = remainder + '0';
+        while(i != 0 && fraction_digits[i - 1] == '9')
+            fraction_digits[--i] = '0';
+        if(i != 0)
+            ++fraction_digits[i - 1];
+        else
+            ++integer;  /* -32768 rounds to 32768 at most, still fits */
     }
 
-    /* add "-" character if it is negative */
-    if(is_negative)
+    /* rounding may have turned a small negative number into zero */
+    if(integer == 0)
     {
-        *dest++ = '-';
-        --digits;
+        for(i = 0; i != decimals && fraction_digits[i] == '0'; ++i) {}
+        if(i == decimals)
+            value = 0;
     }
 
-    /* copy buffer into destination */
-    while(ptr-- != buffer && digits --> 0)
-        *dest++ = *ptr;
-    *dest = '\0';
-    return dest;
+    count = reverse_digits(digits, integer);
+    put_padding(sink, width,
+                count + (value < 0) + (decimals ? decimals + 1 : 0));
+    if(value < 0)
+        sink->put(sink, '-');
+    put_reversed(sink, digits, count);
+    if(decimals)
+    {
+        sink->put(sink, '.');
+        for(i = 0; i != decimals; ++i)
+            sink->put(sink, fraction_digits[i]);
+    }
 }
 
 /* -------------------------------------------------------------------------- */
-char* str_q16itoa(char* dest, short n, _Q16 value)
+char* str_nitoa(char* dest, short digits, short number)
 {
-    char* ptr;
-    short before_decimal = value >> 16;
-    unsigned short after_decimal = (value & 0xFFFF) * 10000 / 65536;
-
-    if(after_decimal && before_decimal < 0)
-        ++before_decimal;
-
-    /* convert before decimal, update n */
-    ptr = str_nitoa(dest, n, before_decimal);
-    n -= ptr - dest + 1;
+    /* keeps the most significant digits if it doesn't fit */
+    struct str_buffer_t buffer;
+    str_put_int(str_buffer_init(&buffer, dest, digits), number, 0);
+    return buffer.write;
+}
 
-    /* not enough space for decimal point and at least one number? */
-    if(n < 2)
-        return ptr;
+/* -------------------------------------------------------------------------- */
+char* str_nutoa(char* dest, short digits, unsigned short number)
+{
+    struct str_buffer_t buffer;
+    str_put_unsigned(str_buffer_init(&buffer, dest, digits), number, 0);
+    return buffer.write;
+}
 
-    *ptr++ = '.'; *ptr = '\0';
-    return str_nitoa(ptr, n, after_decimal);
+/* -------------------------------------------------------------------------- */
+char* str_q16itoa(char* dest, short n, _Q16 value)
+{
+    struct str_buffer_t buffer;
+    char digits[5];
+    short decimals = n - 2 - (value < 0) -
+        reverse_digits(digits, (unsigned short)((value < 0 ? -value : value) >> 16));
+
+    /* as many decimals as fit, rounding up may still add a digit */
+    decimals = (decimals < 0 ? 0 : decimals > 4 ? 4 : decimals);
+    for(;;)
+    {
+        str_put_q16(str_buffer_init(&buffer, dest, n), value, 0, decimals);
+        if(!buffer.truncated || decimals == 0)
+            return buffer.write;
+        --decimals;
+    }
 }
 
 /* -------------------------------------------------------------------------- */
@@ -265,6 +384,20 @@ TEST(string, nitoa_smaller_target_buffer)
     EXPECT_THAT(s, StrEq("-18"));
 }
 
+TEST(string, nutoa_number_larger_than_short)
+{
+    char s[32];
+    str_nutoa(s, 6, 53210);
+    EXPECT_THAT(s, StrEq("53210"));
+}
+
+TEST(string, nutoa_zero)
+{
+    char s[32];
+    str_nutoa(s, 2, 0);
+    EXPECT_THAT(s, StrEq("0"));
+}
+
 TEST(string, Q16itoa)
 {
     char s[32];
@@ -274,4 +407,168 @@ TEST(string, Q16itoa)
     EXPECT_THAT(s, StrEq("11.5"));
 }
 
+TEST(string, Q16itoa_keeps_leading_zeros_of_the_fraction)
+{
+    char s[32];
+    str_q16itoa(s, 8, (_Q16)(1.0625 * 65536));
+    EXPECT_THAT(s, StrEq("1.0625"));
+}
+
+TEST(string, Q16itoa_rounds_to_what_fits)
+{
+    char s[32];
+    str_q16itoa(s, 5, (_Q16)(134.75 * 65536));
+    EXPECT_THAT(s, StrEq("135"));
+    str_q16itoa(s, 5, (_Q16)(-0.5 * 65536));
+    EXPECT_THAT(s, StrEq("-0.5"));
+}
+
+/* -------------------------------------------------------------------------- */
+static std::string put_q16(_Q16 value, unsigned char width, unsigned char decimals)
+{
+    char s[32];
+    struct str_buffer_t buffer;
+    str_put_q16(str_buffer_init(&buffer, s, sizeof(s)), value, width, decimals);
+    return s;
+}
+
+/* The same with 64-bit integers and snprintf() */
+static void reference_q16(char* s, long long value, unsigned char decimals)
+{
+    static const long long scale[] = {1, 10, 100, 1000, 10000, 100000};
+    long long magnitude = value < 0 ? -value : value;
+    long long scaled = (magnitude * scale[decimals] + 32768) >> 16;
+    const char* sign = (value < 0 && scaled != 0) ? "-" : "";
+
+    if(decimals == 0)
+        snprintf(s, 32, "%s%lld", sign, scaled);
+    else
+    {
+        /* the leading 1 keeps the zeros, ".042" from 1042 */
+        snprintf(s, 32, "%s%lld.%lld", sign, scaled / scale[decimals],
+                 scaled % scale[decimals] + scale[decimals]);
+        memmove(strchr(s, '.') + 1, strchr(s, '.') + 2, decimals + 1);
+    }
+}
+
+/* Describes how the value is formatted differently than the reference */
+static std::string compare_to_reference(_Q16 value)
+{
+    char s[32], expected[32];
+    struct str_buffer_t buffer;
+    unsigned char decimals;
+
+    for(decimals = 0; decimals <= STR_Q16_MAX_DECIMALS; ++decimals)
+    {
+        str_put_q16(str_buffer_init(&buffer, s, sizeof(s)), value, 0, decimals);
+        reference_q16(expected, value, decimals);
+        if(strcmp(s, expected))
+            return std::string(s) + " instead of " + expected;
+    }
+    return "";
+}
+
+/* Reads a number with 5 decimals back into a _Q16 */
+static long long parse_q16(const std::string& s)
+{
+    long long integer = 0, fraction = 0;
+    size_t i = (s[0] == '-');
+    for(; s[i] != '.'; ++i)
+        integer = integer * 10 + s[i] - '0';
+    for(++i; i != s.size(); ++i)
+        fraction = fraction * 10 + s[i] - '0';
+    fraction = ((integer * 100000 + fraction) * 65536 + 50000) / 100000;
+    return s[0] == '-' ? -fraction : fraction;
+}
+
+TEST(string, buffer_sink_drops_what_doesnt_fit)
+{
+    char s[4];
+    struct str_buffer_t buffer;
+    str_put_string(str_buffer_init(&buffer, s, sizeof(s)), "abc");
+    EXPECT_THAT(buffer.truncated, Eq(0));
+    str_put_string(&buffer.sink, "d");
+    EXPECT_THAT(buffer.truncated, Eq(1));
+    EXPECT_THAT(s, StrEq("abc"));
+    EXPECT_THAT(buffer.write, Eq(s + 3));
+}
+
+TEST(string, put_pads_to_width)
+{
+    char s[32];
+    struct str_buffer_t buffer;
+    struct str_sink_t* sink = str_buffer_init(&buffer, s, sizeof(s));
+    str_put_unsigned(sink, 7, 3);
+    str_put_int(sink, -42, 4);
+    str_put_int(sink, 12345, 2);
+    str_put_unsigned(sink, 65535, 0);
+    str_put_int(sink, -32768, 0);
+    EXPECT_THAT(s, StrEq("  7 -421234565535-32768"));
+}
+
+TEST(string, put_q16_pads_and_rounds)
+{
+    EXPECT_THAT(put_q16((_Q16)(-24.5 * 65536), 5, 1), StrEq("-24.5"));
+    EXPECT_THAT(put_q16((_Q16)(5.5 * 65536), 6, 2), StrEq("  5.50"));
+    EXPECT_THAT(put_q16((_Q16)(9.99999 * 65536), 0, 3), StrEq("10.000"));
+    EXPECT_THAT(put_q16(-1, 0, 4), StrEq("0.0000"));
+    EXPECT_THAT(put_q16(-1, 0, 5), StrEq("-0.00002"));
+    EXPECT_THAT(put_q16((_Q16)0x80000000, 0, 0), StrEq("-32768"));
+    EXPECT_THAT(put_q16(0x7FFFFFFF, 0, 4), StrEq("32768.0000"));
+    EXPECT_THAT(put_q16(0x7FFFFFFF, 0, 9), StrEq("32767.99998"));
+}
+
+TEST(string, put_q16_matches_reference_for_every_fraction)
+{
+    static const short integers[] = {0, 1, -1, 12, -24, 32767, -32768};
+    std::string mismatch;
+    unsigned i, fraction;
+
+    for(i = 0; i != sizeof(integers) / sizeof(*integers); ++i)
+        for(fraction = 0; fraction != 0x10000 && mismatch.empty(); ++fraction)
+            mismatch = compare_to_reference(
+                (_Q16)(((long long)integers[i] << 16) | fraction));
+    EXPECT_THAT(mismatch, StrEq(""));
+}
+
+TEST(string, put_q16_matches_reference_for_every_integer)
+{
+    static const unsigned short fractions[] = {0, 1, 0x7FFF, 0x8000, 0xFFFF};
+    std::string mismatch;
+    unsigned i;
+    long integer;
+
+    for(integer = -32768; integer <= 32767 && mismatch.empty(); ++integer)
+        for(i = 0; i != sizeof(fractions) / sizeof(*fractions); ++i)
+            mismatch += compare_to_reference(
+                (_Q16)(((long long)integer << 16) | fractions[i]));
+    EXPECT_THAT(mismatch, StrEq(""));
+}
+
+TEST(string, put_q16_reads_back_exactly)
+{
+    unsigned long step;
+    unsigned i;
+
+    /* every value around zero and at the ends, a spread in between */
+    for(step = 0; step != 0x30000; ++step)
+    {
+        _Q16 values[] = {
+            (_Q16)(step - 0x18000),
+            (_Q16)(0x7FFFFFFF - step),
+            (_Q16)(0x80000000 + step),
+            (_Q16)((step * 0x10001) ^ 0x5A5A5A5A)
+        };
+        for(i = 0; i != 4; ++i)
+        {
+            char s[32];
+            struct str_buffer_t buffer;
+            str_put_q16(str_buffer_init(&buffer, s, sizeof(s)), values[i], 0,
+                        STR_Q16_MAX_DECIMALS);
+            if(parse_q16(s) != values[i])
+                FAIL() << s << " reads back as " << parse_q16(s);
+        }
+    }
+}
+
 #endif /* TESTING */
@@ -0,0 +1,153 @@
+/*!
+ * @file boot.c
+ *
+ * Boot phase timestamps. The counter is started while the CPU still runs from
+ * the FRC oscillator, so ticks up to BOOT_CLOCK_LOCKED are converted with the
+ * FRC instruction rate and everything after it with FCY. The conversion only
+ * happens when the times are read, marking a phase costs two register reads.
+ */
+
+#include "drv/boot.h"
+#include "drv/hw.h"
+
+/* Instruction clock before the switch to the PLL, FRC / 2 */
+#define FCY_FRC 3685000UL
+
+static uint32_t ticks[BOOT_PHASE_COUNT];
+static uint16_t marked;            /* bit n: phase n has a timestamp */
+
+/* -------------------------------------------------------------------------- */
+void boot_timer_start(void)
+{
+    /*
+     * Timer 2 and 3 form a 32-bit timer clocked by the instruction clock, 1:1
+     * prescale. At 60 MHz it overflows after 71s, at which point the boot is
+     * long over and the timer is switched off again, see boot_mark().
+     */
+    T2CONbits.TON = 0;
+    T2CONbits.T32 = 1;
+    T2CONbits.TCKPS = 0;
+    TMR3 = 0;
+    TMR2 = 0;
+    PR3 = 0xFFFF;
+    PR2 = 0xFFFF;
+    IFS0bits.T3IF = 0;
+    marked = 0;
+    T2CONbits.TON = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void boot_mark(boot_phase_e phase)
+{
+    unsigned char gie;
+    uint16_t lsw, msw;
+
+    if(marked & (1u << phase) || !T2CONbits.TON)
+        return;
+    if(IFS0bits.T3IF)
+    {
+        T2CONbits.TON = 0;
+        return;
+    }
+
+    /* reading TMR2 latches TMR3 into TMR3HLD, nothing may read TMR2 in
+     * between */
+    gie = _GIE;
+    disable_interrupts();
+        lsw = TMR2;
+        msw = TMR3HLD;
+    _GIE = gie;
+
+    ticks[phase] = ((uint32_t)msw << 16) | lsw;
+    marked |= 1u << phase;
+}
+
+/* -------------------------------------------------------------------------- */
+uint32_t boot_get_time(boot_phase_e phase)
+{
+    uint32_t lock, us;
+
+    if(!(marked & (1u << phase)) || !(marked & (1u << BOOT_CLOCK_LOCKED)))
+        return BOOT_TIME_PENDING;
+
+    /* split so the multiplication can't overflow */
+    lock = ticks[BOOT_CLOCK_LOCKED];
+    us = lock / FCY_FRC * 1000000UL + lock % FCY_FRC * 1000UL / (FCY_FRC / 1000);
+    if(phase == BOOT_CLOCK_LOCKED)
+        return us;
+    return us + (ticks[phase] - lock) / (FCY / 1000000UL);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+
+using namespace ::testing;
+
+class boot : public Test
+{
+    virtual void SetUp()
+    {
+        boot_timer_start();
+    }
+
+    virtual void TearDown()
+    {
+        T2CONbits.TON = 0;
+    }
+};
+
+static void set_ticks(uint32_t value)
+{
+    TMR2 = value & 0xFFFF;
+    TMR3HLD = value >> 16;
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(boot, phases_are_pending_until_marked)
+{
+    EXPECT_THAT(boot_get_time(BOOT_CLOCK_LOCKED), Eq(BOOT_TIME_PENDING));
+    set_ticks(3685);
+    boot_mark(BOOT_CLOCK_LOCKED);
+    EXPECT_THAT(boot_get_time(BOOT_CLOCK_LOCKED), Eq(1000u));
+    EXPECT_THAT(boot_get_time(BOOT_ADC_READY), Eq(BOOT_TIME_PENDING));
+}
+
+TEST_F(boot, ticks_after_the_clock_switch_run_at_fcy)
+{
+    set_ticks(3685);
+    boot_mark(BOOT_CLOCK_LOCKED);
+    set_ticks(3685 + 70000UL * 60);
+    boot_mark(BOOT_OUTPUT_LIVE);
+
+    EXPECT_THAT(boot_get_time(BOOT_OUTPUT_LIVE), Eq(71000u));
+}
+
+TEST_F(boot, only_the_first_mark_counts)
+{
+    set_ticks(0);
+    boot_mark(BOOT_CLOCK_LOCKED);
+    set_ticks(600);
+    boot_mark(BOOT_ADC_READY);
+    set_ticks(6000);
+    boot_mark(BOOT_ADC_READY);
+
+    EXPECT_THAT(boot_get_time(BOOT_ADC_READY), Eq(10u));
+}
+
+TEST_F(boot, marks_are_dropped_after_overflow)
+{
+    set_ticks(0);
+    boot_mark(BOOT_CLOCK_LOCKED);
+    IFS0bits.T3IF = 1;
+    boot_mark(BOOT_OUTPUT_LIVE);
+
+    EXPECT_THAT(boot_get_time(BOOT_OUTPUT_LIVE), Eq(BOOT_TIME_PENDING));
+    EXPECT_THAT((unsigned)T2CONbits.TON, Eq(0u));
+}
+
+#endif /* TESTING */
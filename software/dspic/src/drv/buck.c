@@ -8,18 +8,662 @@
 #include <stdint.h>
 #include "drv/buck.h"
 #include "drv/hw.h"
+#include "drv/boot.h"
 #include "core/event.h"
+#include "core/ram_budget.h"
+#include "usr/journal.h"
 #include <stddef.h>
 
 /* -------------------------------------------------------------------------- */
 
-static uint16_t ADCdata0 = 0;
-static uint16_t ADCdata1 = 0;
+/*
+ * Every conversion passes through a filter in the ADC interrupt, so nothing
+ * in the main loop has to pay for it:
+ *
+ *  + "fast" is a first order IIR, fast = fast + (sample - fast) / 2^FAST_SHIFT,
+ *    kept with FAST_SHIFT fractional bits. It lags by a few samples and is
+ *    meant for regulation.
+ *  + "average" is a boxcar over 2^log2_samples conversions which is then
+ *    decimated, i.e. only updated once per block. The sum of 2^n samples of a
+ *    12-bit ADC carries n extra bits, FRACTIONAL_BITS of them are kept, so
+ *    the result is in 12.4 format. Meant for display and telemetry.
+ */
+#define ADC_FAST_SHIFT 2
+#define ADC_FRACTIONAL_BITS 4
+#define ADC_DEFAULT_LOG2_SAMPLES 8      /* 256 samples, 64ms at 4 kHz */
+#define ADC_MAX_LOG2_SAMPLES 10
+
+struct adc_filter_t
+{
+    uint16_t fast;              /* IIR state, 12.FAST_SHIFT */
+    uint16_t average;           /* last boxcar result, 12.FRACTIONAL_BITS */
+    uint32_t sum;
+    uint16_t count;
+    uint16_t min;               /* range of the last block, block capture */
+    uint16_t max;               /* only */
+};
+
+static struct adc_filter_t current_filter;
+static struct adc_filter_t voltage_filter;
+static unsigned char log2_samples = ADC_DEFAULT_LOG2_SAMPLES;
+
+/*
+ * Block capture. Instead of running the filters for every conversion, the AN1
+ * ISR only stores both channels (AN0 and AN1 are triggered together and
+ * finish together) into one of two buffers. Once a buffer is full, the ISR
+ * switches to the other one, lowers its own priority so the following
+ * conversions can interrupt it, and processes the full buffer in one go:
+ * sum, min and max of each channel, then the filters, reference and regulator
+ * once for the whole block. This halves the number of interrupts and moves
+ * most of the work out of the per-conversion path, so Timer1 can trigger
+ * faster than the default 4 kHz.
+ *
+ * If a buffer fills up while the previous one is still being processed, it is
+ * dropped and counted as an overrun.
+ */
+#define ADC_BLOCK_SHIFT 3               /* see RAM_BUDGET_ADC_BLOCKS */
+#define ADC_BLOCK_SIZE (1 << ADC_BLOCK_SHIFT)
+#define ADC_PROCESSING_IPL 3            /* one below the ADC interrupts */
+
+struct adc_block_t
+{
+    uint16_t current[ADC_BLOCK_SIZE];
+    uint16_t voltage[ADC_BLOCK_SIZE];
+};
+
+struct block_capture_t
+{
+    unsigned char enabled;
+    unsigned char fill;         /* buffer the ISR is writing to */
+    unsigned char index;        /* next sample in that buffer */
+    volatile unsigned char processing;
+    unsigned short overruns;
+};
+
+static struct adc_block_t adc_blocks[2];
+RAM_BUDGET_CHECK(adc_blocks, sizeof(adc_blocks), RAM_BUDGET_ADC_BLOCKS);
+static struct block_capture_t capture;
+
+/* the AN0 interrupt is only used when not capturing blocks */
+#define disable_adc_interrupts() do { \
+        _ADCAN0IE = 0;                 \
+        _ADCAN1IE = 0; } while(0)
+#define enable_adc_interrupts() do {  \
+        _ADCAN0IE = !capture.enabled;  \
+        _ADCAN1IE = 1; } while(0)
+
+/* Timer1 runs at FCY / 64 */
+#define TIMER1_FREQUENCY (FCY / 64)
+#define DEFAULT_SAMPLE_RATE 4000
+
+/*
+ * Conversion of the 12.4 readings to Q16 volts and amps, see
+ * struct buck_calibration_t. The defaults are the nominal values of the
+ * circuit, calibration.c replaces them with the ones measured for the unit.
+ */
+#define CURRENT_OFFSET 1862             /* ADC reading at 0A */
+#define TO_12_4(reading, fractional_bits) \
+        ((_Q16)(reading) << (ADC_FRACTIONAL_BITS - (fractional_bits)))
+#define CONVERT(reading_12_4, offset, gain) \
+        ((((_Q16)(reading_12_4) - (offset)) * (gain)) >> BUCK_CALIBRATION_SHIFT)
+
+static struct buck_calibration_t calibration;
+
+/*
+ * The conversions above are relative to AVdd, which isn't stable. AN8 samples
+ * the 1.5V reference instead, and since the reference is known, the ratio of
+ * the expected to the measured reading is how far off AVdd is. The ratio is
+ * kept as a Q16 scale factor so correcting a reading costs one multiply.
+ *
+ * The reference doesn't move quickly, so it is converted once every
+ * VREF_DECIMATION voltage conversions (62.5 Hz at 4 kHz) and low-pass
+ * filtered with VREF_FILTER_SHIFT fractional bits. The division to update the
+ * scale factor happens only then.
+ */
+#define VREF_DECIMATION 64
+#define VREF_FILTER_SHIFT 3
+#define VREF_NOMINAL 1862               /* 1.5V with AVdd = 3.3V */
+#define VREF_MIN (VREF_NOMINAL * 9 / 10)
+#define VREF_MAX (VREF_NOMINAL * 11 / 10)
+#define VREF_SCALE_ONE 0x10000
+
+struct vref_t
+{
+    uint16_t filtered;          /* 12.VREF_FILTER_SHIFT, 0 if no sample yet */
+    _Q16 scale;
+    unsigned char countdown;
+};
+
+static struct vref_t vref;
+
+/*
+ * Optional PI regulator, run from the AN1 ISR on every voltage conversion, or
+ * once per block with block capture.
+ * It compares the fast output voltage to the target set by the main loop and
+ * moves the voltage comparator's DAC reference to make up for the difference:
+ *
+ *   output = target + kp * error + integral,  integral += ki * error
+ *
+ * All values are Q16 volts, the gains are Q16 and ki is applied at the ADC
+ * trigger rate. Anti-windup is done by clamping the integral and by not
+ * integrating any further while the output is saturated in the direction of
+ * the error. When disabled, the target goes straight to the DAC.
+ *
+ * Optionally, the regulator (or the DAC when it's disabled) doesn't follow the
+ * target directly but a setpoint that moves towards it by at most slew_step
+ * per conversion. That keeps the output continuous when the target jumps,
+ * e.g. when switching panels. The step is derived from a rate in V/ms and the
+ * sample rate, so it only costs a comparison while the setpoint is settled.
+ */
+#define DAC_MAX_VOLTAGE 1507328         /* 23V */
+#define DAC_VOLTAGE_SCALE 2427          /* 1 / (18 * 1.5V) */
+#define REGULATOR_INTEGRAL_LIMIT 131072 /* 2V */
+#define REGULATOR_DEFAULT_KP 32768      /* 0.5 */
+#define REGULATOR_DEFAULT_KI 655        /* 0.01 */
+#define REGULATOR_MAX_SLEW_RATE (64 * 65536L) /* V/ms, keeps rate * 1000 in 32 bits */
+
+struct regulator_t
+{
+    unsigned char enabled;
+    _Q16 target;
+    _Q16 kp;
+    _Q16 ki;
+    _Q16 integral;
+    _Q16 setpoint;              /* target after slew limiting */
+    _Q16 slew_rate;             /* V/ms, 0 = no limit */
+    _Q16 slew_step;             /* V per conversion */
+};
+
+static struct regulator_t regulator;
+
+/*
+ * Transient capture for a scope-like view on the host. Once armed, every
+ * conversion pair is recorded into a ring of BUCK_TRANSIENT_DEPTH samples so
+ * there is always some history before the trigger. The trigger is either a
+ * current step between two consecutive samples larger than di_threshold, a
+ * call to buck_transient_trigger() or UVLO. The trigger sample counts as the
+ * first of post_trigger samples, after which the ring is frozen until the
+ * main loop has read it and released it.
+ *
+ * The raw readings are kept and only converted when read, so the ISR doesn't
+ * do more than copy two words. When disarmed it costs one comparison.
+ */
+struct transient_t
+{
+    volatile unsigned char state;   /* buck_transient_state_e */
+    unsigned char next;             /* ring position of the next sample */
+    unsigned char length;           /* samples in the ring */
+    unsigned char pre_trigger;
+    unsigned char post_trigger;     /* samples from the trigger on */
+    unsigned char recorded;         /* samples since the trigger */
+    uint16_t di_threshold;          /* ADC LSBs per sample, 0 = off */
+    uint16_t last_current;
+    uint16_t current[BUCK_TRANSIENT_DEPTH];
+    uint16_t voltage[BUCK_TRANSIENT_DEPTH];
+};
+
+static struct transient_t transient;
+RAM_BUDGET_CHECK(transient, sizeof(transient), RAM_BUDGET_TRANSIENT);
+static unsigned short sample_rate;
+
+/*
+ * Measurement statistics. Besides the filters, every conversion pair is
+ * accumulated over a window of 2^log2_samples conversions: sum, minimum and
+ * maximum of each channel, the sum of squares for the RMS ripple and the sum
+ * of the products of voltage and current for the mean power. That's a few
+ * adds and three multiplies per conversion, with block capture too. When the
+ * window is complete the ISR hands the sums over to buck_get_stats(), which
+ * converts them when asked.
+ *
+ * The squares are taken of the deviation from the first sample of the
+ * window, the RMS ripple then is sqrt(E[d^2] - E[d]^2). Deviations are
+ * clipped to STATS_MAX_DEVIATION so the squares of the longest window fit 32
+ * bits, anything larger isn't ripple but a step anyway. The products are
+ * taken of the readings relative to the calibration offsets, so the power is
+ * the mean of v * i and not the product of the means.
+ *
+ * The products of two 12-bit readings have 24 bits. They are summed with
+ * STATS_POWER_SHIFT bits less, so a window of 2^ADC_MAX_LOG2_SAMPLES fits 31
+ * bits. The power sum of each window goes into pending_energy with another
+ * STATS_ENERGY_SHIFT bits less, which holds 2^14 conversions, a quarter of a
+ * second at the highest sample rate. energy_fold() converts it to watt hours
+ * every update. Readings are converted with the calibration and sample rate
+ * they were taken with, so it's also folded before either changes.
+ */
+#define STATS_MAX_DEVIATION 2047
+#define STATS_POWER_SHIFT 3
+#define STATS_ENERGY_SHIFT 4
+#define SECONDS_PER_HOUR 3600
+
+struct stats_channel_t
+{
+    uint32_t sum;
+    uint32_t square_sum;        /* of the deviations from first */
+    uint16_t first;
+    uint16_t min;
+    uint16_t max;
+};
+
+struct stats_window_t
+{
+    struct stats_channel_t voltage;
+    struct stats_channel_t current;
+    int32_t power_sum;          /* of (voltage - zero) * (current - zero) */
+    uint16_t count;
+};
+
+struct stats_t
+{
+    struct stats_window_t window;   /* accumulated by the ISR */
+    struct stats_window_t finished; /* last complete window */
+    unsigned short sequence;        /* complete windows */
+    uint16_t voltage_zero;          /* calibration offsets in whole LSBs */
+    uint16_t current_zero;
+    int32_t pending_energy;         /* power sums not folded yet */
+    int32_t watt_samples;           /* Q16 W * samples, less than a Wh */
+    _Q16 energy;                    /* Q16 Wh */
+};
+
+static struct stats_t stats;
+RAM_BUDGET_CHECK(stats, sizeof(stats), RAM_BUDGET_STATS);
+
+/* -------------------------------------------------------------------------- */
+static void filter_reset(struct adc_filter_t* filter)
+{
+    filter->fast = 0;
+    filter->average = 0;
+    filter->sum = 0;
+    filter->count = 0;
+    filter->min = 0;
+    filter->max = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void filter_decimate(struct adc_filter_t* filter, unsigned char shift)
+{
+    if(!(filter->count >> shift))
+        return;
+
+    /* shifting right by a negative amount isn't a thing, hence the
+     * distinction for blocks shorter than 16 samples */
+    if(shift >= ADC_FRACTIONAL_BITS)
+        filter->average = filter->sum >> (shift - ADC_FRACTIONAL_BITS);
+    else
+        filter->average = filter->sum << (ADC_FRACTIONAL_BITS - shift);
+    filter->sum = 0;
+    filter->count = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void filter_sample(struct adc_filter_t* filter, uint16_t sample)
+{
+    /* fast += sample - fast / 2^FAST_SHIFT, everything scaled by 2^FAST_SHIFT */
+    filter->fast += sample - (filter->fast >> ADC_FAST_SHIFT);
+
+    filter->sum += sample;
+    ++filter->count;
+    filter_decimate(filter, log2_samples);
+}
+
+/* -------------------------------------------------------------------------- */
+static void filter_block(struct adc_filter_t* filter, const uint16_t* samples)
+{
+    uint32_t sum = 0;
+    uint16_t min = 0xffff;
+    uint16_t max = 0;
+    unsigned char i;
+
+    for(i = 0; i != ADC_BLOCK_SIZE; ++i)
+    {
+        uint16_t sample = samples[i];
+        sum += sample;
+        if(sample < min)
+            min = sample;
+        if(sample > max)
+            max = sample;
+    }
+    filter->min = min;
+    filter->max = max;
+
+    /* the fast filter sees one sample per block, the block mean */
+    filter->fast += (uint16_t)(sum >> ADC_BLOCK_SHIFT) -
+                    (filter->fast >> ADC_FAST_SHIFT);
+
+    /* averaging over less than a block makes no sense, average the block */
+    filter->sum += sum;
+    filter->count += ADC_BLOCK_SIZE;
+    filter_decimate(filter, log2_samples > ADC_BLOCK_SHIFT ?
+                            log2_samples : ADC_BLOCK_SHIFT);
+}
+
+/* -------------------------------------------------------------------------- */
+static void vref_reset(void)
+{
+    vref.filtered = 0;
+    vref.scale = VREF_SCALE_ONE;
+    vref.countdown = VREF_DECIMATION;
+}
+
+/* -------------------------------------------------------------------------- */
+static void vref_sample(uint16_t sample)
+{
+    /*
+     * Readings this far off mean the reference itself isn't there (yet),
+     * trusting them would make things worse than using AVdd.
+     */
+    if(sample < VREF_MIN || sample > VREF_MAX)
+        return;
+
+    if(vref.filtered == 0)
+        vref.filtered = sample << VREF_FILTER_SHIFT;
+    else
+        vref.filtered += sample - (vref.filtered >> VREF_FILTER_SHIFT);
+
+    vref.scale = ((uint32_t)VREF_NOMINAL << (16 + VREF_FILTER_SHIFT)) /
+                 vref.filtered;
+}
+
+/* -------------------------------------------------------------------------- */
+static uint16_t voltage_to_dac(_Q16 voltage)
+{
+    /* the comparator reference is inverted, 0 is 23V and 4095 is -4V */
+    _Q16 value = _Q16mpy(DAC_MAX_VOLTAGE - voltage, DAC_VOLTAGE_SCALE) >> 4;
+    if(value < 0)
+        return 0;
+    if(value > 0x0fff)
+        return 0x0fff;
+    return (uint16_t)value;
+}
+
+/* -------------------------------------------------------------------------- */
+static void regulator_reset(void)
+{
+    regulator.enabled = 0;
+    regulator.target = 0;
+    regulator.kp = REGULATOR_DEFAULT_KP;
+    regulator.ki = REGULATOR_DEFAULT_KI;
+    regulator.integral = 0;
+    regulator.setpoint = 0;
+    regulator.slew_rate = 0;
+    regulator.slew_step = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void update_slew_step(void)
+{
+    unsigned long step = 0;
+    if(regulator.slew_rate)
+    {
+        step = ((unsigned long)regulator.slew_rate * 1000 + sample_rate / 2) /
+               sample_rate;
+        if(step == 0)
+            step = 1;
+    }
+    regulator.slew_step = (_Q16)step;
+}
+
+/* -------------------------------------------------------------------------- */
+static void slew_setpoint(unsigned char shift)
+{
+    _Q16 limit = regulator.slew_step << shift;
+    _Q16 difference = regulator.target - regulator.setpoint;
+    if(difference > limit)
+        difference = limit;
+    else if(difference < -limit)
+        difference = -limit;
+    regulator.setpoint += difference;
+
+    if(!regulator.enabled)
+        CMP1DACbits.CMREF = voltage_to_dac(regulator.setpoint);
+}
+
+/* -------------------------------------------------------------------------- */
+static void regulator_step(void)
+{
+    _Q16 error = regulator.setpoint - buck_get_voltage_fast();
+    _Q16 output = regulator.setpoint + _Q16mpy(regulator.kp, error) +
+                  regulator.integral;
+
+    if(output > DAC_MAX_VOLTAGE)
+    {
+        output = DAC_MAX_VOLTAGE;
+        if(error > 0)
+            error = 0;
+    }
+    else if(output < 0)
+    {
+        output = 0;
+        if(error < 0)
+            error = 0;
+    }
+
+    regulator.integral += _Q16mpy(regulator.ki, error);
+    if(regulator.integral > REGULATOR_INTEGRAL_LIMIT)
+        regulator.integral = REGULATOR_INTEGRAL_LIMIT;
+    else if(regulator.integral < -REGULATOR_INTEGRAL_LIMIT)
+        regulator.integral = -REGULATOR_INTEGRAL_LIMIT;
+
+    CMP1DACbits.CMREF = voltage_to_dac(output);
+}
+
+/* -------------------------------------------------------------------------- */
+static void request_reference_conversion(void)
+{
+    ADCON3Lbits.CNVCHSEL = 8; // AN8
+    ADCON3Lbits.CNVRTCH = 1; // individual channel conversion trigger
+}
+
+/* -------------------------------------------------------------------------- */
+static void stats_reset(void)
+{
+    stats.window.count = 0;
+    stats.finished.count = 0;
+    stats.sequence = 0;
+    stats.pending_energy = 0;
+    stats.watt_samples = 0;
+    stats.energy = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void stats_set_zero(void)
+{
+    /* rounded to whole LSBs, so the products are 16x16 bit multiplies */
+    stats.voltage_zero = (calibration.voltage_offset +
+                          (1 << (ADC_FRACTIONAL_BITS - 1))) >> ADC_FRACTIONAL_BITS;
+    stats.current_zero = (calibration.current_offset +
+                          (1 << (ADC_FRACTIONAL_BITS - 1))) >> ADC_FRACTIONAL_BITS;
+}
+
+/* -------------------------------------------------------------------------- */
+static void stats_channel_begin(struct stats_channel_t* channel,
+                                uint16_t sample)
+{
+    channel->sum = 0;
+    channel->square_sum = 0;
+    channel->first = sample;
+    channel->min = sample;
+    channel->max = sample;
+}
+
+/* -------------------------------------------------------------------------- */
+static void stats_channel_sample(struct stats_channel_t* channel,
+                                 uint16_t sample)
+{
+    int16_t deviation = (int16_t)(sample - channel->first);
+    if(deviation > STATS_MAX_DEVIATION)
+        deviation = STATS_MAX_DEVIATION;
+    else if(deviation < -STATS_MAX_DEVIATION)
+        deviation = -STATS_MAX_DEVIATION;
+
+    channel->sum += sample;
+    channel->square_sum += (uint32_t)((int32_t)deviation * deviation);
+    if(sample < channel->min)
+        channel->min = sample;
+    if(sample > channel->max)
+        channel->max = sample;
+}
+
+/* -------------------------------------------------------------------------- */
+static void stats_sample(uint16_t current, uint16_t voltage)
+{
+    struct stats_window_t* window = &stats.window;
+
+    if(window->count == 0)
+    {
+        stats_channel_begin(&window->voltage, voltage);
+        stats_channel_begin(&window->current, current);
+        window->power_sum = 0;
+    }
+
+    stats_channel_sample(&window->voltage, voltage);
+    stats_channel_sample(&window->current, current);
+    window->power_sum += ((int32_t)(int16_t)(voltage - stats.voltage_zero) *
+                          (int16_t)(current - stats.current_zero) +
+                          (1 << (STATS_POWER_SHIFT - 1))) >> STATS_POWER_SHIFT;
+
+    if(++window->count >> log2_samples)
+    {
+        stats.finished = *window;
+        stats.pending_energy += (window->power_sum +
+                                 (1 << (STATS_ENERGY_SHIFT - 1))) >>
+                                STATS_ENERGY_SHIFT;
+        ++stats.sequence;
+        window->count = 0;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Converts a sum of products, each STATS_POWER_SHIFT bits short */
+static int64_t to_watt_samples(int64_t products)
+{
+    /* (v * gv >> 4) * (i * gi >> 4) >> 16 in two steps to stay in 64 bits */
+    uint32_t voltage_gain = (uint32_t)calibration.voltage_gain * vref.scale >> 16;
+    uint32_t current_gain = (uint32_t)calibration.current_gain * vref.scale >> 16;
+    return ((products * voltage_gain) >> (12 - STATS_POWER_SHIFT)) *
+           current_gain >> 12;
+}
+
+/* -------------------------------------------------------------------------- */
+static void energy_fold(void)
+{
+    int32_t pending;
+    int32_t samples_per_hour;
+    int64_t watt_samples;
+
+    _ADCAN1IE = 0;
+        pending = stats.pending_energy;
+        stats.pending_energy = 0;
+    _ADCAN1IE = 1;
+    if(pending == 0 || sample_rate == 0)
+        return;
+
+    /* only the remainder is kept, it's less than samples_per_hour */
+    samples_per_hour = (int32_t)sample_rate * SECONDS_PER_HOUR;
+    watt_samples = stats.watt_samples +
+            to_watt_samples((int64_t)pending << STATS_ENERGY_SHIFT);
+    stats.energy += (_Q16)(watt_samples / samples_per_hour);
+    stats.watt_samples = (int32_t)(watt_samples % samples_per_hour);
+}
+
+/* -------------------------------------------------------------------------- */
+static void on_update(unsigned int arg)
+{
+    energy_fold();
+}
+
+/* -------------------------------------------------------------------------- */
+static void process_block(const struct adc_block_t* block)
+{
+    unsigned char i;
+
+    filter_block(&current_filter, block->current);
+    filter_block(&voltage_filter, block->voltage);
+    for(i = 0; i != ADC_BLOCK_SIZE; ++i)
+        stats_sample(block->current[i], block->voltage[i]);
+
+    if(vref.countdown <= ADC_BLOCK_SIZE)
+    {
+        vref.countdown = VREF_DECIMATION;
+        request_reference_conversion();
+    }
+    else
+        vref.countdown -= ADC_BLOCK_SIZE;
+
+    if(regulator.setpoint != regulator.target)
+        slew_setpoint(ADC_BLOCK_SHIFT);
+    if(regulator.enabled)
+        regulator_step();
+}
+
+/* -------------------------------------------------------------------------- */
+static void transient_finish(void)
+{
+    transient.state = BUCK_TRANSIENT_DONE;
+    event_post(EVENT_TRANSIENT_CAPTURED, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+static void transient_sample(uint16_t current, uint16_t voltage)
+{
+    transient.current[transient.next] = current;
+    transient.voltage[transient.next] = voltage;
+    transient.next = (transient.next + 1) & (BUCK_TRANSIENT_DEPTH - 1);
+    if(transient.length != BUCK_TRANSIENT_DEPTH)
+        ++transient.length;
+
+    /* only look for a step once the requested history is there */
+    if(transient.state == BUCK_TRANSIENT_ARMED &&
+       transient.di_threshold &&
+       transient.length > transient.pre_trigger &&
+       transient.length > 1)
+    {
+        uint16_t step = current > transient.last_current ?
+                current - transient.last_current :
+                transient.last_current - current;
+        if(step >= transient.di_threshold)
+            transient.state = BUCK_TRANSIENT_TRIGGERED;
+    }
+    transient.last_current = current;
+
+    if(transient.state == BUCK_TRANSIENT_TRIGGERED &&
+       ++transient.recorded == transient.post_trigger)
+    {
+        transient_finish();
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static void capture_sample(void)
+{
+    struct adc_block_t* block = &adc_blocks[capture.fill];
+    block->current[capture.index] = ADCBUF0;
+    block->voltage[capture.index] = ADCBUF1;
+    _ADCAN1IF = 0;
+
+    if(++capture.index != ADC_BLOCK_SIZE)
+        return;
+    capture.index = 0;
+
+    /* the other buffer is still being worked on, refill this one */
+    if(capture.processing)
+    {
+        ++capture.overruns;
+        return;
+    }
+
+    capture.fill ^= 1;
+    capture.processing = 1;
+        SRbits.IPL = ADC_PROCESSING_IPL;
+        process_block(block);
+    capture.processing = 0;
+}
 
+/* -------------------------------------------------------------------------- */
 void buck_enable()
 {
     BUCK_EN = 1;
     T1CONbits.TON = 1;      /* start timer */
+    boot_mark(BOOT_OUTPUT_LIVE);
 }
 
 void buck_disable()
@@ -44,8 +688,7 @@ static void buck_timer_init()
      */
     T1CONbits.TON = 0;      /* disable timer during config */
     T1CONbits.TCKPS = 0x02; /* prescale 1:64 */
-    PR4 = 234;              /* period match, divide the 936 kHz by 234 to
-                             * reach 250us */
+    buck_set_sample_rate(DEFAULT_SAMPLE_RATE);
     IFS0bits.T1IF = 0;      /* clear interrupt flag */
     /* IEC0bits.T1IE = 1;       enable timer 4 interrupts */
 }
@@ -80,59 +723,58 @@ static void buck_pga_init()
     PGA1CONbits.PGAEN = 1; //Enable PGA1
 }
 
-static void EnableAndCalibrate()
+static void adc_power_up(void)
 {
     // Set initialisation time to maximum
     ADCON5Hbits.WARMTIME = 15;
     // Turn on ADC module
     ADCON1Lbits.ADON = 1;
 
-    // Turn on analog power for dedicated core 0
+    // Turn on analog power for all cores at once, they warm up in parallel
+    // while the other drivers initialise, see buck_init_end()
     ADCON5Lbits.C0PWR = 1;
-    // Wait when the core 0 is ready for operation
-    while(ADCON5Lbits.C0RDY == 0);
-    // Turn on digital power to enable triggers to the core 0
-    ADCON3Hbits.C0EN = 1;
-
-    // Turn on analog power for dedicated core 1
     ADCON5Lbits.C1PWR = 1;
-    // Wait when the core 1 is ready for operation
-    while(ADCON5Lbits.C1RDY == 0);
-    // Turn on digital power to enable triggers to the core 1
+    ADCON5Lbits.SHRPWR = 1;
+}
+
+static void adc_calibrate(void)
+{
+    // Wait when the cores are ready for operation
+    while(ADCON5Lbits.C0RDY == 0 ||
+          ADCON5Lbits.C1RDY == 0 ||
+          ADCON5Lbits.SHRRDY == 0);
+    // Turn on digital power to enable triggers to the cores
+    ADCON3Hbits.C0EN = 1;
     ADCON3Hbits.C1EN = 1;
+    ADCON3Hbits.SHREN = 1;
 
-    // Enable calibration for the dedicated core 0
+    // The cores calibrate independently, run them concurrently instead of
+    // one after the other as in Example 5-1
     ADCAL0Lbits.CAL0EN = 1;
-    // Single-ended input calibration
-    ADCAL0Lbits.CAL0DIFF = 0;
-    // Start calibration
-    ADCAL0Lbits.CAL0RUN = 1;
-    // Poll for the calibration end
-    while(ADCAL0Lbits.CAL0RDY == 0);
-    // Differential input calibration
-    ADCAL0Lbits.CAL0DIFF = 1;
-    // Start calibration
-    ADCAL0Lbits.CAL0RUN = 1;
-    // Poll for the calibration end
-    while(ADCAL0Lbits.CAL0RDY == 0);
-    // End the core 0 calibration
-    ADCAL0Lbits.CAL0EN = 0;
-
-    // Enable calibration for the dedicated core 1
     ADCAL0Lbits.CAL1EN = 1;
+    ADCAL1Hbits.CSHREN = 1;
+
     // Single-ended input calibration
+    ADCAL0Lbits.CAL0DIFF = 0;
     ADCAL0Lbits.CAL1DIFF = 0;
-    // Start calibration
+    ADCAL1Hbits.CSHRDIFF = 0;
+    ADCAL0Lbits.CAL0RUN = 1;
     ADCAL0Lbits.CAL1RUN = 1;
-    // Poll for the calibration end
-    while(ADCAL0Lbits.CAL1RDY == 0);
-    // Differential input calibration
+    ADCAL1Hbits.CSHRRUN = 1;
+    while(ADCAL0Lbits.CAL0RDY == 0 ||
+          ADCAL0Lbits.CAL1RDY == 0 ||
+          ADCAL1Hbits.CSHRRDY == 0);
+    // The shared core only converts single-ended inputs
+    ADCAL1Hbits.CSHREN = 0;
+
+    // Differential input calibration of the dedicated cores
+    ADCAL0Lbits.CAL0DIFF = 1;
     ADCAL0Lbits.CAL1DIFF = 1;
-    // Start calibration
+    ADCAL0Lbits.CAL0RUN = 1;
     ADCAL0Lbits.CAL1RUN = 1;
-    // Poll for the calibration end
-    while(ADCAL0Lbits.CAL1RDY == 0);
-    // End the core 1 calibration
+    while(ADCAL0Lbits.CAL0RDY == 0 ||
+          ADCAL0Lbits.CAL1RDY == 0);
+    ADCAL0Lbits.CAL0EN = 0;
     ADCAL0Lbits.CAL1EN = 0;
 }
 
@@ -142,6 +784,7 @@ static void buck_adc_init()
     // Configure the I/O pins to be used as analog inputs.
     ADCON4Hbits.C0CHS = 2; //PGA1
     ADCON4Hbits.C1CHS = 0; //AN1
+    // AN8 (VREF) has no dedicated core and is converted by the shared core
 
     // Configure the common ADC clock.
     ADCON3Hbits.CLKSEL = 2; // clock from FRC oscillator
@@ -149,6 +792,8 @@ static void buck_adc_init()
     // Configure the cores? ADC clock.
     ADCORE0Hbits.ADCS = 0; // clock divider (1:2)
     ADCORE1Hbits.ADCS = 0; // clock divider (1:2)
+    ADCON2Lbits.SHRADCS = 0; // clock divider (1:2)
+    ADCON2Hbits.SHRSAMC = 15; // 17 TAD sampling time, VREF is high impedance
     // Configure the ADC reference sources.
     ADCON3Lbits.REFSEL = 0; // AVdd as voltage reference
     // Configure the integer of fractional output format.
@@ -158,13 +803,23 @@ static void buck_adc_init()
     ADMOD0Lbits.DIFF0 = 0; // AN0/RA0
     ADMOD0Lbits.SIGN1 = 0; // AN1/RA1
     ADMOD0Lbits.DIFF1 = 0; // AN1/RA1
+    ADMOD0Hbits.SIGN8 = 0; // AN8/RC1
+    ADMOD0Hbits.DIFF8 = 0; // AN8/RC1
+
+    // Power up the cores, they are calibrated in buck_adc_start()
+    adc_power_up();
+}
 
-    // Enable and calibrate the module.
-    EnableAndCalibrate(); // See Example 5-1
+static void buck_adc_start()
+{
+    // Calibrate the cores once they are powered, see Example 5-1
+    adc_calibrate();
 
     // Set same trigger source for all inputs to sample signals simultaneously.
     ADTRIG0Lbits.TRGSRC0 = 12; // timer 1 for AN0
     ADTRIG0Lbits.TRGSRC1 = 12; // timer 1 for AN1
+    // AN8 is converted on demand from the AN1 ISR, see vref_t
+    ADTRIG2Lbits.TRGSRC8 = 0; // no trigger
 
     // Configure and enable ADC interrupts.
     ADIELbits.IE0 = 1; // enable interrupt for AN0
@@ -173,6 +828,9 @@ static void buck_adc_init()
     _ADCAN0IE = 1; // enable interrupt for AN0
     _ADCAN1IF = 0; // clear interrupt flag for AN1
     _ADCAN1IE = 1; // enable interrupt for AN1
+    ADIELbits.IE8 = 1; // enable interrupt for AN8
+    _ADCAN8IF = 0; // clear interrupt flag for AN8
+    _ADCAN8IE = 1; // enable interrupt for AN8
 }
 
 static void buck_dac_init()
@@ -189,78 +847,509 @@ static void buck_dac_init()
 }
 
 void buck_init(void)
+{
+    buck_init_begin();
+    buck_init_end();
+}
+
+void buck_init_begin(void)
 {
     buck_gpio_init();
     buck_timer_init();
     buck_pga_init();
     buck_adc_init();
     buck_dac_init();
-}
 
-_Q16 buck_get_voltage()
-{
-    _Q16 value = (_Q16)ADCdata1 * 845;
-    return value;
+    filter_reset(&current_filter);
+    filter_reset(&voltage_filter);
+    log2_samples = ADC_DEFAULT_LOG2_SAMPLES;
+    calibration.voltage_offset = BUCK_DEFAULT_VOLTAGE_OFFSET;
+    calibration.voltage_gain = BUCK_DEFAULT_VOLTAGE_GAIN;
+    calibration.current_offset = BUCK_DEFAULT_CURRENT_OFFSET;
+    calibration.current_gain = BUCK_DEFAULT_CURRENT_GAIN;
+    capture.enabled = 0;
+    capture.fill = 0;
+    capture.index = 0;
+    capture.processing = 0;
+    capture.overruns = 0;
+    vref_reset();
+    regulator_reset();
+    transient.state = BUCK_TRANSIENT_IDLE;
+    stats_set_zero();
+    stats_reset();
+
+    event_register_listener(EVENT_UPDATE, on_update);
 }
 
-_Q16 buck_get_current()
+void buck_init_end(void)
 {
-    _Q16 value = ((_Q16)ADCdata0 - 1862) * 330;
-    return value;
+    buck_adc_start();
 }
 
-void buck_set_voltage(_Q16 voltage)
+/* -------------------------------------------------------------------------- */
+void buck_set_averaging(unsigned char log2)
 {
-    _Q16 max_v = 1507328; // 23V
-    _Q16 div = 1769472; // 18 * 1.5V
-
-    int16_t value = _Q16div(max_v - voltage, div) >> 4;
-    if(value < 0){
-        value = 0;
-    }else if(value > 0x0fff){
-        value = 0x0fff;
-    }
+    if(log2 > ADC_MAX_LOG2_SAMPLES)
+        log2 = ADC_MAX_LOG2_SAMPLES;
 
-    CMP1DACbits.CMREF = value;
+    /* the ISRs must not see a half-updated filter */
+    disable_adc_interrupts();
+        log2_samples = log2;
+        current_filter.sum = 0;
+        current_filter.count = 0;
+        voltage_filter.sum = 0;
+        voltage_filter.count = 0;
+        stats.window.count = 0;
+    enable_adc_interrupts();
 }
 
-void buck_set_current(_Q16 current)
+/* -------------------------------------------------------------------------- */
+void buck_set_block_capture(unsigned char enable)
 {
-    _Q16 max_i = 327680; // 5A
+    disable_adc_interrupts();
+        capture.enabled = enable;
+        capture.fill = 0;
+        capture.index = 0;
+        ADIELbits.IE0 = !enable;
+    enable_adc_interrupts();
+}
 
-    int16_t value = _Q16div(current, max_i) >> 4;
+/* -------------------------------------------------------------------------- */
+unsigned short buck_get_block_overruns()
+{
+    return capture.overruns;
+}
 
-    if(value < 0){
-        value = 0;
-    }else if(value > 0x0fff){
-        value = 0x0fff;
-    }
+/* -------------------------------------------------------------------------- */
+void buck_set_sample_rate(unsigned short hz)
+{
+    unsigned long period = (TIMER1_FREQUENCY + hz / 2) / hz;
+    if(period > 0x10000)
+        period = 0x10000;
+    PR1 = (unsigned short)(period - 1);
 
-    CMP2DACbits.CMREF = value;
+    /* what was measured so far counts at the old rate */
+    energy_fold();
+    _ADCAN1IE = 0;
+        sample_rate = hz;
+        update_slew_step();
+    _ADCAN1IE = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned short buck_get_sample_rate()
+{
+    return sample_rate;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_transient_arm(unsigned char pre_trigger, _Q16 di_threshold)
+{
+    /* the step is compared in raw readings, see CONVERT() */
+    unsigned long threshold = 0;
+    if(di_threshold > 0)
+    {
+        threshold = ((unsigned long)di_threshold << ADC_FRACTIONAL_BITS) /
+                    calibration.current_gain;
+        if(threshold == 0)
+            threshold = 1;
+        if(threshold > 0xFFFF)
+            threshold = 0xFFFF;
+    }
+
+    if(pre_trigger > BUCK_TRANSIENT_DEPTH - 1)
+        pre_trigger = BUCK_TRANSIENT_DEPTH - 1;
+
+    _ADCAN1IE = 0;
+        transient.next = 0;
+        transient.length = 0;
+        transient.recorded = 0;
+        transient.pre_trigger = pre_trigger;
+        transient.post_trigger = BUCK_TRANSIENT_DEPTH - pre_trigger;
+        transient.di_threshold = (uint16_t)threshold;
+        transient.state = BUCK_TRANSIENT_ARMED;
+    _ADCAN1IE = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_transient_trigger()
+{
+    _ADCAN1IE = 0;
+        if(transient.state == BUCK_TRANSIENT_ARMED)
+            transient.state = BUCK_TRANSIENT_TRIGGERED;
+    _ADCAN1IE = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_transient_release()
+{
+    _ADCAN1IE = 0;
+        transient.state = BUCK_TRANSIENT_IDLE;
+    _ADCAN1IE = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+buck_transient_state_e buck_transient_get_state()
+{
+    return (buck_transient_state_e)transient.state;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char buck_transient_get_length()
+{
+    return transient.length;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char buck_transient_get_trigger()
+{
+    return transient.length - transient.recorded;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_transient_get_sample(unsigned char index,
+                               _Q16* voltage, _Q16* current)
+{
+    unsigned char position = (transient.next - transient.length + index) &
+                             (BUCK_TRANSIENT_DEPTH - 1);
+
+    *voltage = _Q16mpy(CONVERT(TO_12_4(transient.voltage[position], 0),
+                               calibration.voltage_offset,
+                               calibration.voltage_gain), vref.scale);
+    *current = _Q16mpy(CONVERT(TO_12_4(transient.current[position], 0),
+                               calibration.current_offset,
+                               calibration.current_gain), vref.scale);
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_regulator_set_target(_Q16 voltage)
+{
+    _ADCAN1IE = 0;
+        regulator.target = voltage;
+        if(!regulator.slew_step)
+            regulator.setpoint = voltage;
+    _ADCAN1IE = 1;
+
+    /* otherwise the ISR walks the DAC there */
+    if(!regulator.enabled && !regulator.slew_step)
+        buck_set_voltage(voltage);
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 buck_regulator_get_target()
+{
+    return regulator.target;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_set_slew_rate(_Q16 volts_per_ms)
+{
+    if(volts_per_ms < 0)
+        volts_per_ms = 0;
+    if(volts_per_ms > REGULATOR_MAX_SLEW_RATE)
+        volts_per_ms = REGULATOR_MAX_SLEW_RATE;
+
+    _ADCAN1IE = 0;
+        regulator.slew_rate = volts_per_ms;
+        update_slew_step();
+        if(!regulator.slew_step)
+            regulator.setpoint = regulator.target;
+    _ADCAN1IE = 1;
+
+    if(!regulator.enabled && !regulator.slew_step)
+        buck_set_voltage(regulator.target);
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 buck_get_slew_rate()
+{
+    return regulator.slew_rate;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_regulator_set_gains(_Q16 kp, _Q16 ki)
+{
+    _ADCAN1IE = 0;
+        regulator.kp = kp;
+        regulator.ki = ki;
+    _ADCAN1IE = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 buck_regulator_get_kp()
+{
+    return regulator.kp;
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 buck_regulator_get_ki()
+{
+    return regulator.ki;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_regulator_enable(unsigned char enable)
+{
+    if(regulator.enabled == enable)
+        return;
+
+    _ADCAN1IE = 0;
+        regulator.enabled = enable;
+        regulator.integral = 0;
+    _ADCAN1IE = 1;
+
+    if(!enable)
+        buck_set_voltage(regulator.setpoint);
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char buck_regulator_is_enabled()
+{
+    return regulator.enabled;
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 buck_get_voltage()
+{
+    _Q16 value = CONVERT(voltage_filter.average,
+                         calibration.voltage_offset, calibration.voltage_gain);
+    return _Q16mpy(value, vref.scale);
+}
+
+_Q16 buck_get_current()
+{
+    _Q16 value = CONVERT(current_filter.average,
+                         calibration.current_offset, calibration.current_gain);
+    return _Q16mpy(value, vref.scale);
+}
+
+_Q16 buck_get_voltage_fast()
+{
+    _Q16 value = CONVERT(TO_12_4(voltage_filter.fast, ADC_FAST_SHIFT),
+                         calibration.voltage_offset, calibration.voltage_gain);
+    return _Q16mpy(value, vref.scale);
+}
+
+_Q16 buck_get_current_fast()
+{
+    _Q16 value = CONVERT(TO_12_4(current_filter.fast, ADC_FAST_SHIFT),
+                         calibration.current_offset, calibration.current_gain);
+    return _Q16mpy(value, vref.scale);
+}
+
+_Q16 buck_get_voltage_ripple()
+{
+    _Q16 value = CONVERT(TO_12_4(voltage_filter.max - voltage_filter.min, 0),
+                         0, calibration.voltage_gain);
+    return _Q16mpy(value, vref.scale);
+}
+
+_Q16 buck_get_current_ripple()
+{
+    _Q16 value = CONVERT(TO_12_4(current_filter.max - current_filter.min, 0),
+                         0, calibration.current_gain);
+    return _Q16mpy(value, vref.scale);
+}
+
+uint16_t buck_get_voltage_reading()
+{
+    return voltage_filter.average;
+}
+
+uint16_t buck_get_current_reading()
+{
+    return current_filter.average;
+}
+
+/* -------------------------------------------------------------------------- */
+static uint16_t square_root(uint32_t value)
+{
+    uint32_t result = 0;
+    uint32_t bit = 1UL << 30;
+
+    while(bit > value)
+        bit >>= 2;
+    for(; bit; bit >>= 2)
+    {
+        if(value >= result + bit)
+        {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        }
+        else
+            result >>= 1;
+    }
+    return (uint16_t)result;
+}
+
+/* -------------------------------------------------------------------------- */
+static void stats_channel_convert(struct buck_channel_stats_t* result,
+                                  const struct stats_channel_t* channel,
+                                  uint16_t count,
+                                  uint16_t offset,
+                                  uint16_t gain)
+{
+    uint16_t mean, rms;
+    int32_t deviation_sum;
+    int64_t squares;
+
+    if(count == 0)
+    {
+        result->mean = result->min = result->max = result->ripple = 0;
+        return;
+    }
+
+    mean = (uint16_t)(((channel->sum << ADC_FRACTIONAL_BITS) + count / 2) /
+                      count);
+
+    /* n * variance = sum(d^2) - sum(d)^2 / n, below 0 only if clipped */
+    deviation_sum = (int32_t)(channel->sum - (uint32_t)channel->first * count);
+    squares = (int64_t)channel->square_sum -
+              (int64_t)deviation_sum * deviation_sum / count;
+    if(squares < 0)
+        squares = 0;
+    /* variance with 2 * FRACTIONAL_BITS, its root is in 12.4 */
+    rms = square_root((uint32_t)((squares << (2 * ADC_FRACTIONAL_BITS)) / count));
+
+    result->mean = _Q16mpy(CONVERT(mean, offset, gain), vref.scale);
+    result->min = _Q16mpy(CONVERT(TO_12_4(channel->min, 0), offset, gain),
+                          vref.scale);
+    result->max = _Q16mpy(CONVERT(TO_12_4(channel->max, 0), offset, gain),
+                          vref.scale);
+    result->ripple = _Q16mpy(CONVERT(rms, 0, gain), vref.scale);
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_get_stats(struct buck_stats_t* result)
+{
+    struct stats_window_t window;
+
+    _ADCAN1IE = 0;
+        window = stats.finished;
+        result->window = stats.sequence;
+    _ADCAN1IE = 1;
+
+    stats_channel_convert(&result->voltage, &window.voltage, window.count,
+                          calibration.voltage_offset, calibration.voltage_gain);
+    stats_channel_convert(&result->current, &window.current, window.count,
+                          calibration.current_offset, calibration.current_gain);
+    result->power = window.count ?
+            (_Q16)(to_watt_samples(window.power_sum) / window.count) : 0;
+
+    energy_fold();
+    result->energy = stats.energy;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_reset_energy()
+{
+    _ADCAN1IE = 0;
+        stats.pending_energy = 0;
+    _ADCAN1IE = 1;
+    stats.watt_samples = 0;
+    stats.energy = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_set_calibration(const struct buck_calibration_t* coefficients)
+{
+    /* the regulator uses them from the ISR */
+    energy_fold();
+    disable_adc_interrupts();
+        calibration = *coefficients;
+        stats_set_zero();
+    enable_adc_interrupts();
+}
+
+/* -------------------------------------------------------------------------- */
+void buck_get_calibration(struct buck_calibration_t* coefficients)
+{
+    *coefficients = calibration;
+}
+
+_Q16 buck_get_reference_scale()
+{
+    return vref.scale;
+}
+
+void buck_set_voltage(_Q16 voltage)
+{
+    CMP1DACbits.CMREF = voltage_to_dac(voltage);
+}
+
+void buck_set_current(_Q16 current)
+{
+    _Q16 max_i = 327680; // 5A
+
+    int16_t value = _Q16div(current, max_i) >> 4;
+
+    if(value < 0){
+        value = 0;
+    }else if(value > 0x0fff){
+        value = 0x0fff;
+    }
+
+    CMP2DACbits.CMREF = value;
 }
 
 
 // ADC AN0 ISR
 void _ISR_NOPSV _ADCAN0Interrupt(void)
 {
-    ADCdata0 = ADCBUF0; // read conversion result
+    filter_sample(&current_filter, ADCBUF0); // read conversion result
     _ADCAN0IF = 0; // clear interrupt flag
 }
 
 // ADC AN1 ISR
 void _ISR_NOPSV _ADCAN1Interrupt(void)
 {
-    ADCdata1 = ADCBUF1; // read conversion result
+    if(transient.state >= BUCK_TRANSIENT_ARMED)
+        transient_sample(ADCBUF0, ADCBUF1);
+
+    if(capture.enabled)
+    {
+        capture_sample();
+        return;
+    }
+
+    filter_sample(&voltage_filter, ADCBUF1); // read conversion result
+    stats_sample(ADCBUF0, ADCBUF1);
+
+    if(--vref.countdown == 0)
+    {
+        vref.countdown = VREF_DECIMATION;
+        request_reference_conversion();
+    }
+
+    if(regulator.setpoint != regulator.target)
+        slew_setpoint(0);
+    if(regulator.enabled)
+        regulator_step();
+
     _ADCAN1IF = 0; // clear interrupt flag
 }
 
+// ADC AN8 ISR
+void _ISR_NOPSV _ADCAN8Interrupt(void)
+{
+    vref_sample(ADCBUF8); // read conversion result
+    _ADCAN8IF = 0; // clear interrupt flag
+}
+
 /* -------------------------------------------------------------------------- */
 /* Called when an UVLO event occurs */
 void _ISR_NOPSV _INT2Interrupt(void)
 {
     buck_disable();
+
+    /* the rail won't last until the event is dispatched */
+    journal_uvlo();
     event_post(EVENT_UVLO, 0);
 
+    /* no more conversions with the timer stopped, keep what led up to it */
+    if(transient.state >= BUCK_TRANSIENT_ARMED)
+        transient_finish();
+
     /* clear interrupt flag */
     IFS1bits.INT2IF = 0;
 }
@@ -272,6 +1361,7 @@ void _ISR_NOPSV _INT2Interrupt(void)
 #ifdef TESTING
 
 #include "gmock/gmock.h"
+#include <math.h>
 
 using namespace ::testing;
 
@@ -281,8 +1371,6 @@ class buck : public Test
     virtual void SetUp()
     {
         buck_init();
-        ADCdata0 = 0;
-        ADCdata1 = 0;
     }
 
     virtual void TearDown()
@@ -297,4 +1385,559 @@ TEST_F(buck, example_test)
     EXPECT_THAT(1, Eq(1));
 }
 
+/* -------------------------------------------------------------------------- */
+static void convert_voltage(uint16_t sample)
+{
+    ADCBUF1 = sample;
+    _ADCAN1Interrupt();
+}
+
+TEST_F(buck, average_is_only_updated_once_per_block)
+{
+    buck_set_averaging(4);
+    for(int i = 0; i != 15; ++i)
+        convert_voltage(1000);
+    EXPECT_THAT(buck_get_voltage(), Eq(0));
+
+    convert_voltage(1000);
+    EXPECT_THAT(buck_get_voltage(), Eq(1000 * 845));
+}
+
+TEST_F(buck, average_gains_resolution_from_noise)
+{
+    /* dithering between two codes resolves to the half code in between */
+    buck_set_averaging(6);
+    for(int i = 0; i != 64; ++i)
+        convert_voltage(1000 + (i & 1));
+
+    EXPECT_THAT(voltage_filter.average, Eq((1000 << ADC_FRACTIONAL_BITS) + 8));
+}
+
+TEST_F(buck, short_blocks_keep_format)
+{
+    buck_set_averaging(1);
+    convert_voltage(1000);
+    convert_voltage(1002);
+
+    EXPECT_THAT(buck_get_voltage(), Eq(1001 * 845));
+}
+
+TEST_F(buck, fast_value_follows_steps_within_a_few_samples)
+{
+    for(int i = 0; i != 30; ++i)
+        convert_voltage(2000);
+    EXPECT_THAT(buck_get_voltage_fast(), Eq(2000 * 845));
+
+    for(int i = 0; i != 4; ++i)
+        convert_voltage(1000);
+    EXPECT_THAT(buck_get_voltage_fast(), Gt(1000 * 845));
+    EXPECT_THAT(buck_get_voltage_fast(), Lt(1400 * 845));
+}
+
+TEST_F(buck, reference_is_converted_every_64_voltage_conversions)
+{
+    ADCON3Lbits.CNVRTCH = 0;
+    for(int i = 0; i != VREF_DECIMATION - 1; ++i)
+        convert_voltage(1000);
+    EXPECT_THAT((unsigned)ADCON3Lbits.CNVRTCH, Eq(0u));
+
+    convert_voltage(1000);
+    EXPECT_THAT((unsigned)ADCON3Lbits.CNVRTCH, Eq(1u));
+    EXPECT_THAT((unsigned)ADCON3Lbits.CNVCHSEL, Eq(8u));
+}
+
+static void convert_reference(uint16_t sample)
+{
+    ADCBUF8 = sample;
+    _ADCAN8Interrupt();
+}
+
+TEST_F(buck, nominal_reference_does_not_change_readings)
+{
+    buck_set_averaging(0);
+    convert_voltage(1000);
+    convert_reference(VREF_NOMINAL);
+
+    EXPECT_THAT(buck_get_reference_scale(), Eq(VREF_SCALE_ONE));
+    EXPECT_THAT(buck_get_voltage(), Eq(1000 * 845));
+}
+
+TEST_F(buck, low_supply_scales_readings_down)
+{
+    /* AVdd at 3.0V makes the 1.5V reference read as half scale */
+    buck_set_averaging(0);
+    convert_voltage(1000);
+    convert_reference(2048);
+
+    EXPECT_THAT(buck_get_voltage(), Eq(_Q16mpy(1000 * 845, 0x10000 * 1862 / 2048)));
+    EXPECT_THAT(buck_get_voltage_fast(), Lt(1000 * 845));
+}
+
+TEST_F(buck, implausible_reference_is_ignored)
+{
+    convert_reference(0);
+    convert_reference(4095);
+
+    EXPECT_THAT(buck_get_reference_scale(), Eq(VREF_SCALE_ONE));
+}
+
+TEST_F(buck, reference_is_filtered)
+{
+    convert_reference(VREF_NOMINAL);
+    convert_reference(2048);
+
+    EXPECT_THAT(buck_get_reference_scale(), Lt(VREF_SCALE_ONE));
+    EXPECT_THAT(buck_get_reference_scale(), Gt(0x10000 * 1862 / 2048));
+}
+
+TEST_F(buck, set_voltage_maps_to_inverted_dac_reference)
+{
+    buck_set_voltage(DAC_MAX_VOLTAGE);
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(0u));
+
+    buck_set_voltage(12 * 65536);
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(1668u)); /* 11V / 27V * 4096 */
+
+    buck_set_voltage(-10 * 65536);
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(0x0fffu));
+}
+
+TEST_F(buck, disabled_regulator_drives_dac_directly)
+{
+    buck_regulator_set_target(12 * 65536);
+    convert_voltage(0);
+
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(1668u));
+}
+
+/* ADC code that reads as the given voltage through the fast filter */
+static uint16_t voltage_code(double volts)
+{
+    return (uint16_t)(volts * 65536 / 845 + 0.5);
+}
+
+TEST_F(buck, regulator_raises_output_while_voltage_is_low)
+{
+    buck_regulator_set_target(12 * 65536);
+    buck_regulator_enable(1);
+
+    for(int i = 0; i != 30; ++i)
+        convert_voltage(voltage_code(11));
+    unsigned first = CMP1DACbits.CMREF;
+    for(int i = 0; i != 30; ++i)
+        convert_voltage(voltage_code(11));
+
+    /* a lower reference code means a higher voltage */
+    EXPECT_THAT(first, Lt(1668u));
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Lt(first));
+}
+
+TEST_F(buck, regulator_output_equals_target_without_error)
+{
+    /* pick a target the ADC can represent exactly */
+    buck_set_voltage(930 * 845);
+    unsigned expected = CMP1DACbits.CMREF;
+    buck_regulator_set_target(930 * 845);
+    for(int i = 0; i != 30; ++i)
+        convert_voltage(930);
+    buck_regulator_enable(1);
+
+    for(int i = 0; i != 100; ++i)
+        convert_voltage(930);
+
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(expected));
+}
+
+TEST_F(buck, regulator_integral_does_not_wind_up)
+{
+    /* output can't get there, the integral must stop at its limit */
+    buck_regulator_set_gains(0, 65536);
+    buck_regulator_set_target(22 * 65536);
+    buck_regulator_enable(1);
+    for(int i = 0; i != 1000; ++i)
+        convert_voltage(0);
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(0u));
+
+    /* once the voltage is there the output must come back right away */
+    buck_regulator_set_target(12 * 65536);
+    convert_voltage(voltage_code(12));
+    EXPECT_THAT(regulator.integral, Le(REGULATOR_INTEGRAL_LIMIT));
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Gt(1668u - 2 * 152u));
+}
+
+TEST_F(buck, disabling_regulator_restores_open_loop_reference)
+{
+    buck_regulator_set_target(12 * 65536);
+    buck_regulator_enable(1);
+    for(int i = 0; i != 10; ++i)
+        convert_voltage(0);
+    buck_regulator_enable(0);
+
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(1668u));
+}
+
+TEST_F(buck, sample_rate_sets_timer1_period)
+{
+    buck_set_sample_rate(4000);
+    EXPECT_THAT(PR1, Eq(233u));
+
+    buck_set_sample_rate(20000);
+    EXPECT_THAT(PR1, Eq(46u));
+}
+
+static void convert_both(uint16_t current, uint16_t voltage)
+{
+    ADCBUF0 = current;
+    ADCBUF1 = voltage;
+    _ADCAN1Interrupt();
+}
+
+TEST_F(buck, block_capture_only_processes_full_blocks)
+{
+    buck_set_block_capture(1);
+    buck_set_averaging(0);
+    for(int i = 0; i != ADC_BLOCK_SIZE - 1; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+    EXPECT_THAT(buck_get_voltage(), Eq(0));
+
+    convert_both(CURRENT_OFFSET, 1000);
+    EXPECT_THAT(buck_get_voltage(), Eq(1000 * 845));
+    EXPECT_THAT(buck_get_current(), Eq(0));
+    EXPECT_THAT((unsigned)_ADCAN0IE, Eq(0u));
+}
+
+TEST_F(buck, block_capture_averages_like_per_sample_mode)
+{
+    buck_set_block_capture(1);
+    buck_set_averaging(6);
+    for(int i = 0; i != 64; ++i)
+        convert_both(CURRENT_OFFSET, 1000 + (i & 1));
+
+    EXPECT_THAT(voltage_filter.average, Eq((1000 << ADC_FRACTIONAL_BITS) + 8));
+}
+
+TEST_F(buck, block_capture_reports_ripple)
+{
+    buck_set_block_capture(1);
+    for(int i = 0; i != ADC_BLOCK_SIZE; ++i)
+        convert_both(CURRENT_OFFSET + (i & 3), 1000 + (i & 1) * 10);
+
+    EXPECT_THAT(buck_get_voltage_ripple(), Eq(10 * 845));
+    EXPECT_THAT(buck_get_current_ripple(), Eq(3 * 330));
+}
+
+TEST_F(buck, block_capture_alternates_buffers)
+{
+    buck_set_block_capture(1);
+    for(int i = 0; i != ADC_BLOCK_SIZE; ++i)
+        convert_both(0, 1);
+    for(int i = 0; i != ADC_BLOCK_SIZE; ++i)
+        convert_both(0, 2);
+
+    EXPECT_THAT(adc_blocks[0].voltage[0], Eq(1u));
+    EXPECT_THAT(adc_blocks[1].voltage[0], Eq(2u));
+}
+
+TEST_F(buck, block_is_dropped_while_previous_is_processed)
+{
+    buck_set_block_capture(1);
+    capture.processing = 1;
+    for(int i = 0; i != ADC_BLOCK_SIZE; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+    capture.processing = 0;
+
+    EXPECT_THAT(buck_get_block_overruns(), Eq(1u));
+    EXPECT_THAT(capture.fill, Eq(0u));
+}
+
+TEST_F(buck, calibration_coefficients_are_used)
+{
+    struct buck_calibration_t coefficients = {
+        10 << ADC_FRACTIONAL_BITS, 2 * BUCK_DEFAULT_VOLTAGE_GAIN,
+        BUCK_DEFAULT_CURRENT_OFFSET, BUCK_DEFAULT_CURRENT_GAIN
+    };
+    buck_set_calibration(&coefficients);
+    buck_set_averaging(0);
+    for(int i = 0; i != 30; ++i)
+        convert_voltage(1010);
+
+    EXPECT_THAT(buck_get_voltage(), Eq(2 * 1000 * 845));
+    EXPECT_THAT(buck_get_voltage_fast(), Eq(2 * 1000 * 845));
+    EXPECT_THAT(buck_get_voltage_reading(), Eq(1010u << ADC_FRACTIONAL_BITS));
+}
+
+TEST_F(buck, current_is_zero_at_offset)
+{
+    buck_set_averaging(2);
+    for(int i = 0; i != 4; ++i)
+    {
+        ADCBUF0 = CURRENT_OFFSET;
+        _ADCAN0Interrupt();
+    }
+
+    EXPECT_THAT(buck_get_current(), Eq(0));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(buck, stats_are_zero_until_the_first_window_is_complete)
+{
+    struct buck_stats_t stats;
+    buck_set_averaging(4);
+    for(int i = 0; i != 15; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+    buck_get_stats(&stats);
+    EXPECT_THAT(stats.window, Eq(0u));
+    EXPECT_THAT(stats.voltage.mean, Eq(0));
+
+    convert_both(CURRENT_OFFSET, 1000);
+    buck_get_stats(&stats);
+    EXPECT_THAT(stats.window, Eq(1u));
+    EXPECT_THAT(stats.voltage.mean, Eq(1000 * 845));
+    EXPECT_THAT(stats.current.mean, Eq(0));
+}
+
+TEST_F(buck, stats_report_range_and_rms_ripple)
+{
+    struct buck_stats_t stats;
+    buck_set_averaging(4);
+    for(int i = 0; i != 16; ++i)
+        convert_both(CURRENT_OFFSET + 100 + (i & 1 ? 10 : -10),
+                     1000 + (i & 1 ? 20 : -20));
+    buck_get_stats(&stats);
+
+    EXPECT_THAT(stats.voltage.mean, Eq(1000 * 845));
+    EXPECT_THAT(stats.voltage.min, Eq(980 * 845));
+    EXPECT_THAT(stats.voltage.max, Eq(1020 * 845));
+    EXPECT_THAT(stats.voltage.ripple, Eq(20 * 845));
+    EXPECT_THAT(stats.current.mean, Eq(100 * 330));
+    EXPECT_THAT(stats.current.ripple, Eq(10 * 330));
+}
+
+TEST_F(buck, stats_ripple_is_independent_of_the_first_sample)
+{
+    struct buck_stats_t stats;
+    buck_set_averaging(4);
+    for(int i = 0; i != 16; ++i)
+        convert_both(CURRENT_OFFSET, i == 0 ? 1000 : 1032);
+    buck_get_stats(&stats);
+
+    /* sqrt(1/16 * 15/16) * 32 LSBs */
+    EXPECT_THAT(stats.voltage.ripple / 65536.0,
+                DoubleNear(sqrt(15.0) / 16 * 32 * 845 / 65536.0, 0.001));
+}
+
+TEST_F(buck, stats_power_is_the_mean_of_the_products)
+{
+    struct buck_stats_t stats;
+    double volts = 3000 * 845 / 65536.0, amps = 200 * 330 / 65536.0;
+    buck_set_averaging(4);
+
+    /* in phase, full power half of the time and none otherwise */
+    for(int i = 0; i != 16; ++i)
+        convert_both(CURRENT_OFFSET + (i & 1) * 200, 1000 + (i & 1) * 2000);
+    buck_get_stats(&stats);
+
+    EXPECT_THAT(stats.power / 65536.0, DoubleNear(volts * amps / 2, 0.001));
+    EXPECT_THAT(_Q16mpy(stats.voltage.mean, stats.current.mean),
+                Ne(stats.power));
+}
+
+TEST_F(buck, stats_power_of_the_longest_window_fits)
+{
+    struct buck_stats_t stats;
+    double volts = 4095 * 845 / 65536.0, amps = (4095 - CURRENT_OFFSET) * 330 / 65536.0;
+    buck_set_averaging(ADC_MAX_LOG2_SAMPLES);
+
+    for(int i = 0; i != 1 << ADC_MAX_LOG2_SAMPLES; ++i)
+        convert_both(4095, 4095);
+    buck_get_stats(&stats);
+
+    EXPECT_THAT(stats.window, Eq(1u));
+    EXPECT_THAT(stats.power / 65536.0, DoubleNear(volts * amps, 0.01));
+}
+
+TEST_F(buck, stats_accumulate_energy)
+{
+    struct buck_stats_t stats;
+    double watts = 1000 * 845 / 65536.0 * 200 * 330 / 65536.0;
+    buck_set_averaging(4);
+
+    /* one second at 4 kHz */
+    for(int i = 0; i != 4000; ++i)
+    {
+        convert_both(CURRENT_OFFSET + 200, 1000);
+        if(i % 40 == 0)
+            on_update(0);
+    }
+    buck_get_stats(&stats);
+    EXPECT_THAT(stats.energy / 65536.0, DoubleNear(watts / 3600, 2 / 65536.0));
+
+    buck_reset_energy();
+    buck_get_stats(&stats);
+    EXPECT_THAT(stats.energy, Eq(0));
+}
+
+TEST_F(buck, block_capture_accumulates_stats)
+{
+    struct buck_stats_t stats;
+    buck_set_block_capture(1);
+    buck_set_averaging(5);
+    for(int i = 0; i != 1 << 5; ++i)
+        convert_both(CURRENT_OFFSET, 1000 + (i & 1) * 10);
+    buck_get_stats(&stats);
+    buck_set_block_capture(0);
+
+    EXPECT_THAT(stats.window, Eq(1u));
+    EXPECT_THAT(stats.voltage.min, Eq(1000 * 845));
+    EXPECT_THAT(stats.voltage.max, Eq(1010 * 845));
+    EXPECT_THAT(stats.voltage.ripple, Eq(5 * 845));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(buck, disarmed_transient_capture_records_nothing)
+{
+    for(int i = 0; i != 4; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_IDLE));
+    EXPECT_THAT(buck_transient_get_length(), Eq(0));
+}
+
+TEST_F(buck, current_step_triggers_transient_capture)
+{
+    _Q16 voltage, current;
+    buck_transient_arm(8, 65536); /* 1A, about 198 LSBs */
+    for(int i = 0; i != 20; ++i)
+        convert_both(CURRENT_OFFSET + 100, 1000);
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_ARMED));
+
+    convert_both(CURRENT_OFFSET + 400, 1000);
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_TRIGGERED));
+    for(int i = 0; i != BUCK_TRANSIENT_DEPTH - 8 - 2; ++i)
+        convert_both(CURRENT_OFFSET + 400, 1000);
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_TRIGGERED));
+    convert_both(CURRENT_OFFSET + 400, 1000);
+
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_DONE));
+    EXPECT_THAT(buck_transient_get_length(), Eq(BUCK_TRANSIENT_DEPTH));
+    EXPECT_THAT(buck_transient_get_trigger(), Eq(8));
+    buck_transient_get_sample(7, &voltage, &current);
+    EXPECT_THAT(current, Eq(100 * 330));
+    EXPECT_THAT(voltage, Eq(1000 * 845));
+    buck_transient_get_sample(8, &voltage, &current);
+    EXPECT_THAT(current, Eq(400 * 330));
+}
+
+TEST_F(buck, small_current_steps_dont_trigger)
+{
+    buck_transient_arm(8, 65536);
+    for(int i = 0; i != 100; ++i)
+        convert_both(CURRENT_OFFSET + (i & 1) * 150, 1000);
+
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_ARMED));
+}
+
+TEST_F(buck, early_manual_trigger_shortens_history)
+{
+    buck_transient_arm(10, 0);
+    for(int i = 0; i != 3; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+    buck_transient_trigger();
+    for(int i = 0; i != BUCK_TRANSIENT_DEPTH - 10; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_DONE));
+    EXPECT_THAT(buck_transient_get_length(), Eq(BUCK_TRANSIENT_DEPTH - 10 + 3));
+    EXPECT_THAT(buck_transient_get_trigger(), Eq(3));
+}
+
+TEST_F(buck, uvlo_ends_transient_capture)
+{
+    buck_transient_arm(32, 0);
+    for(int i = 0; i != 5; ++i)
+        convert_both(CURRENT_OFFSET, 1000 - i * 100);
+    _INT2Interrupt();
+
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_DONE));
+    EXPECT_THAT(buck_transient_get_length(), Eq(5));
+    EXPECT_THAT(buck_transient_get_trigger(), Eq(5));
+}
+
+TEST_F(buck, finished_transient_capture_is_held_until_released)
+{
+    _Q16 voltage, current;
+    buck_transient_arm(0, 0);
+    buck_transient_trigger();
+    for(int i = 0; i != BUCK_TRANSIENT_DEPTH; ++i)
+        convert_both(CURRENT_OFFSET, 1000);
+    convert_both(CURRENT_OFFSET, 2000);
+
+    buck_transient_get_sample(BUCK_TRANSIENT_DEPTH - 1, &voltage, &current);
+    EXPECT_THAT(voltage, Eq(1000 * 845));
+
+    buck_transient_release();
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_IDLE));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(buck, slew_rate_limits_setpoint_changes)
+{
+    buck_set_slew_rate(65536); /* 1V/ms, 0.25V per conversion at 4 kHz */
+    buck_regulator_set_target(12 * 65536);
+    convert_voltage(0);
+    EXPECT_THAT(regulator.setpoint, Eq(65536 / 4));
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF,
+                Eq((unsigned)voltage_to_dac(65536 / 4)));
+
+    for(int i = 0; i != 47; ++i)
+        convert_voltage(0);
+    EXPECT_THAT(regulator.setpoint, Eq(12 * 65536));
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(1668u));
+    EXPECT_THAT(buck_regulator_get_target(), Eq(12 * 65536));
+}
+
+TEST_F(buck, slew_step_follows_sample_rate)
+{
+    buck_set_slew_rate(65536);
+    buck_set_sample_rate(20000);
+
+    EXPECT_THAT(regulator.slew_step, Eq(3277));
+    buck_set_sample_rate(4000);
+}
+
+TEST_F(buck, regulator_follows_slewed_setpoint)
+{
+    buck_set_slew_rate(65536);
+    buck_regulator_enable(1);
+    buck_regulator_set_target(12 * 65536);
+    convert_voltage(0);
+
+    /* 0.25V plus some error, nowhere near 12V (lower codes are higher) */
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Gt(3000u));
+    buck_regulator_enable(0);
+}
+
+TEST_F(buck, block_capture_slews_once_per_block)
+{
+    buck_set_slew_rate(65536);
+    buck_set_block_capture(1);
+    buck_regulator_set_target(12 * 65536);
+    for(int i = 0; i != ADC_BLOCK_SIZE; ++i)
+        convert_both(CURRENT_OFFSET, 0);
+
+    /* 0.25V per conversion at 4 kHz */
+    EXPECT_THAT(regulator.setpoint, Eq(ADC_BLOCK_SIZE * 65536 / 4));
+    buck_set_block_capture(0);
+}
+
+TEST_F(buck, removing_slew_limit_jumps_to_target)
+{
+    buck_set_slew_rate(65536);
+    buck_regulator_set_target(12 * 65536);
+    buck_set_slew_rate(0);
+
+    EXPECT_THAT(regulator.setpoint, Eq(12 * 65536));
+    EXPECT_THAT((unsigned)CMP1DACbits.CMREF, Eq(1668u));
+}
+
 #endif /* TESTING */
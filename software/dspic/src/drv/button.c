@@ -16,6 +16,11 @@
     TIME_THRESHOLD_IN_MILLISECONDS / 10
 
 volatile static unsigned char button_timer = 0;
+static unsigned char button_down = 0;
+
+/* 10ms updates since the last twist, and between the last two twists */
+volatile static unsigned char twist_timer = 0xFF;
+volatile static unsigned char twist_interval = 0xFF;
 
 static void on_update(unsigned int arg);
 
@@ -29,6 +34,10 @@ void button_init(void)
      */
     ANSELC &= ~0x0070;
 
+    button_down = 0;
+    twist_timer = 0xFF;
+    twist_interval = 0xFF;
+
     /* twist/push button has three wires that need pull-ups */
     CNPUC |= 0x0070;     /* bit 4, 5, 6 */
 
@@ -38,7 +47,7 @@ void button_init(void)
     IEC1bits.CNIE = 1;   /* enable change notification interrupts */
 
     /* listen to 10ms update events, required for "long press" timings of
-     * the button */
+     * the button and for timing twists */
     event_register_listener(EVENT_UPDATE, on_update);
 }
 
@@ -49,6 +58,8 @@ static void on_update(unsigned int arg)
      * increment it */
     if(button_timer)
         ++button_timer;
+    if(twist_timer != 0xFF)
+        ++twist_timer;
     if(button_timer > TIME_THRESHOLD)
     {
         event_post(EVENT_BUTTON, BUTTON_PRESSED_LONGER);
@@ -59,8 +70,14 @@ static void on_update(unsigned int arg)
 /* -------------------------------------------------------------------------- */
 static void process_press_event(void)
 {
+    /* twisting changes other pins of the same port, ignore those */
+    unsigned char down = !KNOB_BUTTON;
+    if(down == button_down)
+        return;
+    button_down = down;
+
     /* Was the button pressed? (falling edge) */
-    if(!KNOB_BUTTON)
+    if(button_down)
     {
         event_post(EVENT_BUTTON, BUTTON_PRESSED);
         button_timer = 1; /* start timer - gets incremented on EVENT_UPDATE */
@@ -71,6 +88,27 @@ static void process_press_event(void)
     }
 }
 
+/* -------------------------------------------------------------------------- */
+static void post_twist_event(unsigned int button)
+{
+    static unsigned int last_button = 0;
+
+    twist_interval = button == last_button ? twist_timer : 0xFF;
+    twist_timer = 0;
+    last_button = button;
+
+    /*
+     * Twisting while the button is held down is a gesture of its own. The
+     * press is cancelled, so neither a release nor a longer press follows.
+     */
+    if(button_down)
+    {
+        button_timer = 0;
+        button += BUTTON_PRESSED_TWISTED_LEFT - BUTTON_TWISTED_LEFT;
+    }
+    event_post(EVENT_BUTTON, button);
+}
+
 /* -------------------------------------------------------------------------- */
 static void process_twist_event(void)
 {
@@ -103,17 +141,23 @@ static void process_twist_event(void)
     {
         ticks = (ticks + 1) & 0x3;
         if(ticks == 0)
-            event_post(EVENT_BUTTON, BUTTON_TWISTED_LEFT);
+            post_twist_event(BUTTON_TWISTED_LEFT);
     } else {
         ticks = (ticks - 1) & 0x3;
         if(ticks == 2)
-            event_post(EVENT_BUTTON, BUTTON_TWISTED_RIGHT);
+            post_twist_event(BUTTON_TWISTED_RIGHT);
     }
 
     /* update current AB */
     current_AB = AB;
 }
 
+/* -------------------------------------------------------------------------- */
+unsigned char button_get_twist_interval(void)
+{
+    return twist_interval;
+}
+
 /* -------------------------------------------------------------------------- */
 /* called when the button is twisted (A or B changed) */
 void _ISR_NOPSV _CNInterrupt(void)
@@ -201,10 +245,8 @@ static void release_button()
     event_dispatch_all();
 }
 
-static void press_button_for(int time_to_pass_in_milliseconds)
+static void let_time_pass(int time_to_pass_in_milliseconds)
 {
-    press_button();
-
     /* button uses EVENT_UPDATE to measure time. One EVENT_UPDATE = 10ms */
     int number_of_updates = time_to_pass_in_milliseconds / 10;
     for(int i = 0; i != number_of_updates; ++i)
@@ -214,6 +256,25 @@ static void press_button_for(int time_to_pass_in_milliseconds)
     }
 }
 
+static void press_button_for(int time_to_pass_in_milliseconds)
+{
+    press_button();
+    let_time_pass(time_to_pass_in_milliseconds);
+}
+
+/* one detent is four steps of the encoder */
+static void twist_button_left_once()
+{
+    for(int i = 0; i != 4; ++i)
+        twist_button_left();
+}
+
+static void twist_button_right_once()
+{
+    for(int i = 0; i != 4; ++i)
+        twist_button_right();
+}
+
 /* -------------------------------------------------------------------------- */
 TEST_F(button, twist_left_posts_correct_event)
 {
@@ -298,4 +359,56 @@ TEST_F(button, pressing_for_100_milliseconds_doesnt_post_event)
     EXPECT_THAT(button_action, Eq(BUTTON_RELEASED));
 }
 
+TEST_F(button, twists_are_timed)
+{
+    twist_button_right_once();
+    let_time_pass(5000);
+    twist_button_right_once();
+    EXPECT_THAT(button_get_twist_interval(), Eq(255));
+
+    let_time_pass(50);
+    twist_button_right_once();
+    EXPECT_THAT(button_get_twist_interval(), Eq(5));
+
+    let_time_pass(20);
+    twist_button_right_once();
+    EXPECT_THAT(button_get_twist_interval(), Eq(2));
+
+    let_time_pass(5000);
+    twist_button_right_once();
+    EXPECT_THAT(button_get_twist_interval(), Eq(255));
+}
+
+TEST_F(button, changing_direction_counts_as_a_slow_twist)
+{
+    twist_button_right_once();
+    twist_button_right_once();
+    twist_button_right_once();
+    EXPECT_THAT(button_get_twist_interval(), Eq(0));
+
+    twist_button_left_once();
+    EXPECT_THAT(button_get_twist_interval(), Eq(255));
+}
+
+TEST_F(button, twisting_while_pressed_replaces_the_press)
+{
+    twist_button_right_once();
+    event_register_listener(EVENT_BUTTON, test_callback);
+
+    press_button();
+    twist_button_right_once();
+    EXPECT_THAT(button_action, Eq(BUTTON_PRESSED_TWISTED_RIGHT));
+    twist_button_left_once();
+    EXPECT_THAT(button_action, Eq(BUTTON_PRESSED_TWISTED_LEFT));
+
+    /* neither a longer press nor a release follows */
+    button_action = 0;
+    let_time_pass(1000);
+    release_button();
+    EXPECT_THAT(button_action, Eq(0));
+
+    twist_button_right_once();
+    EXPECT_THAT(button_action, Eq(BUTTON_TWISTED_RIGHT));
+}
+
 #endif /* TESTING */
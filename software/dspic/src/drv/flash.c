@@ -0,0 +1,180 @@
+/*!
+ * @file flash.c
+ *
+ * See section 4 "Flash Programming" of the family reference manual. Erasing
+ * and programming stall the CPU for up to a few ms, so this is best done
+ * while nothing time critical is happening.
+ *
+ * The UVLO interrupt programs flash as well, see journal_uvlo(). It is held
+ * off while an operation is being set up, otherwise it would replace the
+ * latches and address registers halfway through, and flash_write() restores
+ * TBLPAG for a flash_read_word() it may have interrupted.
+ */
+
+#include "drv/flash.h"
+#include "drv/hw.h"
+
+#define NVMOP_DOUBLE_WORD   0x1
+#define NVMOP_PAGE_ERASE    0x3
+#define WRITE_LATCH_PAGE    0xFA
+
+/*
+ * Keep the linker from placing code or constants in the data pages. Each
+ * element takes up one instruction word.
+ */
+#if !defined(TESTING) && !defined(BENCHMARK)
+const uint16_t __attribute__((space(prog), address(FLASH_JOURNAL_PAGE_A),
+                              noload, keep))
+    flash_journal_pages[2 * FLASH_WORDS_PER_PAGE];
+#endif
+
+#define hold_uvlo_interrupt(enabled) do { \
+        enabled = IEC1bits.INT2IE;         \
+        IEC1bits.INT2IE = 0; } while(0)
+#define release_uvlo_interrupt(enabled) \
+        (IEC1bits.INT2IE = enabled)
+
+/* -------------------------------------------------------------------------- */
+static unsigned char execute(flash_address_t address, unsigned char operation)
+{
+    NVMADRU = (uint16_t)(address >> 16);
+    NVMADR = (uint16_t)address;
+    NVMCONbits.NVMOP = operation;
+    NVMCONbits.WREN = 1;
+
+    /* writes the unlock sequence and sets WR with interrupts disabled */
+    __builtin_write_NVM();
+    while(NVMCONbits.WR) {}
+
+    NVMCONbits.WREN = 0;
+    return !NVMCONbits.WRERR;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char flash_erase_page(flash_address_t address)
+{
+    unsigned char uvlo, result;
+
+    hold_uvlo_interrupt(uvlo);
+        result = execute(address & ~(flash_address_t)(FLASH_PAGE_SIZE - 1),
+                         NVMOP_PAGE_ERASE);
+    release_uvlo_interrupt(uvlo);
+    return result;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char flash_write(flash_address_t address,
+                          const uint16_t* data,
+                          uint16_t count)
+{
+    uint16_t page = TBLPAG;
+    unsigned char uvlo, result;
+
+    while(count)
+    {
+        hold_uvlo_interrupt(uvlo);
+            TBLPAG = WRITE_LATCH_PAGE;
+            __builtin_tblwtl(0, *data++);
+            __builtin_tblwth(0, 0xFF);
+            __builtin_tblwtl(2, count > 1 ? *data++ : 0xFFFF);
+            __builtin_tblwth(2, 0xFF);
+            result = execute(address, NVMOP_DOUBLE_WORD);
+            TBLPAG = page;
+        release_uvlo_interrupt(uvlo);
+        if(!result)
+            return 0;
+
+        address += 4;
+        count = (count > 1 ? count - 2 : 0);
+    }
+
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+uint16_t flash_read_word(flash_address_t address)
+{
+    TBLPAG = (uint16_t)(address >> 16);
+    return __builtin_tblrdl((uint16_t)address);
+}
+
+/* -------------------------------------------------------------------------- */
+void flash_read(flash_address_t address, uint16_t* data, uint16_t count)
+{
+    while(count--)
+    {
+        *data++ = flash_read_word(address);
+        address += 2;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+
+using namespace ::testing;
+
+#define TEST_PAGE FLASH_JOURNAL_PAGE_B
+
+class flash : public Test
+{
+    virtual void SetUp()
+    {
+        flash_erase_page(TEST_PAGE);
+    }
+
+    virtual void TearDown()
+    {
+        flash_erase_page(TEST_PAGE);
+    }
+};
+
+/* -------------------------------------------------------------------------- */
+TEST_F(flash, erased_page_reads_all_ones)
+{
+    uint16_t words[4];
+    flash_read(TEST_PAGE + FLASH_PAGE_SIZE - 8, words, 4);
+
+    EXPECT_THAT(words, Each(Eq(0xFFFFu)));
+}
+
+TEST_F(flash, written_words_read_back)
+{
+    const uint16_t data[] = {0x1234, 0x5678, 0x9abc};
+    uint16_t words[4];
+
+    EXPECT_THAT(flash_write(TEST_PAGE + 8, data, 3), Eq(1));
+    flash_read(TEST_PAGE + 8, words, 4);
+
+    EXPECT_THAT(words, ElementsAre(0x1234, 0x5678, 0x9abc, 0xFFFF));
+}
+
+TEST_F(flash, programming_only_clears_bits)
+{
+    const uint16_t first[] = {0x00FF, 0xFFFF};
+    const uint16_t second[] = {0x0FF0, 0xFFFF};
+
+    flash_write(TEST_PAGE, first, 2);
+    flash_write(TEST_PAGE, second, 2);
+
+    EXPECT_THAT(flash_read_word(TEST_PAGE), Eq(0x00F0u));
+}
+
+TEST_F(flash, erase_affects_whole_page_only)
+{
+    const uint16_t data[] = {0, 0};
+    flash_write(TEST_PAGE + FLASH_PAGE_SIZE - 4, data, 2);
+    flash_write(TEST_PAGE - 4, data, 2);
+
+    flash_erase_page(TEST_PAGE + 0x10);
+
+    EXPECT_THAT(flash_read_word(TEST_PAGE + FLASH_PAGE_SIZE - 4), Eq(0xFFFFu));
+    EXPECT_THAT(flash_read_word(TEST_PAGE - 4), Eq(0u));
+    flash_erase_page(TEST_PAGE - 4);
+}
+
+#endif /* TESTING */
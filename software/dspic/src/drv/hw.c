@@ -7,6 +7,7 @@
 
 #include "drv/hw.h"
 #include "core/event.h"
+#include "drv/boot.h"
 #include "drv/buck.h"
 #include "drv/button.h"
 #include "drv/lcd.h"
@@ -33,6 +34,26 @@ _FOSC(
     IOL1WAY_ON &    /* allow only one reconfiguration of clock */
     POSCMD_NONE)    /* primary oscillator is disabled (we're using internal) */
 
+void init_ports(void)
+{
+    /*
+     * Set unused pins as output and drive low.
+     * For TRISx: "1" means input, "0" means output. Default is input.
+     */
+
+    /* drive low */
+    PORTA = 0x00;
+    PORTB = 0x0000;
+    PORTC = 0x0000;
+    PORTD = 0x0000;
+    /*        FEDCBA9876543210 */
+    TRISA =            0b00111;
+    TRISB = 0b1000100100001100;
+    TRISC = 0b0001101001111110;
+    TRISD = 0b0010000001001010;
+}
+
+/* -------------------------------------------------------------------------- */
 static void init_sysclk60mips(void)
 {
     /*
@@ -51,6 +72,10 @@ static void init_sysclk60mips(void)
     __builtin_write_OSCCONL(OSCCON | 0x01); /* requests oscillator switch to
                                              * the selection specified above */
 
+    /* the ports don't depend on the clock, configure them while the PLL
+     * locks */
+    init_ports();
+
     /* wait for clock switch to occur */
     while(OSCCONbits.COSC != 0x01);
 
@@ -58,26 +83,6 @@ static void init_sysclk60mips(void)
     while(OSCCONbits.LOCK != 1);
 }
 
-/* -------------------------------------------------------------------------- */
-void init_ports(void)
-{
-    /*
-     * Set unused pins as output and drive low.
-     * For TRISx: "1" means input, "0" means output. Default is input.
-     */
-
-    /* drive low */
-    PORTA = 0x00;
-    PORTB = 0x0000;
-    PORTC = 0x0000;
-    PORTD = 0x0000;
-    /*        FEDCBA9876543210 */
-    TRISA =            0b00111;
-    TRISB = 0b1000100100001100;
-    TRISC = 0b0001101001111110;
-    TRISD = 0b0010000001001010;
-}
-
 static void init_auxiliary_clock(void)
 {
     /*
@@ -91,13 +96,14 @@ static void init_auxiliary_clock(void)
 /* -------------------------------------------------------------------------- */
 void hw_init(void)
 {
+    boot_timer_start();
     unlock_registers();
     disable_interrupts();
 
     /* system clock and initial port config */
     init_sysclk60mips();
+    boot_mark(BOOT_CLOCK_LOCKED);
     init_auxiliary_clock();
-    init_ports();
 
     enable_interrupts();
 }
@@ -107,16 +113,24 @@ void drivers_init(void)
 {
     disable_interrupts();
 
-    /* initialise all drivers here */
-    buck_init();
+    /*
+     * Initialise all drivers here. The ADC cores take a few milliseconds to
+     * warm up, the other drivers are initialised in the meantime. The LCD is
+     * held in reset over the same time, so menu_init() can start sending to
+     * it right away.
+     */
+    buck_init_begin();
+    lcd_init();
     button_init();
     leds_init();
     timer_init();
     uart_init();
-    lcd_init();
+    buck_init_end();
+    boot_mark(BOOT_ADC_READY);
 
     enable_interrupts();
     lock_registers();
+    boot_mark(BOOT_DRIVERS_READY);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -9,23 +9,55 @@
 #include <string.h>
 #include "drv/lcd.h"
 #include "drv/hw.h"
+#include "drv/boot.h"
 #include "core/event.h"
+#include "core/ram_budget.h"
 
+/*
+ * Every transaction starts with the address, followed by control bytes. A
+ * control byte with Co set is followed by a single byte, so a cursor command
+ * and the characters behind it go out as
+ *
+ *   START 0x78 0x80 <command> 0x40 <data> <data> ... STOP
+ *
+ * A control byte without Co opens a stream that lasts until the stop
+ * condition, 0x40 for data and 0x00 for commands. A command is only sent on
+ * its own if data follows it, runs of commands are streamed.
+ */
 enum lcd_states{
     lcd_idle = 0,
-    lcd_starting,
-    lcd_configuring,
-    lcd_sending,
+    lcd_starting,       /* start condition sent, address next */
+    lcd_addressed,      /* ready for a control byte */
+    lcd_pairing,        /* Co control byte sent, its command next */
+    lcd_streaming,      /* stream control byte sent */
     lcd_stopping
 };
 static enum lcd_states lcd_state = lcd_idle;
 
+/* FIFO entries are the byte to send, data bytes have LCD_DATA set */
+#define LCD_DATA 0x0100
 #define LCD_FIFO_SIZE 128
 #define LCD_FIFO_TYPE short
 static LCD_FIFO_TYPE lcd_fifo[LCD_FIFO_SIZE] = {};
 static unsigned short lcd_fifo_start = 0;
 static volatile unsigned short lcd_fifo_end = 0;
 
+/*
+ * What the display should show. Writes only go to the shadow and mark the
+ * characters that changed, lcd_flush() then sends the changed spans. Clean
+ * characters between two changed ones are sent along if that's cheaper than
+ * a new transaction to move the cursor, which costs about LCD_SPAN_GAP bytes.
+ */
+#define LCD_LINES 4
+#define LCD_COLUMNS 20
+#define LCD_SPAN_GAP 4
+static char lcd_shadow[LCD_LINES][LCD_COLUMNS];
+static uint32_t lcd_dirty[LCD_LINES];   /* bit n: column n changed */
+RAM_BUDGET_CHECK(lcd_shadow, sizeof(lcd_shadow) + sizeof(lcd_dirty),
+                 RAM_BUDGET_LCD_SHADOW);
+
+static void on_update(unsigned int arg);
+
 static int lcd_fifo_full(){
     return lcd_fifo_start == ((lcd_fifo_end + 1) % LCD_FIFO_SIZE);
 }
@@ -49,6 +81,47 @@ static LCD_FIFO_TYPE lcd_fifo_peek(){
     }
     return data;
 }
+static LCD_FIFO_TYPE lcd_fifo_peek_second(){
+    LCD_FIFO_TYPE data = 0;
+    unsigned short second = (lcd_fifo_start + 1) % LCD_FIFO_SIZE;
+    if(!lcd_fifo_empty() && second != lcd_fifo_end){
+        data = lcd_fifo[second];
+    }
+    return data;
+}
+/*
+ * Power-on configuration, sent by lcd_reset(). Entries are in the same format
+ * as the FIFO, data bytes have LCD_DATA set.
+ */
+static const unsigned short lcd_init_sequence[] = {
+    0x2a, 0x71, LCD_DATA | 0x5c, 0x28, 0x08, 0x2a, 0x79, 0xd5,
+    0x70, 0x78, 0x09, 0x06, 0x72, LCD_DATA | 0x00, 0x2a, 0x79,
+    0xda, 0x10, 0xdc, 0x00, 0x81, 0x7f, 0xd9, 0xf1,
+    0xdb, 0x40, 0x78, 0x28, 0x01, 0x80, 0x0c, 0x01
+};
+static unsigned char lcd_held_in_reset = 0;
+static volatile unsigned char lcd_configuring_after_reset = 0;
+
+/*
+ * Updates until the display may be talked to after lcd_reset(). The reset
+ * line is released when this reaches 2, the FIFO starts at 0. Counting whole
+ * updates keeps both at least 10ms apart without busy waiting.
+ */
+static volatile unsigned char lcd_wakeup = 0;
+
+/* Counted by the interrupt, latched once per second by on_update() */
+#define LCD_RATE_UPDATES 100
+struct lcd_traffic_t{
+    unsigned short transactions;
+    unsigned short bytes;
+};
+static volatile struct lcd_traffic_t lcd_traffic;
+static struct lcd_traffic_t lcd_rate;
+static unsigned char lcd_rate_updates = 0;
+
+static unsigned short lcd_fifo_free(){
+    return (lcd_fifo_start + LCD_FIFO_SIZE - lcd_fifo_end - 1) % LCD_FIFO_SIZE;
+}
 static void lcd_fifo_put(LCD_FIFO_TYPE data){
     if(!lcd_fifo_full()){
         lcd_fifo[lcd_fifo_end++] = data;
@@ -58,63 +131,70 @@ static void lcd_fifo_put(LCD_FIFO_TYPE data){
     }
 }
 
-static void lcd_send_blocking(char is_command, char data){
-    I2C2CONLbits.SEN = 1;
-    while(I2C2CONLbits.SEN);
-    I2C2TRN = 0x78;
-    while(I2C2STATbits.TRSTAT);
-    if(is_command){
-        I2C2TRN = 0xC0;
-    }else{
-        I2C2TRN = 0x80;
-    }
-    while(I2C2STATbits.TRSTAT);
+static void lcd_transmit(unsigned char data){
     I2C2TRN = data;
-    while(I2C2STATbits.TRSTAT);
-    I2C2CONLbits.PEN = 1;
-    while(I2C2CONLbits.PEN);
+    lcd_traffic.bytes++;
 }
 
+static void lcd_start(){
+    I2C2CONLbits.SEN = 1;
+    lcd_traffic.transactions++;
+}
 
 static void lcd_statemachine_tick(){
-    static unsigned char current_config = 0;
+    static unsigned short stream_config = 0;
 
     switch(lcd_state){
         case lcd_idle:
             if(!lcd_fifo_empty()){
                 lcd_state = lcd_starting;
-                I2C2CONLbits.SEN = 1;
+                lcd_start();
             }
             break;
         case lcd_starting:
-            lcd_state = lcd_configuring;
+            lcd_state = lcd_addressed;
 
-            I2C2TRN = 0x78; // I2C Address of Display
+            lcd_transmit(0x78); // I2C Address of Display
 
             break;
-        case lcd_configuring:
-            lcd_state = lcd_sending;
-            current_config = lcd_fifo_peek() >> 8;
-            I2C2TRN = current_config << 6;
-            break;
-        case lcd_sending:
+        case lcd_addressed:
             if(lcd_fifo_empty()){
                 I2C2CONLbits.PEN = 1;
                 lcd_state = lcd_stopping;
-            }else if((lcd_fifo_peek() >> 8) != current_config){
+            }else if(!(lcd_fifo_peek() & LCD_DATA) &&
+                     (lcd_fifo_peek_second() & LCD_DATA)){
+                lcd_state = lcd_pairing;
+                lcd_transmit(0x80); // Co = 1, D/C = 0
+            }else{
+                lcd_state = lcd_streaming;
+                stream_config = lcd_fifo_peek() & LCD_DATA;
+                lcd_transmit(stream_config ? 0x40 : 0x00);
+            }
+            break;
+        case lcd_pairing:
+            lcd_state = lcd_addressed;
+            lcd_transmit(lcd_fifo_get() & 0xff);
+            break;
+        case lcd_streaming:
+            if(lcd_fifo_empty() ||
+               (lcd_fifo_peek() & LCD_DATA) != stream_config){
                 I2C2CONLbits.PEN = 1;
                 lcd_state = lcd_stopping;
             }else{
-                I2C2TRN = lcd_fifo_get() & 0xff;
+                lcd_transmit(lcd_fifo_get() & 0xff);
             }
 
             break;
         case lcd_stopping:
             if(lcd_fifo_empty()){
                 lcd_state = lcd_idle;
+                if(lcd_configuring_after_reset){
+                    lcd_configuring_after_reset = 0;
+                    boot_mark(BOOT_LCD_READY);
+                }
             }else{
                 lcd_state = lcd_starting;
-                I2C2CONLbits.SEN = 1;
+                lcd_start();
             }
             break;
         default:
@@ -129,9 +209,9 @@ short lcd_send(char is_command, unsigned char data) {
     if(is_command){
         lcd_fifo_put(0x0000 | data);
     }else{
-        lcd_fifo_put(0x0100 | data);
+        lcd_fifo_put(LCD_DATA | data);
     }
-    if(lcd_state == lcd_idle){
+    if(lcd_state == lcd_idle && !lcd_wakeup){
         lcd_statemachine_tick();
     }
     return 0;
@@ -139,52 +219,44 @@ short lcd_send(char is_command, unsigned char data) {
 
 void lcd_reset(){
 
-    volatile unsigned short delay = 0;
-
-    lcd_disable();
-    for(delay = 0; delay < 10000; delay++);
-    lcd_enable();
-    for(delay = 0; delay < 10000; delay++);
-
-    lcd_send_blocking(0, 0x2a);
-    lcd_send_blocking(0, 0x71);
-    lcd_send_blocking(1, 0x5c);
-    lcd_send_blocking(0, 0x28);
-    lcd_send_blocking(0, 0x08);
-    lcd_send_blocking(0, 0x2a);
-    lcd_send_blocking(0, 0x79);
-    lcd_send_blocking(0, 0xd5);
-    lcd_send_blocking(0, 0x70);
-    lcd_send_blocking(0, 0x78);
-    lcd_send_blocking(0, 0x09);
-    lcd_send_blocking(0, 0x06);
-    lcd_send_blocking(0, 0x72);
-    lcd_send_blocking(1, 0x00);
-    lcd_send_blocking(0, 0x2a);
-    lcd_send_blocking(0, 0x79);
-    lcd_send_blocking(0, 0xda);
-    lcd_send_blocking(0, 0x10);
-    lcd_send_blocking(0, 0xdc);
-    lcd_send_blocking(0, 0x00);
-    lcd_send_blocking(0, 0x81);
-    lcd_send_blocking(0, 0x7f);
-    lcd_send_blocking(0, 0xd9);
-    lcd_send_blocking(0, 0xf1);
-    lcd_send_blocking(0, 0xdb);
-    lcd_send_blocking(0, 0x40);
-    lcd_send_blocking(0, 0x78);
-    lcd_send_blocking(0, 0x28);
-    lcd_send_blocking(0, 0x01);
-    lcd_send_blocking(0, 0x80);
-    lcd_send_blocking(0, 0x0c);
-    lcd_send_blocking(0, 0x01);
+    unsigned char i, line;
+
+    /* lcd_init() leaves the display in reset, only pulse it if it has been
+     * released since. The rest happens in on_update() */
+    if(lcd_held_in_reset){
+        lcd_enable();
+        lcd_wakeup = 2;
+    }else{
+        lcd_disable();
+        lcd_wakeup = 4;
+    }
+    lcd_held_in_reset = 0;
+
+    /* queue the configuration, it is sent from the I2C interrupt once the
+     * display is awake while the caller carries on */
+    for(i = 0; i != sizeof(lcd_init_sequence) / sizeof(*lcd_init_sequence); i++){
+        lcd_send(!(lcd_init_sequence[i] & LCD_DATA), lcd_init_sequence[i] & 0xff);
+    }
+    lcd_configuring_after_reset = 1;
+
+    /* the configuration clears the display */
+    for(line = 0; line != LCD_LINES; line++){
+        lcd_dirty[line] = 0;
+        for(i = 0; i != LCD_COLUMNS; i++){
+            if(lcd_shadow[line][i] != ' '){
+                lcd_dirty[line] |= (uint32_t)1 << i;
+            }
+        }
+    }
+    lcd_flush();
 }
 
 void lcd_init(void)
 {
     /* LCD reset is a 5V output signal, set to open drain and let external
      * pull-ups do their job */
-    PORTBbits.RB11 = 0; /* disable LCD */
+    PORTBbits.RB11 = 0; /* disable LCD, released in lcd_reset() */
+    lcd_held_in_reset = 1;
     ODCBbits.ODCB11 = 1; /* open drain for 5V operation */
     TRISBbits.TRISB11 = 0; /* output */
     
@@ -209,30 +281,120 @@ void lcd_init(void)
 
     /* enable I2C2 module, master mode*/
     I2C2CONLbits.I2CEN = 1;
+
+    memset(lcd_shadow, ' ', sizeof(lcd_shadow));
+    memset(lcd_dirty, 0, sizeof(lcd_dirty));
+
+    /* sends whatever didn't fit into the FIFO last time */
+    event_register_listener(EVENT_UPDATE, on_update);
+}
+
+static void lcd_line_put(struct str_sink_t* sink, char c){
+    struct lcd_line_t* line = (struct lcd_line_t*)sink;
+    if(line->column == LCD_COLUMNS){
+        return;
+    }
+    if(lcd_shadow[line->line][line->column] != c){
+        lcd_shadow[line->line][line->column] = c;
+        lcd_dirty[line->line] |= (uint32_t)1 << line->column;
+    }
+    line->column++;
+}
+
+struct str_sink_t* lcd_line_begin(struct lcd_line_t* line,
+                                  unsigned char lineN){
+    line->sink.put = lcd_line_put;
+    line->line = lineN;
+    /* out of range lines drop everything */
+    line->column = (lineN < LCD_LINES ? 0 : LCD_COLUMNS);
+    return &line->sink;
+}
+
+int lcd_line_end(struct lcd_line_t* line){
+    unsigned char n_written = line->column;
+    if(line->line >= LCD_LINES){
+        return 0;
+    }
+    while(line->column != LCD_COLUMNS){
+        lcd_line_put(&line->sink, ' ');
+    }
+    lcd_flush();
+    return n_written;
 }
 
 int lcd_writeline(unsigned char lineN, const char * string){
-    int i = 0;
-    int n_send = 0;
-    char c = 0;
+    struct lcd_line_t line;
     if(string == NULL){
         return 0;
     }
+    str_put_string(lcd_line_begin(&line, lineN), string);
+    return lcd_line_end(&line);
+}
+
+void lcd_flush(void){
+    unsigned char line, start, end, gap, i;
+    uint32_t dirty;
+
+    /* nothing can be sent before lcd_reset() */
+    if(lcd_held_in_reset){
+        return;
+    }
 
-    lcd_send(1, 0x80 | (lineN << 5));
+    for(line = 0; line != LCD_LINES; line++){
+        while((dirty = lcd_dirty[line]) != 0){
+            /* first changed column and the end of the span starting there */
+            for(start = 0; !(dirty & ((uint32_t)1 << start)); start++);
+            end = start + 1;
+            gap = 0;
+            for(i = end; i != LCD_COLUMNS && gap <= LCD_SPAN_GAP; i++){
+                if(dirty & ((uint32_t)1 << i)){
+                    end = i + 1;
+                    gap = 0;
+                }else{
+                    gap++;
+                }
+            }
+
+            /* the rest goes out with the next update */
+            if(lcd_fifo_free() < end - start + 1){
+                return;
+            }
 
-    while((c = *string++) != '\0'){
-        if(lcd_send(0, c)){
-            return n_send;
+            lcd_send(1, 0x80 | (line << 5) | start);
+            for(i = start; i != end; i++){
+                lcd_send(0, lcd_shadow[line][i]);
+            }
+            lcd_dirty[line] &= ~((((uint32_t)1 << end) - 1) &
+                                 ~(((uint32_t)1 << start) - 1));
         }
-        n_send++;
     }
-    for(i = n_send; i < 20; i++){
-         if(lcd_send(0, ' ')){
-            return n_send;
+}
+
+void lcd_get_traffic(unsigned short* transactions, unsigned short* bytes){
+    *transactions = lcd_rate.transactions;
+    *bytes = lcd_rate.bytes;
+}
+
+static void on_update(unsigned int arg){
+    if(lcd_wakeup){
+        if(--lcd_wakeup == 2){
+            lcd_enable();
+        }else if(lcd_wakeup == 0 && lcd_state == lcd_idle){
+            lcd_statemachine_tick();
         }
     }
-    return n_send;
+
+    if(++lcd_rate_updates == LCD_RATE_UPDATES){
+        lcd_rate_updates = 0;
+        IEC3bits.MI2C2IE = 0;
+            lcd_rate.transactions = lcd_traffic.transactions;
+            lcd_rate.bytes = lcd_traffic.bytes;
+            lcd_traffic.transactions = 0;
+            lcd_traffic.bytes = 0;
+        IEC3bits.MI2C2IE = 1;
+    }
+
+    lcd_flush();
 }
 
 void _ISR_NOPSV _MI2C2Interrupt(void)
@@ -240,3 +402,195 @@ void _ISR_NOPSV _MI2C2Interrupt(void)
     lcd_statemachine_tick();
     IFS3bits.MI2C2IF = 0;  /* clear interrupt flag */
 }
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace ::testing;
+
+/* drops everything queued so far, as if it had been sent */
+static void drain(){
+    lcd_fifo_start = lcd_fifo_end;
+    lcd_state = lcd_idle;
+}
+
+static std::vector<short> queued(){
+    std::vector<short> entries;
+    for(unsigned short i = lcd_fifo_start; i != lcd_fifo_end;
+        i = (i + 1) % LCD_FIFO_SIZE){
+        entries.push_back(lcd_fifo[i]);
+    }
+    return entries;
+}
+
+/* runs the interrupt until the FIFO is empty and records the bus traffic */
+static std::string run_bus(){
+    std::string bus;
+    char buf[4];
+    unsigned short bytes;
+
+    lcd_wakeup = 0;
+    lcd_statemachine_tick();
+    for(int i = 0; i != 1000 && lcd_state != lcd_idle; ++i){
+        if(I2C2CONLbits.SEN){
+            bus += "S ";
+            I2C2CONLbits.SEN = 0;
+        }
+        if(I2C2CONLbits.PEN){
+            bus += "P";
+            I2C2CONLbits.PEN = 0;
+        }
+        bytes = lcd_traffic.bytes;
+        _MI2C2Interrupt();
+        if(lcd_traffic.bytes != bytes){
+            sprintf(buf, "%02x ", I2C2TRN & 0xff);
+            bus += buf;
+        }
+    }
+    return bus;
+}
+
+class lcd : public Test
+{
+    virtual void SetUp()
+    {
+        event_deinit();
+        lcd_init();
+        lcd_reset();
+        drain();
+    }
+
+    virtual void TearDown()
+    {
+        drain();
+        event_deinit();
+    }
+};
+
+/* -------------------------------------------------------------------------- */
+TEST_F(lcd, nothing_is_sent_while_held_in_reset)
+{
+    lcd_init();
+    lcd_writeline(0, "hello");
+    EXPECT_THAT(queued(), IsEmpty());
+
+    lcd_reset();
+    EXPECT_THAT(queued(), Contains(LCD_DATA | 'h'));
+}
+
+TEST_F(lcd, unchanged_line_is_not_sent_again)
+{
+    lcd_writeline(0, "12.0V 1.00A 12.0W");
+    drain();
+    lcd_writeline(0, "12.0V 1.00A 12.0W");
+
+    EXPECT_THAT(queued(), IsEmpty());
+}
+
+TEST_F(lcd, changed_character_is_sent_behind_the_cursor)
+{
+    lcd_writeline(1, "12.0V");
+    drain();
+    lcd_writeline(1, "12.5V");
+
+    EXPECT_THAT(queued(), ElementsAre(0x80 | 0x20 | 3, LCD_DATA | '5'));
+}
+
+TEST_F(lcd, numbers_are_formatted_into_the_line)
+{
+    struct lcd_line_t line;
+
+    lcd_writeline(1, "12.0V");
+    drain();
+    str_put_q16(lcd_line_begin(&line, 1), (_Q16)(12.5 * 65536), 4, 1);
+    str_put_string(&line.sink, "V");
+    EXPECT_THAT(lcd_line_end(&line), Eq(5));
+
+    EXPECT_THAT(queued(), ElementsAre(0x80 | 0x20 | 3, LCD_DATA | '5'));
+}
+
+TEST_F(lcd, close_changes_are_sent_in_one_span)
+{
+    lcd_writeline(0, "abcdefghijklmnop");
+    drain();
+    lcd_writeline(0, "xbcyefghijklmnoz");
+
+    EXPECT_THAT(queued(), ElementsAre(0x80 | 0,
+                                      LCD_DATA | 'x', LCD_DATA | 'b',
+                                      LCD_DATA | 'c', LCD_DATA | 'y',
+                                      0x80 | 15, LCD_DATA | 'z'));
+}
+
+TEST_F(lcd, shorter_line_is_blanked)
+{
+    lcd_writeline(2, "> Panel 1");
+    drain();
+    lcd_writeline(2, "> Panel");
+
+    EXPECT_THAT(queued(), ElementsAre(0x80 | 0x40 | 8, LCD_DATA | ' '));
+}
+
+TEST_F(lcd, spans_that_dont_fit_are_sent_on_the_next_update)
+{
+    while(lcd_fifo_free() > 3)
+        lcd_send(0, ' ');
+    lcd_writeline(3, "abcde");
+    EXPECT_THAT(lcd_dirty[3], Eq(0x1Fu));
+
+    drain();
+    event_post(EVENT_UPDATE, 0);
+    event_dispatch_all();
+
+    EXPECT_THAT(queued(), SizeIs(6));
+    EXPECT_THAT(lcd_dirty[3], Eq(0u));
+}
+
+TEST_F(lcd, cursor_and_characters_share_one_transaction)
+{
+    lcd_send(1, 0xa3);
+    lcd_send(0, '5');
+    lcd_send(0, 'V');
+
+    EXPECT_THAT(run_bus(), StrEq("S 78 80 a3 40 35 56 P"));
+}
+
+TEST_F(lcd, command_runs_are_streamed)
+{
+    lcd_send(1, 0x2a);
+    lcd_send(1, 0x71);
+    lcd_send(0, 0x5c);
+    lcd_send(1, 0x28);
+
+    EXPECT_THAT(run_bus(), StrEq("S 78 00 2a 71 PS 78 40 5c PS 78 00 28 P"));
+}
+
+TEST_F(lcd, traffic_is_reported_per_second)
+{
+    unsigned short transactions, bytes;
+
+    lcd_traffic.transactions = 0;
+    lcd_traffic.bytes = 0;
+    lcd_rate_updates = 0;
+    lcd_writeline(0, "a         b");
+    run_bus();
+    for(int i = 0; i != LCD_RATE_UPDATES; ++i)
+    {
+        event_post(EVENT_UPDATE, 0);
+        event_dispatch_all();
+    }
+
+    /* two spans, "78 80 <cursor> 40 <character>" each */
+    lcd_get_traffic(&transactions, &bytes);
+    EXPECT_THAT(transactions, Eq(2u));
+    EXPECT_THAT(bytes, Eq(10u));
+}
+
+#endif /* TESTING */
@@ -9,10 +9,15 @@
 #include <stdint.h>
 #include "drv/uart.h"
 #include "drv/hw.h"
+#include "drv/boot.h"
 #include "core/event.h"
 #include "usr/pv_model.h"
+#include "usr/calibration.h"
+#include "usr/profile.h"
+#include "usr/panels_db.h"
 #include "core/string.h"
 #include "drv/buck.h"
+#include "drv/lcd.h"
 #include "drv/leds.h"
 
 /* Sets the size of the send queue */
@@ -31,29 +36,79 @@
 #define DEFAULT_EXPOSURE 100     /* percent */
 #define DEFAULT_TEMPERATURE 2930 /* 1/10ths kelvin */
 
-/* Length of the numbers for UART */
-#define VOLTAGE_LENGTH 5
-#define CURRENT_LENGTH 5
-#define EXPOSURE_LENGTH 3
-#define TEMPERATURE_LENGTH 3
+/*
+ * Baud rates the host can negotiate with the 'b' command. All rates use the
+ * high speed baud rate generator (BRGH=1), where U1BRG = FCY / (4 * baud) - 1.
+ * Only rates that divide evenly (or within 0.2%) are listed, the FT232R on the
+ * other side of the isolator can reproduce all of them exactly.
+ */
+#define BRG_FOR(baud) ((unsigned short)((FCY + 2 * (baud)) / (4 * (baud)) - 1))
+static const unsigned short baud_brg_table[] = {
+    BRG_FOR(115200UL),   /* 0 - default after reset */
+    BRG_FOR(230400UL),   /* 1 */
+    BRG_FOR(500000UL),   /* 2 */
+    BRG_FOR(1000000UL),  /* 3 */
+    BRG_FOR(1500000UL)   /* 4 */
+};
+#define BAUD_DEFAULT 0
+#define BAUD_COUNT (sizeof(baud_brg_table) / sizeof(*baud_brg_table))
+
+/* Number of 10ms updates the host has to confirm a new baud rate with 'k' */
+#define BAUD_CONFIRM_TIMEOUT 50
+/* Number of RX errors per second that cause a fall back to the default rate */
+#define BAUD_ERROR_THRESHOLD 8
+
+/* Number of I-V points computed per 10ms update while a sweep is running */
+#define SWEEP_POINTS_PER_UPDATE 4
+/* Longest sweep point, "p255I32767U65535\n". Lines are formatted straight
+ * into the transmit queue and only started once they fit. */
+#define SWEEP_LINE_LENGTH 17
+
+/* Longest transient sample, "q255U65535I-32767\n" */
+#define TRANSIENT_LINE_LENGTH 18
+
+/* Longest dump line, "dc255U-32767I-32767T-32767E-32767\n" */
+#define DUMP_LINE_LENGTH 35
+
+/* Longest streamed measurement, "mU-32768I-32768P-32768.000E-32768.000\n" */
+#define TELEMETRY_LINE_LENGTH 38
+/* Largest interval "m<n>" accepts, in windows */
+#define TELEMETRY_MAX_INTERVAL 65535
+
+/* Length of the numbers for UART, including the null terminator */
 #define BUFFER_LENGTH 7
 /*
  * In order to test some of the concurrency situations present in the transmit
  * queue, we need to call an "update" function while uart_send() is blocking.
+ * The protocol benchmark on the host uses the same hook to drain the queue.
  */
 #ifdef TESTING
 static void tx_send_update(); /* is implemented in the tests below */
 #   define TX_SEND_UPDATE() \
             (tx_send_update())
+#elif defined(BENCHMARK)
+void benchmark_tx_update(void); /* see software/benchmarks */
+#   define TX_SEND_UPDATE() \
+            (benchmark_tx_update())
 #else
 #   define TX_SEND_UPDATE()
 #endif
 
 static void process_incoming_data(unsigned int data);
+static void process_command(unsigned int data);
 static void configure_pins(void);
 static void configure_uart(void);
 static void send_next_byte(void);
+static void queue_byte(struct str_sink_t* sink, char c);
+static void send_sweep_points(void);
+static void send_transient_samples(void);
+static void send_telemetry(void);
+static void start_transient_upload(unsigned int arg);
+static void send_next_dump_line(unsigned int arg);
+static void reply_begin(void);
+static void reply_end(void);
 static void send_update_to_frontend(unsigned int arg);
+static void on_update(unsigned int arg);
 
 typedef enum
 {
@@ -68,6 +123,14 @@ typedef enum
     STATE_GET_CONFIG_DUMP,
     STATE_GET_MEASUREMENTS,
     STATE_REMOVE_CELL,
+    STATE_SET_BAUD_RATE,
+    STATE_SEQUENCE_NUMBER,
+    STATE_START_SWEEP,
+    STATE_SET_REGULATOR,
+    STATE_CALIBRATE,
+    STATE_TRANSIENT,
+    STATE_PROFILE,
+    STATE_PANELS_DB,
 } state_e;
 
 typedef enum
@@ -76,7 +139,19 @@ typedef enum
     CASE_REMOVE_CELL = 'r',
     CASE_ADD_CELL = 'a',
     CASE_DUMP_CONFIG = 'd',
-    CASE_GET_MEASUREMENTS = 'm'
+    CASE_GET_MEASUREMENTS = 'm',
+    CASE_SET_BAUD_RATE = 'b',
+    CASE_CONFIRM = 'k',
+    CASE_START_SWEEP = 's',
+    CASE_SET_REGULATOR = 'g',
+    CASE_CALIBRATE = 'x',
+    CASE_TRANSIENT = 't',
+    CASE_PROFILE = 'i',
+    CASE_BOOT_TIMES = 'u',
+    CASE_LCD_TRAFFIC = 'l',
+    CASE_PANELS_DB = 'f',
+    CASE_SEQUENCE_NUMBER = '#',
+    CASE_END_OF_COMMAND = '\n'
 } case_e;
 
 struct data_t {
@@ -94,11 +169,260 @@ struct data_t {
                                            * received char was digit or not */
         } config_cell;
         struct {
-            unsigned char selected_cell;
+            unsigned char first;          /* cell ID range to dump */
+            unsigned char last;
+            unsigned int since;           /* only cells changed after this */
+            unsigned char field;          /* which of the above digits go to */
+            unsigned char was_digit;
         } config_dump;
+        struct {
+            unsigned char index;
+            unsigned char was_digit;
+        } baud_rate;
+        struct {
+            unsigned int points;
+            unsigned char was_digit;
+        } sweep;
+        struct {
+            unsigned int interval;        /* windows */
+            unsigned char was_digit;
+        } measurements;
+        struct {
+            unsigned int value;           /* digits of the current field */
+            unsigned int kp;              /* thousandths */
+            unsigned int ki;              /* thousandths */
+            unsigned int slew_rate;       /* millivolts per millisecond */
+            unsigned char enable;
+            unsigned char field;          /* 'E', 'P', 'I', 'S', 0 if none */
+            unsigned char was_digit;
+        } regulator;
+        struct {
+            unsigned int value;           /* millivolts or milliamperes */
+            unsigned char command;        /* 0 until the first character */
+        } calibration;
+        struct {
+            unsigned int pre_trigger;     /* samples */
+            unsigned int threshold;       /* milliamperes per sample */
+            unsigned char command;        /* 0 until the first character */
+            unsigned char field;          /* 'D' once the threshold starts */
+        } transient;
+        struct {
+            struct profile_keyframe_t keyframe;
+            unsigned int value;           /* digits of the current field */
+            unsigned char field;          /* 0 dt, 1 global, 2.. cells */
+            unsigned char command;        /* 'k' for a keyframe */
+            unsigned char was_digit;
+        } profile;
+        struct {
+            uint16_t words[PANELS_DB_BLOCK_WORDS];
+            unsigned int numbers[3];      /* decimal fields, see below */
+            unsigned int value;           /* digits of the current field */
+            unsigned char count;          /* words received, may overflow */
+            unsigned char digits;         /* hex digits of the next word */
+            unsigned char field;
+            unsigned char command;        /* 0 until the first character */
+        } panels_db;
     };
 };
 
+/*
+ * Baud rate negotiation. The host requests a rate with "b<index>", the device
+ * acknowledges at the old rate and switches as soon as the acknowledgement has
+ * left the TX buffer. The host then has BAUD_CONFIRM_TIMEOUT updates to send a
+ * 'k' at the new rate, otherwise the device falls back to the last confirmed
+ * rate. The confirmed rate is kept until the device is reset or too many
+ * receive errors make the device announce "#b0\n" and go back to the default.
+ */
+struct baud_rate_t
+{
+    unsigned char active;          /* index currently loaded into U1BRG */
+    unsigned char committed;       /* last index confirmed by the host */
+    unsigned char pending;         /* index to switch to once TX is idle */
+    unsigned char switch_requested;
+    unsigned char timeout;         /* updates left to confirm, 0 = none */
+    unsigned char error_window;    /* updates since errors were reset */
+};
+
+/*
+ * Sequenced commands. A command prefixed with "#<n>" and terminated with '\n'
+ * is answered with exactly one reply of the form "#<n><reply>\n". Commands
+ * without a reply of their own (cell configuration) are acknowledged with an
+ * empty "#<n>\n". This lets the host keep several commands in flight and
+ * match replies to requests. Commands without a prefix work like they always
+ * did, and unsolicited messages never start with '#'.
+ */
+struct sequence_t
+{
+    unsigned char number;          /* 0-255, wraps */
+    unsigned char active;          /* current command carries a number */
+    unsigned char replied;         /* reply was sent, no empty ack needed */
+};
+
+/*
+ * I-V sweep of the active model. "s<points>" is answered with "s<points>"
+ * (or "s0" if the sweep can't run), after which the points are streamed as
+ * "p<index>I<milliamps>U<millivolts>\n" from on_update(), a few per update and
+ * only as long as they fit into the transmit queue without blocking. Current
+ * runs from 0 to the largest short circuit current of all cells.
+ */
+struct sweep_t
+{
+    unsigned char running;
+    unsigned char points;
+    unsigned char next;            /* index of the next point to send */
+    _Q16 max_current;
+};
+
+/*
+ * Measurements, see buck_get_stats(). "m" is answered with the statistics of
+ * the last window of conversions:
+ *
+ *   mU<mV>I<mA>P<W>E<Wh>R<mV>,<mA>L<mV>,<mA>H<mV>,<mA>
+ *
+ * U and I are the means, P the mean power and E the energy since boot, both
+ * with three decimals. R is the RMS ripple of voltage and current, L and H
+ * their minimum and maximum. "m<n>" is answered the same way and also streams
+ * "mU<mV>I<mA>P<W>E<Wh>\n" from on_update() once every n windows, at most
+ * once per update and only if the line fits into the transmit queue. "m0"
+ * stops streaming.
+ */
+struct telemetry_t
+{
+    unsigned short interval;       /* windows, 0 = not streaming */
+    unsigned short last_window;    /* window of the last line sent */
+};
+
+/*
+ * Regulator settings. "g" with any of the fields E<0|1>, P<kp>, I<ki> and
+ * S<mV/ms>, the gains in thousandths, e.g. "gE1P500I10" enables the regulator
+ * with kp = 0.5 and ki = 0.01. S is the slew rate of the output, see
+ * buck_set_slew_rate(), 0 for none. Fields that are left out keep their
+ * value, a plain "g" only reports the settings. Always answered with all
+ * four fields.
+ */
+#define REGULATOR_MAX_GAIN 32767
+
+/*
+ * Calibration against reference loads, see usr/calibration.h. With the output
+ * settled at a known voltage or current, the host sends the true value and
+ * the device records its own reading for it:
+ *
+ *   xU<mV>    record a voltage point, answered with "xU<points recorded>"
+ *   xI<mA>    record a current point, answered with "xI<points recorded>"
+ *   xa        fit and use new coefficients, answered with "xa1" or "xa0"
+ *   xw        write the coefficients in use to flash, "xw1" or "xw0"
+ *   xr        back to nominal coefficients and erase flash, "xr"
+ *   x         report the coefficients in use as
+ *             "xU<offset>,<gain>I<offset>,<gain>", see buck_calibration_t
+ *
+ * Averaging should be long and the output steady while recording points.
+ */
+
+/*
+ * Transient capture, see buck_transient_arm():
+ *
+ *   ta<pre>[D<mA>]  arm with <pre> samples before the trigger, optionally
+ *                   triggering on a current step of <mA> between two
+ *                   conversions, answered with "ta<pre>"
+ *   tt              trigger now, "tt"
+ *   tr              disarm and drop the capture, "tr"
+ *   t               report the state as "t<buck_transient_state_e>"
+ *
+ * UVLO triggers as well. Once the capture is complete it is streamed from
+ * on_update() like a sweep, starting with "qh<length>,<trigger>,<rate>\n",
+ * followed by one "q<index>U<mV>I<mA>\n" per sample and ending with "qe\n".
+ * The trigger is the index of the trigger sample, rate is in Hz. The capture
+ * is released after the last sample, so it has to be armed again.
+ */
+struct transient_upload_t
+{
+    unsigned char running;
+    unsigned char header_sent;
+    unsigned char next;            /* index of the next sample to send */
+};
+
+/*
+ * Irradiance profile playback, see usr/profile.h. Irradiances are in tenths
+ * of a percent, cells are counted from the first one added:
+ *
+ *   i<dt>G<g>[,<g0>,<g1>,<g2>,<g3>]
+ *           push a keyframe <dt> ms after the previous one, cells left empty
+ *           follow <g>, e.g. "i500G800,,950" ramps the second cell to 95% and
+ *           all others to 80% over 500ms. Answered with "ik<free slots>", or
+ *           "if" if the ring is full
+ *   ir      start playing, "ir1", or "ir0" if there is nothing to play
+ *   is      stop and drop all keyframes, "is"
+ *   i       report "i<running>,<free slots>"
+ *
+ * The host keeps the ring topped up while playing, using the free slots
+ * in the replies for flow control.
+ */
+#define PROFILE_MAX_VALUE 65535
+
+/*
+ * Boot timing, see drv/boot.h. "u" is answered with the time each phase
+ * completed after reset, in boot_phase_e order and in milliseconds with three
+ * decimals, e.g. "u0.412,9.630,9.702,...". Phases that haven't completed yet
+ * are sent as '-'.
+ */
+
+/*
+ * Display traffic, see lcd_get_traffic(). "l" is answered with
+ * "l<transactions>,<bytes>" sent to the LCD during the last second.
+ */
+
+/*
+ * Panel database upload, see panels_db_upload_begin(). Numbers are decimal,
+ * image words are sent as four hex digits each:
+ *
+ *   fb<length>,<checksum>    start an upload of <length> words, <checksum>
+ *                            being the image's last word. Erases the
+ *                            database, answered with "fb1" or "fb0"
+ *   fw<offset>,<words>,<crc> program up to PANELS_DB_BLOCK_WORDS words at
+ *                            <offset>. <crc> is the CRC-16/CCITT (0x1021,
+ *                            starting at 0xFFFF) over the offset and the
+ *                            words, each low byte first. Always answered
+ *                            with "fw<words received>", a block that didn't
+ *                            make it leaves the count where it was
+ *   fc                       switch to the new image, "fc1" if it's complete
+ *                            and valid, "fc0" otherwise
+ *   f                        report "f<received>,<length>,<checksum>",
+ *                            length is 0 if there is no upload to resume
+ *
+ * The host waits for each reply before sending the next block. Programming
+ * stalls the CPU, and nothing arrives in the meantime that way.
+ */
+#define PANELS_DB_MAX_VALUE 65535
+
+/*
+ * Config dump. The 'd' command only starts the dump and is answered with "d"
+ * right away. The cells are then sent one per event dispatch as
+ * "dc<id>U<mV>I<mA>T<temperature>E<exposure>\n", the same format the device
+ * uses when a value is changed on the device itself, in ascending ID order.
+ * The dump ends with "dv<version>\n", where version is the model version at
+ * the time the dump started.
+ *
+ *   d             all cells
+ *   d<a>-<b>      cells with IDs a to b, "d<a>" is only cell a, "d<a>-" a
+ *                 and up
+ *   dv<version>   only cells that changed after the given version
+ *
+ * The cursor is the ID of the last cell sent, so cells may be added or
+ * removed while the dump is running. A new 'd' restarts the dump.
+ */
+struct config_dump_t
+{
+    unsigned char active;
+    unsigned char waiting;         /* transmit queue was full, see on_update */
+    unsigned char progressed;      /* a line was sent since the last update */
+    unsigned char generation;      /* events of older chains are ignored */
+    unsigned char cursor;          /* ID of the last cell sent */
+    unsigned char last;
+    unsigned char changed_only;
+    unsigned short since;
+    unsigned short version;        /* model version when the dump started */
+};
+
 struct ring_buffer_t
 {
     volatile unsigned char read;
@@ -109,6 +433,16 @@ struct ring_buffer_t
 static state_e              state       = STATE_IDLE;
 static struct data_t        state_data;
 static struct ring_buffer_t transmit_queue  = {};
+static struct baud_rate_t   baud_rate;
+static struct sequence_t    sequence;
+static struct sweep_t       sweep;
+static struct config_dump_t config_dump;
+static struct transient_upload_t transient_upload;
+static struct telemetry_t   telemetry;
+static volatile unsigned char rx_errors = 0;
+
+/* Formats numbers straight into the transmit queue, see core/string.h */
+static struct str_sink_t    uart_sink   = { queue_byte };
 
 /* -------------------------------------------------------------------------- */
 void uart_init(void)
@@ -118,10 +452,23 @@ void uart_init(void)
 
     event_register_listener(EVENT_DATA_RECEIVED, process_incoming_data);
     event_register_listener(EVENT_CELL_VALUE_UPDATED, send_update_to_frontend);
+    event_register_listener(EVENT_UPDATE, on_update);
+    event_register_listener(EVENT_UART_DUMP_NEXT, send_next_dump_line);
+    event_register_listener(EVENT_TRANSIENT_CAPTURED, start_transient_upload);
 }
 
 /* -------------------------------------------------------------------------- */
-void uart_send(const char* str)
+/* sends the first byte in the queue if the TX buffer is idle */
+static void try_send_first_byte(void)
+{
+    disable_tx_interrupt();
+        if(U1STAbits.TRMT)
+            send_next_byte();
+    enable_tx_interrupt();
+}
+
+/* -------------------------------------------------------------------------- */
+static void queue_byte(struct str_sink_t* sink, char c)
 {
     /*
      * Note: The assumption is that this never gets called from an interrupt,
@@ -133,31 +480,27 @@ void uart_send(const char* str)
         write = transmit_queue.write + 1;                               \
         write = (write == TRANSMIT_QUEUE_SIZE ? 0 : write); } while(0)
 
-    /* sends the first byte in the queue if the TX buffer is idle */
-#define try_send_first_byte() do {        \
-        disable_tx_interrupt();           \
-            if(U1STAbits.TRMT)            \
-                send_next_byte();         \
-        enable_tx_interrupt(); } while(0)
+    /* increment and wrap write position */
+    unsigned char write;
+    get_next_write_position(write);
 
-    while(*str)
+    /* if queue is full, block until space frees up */
+    while(write == transmit_queue.read)
     {
-        /* increment and wrap write position */
-        unsigned char write;
+        try_send_first_byte(); /* send, so buffer is emptied */
+        while(write == transmit_queue.read) { TX_SEND_UPDATE(); }
         get_next_write_position(write);
+    }
 
-        /* if queue is full, block until space frees up */
-        while(write == transmit_queue.read)
-        {
-            try_send_first_byte(); /* send, so buffer is emptied */
-            while(write == transmit_queue.read) { TX_SEND_UPDATE(); }
-            get_next_write_position(write);
-        }
+    /* add data to queue and update write position */
+    transmit_queue.data[write] = c;
+    transmit_queue.write = write;
+}
 
-        /* add data to queue and update write position */
-        transmit_queue.data[write] = *str++;
-        transmit_queue.write = write;
-    }
+/* -------------------------------------------------------------------------- */
+void uart_send(const char* str)
+{
+    str_put_string(&uart_sink, str);
 
     /*
      * At this point the data is in the queue, but we don't know if the TX
@@ -168,6 +511,22 @@ void uart_send(const char* str)
     try_send_first_byte();
 }
 
+/* -------------------------------------------------------------------------- */
+/* Formats the number straight into the queue, like uart_send() */
+static void send_number(const char* prefix, short number)
+{
+    str_put_string(&uart_sink, prefix);
+    str_put_int(&uart_sink, number, 0);
+    try_send_first_byte();
+}
+
+static void send_unsigned(const char* prefix, unsigned short number)
+{
+    str_put_string(&uart_sink, prefix);
+    str_put_unsigned(&uart_sink, number, 0);
+    try_send_first_byte();
+}
+
 /* -------------------------------------------------------------------------- */
 static void configure_pins(void)
 {
@@ -191,13 +550,26 @@ static void configure_uart(void)
     U1MODEbits.STSEL = 0;     /* 1 stop bit */
     U1MODEbits.PDSEL = 1;     /* 8-bit data, even parity */
     U1MODEbits.ABAUD = 0;     /* Auto-Baud disabled */
-    U1MODEbits.BRGH = 0;      /* Standard-Speech mode */
+    U1MODEbits.BRGH = 1;      /* High-Speed mode, required for > 1 Mbaud */
     U1MODEbits.RXINV = 1;     /* Invert RX (due to isolating IC) */
     U1STAbits.TXINV = 1;      /* Invert TX (due to isolating IC) */
 
-#define BAUDRATE 115200
-#define BRGVAL (FCY/(BAUDRATE*16))-1
-    U1BRG = BRGVAL;           /* baud rate setting, see #defines at top */
+    /* always start at the default rate, the host has to negotiate again */
+    baud_rate.active = BAUD_DEFAULT;
+    baud_rate.committed = BAUD_DEFAULT;
+    baud_rate.switch_requested = 0;
+    baud_rate.timeout = 0;
+    baud_rate.error_window = 0;
+    rx_errors = 0;
+    U1BRG = baud_brg_table[BAUD_DEFAULT]; /* see baud_brg_table at top */
+
+    sequence.active = 0;
+    sweep.running = 0;
+    config_dump.active = 0;
+    config_dump.waiting = 0;
+    config_dump.progressed = 0;
+    transient_upload.running = 0;
+    telemetry.interval = 0;
 
     IFS0bits.U1TXIF = 0;
     IEC0bits.U1TXIE = 1;      /* enable TX interrupt */
@@ -206,6 +578,75 @@ static void configure_uart(void)
     IEC0bits.U1RXIE = 1;      /* enable RX interrupt */
 }
 
+/* -------------------------------------------------------------------------- */
+static void apply_baud_rate(unsigned char index)
+{
+    /* a byte being shifted out while U1BRG changes gets corrupted. That's
+     * why switches wait for TX to be idle, fall backs don't bother. */
+    U1BRG = baud_brg_table[index];
+    baud_rate.active = index;
+}
+
+/* -------------------------------------------------------------------------- */
+static void on_update(unsigned int arg)
+{
+    /* switch to the requested rate once the acknowledgement was sent */
+    if(baud_rate.switch_requested &&
+       transmit_queue.read == transmit_queue.write &&
+       U1STAbits.TRMT)
+    {
+        apply_baud_rate(baud_rate.pending);
+        baud_rate.switch_requested = 0;
+        if(baud_rate.pending != baud_rate.committed)
+            baud_rate.timeout = BAUD_CONFIRM_TIMEOUT;
+    }
+
+    /* host didn't confirm the new rate in time, go back */
+    if(baud_rate.timeout && --baud_rate.timeout == 0)
+        apply_baud_rate(baud_rate.committed);
+
+    /*
+     * Too many framing/parity errors, the link can't handle this rate. Tell
+     * the host with an unsequenced "#b<index>" frame while it's still
+     * listening at this rate and switch once that has been sent.
+     */
+    if(rx_errors >= BAUD_ERROR_THRESHOLD &&
+       baud_rate.active != BAUD_DEFAULT &&
+       !baud_rate.switch_requested)
+    {
+        baud_rate.committed = BAUD_DEFAULT;
+        baud_rate.pending = BAUD_DEFAULT;
+        baud_rate.switch_requested = 1;
+        baud_rate.timeout = 0;
+        send_unsigned("#b", BAUD_DEFAULT);
+        uart_send("\n");
+    }
+
+    /* errors are counted per second */
+    if(++baud_rate.error_window == 100)
+    {
+        baud_rate.error_window = 0;
+        rx_errors = 0;
+    }
+
+    send_sweep_points();
+    send_transient_samples();
+    send_telemetry();
+
+    /*
+     * Pick the dump up again once the transmit queue has drained. A dump that
+     * didn't get anywhere since the last update lost its event, event_post()
+     * drops events when the queue is full. Resuming starts a new chain.
+     */
+    if(config_dump.active &&
+       (config_dump.waiting || !config_dump.progressed))
+    {
+        config_dump.waiting = 0;
+        send_next_dump_line(++config_dump.generation);
+    }
+    config_dump.progressed = 0;
+}
+
 /* -------------------------------------------------------------------------- */
 static void init_state_vars_config()
 {
@@ -220,6 +661,11 @@ static short convert_milli(_Q16 input)
     return (short)((input * 1000) >> 16);
 }
 
+static short round_milli(_Q16 input)
+{
+    return (short)((input * 1000 + 32768) >> 16);
+}
+
 static short convert_deci(_Q16 input)
 {
     return (short)((input * 10) >> 16);
@@ -252,143 +698,714 @@ static short get_cell_temperature(unsigned char cell_id)
     return convert_unit(model_get_relative_solar_irradiation(cell_id));
 }
 
-static void send_cell_config(unsigned char cell_id)
+static void send_cell_config(unsigned char cell_id,
+                             const struct pv_cell_t* params)
+{
+    /* same conversions as the get_cell_*() functions above */
+    send_number("dc", cell_id);
+    send_number("U", convert_milli(params->voc));
+    send_number("I", convert_milli(params->isc));
+    send_number("T", convert_unit(params->g));
+    send_number("E", convert_deci(params->vt));
+    uart_send("\n");
+}
+
+static unsigned char transmit_queue_free(void)
+{
+    unsigned char used = (transmit_queue.write + TRANSMIT_QUEUE_SIZE -
+                          transmit_queue.read) % TRANSMIT_QUEUE_SIZE;
+    return TRANSMIT_QUEUE_SIZE - 1 - used;
+}
+
+static void send_next_dump_line(unsigned int arg)
 {
-    char buffer_str[BUFFER_LENGTH]; /* five digits, sign, '\0' terminator */
-    short buffer_num;
+    struct pv_cell_t params;
+    unsigned short version;
+    unsigned char cell_id;
 
-    buffer_num = get_cell_voltage(cell_id);
-    str_nitoa(buffer_str, VOLTAGE_LENGTH, buffer_num);
-    uart_send("U");
-    uart_send(buffer_str);
+    if(!config_dump.active || arg != config_dump.generation)
+        return;
 
-    buffer_num = get_cell_current(cell_id);
-    str_nitoa(buffer_str, CURRENT_LENGTH, buffer_num);
-    uart_send("I");
-    uart_send(buffer_str);
+    /* never block the main loop in uart_send(), on_update() resumes */
+    if(transmit_queue_free() < DUMP_LINE_LENGTH)
+    {
+        config_dump.waiting = 1;
+        return;
+    }
+    config_dump.progressed = 1;
 
-    buffer_num = get_cell_temperature(cell_id);
-    str_nitoa(buffer_str, TEMPERATURE_LENGTH, buffer_num);
-    uart_send("T");
-    uart_send(buffer_str);
+    /* skip cells that haven't changed (wrap-around safe comparison) */
+    cell_id = config_dump.cursor;
+    do
+    {
+        cell_id = model_cell_find_next(cell_id, &params, &version);
+    } while(cell_id && cell_id <= config_dump.last &&
+            config_dump.changed_only &&
+            (short)(version - config_dump.since) <= 0);
 
-    buffer_num = get_cell_exposure(cell_id);
-    str_nitoa(buffer_str, EXPOSURE_LENGTH, buffer_num);
-    uart_send("E");
-    uart_send(buffer_str);
+    if(cell_id == 0 || cell_id > config_dump.last)
+    {
+        send_unsigned("dv", config_dump.version);
+        uart_send("\n");
+        config_dump.active = 0;
+        return;
+    }
+
+    send_cell_config(cell_id, &params);
+    config_dump.cursor = cell_id;
+
+    /* one cell per dispatch, so other events get their turn in between */
+    event_post(EVENT_UART_DUMP_NEXT, config_dump.generation);
 }
 
-static void send_measurements(void)
+static void start_config_dump(void)
 {
-    char buffer_str[7];
-    short buffer_num;
+    unsigned char first = state_data.config_dump.first;
+
+    config_dump.cursor = (first ? first - 1 : 0);
+    config_dump.last = state_data.config_dump.last;
+    config_dump.since = state_data.config_dump.since;
+    config_dump.changed_only = (state_data.config_dump.field == 2);
+    config_dump.version = model_get_version();
+    config_dump.waiting = 0;
+    config_dump.active = 1;
+
+    reply_begin();
+    uart_send("d");
+    reply_end();
+
+    /* the event of an already running dump is stale from here on */
+    event_post(EVENT_UART_DUMP_NEXT, ++config_dump.generation);
+}
 
-    buffer_num = convert_milli(buck_get_voltage());
-    str_nitoa(buffer_str, VOLTAGE_LENGTH, buffer_num);
-    uart_send("U");
-    uart_send(buffer_str);
+static void send_sweep_points(void)
+{
+    unsigned char count;
 
-    buffer_num = convert_milli(buck_get_current());
-    str_nitoa(buffer_str, CURRENT_LENGTH, buffer_num);
-    uart_send("I");
-    uart_send(buffer_str);
+    for(count = 0; count != SWEEP_POINTS_PER_UPDATE; ++count)
+    {
+        _Q16 current, voltage;
+
+        if(!sweep.running)
+            return;
+        /* never block the main loop in uart_send() */
+        if(transmit_queue_free() < SWEEP_LINE_LENGTH)
+            return;
+
+        current = (_Q16)((long)sweep.max_current * sweep.next /
+                         (sweep.points - 1));
+        voltage = model_calc_panel_voltage(current);
+
+        send_unsigned("p", sweep.next);
+        send_number("I", convert_milli(current));
+        /* convert_milli() overflows above 32V. Shifting first keeps
+         * everything up to 65V within 32 bits. */
+        send_unsigned("U",
+            (unsigned short)(((unsigned long)voltage >> 4) * 1000 >> 12));
+        uart_send("\n");
+
+        if(++sweep.next == sweep.points)
+            sweep.running = 0;
+    }
 }
+
 /* -------------------------------------------------------------------------- */
-static void process_incoming_data(unsigned int data)
+static void start_transient_upload(unsigned int arg)
 {
+    transient_upload.running = 1;
+    transient_upload.header_sent = 0;
+    transient_upload.next = 0;
+}
 
-#define CHAR_TO_INT(x) ((unsigned short)(x - '0'))
-    
-    switch (state)
+/* -------------------------------------------------------------------------- */
+static void send_transient_samples(void)
+{
+    unsigned char count;
+
+    for(count = 0; count != SWEEP_POINTS_PER_UPDATE; ++count)
     {
-        case STATE_IDLE:
-            led_all(0);
-            if (data == CASE_SELECT_CELL)
-            {
-                init_state_vars_config();
-                state = STATE_SELECT_CELL;
-            } else if (data == CASE_REMOVE_CELL) {
-                init_state_vars_config();
-                state = STATE_REMOVE_CELL;
-            } else if (data == CASE_ADD_CELL) {
-                init_state_vars_config();
-                state = STATE_ADD_CELL;
-            } else if (data == CASE_DUMP_CONFIG) {
-                state = STATE_GET_CONFIG_DUMP;
-            } else if (data == CASE_GET_MEASUREMENTS) {
-                state = STATE_GET_MEASUREMENTS;
-            }
-            break;
+        _Q16 voltage, current;
 
-        case STATE_SELECT_CELL:
-            if (is_number(data))
-            {
-                /* Process multi-digit cell numbers */
-                state_data.config_cell.selected_cell *= 10;
-                state_data.config_cell.selected_cell += CHAR_TO_INT(data);
+        if(!transient_upload.running)
+            return;
+        /* never block the main loop in uart_send() */
+        if(transmit_queue_free() < TRANSIENT_LINE_LENGTH)
+            return;
 
-                /*
-                 * Indicate if last char received was a digit or not.
-                 */
-                state_data.config_cell.was_digit = 1;
-            } else if (state_data.config_cell.was_digit == 0) {
-                /*
-                 * Letter directly followed by another letter: error,
-                 * revert back to idle state
-                 */
-                state = STATE_IDLE;
-            } else {
-                state = STATE_AWAIT_CELL_CONFIG;
-            }
-            break;
+        if(!transient_upload.header_sent)
+        {
+            send_unsigned("qh", buck_transient_get_length());
+            send_unsigned(",", buck_transient_get_trigger());
+            send_unsigned(",", buck_get_sample_rate());
+            uart_send("\n");
+            transient_upload.header_sent = 1;
+            continue;
+        }
 
-        case STATE_AWAIT_CELL_CONFIG:
-            /*
-             * We can configure current, voltage, temp or exposure. Anything
-             * else is an error and results in reverting back to idle state.
-             */
-            switch (data)
-            {
-                case 'I':
-                    state_data.config_cell.was_digit = 0;
-                    state_data.config_cell.param.current = 0;
+        if(transient_upload.next == buck_transient_get_length())
+        {
+            uart_send("qe\n");
+            buck_transient_release();
+            transient_upload.running = 0;
+            return;
+        }
 
-                    state = STATE_CONFIG_SHORT_CIRCUIT_CURRENT;
-                    break;
+        buck_transient_get_sample(transient_upload.next, &voltage, &current);
+        send_unsigned("q", transient_upload.next);
+        /* same as the sweep, see send_sweep_points() */
+        if(voltage < 0)
+            voltage = 0;
+        send_unsigned("U",
+            (unsigned short)(((unsigned long)voltage >> 4) * 1000 >> 12));
+        send_number("I", convert_milli(current));
+        uart_send("\n");
+
+        ++transient_upload.next;
+    }
+}
 
-                case 'U':
-                    state_data.config_cell.was_digit = 0;
-                    state_data.config_cell.param.voltage = 0;
-                    state = STATE_CONFIG_OPEN_CIRCUIT_VOLTAGE;
-                    break;
+/* -------------------------------------------------------------------------- */
+static void send_measurements(const struct buck_stats_t* stats)
+{
+    send_number("U", convert_milli(stats->voltage.mean));
+    send_number("I", convert_milli(stats->current.mean));
+    uart_send("P");
+    str_put_q16(&uart_sink, stats->power, 0, 3);
+    uart_send("E");
+    str_put_q16(&uart_sink, stats->energy, 0, 3);
+}
 
-                case 'T':
-                    state_data.config_cell.was_digit = 0;
-                    state_data.config_cell.param.temperature = 0;
-                    state = STATE_CONFIG_TEMPERATURE;
-                    break;
+static void send_measurement_details(const struct buck_stats_t* stats)
+{
+    send_number("R", convert_milli(stats->voltage.ripple));
+    send_number(",", convert_milli(stats->current.ripple));
+    send_number("L", convert_milli(stats->voltage.min));
+    send_number(",", convert_milli(stats->current.min));
+    send_number("H", convert_milli(stats->voltage.max));
+    send_number(",", convert_milli(stats->current.max));
+}
 
-                case 'E':
-                    state_data.config_cell.was_digit = 0;
-                    state_data.config_cell.param.exposure = 0;
-                    state = STATE_CONFIG_EXPOSURE;
-                    break;
+/* -------------------------------------------------------------------------- */
+static void send_telemetry(void)
+{
+    struct buck_stats_t stats;
 
-                default:
-                    state = STATE_IDLE;
-                    break;
-            }
-            break;
+    if(!telemetry.interval)
+        return;
+    /* never block the main loop in uart_send() */
+    if(transmit_queue_free() < TELEMETRY_LINE_LENGTH)
+        return;
 
-        case STATE_CONFIG_OPEN_CIRCUIT_VOLTAGE:
-            if (is_number(data))
-            {
-                /* Process multi-digit cell numbers */
-                state_data.config_cell.param.voltage *= 10;
-                state_data.config_cell.param.voltage += CHAR_TO_INT(data);
+    buck_get_stats(&stats);
+    if((unsigned short)(stats.window - telemetry.last_window) <
+       telemetry.interval)
+        return;
+    telemetry.last_window = stats.window;
 
-                state_data.config_cell.was_digit = 1;
-            } else {
+    uart_send("m");
+    send_measurements(&stats);
+    uart_send("\n");
+}
+/* -------------------------------------------------------------------------- */
+static void store_regulator_field(void)
+{
+    if(!state_data.regulator.was_digit)
+        return;
+
+    if(state_data.regulator.field == 'E')
+        state_data.regulator.enable = (state_data.regulator.value != 0);
+    else if(state_data.regulator.field == 'P')
+        state_data.regulator.kp = state_data.regulator.value;
+    else if(state_data.regulator.field == 'I')
+        state_data.regulator.ki = state_data.regulator.value;
+    else if(state_data.regulator.field == 'S')
+        state_data.regulator.slew_rate = state_data.regulator.value;
+
+    state_data.regulator.was_digit = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void apply_regulator_settings(void)
+{
+    buck_regulator_set_gains(
+        ((_Q16)state_data.regulator.kp << 16) / 1000,
+        ((_Q16)state_data.regulator.ki << 16) / 1000);
+    buck_regulator_enable(state_data.regulator.enable);
+    buck_set_slew_rate(((_Q16)state_data.regulator.slew_rate << 16) / 1000);
+
+    reply_begin();
+    uart_send("gE");
+    uart_send(buck_regulator_is_enabled() ? "1" : "0");
+    send_number("P", round_milli(buck_regulator_get_kp()));
+    send_number("I", round_milli(buck_regulator_get_ki()));
+    send_number("S", round_milli(buck_get_slew_rate()));
+    reply_end();
+}
+
+/* -------------------------------------------------------------------------- */
+static void send_boot_times(void)
+{
+    char buffer_str[BUFFER_LENGTH];
+    unsigned char phase;
+    uint32_t time;
+    unsigned short fraction;
+
+    uart_send("u");
+    for(phase = 0; phase != BOOT_PHASE_COUNT; ++phase)
+    {
+        if(phase)
+            uart_send(",");
+        time = boot_get_time((boot_phase_e)phase);
+        if(time == BOOT_TIME_PENDING)
+        {
+            uart_send("-");
+            continue;
+        }
+
+        time = time < 65535000UL ? time : 65535000UL;
+        send_unsigned("", (unsigned short)(time / 1000));
+        fraction = (unsigned short)(time % 1000);
+        str_nutoa(buffer_str, BUFFER_LENGTH - 1, fraction + 1000);
+        buffer_str[0] = '.';     /* zero padded, "1042" becomes ".042" */
+        uart_send(buffer_str);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* The whole range of the field, 65535 would overflow a shifted _Q16 */
+static _Q16 milli_to_q16(unsigned int value)
+{
+    return (_Q16)(((unsigned long)value << 16) / 1000);
+}
+
+/* -------------------------------------------------------------------------- */
+static void run_calibration_command(void)
+{
+    struct buck_calibration_t coefficients;
+    unsigned int value = state_data.calibration.value;
+
+    reply_begin();
+    switch(state_data.calibration.command)
+    {
+        case 'U':
+            send_unsigned("xU", calibration_add_voltage_point(
+                milli_to_q16(value)));
+            break;
+        case 'I':
+            send_unsigned("xI", calibration_add_current_point(
+                milli_to_q16(value)));
+            break;
+        case 'a':
+            uart_send(calibration_apply() ? "xa1" : "xa0");
+            break;
+        case 'w':
+            uart_send(calibration_save() ? "xw1" : "xw0");
+            break;
+        case 'r':
+            calibration_reset();
+            uart_send("xr");
+            break;
+        default:
+            buck_get_calibration(&coefficients);
+            send_unsigned("xU", coefficients.voltage_offset);
+            send_unsigned(",", coefficients.voltage_gain);
+            send_unsigned("I", coefficients.current_offset);
+            send_unsigned(",", coefficients.current_gain);
+            break;
+    }
+    reply_end();
+}
+
+/* -------------------------------------------------------------------------- */
+static void run_transient_command(void)
+{
+    unsigned char pre_trigger;
+
+    reply_begin();
+    switch(state_data.transient.command)
+    {
+        case 'a':
+            pre_trigger = state_data.transient.pre_trigger < BUCK_TRANSIENT_DEPTH ?
+                    state_data.transient.pre_trigger : BUCK_TRANSIENT_DEPTH - 1;
+            transient_upload.running = 0;
+            buck_transient_arm(pre_trigger,
+                ((_Q16)state_data.transient.threshold << 16) / 1000);
+            send_unsigned("ta", pre_trigger);
+            break;
+        case 't':
+            buck_transient_trigger();
+            uart_send("tt");
+            break;
+        case 'r':
+            transient_upload.running = 0;
+            buck_transient_release();
+            uart_send("tr");
+            break;
+        default:
+            send_unsigned("t", buck_transient_get_state());
+            break;
+    }
+    reply_end();
+}
+
+/* -------------------------------------------------------------------------- */
+static void store_profile_field(void)
+{
+    unsigned char field = state_data.profile.field;
+    unsigned int value = state_data.profile.value;
+
+    if(field == 0)
+        state_data.profile.keyframe.dt = value;
+    else if(field == 1)
+        state_data.profile.keyframe.g = value;
+    else if(state_data.profile.was_digit && field - 2 < PROFILE_CELLS)
+    {
+        state_data.profile.keyframe.cell_g[field - 2] = value;
+        state_data.profile.keyframe.mask |= 1 << (field - 2);
+    }
+
+    state_data.profile.value = 0;
+    state_data.profile.was_digit = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void run_profile_command(void)
+{
+    reply_begin();
+    switch(state_data.profile.command)
+    {
+        case 'k':
+            if(profile_push(&state_data.profile.keyframe))
+                send_unsigned("ik", profile_get_free());
+            else
+                uart_send("if");
+            break;
+        case 'r':
+            uart_send(profile_start() ? "ir1" : "ir0");
+            break;
+        case 's':
+            profile_stop();
+            uart_send("is");
+            break;
+        default:
+            send_unsigned("i", profile_is_running());
+            send_unsigned(",", profile_get_free());
+            break;
+    }
+    reply_end();
+}
+
+/* -------------------------------------------------------------------------- */
+static uint16_t crc16(uint16_t crc, uint16_t word)
+{
+    unsigned char bit;
+
+    crc ^= (word & 0xFF) << 8;
+    for(bit = 0; bit != 16; ++bit)
+    {
+        if(bit == 8)
+            crc ^= word & 0xFF00;
+        if(crc & 0x8000)
+            crc = (uint16_t)(crc << 1) ^ 0x1021;
+        else
+            crc = (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char hex_digit(unsigned int data)
+{
+    if(is_number(data))
+        return data - '0';
+    if(data >= 'A' && data <= 'F')
+        return data - 'A' + 10;
+    if(data >= 'a' && data <= 'f')
+        return data - 'a' + 10;
+    return 16;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char panels_db_block_is_intact(void)
+{
+    uint16_t crc = crc16(0xFFFF, state_data.panels_db.numbers[0]);
+    unsigned char i;
+
+    if(state_data.panels_db.count > PANELS_DB_BLOCK_WORDS ||
+       state_data.panels_db.digits)
+        return 0;
+
+    for(i = 0; i != state_data.panels_db.count; ++i)
+        crc = crc16(crc, state_data.panels_db.words[i]);
+    return crc == state_data.panels_db.numbers[2];
+}
+
+/* -------------------------------------------------------------------------- */
+static void run_panels_db_command(void)
+{
+    uint16_t received, length, checksum;
+
+    reply_begin();
+    switch(state_data.panels_db.command)
+    {
+        case 'b':
+            uart_send(panels_db_upload_begin(state_data.panels_db.numbers[0],
+                                             state_data.panels_db.numbers[1]) ?
+                      "fb1" : "fb0");
+            break;
+        case 'w':
+            if(panels_db_block_is_intact())
+                panels_db_upload_write(state_data.panels_db.numbers[0],
+                                       state_data.panels_db.words,
+                                       state_data.panels_db.count);
+            panels_db_upload_get_state(&received, &length, &checksum);
+            send_unsigned("fw", received);
+            break;
+        case 'c':
+            uart_send(panels_db_upload_end() ? "fc1" : "fc0");
+            break;
+        default:
+            panels_db_upload_get_state(&received, &length, &checksum);
+            send_unsigned("f", received);
+            send_unsigned(",", length);
+            send_unsigned(",", checksum);
+            break;
+    }
+    reply_end();
+}
+
+/* -------------------------------------------------------------------------- */
+static void reply_begin(void)
+{
+    if(!sequence.active)
+        return;
+
+    send_unsigned("#", sequence.number);
+}
+
+/* -------------------------------------------------------------------------- */
+static void reply_end(void)
+{
+    if(!sequence.active)
+        return;
+
+    uart_send("\n");
+    sequence.replied = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+static void finish_command(void)
+{
+    /*
+     * Every state leaves towards STATE_IDLE when it sees a non-digit, most
+     * commands only take effect at that point (e.g. "c2U4000" sets the
+     * voltage once the next character arrives).
+     */
+    while(state != STATE_IDLE)
+        process_command(CASE_END_OF_COMMAND);
+
+    if(sequence.active && !sequence.replied)
+    {
+        reply_begin();
+        reply_end();
+    }
+    sequence.active = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void process_incoming_data(unsigned int data)
+{
+    /*
+     * A new sequence number or a newline ends whatever command is in
+     * progress, so the host can pipeline commands back to back.
+     */
+    if(data == CASE_SEQUENCE_NUMBER || data == CASE_END_OF_COMMAND)
+    {
+        finish_command();
+        if(data == CASE_SEQUENCE_NUMBER)
+        {
+            sequence.number = 0;
+            sequence.active = 1;
+            sequence.replied = 0;
+            state = STATE_SEQUENCE_NUMBER;
+        }
+        return;
+    }
+
+    process_command(data);
+}
+
+/* -------------------------------------------------------------------------- */
+static void process_command(unsigned int data)
+{
+
+#define CHAR_TO_INT(x) ((unsigned short)(x - '0'))
+    
+    switch (state)
+    {
+        case STATE_IDLE:
+            led_all(0);
+            if (data == CASE_SELECT_CELL)
+            {
+                init_state_vars_config();
+                state = STATE_SELECT_CELL;
+            } else if (data == CASE_REMOVE_CELL) {
+                init_state_vars_config();
+                state = STATE_REMOVE_CELL;
+            } else if (data == CASE_ADD_CELL) {
+                init_state_vars_config();
+                state = STATE_ADD_CELL;
+            } else if (data == CASE_DUMP_CONFIG) {
+                state_data.config_dump.first = 0;
+                state_data.config_dump.last = 255;
+                state_data.config_dump.since = 0;
+                state_data.config_dump.field = 0;
+                state_data.config_dump.was_digit = 0;
+                state = STATE_GET_CONFIG_DUMP;
+            } else if (data == CASE_GET_MEASUREMENTS) {
+                state_data.measurements.interval = 0;
+                state_data.measurements.was_digit = 0;
+                state = STATE_GET_MEASUREMENTS;
+            } else if (data == CASE_SET_BAUD_RATE) {
+                state_data.baud_rate.index = 0;
+                state_data.baud_rate.was_digit = 0;
+                state = STATE_SET_BAUD_RATE;
+            } else if (data == CASE_START_SWEEP) {
+                state_data.sweep.points = 0;
+                state_data.sweep.was_digit = 0;
+                state = STATE_START_SWEEP;
+            } else if (data == CASE_CALIBRATE) {
+                state_data.calibration.value = 0;
+                state_data.calibration.command = 0;
+                state = STATE_CALIBRATE;
+            } else if (data == CASE_TRANSIENT) {
+                state_data.transient.pre_trigger = 0;
+                state_data.transient.threshold = 0;
+                state_data.transient.command = 0;
+                state_data.transient.field = 0;
+                state = STATE_TRANSIENT;
+            } else if (data == CASE_PROFILE) {
+                state_data.profile.keyframe.dt = 0;
+                state_data.profile.keyframe.g = 0;
+                state_data.profile.keyframe.mask = 0;
+                state_data.profile.value = 0;
+                state_data.profile.field = 0;
+                state_data.profile.command = 0;
+                state_data.profile.was_digit = 0;
+                state = STATE_PROFILE;
+            } else if (data == CASE_PANELS_DB) {
+                state_data.panels_db.numbers[0] = 0;
+                state_data.panels_db.numbers[1] = 0;
+                state_data.panels_db.numbers[2] = 0;
+                state_data.panels_db.value = 0;
+                state_data.panels_db.count = 0;
+                state_data.panels_db.digits = 0;
+                state_data.panels_db.field = 0;
+                state_data.panels_db.command = 0;
+                state = STATE_PANELS_DB;
+            } else if (data == CASE_SET_REGULATOR) {
+                state_data.regulator.value = 0;
+                state_data.regulator.kp = round_milli(buck_regulator_get_kp());
+                state_data.regulator.ki = round_milli(buck_regulator_get_ki());
+                state_data.regulator.slew_rate = round_milli(buck_get_slew_rate());
+                state_data.regulator.enable = buck_regulator_is_enabled();
+                state_data.regulator.field = 0;
+                state_data.regulator.was_digit = 0;
+                state = STATE_SET_REGULATOR;
+            } else if (data == CASE_CONFIRM) {
+                /* confirms a newly negotiated baud rate, acts as ping
+                 * otherwise */
+                if(baud_rate.timeout)
+                {
+                    baud_rate.committed = baud_rate.active;
+                    baud_rate.timeout = 0;
+                }
+                reply_begin();
+                uart_send("k");
+                reply_end();
+            } else if (data == CASE_BOOT_TIMES) {
+                reply_begin();
+                send_boot_times();
+                reply_end();
+            } else if (data == CASE_LCD_TRAFFIC) {
+                unsigned short transactions, bytes;
+                lcd_get_traffic(&transactions, &bytes);
+                reply_begin();
+                send_unsigned("l", transactions);
+                send_unsigned(",", bytes);
+                reply_end();
+            }
+            break;
+
+        case STATE_SELECT_CELL:
+            if (is_number(data))
+            {
+                /* Process multi-digit cell numbers */
+                state_data.config_cell.selected_cell *= 10;
+                state_data.config_cell.selected_cell += CHAR_TO_INT(data);
+
+                /*
+                 * Indicate if last char received was a digit or not.
+                 */
+                state_data.config_cell.was_digit = 1;
+            } else if (state_data.config_cell.was_digit == 0) {
+                /*
+                 * Letter directly followed by another letter: error,
+                 * revert back to idle state
+                 */
+                state = STATE_IDLE;
+            } else {
+                state = STATE_AWAIT_CELL_CONFIG;
+            }
+            break;
+
+        case STATE_AWAIT_CELL_CONFIG:
+            /*
+             * We can configure current, voltage, temp or exposure. Anything
+             * else is an error and results in reverting back to idle state.
+             */
+            switch (data)
+            {
+                case 'I':
+                    state_data.config_cell.was_digit = 0;
+                    state_data.config_cell.param.current = 0;
+
+                    state = STATE_CONFIG_SHORT_CIRCUIT_CURRENT;
+                    break;
+
+                case 'U':
+                    state_data.config_cell.was_digit = 0;
+                    state_data.config_cell.param.voltage = 0;
+                    state = STATE_CONFIG_OPEN_CIRCUIT_VOLTAGE;
+                    break;
+
+                case 'T':
+                    state_data.config_cell.was_digit = 0;
+                    state_data.config_cell.param.temperature = 0;
+                    state = STATE_CONFIG_TEMPERATURE;
+                    break;
+
+                case 'E':
+                    state_data.config_cell.was_digit = 0;
+                    state_data.config_cell.param.exposure = 0;
+                    state = STATE_CONFIG_EXPOSURE;
+                    break;
+
+                default:
+                    state = STATE_IDLE;
+                    break;
+            }
+            break;
+
+        case STATE_CONFIG_OPEN_CIRCUIT_VOLTAGE:
+            if (is_number(data))
+            {
+                /* Process multi-digit cell numbers */
+                state_data.config_cell.param.voltage *= 10;
+                state_data.config_cell.param.voltage += CHAR_TO_INT(data);
+
+                state_data.config_cell.was_digit = 1;
+            } else {
                 _Q16 voltage = state_data.config_cell.param.voltage / 1000
                     * (((unsigned long)2)<<16)
                     | state_data.config_cell.param.voltage % 1000;
@@ -495,10 +1512,12 @@ static void process_incoming_data(unsigned int data)
                  */
                 state = STATE_IDLE;
             } else {
+                reply_begin();
                 if (model_cell_remove(state_data.config_cell.selected_cell))
                     uart_send("r1");
                 else
                     uart_send("r0");
+                reply_end();
                 state = STATE_IDLE;
             }
             break;
@@ -531,23 +1550,280 @@ static void process_incoming_data(unsigned int data)
             state = STATE_AWAIT_CELL_CONFIG;
             break;
 
-        case STATE_GET_CONFIG_DUMP:
-            uart_send("d");
-            for (
-                state_data.config_dump.selected_cell = model_cell_begin_iteration();
-                state_data.config_dump.selected_cell != 0;
-                state_data.config_dump.selected_cell = model_cell_get_next())
+        case STATE_GET_CONFIG_DUMP:
+            /* field 0: first ID, 1: last ID, 2: version */
+            if (is_number(data))
+            {
+                unsigned int digit = CHAR_TO_INT(data);
+                if (state_data.config_dump.field == 0)
+                {
+                    state_data.config_dump.first *= 10;
+                    state_data.config_dump.first += digit;
+                    state_data.config_dump.last = state_data.config_dump.first;
+                } else if (state_data.config_dump.field == 1) {
+                    state_data.config_dump.last *= 10;
+                    state_data.config_dump.last += digit;
+                } else {
+                    state_data.config_dump.since *= 10;
+                    state_data.config_dump.since += digit;
+                }
+                state_data.config_dump.was_digit = 1;
+            } else if (data == '-' && state_data.config_dump.field == 0) {
+                state_data.config_dump.field = 1;
+                state_data.config_dump.last = 0;
+                state_data.config_dump.was_digit = 0;
+            } else if (data == 'v') {
+                /* "d<a>-v..." means a and up */
+                if (state_data.config_dump.field == 1 &&
+                    !state_data.config_dump.was_digit)
+                    state_data.config_dump.last = 255;
+                state_data.config_dump.field = 2;
+            } else {
+                if (state_data.config_dump.field == 1 &&
+                    !state_data.config_dump.was_digit)
+                    state_data.config_dump.last = 255;
+                start_config_dump();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_GET_MEASUREMENTS:
+            if (is_number(data))
+            {
+                unsigned long interval =
+                        state_data.measurements.interval * 10UL +
+                        CHAR_TO_INT(data);
+                state_data.measurements.interval =
+                        interval > TELEMETRY_MAX_INTERVAL ?
+                        TELEMETRY_MAX_INTERVAL : (unsigned int)interval;
+                state_data.measurements.was_digit = 1;
+            } else {
+                struct buck_stats_t stats;
+
+                buck_get_stats(&stats);
+                if (state_data.measurements.was_digit)
+                {
+                    telemetry.interval = state_data.measurements.interval;
+                    telemetry.last_window = stats.window;
+                }
+                reply_begin();
+                uart_send("m");
+                send_measurements(&stats);
+                send_measurement_details(&stats);
+                reply_end();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_SET_BAUD_RATE:
+            if (is_number(data))
+            {
+                state_data.baud_rate.index *= 10;
+                state_data.baud_rate.index += CHAR_TO_INT(data);
+                state_data.baud_rate.was_digit = 1;
+            } else {
+                unsigned char index = baud_rate.active;
+
+                /*
+                 * Reply with the index the device will be using. Unknown
+                 * rates are answered with the current rate and are ignored.
+                 */
+                if (state_data.baud_rate.was_digit &&
+                    state_data.baud_rate.index < BAUD_COUNT)
+                {
+                    baud_rate.pending = state_data.baud_rate.index;
+                    baud_rate.switch_requested = 1;
+                    index = baud_rate.pending;
+                }
+                reply_begin();
+                send_unsigned("b", index);
+                reply_end();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_START_SWEEP:
+            if (is_number(data))
+            {
+                /* keep counting past 255 so it can be rejected below */
+                if(state_data.sweep.points < 1000)
+                {
+                    state_data.sweep.points *= 10;
+                    state_data.sweep.points += CHAR_TO_INT(data);
+                }
+                state_data.sweep.was_digit = 1;
+            } else {
+                unsigned char accepted = 0;
+
+                sweep.max_current = model_get_panel_short_circuit_current();
+                if (state_data.sweep.was_digit &&
+                    state_data.sweep.points >= 2 &&
+                    state_data.sweep.points <= 255 &&
+                    sweep.max_current > 0 &&
+                    !sweep.running)
+                {
+                    sweep.points = state_data.sweep.points;
+                    sweep.next = 0;
+                    sweep.running = 1;
+                    accepted = sweep.points;
+                }
+                reply_begin();
+                send_unsigned("s", accepted);
+                reply_end();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_SET_REGULATOR:
+            if (is_number(data) && state_data.regulator.field)
+            {
+                if(state_data.regulator.value <= REGULATOR_MAX_GAIN / 10)
+                {
+                    state_data.regulator.value *= 10;
+                    state_data.regulator.value += CHAR_TO_INT(data);
+                } else {
+                    state_data.regulator.value = REGULATOR_MAX_GAIN;
+                }
+                state_data.regulator.was_digit = 1;
+            } else if (data == 'E' || data == 'P' || data == 'I' ||
+                       data == 'S') {
+                store_regulator_field();
+                state_data.regulator.field = data;
+                state_data.regulator.value = 0;
+            } else {
+                store_regulator_field();
+                apply_regulator_settings();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_CALIBRATE:
+            if (state_data.calibration.command == 0 &&
+                (data == 'U' || data == 'I' || data == 'a' ||
+                 data == 'w' || data == 'r'))
             {
-                uart_send("c");
-                send_cell_config(state_data.config_dump.selected_cell);
+                state_data.calibration.command = data;
+            } else if (is_number(data) &&
+                       (state_data.calibration.command == 'U' ||
+                        state_data.calibration.command == 'I')) {
+                state_data.calibration.value *= 10;
+                state_data.calibration.value += CHAR_TO_INT(data);
+            } else {
+                run_calibration_command();
+                state = STATE_IDLE;
             }
-            state = STATE_IDLE;
             break;
 
-        case STATE_GET_MEASUREMENTS:
-            uart_send("m");
-            send_measurements();
-            state = STATE_IDLE;
+        case STATE_TRANSIENT:
+            if (state_data.transient.command == 0 &&
+                (data == 'a' || data == 't' || data == 'r'))
+            {
+                state_data.transient.command = data;
+            } else if (state_data.transient.command == 'a' &&
+                       state_data.transient.field == 0 && data == 'D') {
+                state_data.transient.field = data;
+            } else if (is_number(data) &&
+                       state_data.transient.command == 'a') {
+                /* both are clamped later, just don't let them overflow */
+                if (state_data.transient.field == 0 &&
+                    state_data.transient.pre_trigger < 1000)
+                {
+                    state_data.transient.pre_trigger *= 10;
+                    state_data.transient.pre_trigger += CHAR_TO_INT(data);
+                } else if (state_data.transient.field == 'D' &&
+                           state_data.transient.threshold < 6000) {
+                    state_data.transient.threshold *= 10;
+                    state_data.transient.threshold += CHAR_TO_INT(data);
+                }
+            } else {
+                run_transient_command();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_PROFILE:
+            if (state_data.profile.command == 0 &&
+                (data == 'r' || data == 's'))
+            {
+                state_data.profile.command = data;
+            } else if (is_number(data) &&
+                       (state_data.profile.command == 0 ||
+                        state_data.profile.command == 'k')) {
+                state_data.profile.command = 'k';
+                if(state_data.profile.value <= PROFILE_MAX_VALUE / 10)
+                {
+                    state_data.profile.value *= 10;
+                    state_data.profile.value += CHAR_TO_INT(data);
+                } else {
+                    state_data.profile.value = PROFILE_MAX_VALUE;
+                }
+                state_data.profile.was_digit = 1;
+            } else if (state_data.profile.command == 'k' &&
+                       ((data == 'G' && state_data.profile.field == 0) ||
+                        (data == ',' && state_data.profile.field != 0))) {
+                store_profile_field();
+                ++state_data.profile.field;
+            } else {
+                if(state_data.profile.command == 'k')
+                    store_profile_field();
+                run_profile_command();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_PANELS_DB:
+            if (state_data.panels_db.command == 0 &&
+                (data == 'b' || data == 'w' || data == 'c'))
+            {
+                state_data.panels_db.command = data;
+            } else if (state_data.panels_db.command == 'w' &&
+                       state_data.panels_db.field == 1 &&
+                       hex_digit(data) < 16) {
+                /* words beyond the block are only counted, see below */
+                unsigned char count = state_data.panels_db.count;
+                if(count < PANELS_DB_BLOCK_WORDS)
+                    state_data.panels_db.words[count] =
+                        (state_data.panels_db.digits ?
+                         state_data.panels_db.words[count] << 4 : 0) |
+                        hex_digit(data);
+                if(++state_data.panels_db.digits == 4)
+                {
+                    state_data.panels_db.digits = 0;
+                    if(count <= PANELS_DB_BLOCK_WORDS)
+                        ++state_data.panels_db.count;
+                }
+            } else if (is_number(data) && state_data.panels_db.command != 0) {
+                if(state_data.panels_db.value <= PANELS_DB_MAX_VALUE / 10)
+                {
+                    state_data.panels_db.value *= 10;
+                    state_data.panels_db.value += CHAR_TO_INT(data);
+                } else {
+                    state_data.panels_db.value = PANELS_DB_MAX_VALUE;
+                }
+            } else if (data == ',' && state_data.panels_db.command != 0 &&
+                       state_data.panels_db.field < 2) {
+                state_data.panels_db.numbers[state_data.panels_db.field++] =
+                    state_data.panels_db.value;
+                state_data.panels_db.value = 0;
+            } else {
+                state_data.panels_db.numbers[state_data.panels_db.field] =
+                    state_data.panels_db.value;
+                run_panels_db_command();
+                state = STATE_IDLE;
+            }
+            break;
+
+        case STATE_SEQUENCE_NUMBER:
+            if (is_number(data))
+            {
+                sequence.number *= 10;
+                sequence.number += CHAR_TO_INT(data);
+            } else {
+                /* first character of the actual command */
+                state = STATE_IDLE;
+                process_command(data);
+                return;
+            }
             break;
 
         default:
@@ -568,7 +1844,6 @@ static void process_incoming_data(unsigned int data)
 /* -------------------------------------------------------------------------- */
 static void send_update_to_frontend(unsigned int arg)
 {
-#define UPDATE_BUFFER_LENGTH 10
     /*
      * When a value for a cell's configuration has been changed on the
      * device itself via the device's menu, that information is sent to
@@ -589,48 +1864,50 @@ static void send_update_to_frontend(unsigned int arg)
      *
      */
     unsigned char cell_id = (arg & 0xFF);
-    char buffer[UPDATE_BUFFER_LENGTH];
-    *buffer='\0';
-
-    str_append(buffer, UPDATE_BUFFER_LENGTH, "dc");
 
-    char numerical_buffer_str[BUFFER_LENGTH];
+    if(!(arg & 0x0F00))
+        return;
 
+    /* same line as a config dump sends, with only the changed value */
+    send_unsigned("dc", cell_id);
     if (arg & 0x0100) {
         /* voltage */
-        str_append(buffer, UPDATE_BUFFER_LENGTH, "U");
-        str_nitoa(numerical_buffer_str, VOLTAGE_LENGTH, get_cell_voltage(cell_id));
-        str_append(buffer, UPDATE_BUFFER_LENGTH, numerical_buffer_str);
+        send_number("U", get_cell_voltage(cell_id));
     } else if (arg & 0x0200) {
         /* current */
-        str_append(buffer, UPDATE_BUFFER_LENGTH, "I");
-        str_nitoa(numerical_buffer_str, CURRENT_LENGTH, get_cell_current(cell_id));
-        str_append(buffer, UPDATE_BUFFER_LENGTH, numerical_buffer_str);
+        send_number("I", get_cell_current(cell_id));
     } else if (arg & 0x0400) {
         /* temperature */
-        str_append(buffer, UPDATE_BUFFER_LENGTH, "T");
-        str_nitoa(numerical_buffer_str, CURRENT_LENGTH, get_cell_temperature(cell_id));
-        str_append(buffer, UPDATE_BUFFER_LENGTH, numerical_buffer_str);
-    } else if (arg & 0x0800) {
+        send_number("T", get_cell_temperature(cell_id));
+    } else {
         /* exposure */
-        str_append(buffer, UPDATE_BUFFER_LENGTH, "E");
-        str_nitoa(numerical_buffer_str, CURRENT_LENGTH, get_cell_exposure(cell_id));
-        str_append(buffer, UPDATE_BUFFER_LENGTH, numerical_buffer_str);
-    } else
-        return
-
-    uart_send(buffer);
+        send_number("E", get_cell_exposure(cell_id));
+    }
+    uart_send("\n");
 }
 
 /* -------------------------------------------------------------------------- */
 void _ISR_NOPSV _U1RXInterrupt(void)
 {
-    /*event_post(EVENT_DATA_RECEIVED, U1RXREG);*/
-    
-    char buf[2];
-    *buf = U1RXREG;
-    buf[1] = '\0';
-    uart_send(buf);
+    /*
+     * Parity and framing errors refer to the byte at the top of the FIFO and
+     * have to be checked before reading it. Bad bytes are dropped and counted,
+     * on_update() falls back to the default baud rate if there are too many.
+     */
+    if(U1STAbits.PERR || U1STAbits.FERR)
+    {
+        (void)U1RXREG;
+        ++rx_errors;
+    } else {
+        event_post(EVENT_DATA_RECEIVED, U1RXREG);
+    }
+
+    /* clearing an overrun resets the receive FIFO */
+    if(U1STAbits.OERR)
+    {
+        U1STAbits.OERR = 0;
+        ++rx_errors;
+    }
 
     /* clear interrupt flag */
     IFS0bits.U1RXIF = 0;
@@ -668,6 +1945,7 @@ static void send_next_byte(void)
 #ifdef TESTING
 
 #include "gmock/gmock.h"
+#include "usr/panels_db_image.h"
 
 using namespace ::testing;
 
@@ -782,6 +2060,683 @@ TEST_F(uart_rx_fss, abort_cell_selection_if_no_number_is_sent)
     EXPECT_THAT(state, Eq(STATE_IDLE));
 }
 
+/* -------------------------------------------------------------------------- */
+/* Lets the acknowledgement leave the TX buffer and runs one 10ms update */
+static void drain_tx_and_update()
+{
+    tx_send_update_send_all();
+    U1STAbits.TRMT = 1;
+    on_update(0);
+}
+
+TEST_F(uart_rx_fss, baud_rate_switches_after_acknowledgement_was_sent)
+{
+    sendString("b3\n");
+
+    EXPECT_THAT(state, Eq(STATE_IDLE));
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[BAUD_DEFAULT]));
+
+    drain_tx_and_update();
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[3]));
+    EXPECT_THAT(U1BRG, Eq(14u)); /* 1 Mbaud */
+}
+
+TEST_F(uart_rx_fss, baud_rate_is_kept_when_host_confirms)
+{
+    sendString("b4\n");
+    drain_tx_and_update();
+    sendString("k");
+
+    for(int i = 0; i != BAUD_CONFIRM_TIMEOUT * 2; ++i)
+        on_update(0);
+
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[4]));
+    EXPECT_THAT(baud_rate.committed, Eq(4));
+}
+
+TEST_F(uart_rx_fss, baud_rate_falls_back_if_host_does_not_confirm)
+{
+    sendString("b4\n");
+    drain_tx_and_update();
+
+    for(int i = 0; i != BAUD_CONFIRM_TIMEOUT; ++i)
+        on_update(0);
+
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[BAUD_DEFAULT]));
+}
+
+TEST_F(uart_rx_fss, invalid_baud_rate_is_ignored)
+{
+    sendString("b9\n");
+    drain_tx_and_update();
+
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[BAUD_DEFAULT]));
+    EXPECT_THAT(baud_rate.switch_requested, Eq(0));
+}
+
+TEST_F(uart_rx_fss, baud_rate_falls_back_on_receive_errors)
+{
+    sendString("b2\n");
+    drain_tx_and_update();
+    sendString("k");
+
+    U1STAbits.FERR = 1;
+    for(int i = 0; i != BAUD_ERROR_THRESHOLD; ++i)
+        _U1RXInterrupt();
+    U1STAbits.FERR = 0;
+    tx_send_update_send_all();
+    U1STAbits.TRMT = 0;
+    on_update(0);
+
+    /* the host is told at the old rate */
+    std::string notice;
+    while(transmit_queue.read != transmit_queue.write)
+    {
+        _U1TXInterrupt();
+        notice += (char)U1TXREG;
+    }
+    EXPECT_THAT(notice, StrEq("#b0\n"));
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[2]));
+
+    drain_tx_and_update();
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[BAUD_DEFAULT]));
+    EXPECT_THAT(baud_rate.committed, Eq(BAUD_DEFAULT));
+
+    /* nothing to confirm, the default rate is kept */
+    for(int i = 0; i != BAUD_CONFIRM_TIMEOUT * 2; ++i)
+        on_update(0);
+    EXPECT_THAT(U1BRG, Eq(baud_brg_table[BAUD_DEFAULT]));
+}
+
+/* -------------------------------------------------------------------------- */
+/* Queues everything that gets sent so replies can be read back in one go */
+static void hold_replies()
+{
+    transmit_queue.read = 0;
+    transmit_queue.write = 0;
+    U1STAbits.TRMT = 0;
+}
+static std::string held_replies()
+{
+    std::string reply;
+    while(transmit_queue.read != transmit_queue.write)
+    {
+        _U1TXInterrupt();
+        reply += (char)U1TXREG;
+    }
+    return reply;
+}
+
+TEST_F(uart_rx_fss, sequenced_command_without_reply_is_acknowledged)
+{
+    hold_replies();
+    sendString("#42c1U4000\n");
+
+    EXPECT_THAT(state, Eq(STATE_IDLE));
+    EXPECT_THAT(held_replies(), StrEq("#42\n"));
+}
+
+TEST_F(uart_rx_fss, sequenced_reply_echoes_sequence_number)
+{
+    hold_replies();
+    sendString("#7k\n");
+
+    EXPECT_THAT(held_replies(), StrEq("#7k\n"));
+}
+
+TEST_F(uart_rx_fss, pipelined_commands_are_answered_in_order)
+{
+    hold_replies();
+    sendString("#1c1U4000#2r9#3k#4\n");
+
+    EXPECT_THAT(state, Eq(STATE_IDLE));
+    EXPECT_THAT(held_replies(), StrEq("#1\n#2r0\n#3k\n#4\n"));
+}
+
+TEST_F(uart_rx_fss, commands_without_sequence_number_are_not_framed)
+{
+    hold_replies();
+    sendString("r9\nk");
+
+    EXPECT_THAT(held_replies(), StrEq("r0k"));
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char add_dump_test_cell()
+{
+    unsigned char id = model_cell_add();
+    model_set_open_circuit_voltage(id, 6 * 65536);
+    model_set_short_circuit_current(id, 3 * 65536);
+    model_set_thermal_voltage(id, 65536);
+    model_set_relative_solar_irradiation(id, 65536);
+    return id;
+}
+static std::string dump_line(unsigned char id)
+{
+    char buf[DUMP_LINE_LENGTH];
+    sprintf(buf, "dc%dU6000I3000T1E10\n", id);
+    return buf;
+}
+static std::string version_line()
+{
+    char buf[DUMP_LINE_LENGTH];
+    sprintf(buf, "dv%d\n", model_get_version());
+    return buf;
+}
+static std::string dispatch_and_collect(int dispatches)
+{
+    std::string reply;
+    while(dispatches--)
+    {
+        event_dispatch_all();
+        reply += held_replies();
+    }
+    return reply;
+}
+
+TEST_F(uart_rx_fss, dump_sends_one_cell_per_dispatch)
+{
+    model_cell_remove_all();
+    unsigned char a = add_dump_test_cell();
+    unsigned char b = add_dump_test_cell();
+
+    hold_replies();
+    sendString("#5d\n");
+    EXPECT_THAT(held_replies(), StrEq("#5d\n"));
+
+    EXPECT_THAT(dispatch_and_collect(1), StrEq(dump_line(a)));
+    EXPECT_THAT(dispatch_and_collect(1), StrEq(dump_line(b)));
+    EXPECT_THAT(dispatch_and_collect(1), StrEq(version_line()));
+    EXPECT_THAT(config_dump.active, Eq(0));
+
+    model_cell_remove_all();
+}
+
+TEST_F(uart_rx_fss, dump_range_of_cells)
+{
+    model_cell_remove_all();
+    unsigned char a = add_dump_test_cell();
+    unsigned char b = add_dump_test_cell();
+    unsigned char c = add_dump_test_cell();
+    add_dump_test_cell();
+
+    char request[16];
+    sprintf(request, "d%d-%d\n", b, c);
+    hold_replies();
+    sendString(request);
+
+    EXPECT_THAT(held_replies() + dispatch_and_collect(10),
+                StrEq("d" + dump_line(b) + dump_line(c) + version_line()));
+
+    sprintf(request, "d%d\n", a);
+    sendString(request);
+    EXPECT_THAT(held_replies() + dispatch_and_collect(10),
+                StrEq("d" + dump_line(a) + version_line()));
+
+    model_cell_remove_all();
+}
+
+TEST_F(uart_rx_fss, dump_only_cells_changed_since_version)
+{
+    model_cell_remove_all();
+    add_dump_test_cell();
+    unsigned char b = add_dump_test_cell();
+    add_dump_test_cell();
+
+    char request[16];
+    sprintf(request, "dv%d\n", model_get_version());
+    model_set_short_circuit_current(b, 2 * 65536);
+
+    hold_replies();
+    sendString(request);
+
+    char expected[DUMP_LINE_LENGTH];
+    sprintf(expected, "dc%dU6000I2000T1E10\n", b);
+    EXPECT_THAT(held_replies() + dispatch_and_collect(10),
+                StrEq("d" + std::string(expected) + version_line()));
+
+    model_cell_remove_all();
+}
+
+TEST_F(uart_rx_fss, dump_waits_for_transmit_queue)
+{
+    model_cell_remove_all();
+    for(int i = 0; i != 10; ++i)
+        add_dump_test_cell();
+
+    hold_replies();
+    sendString("d\n");
+    for(int i = 0; i != 10; ++i)
+        event_dispatch_all();
+
+    /* nothing was drained, so the queue filled up and the dump waits */
+    EXPECT_THAT(config_dump.active, Eq(1));
+    EXPECT_THAT(config_dump.waiting, Eq(1));
+
+    /* update picks it up again after the queue was drained */
+    std::string reply = held_replies();
+    on_update(0);
+    reply += held_replies() + dispatch_and_collect(20);
+    EXPECT_THAT(std::count(reply.begin(), reply.end(), '\n'), Eq(11));
+    EXPECT_THAT(config_dump.active, Eq(0));
+
+    model_cell_remove_all();
+}
+
+TEST_F(uart_rx_fss, dump_resumes_if_its_event_was_dropped)
+{
+    model_cell_remove_all();
+    unsigned char a = add_dump_test_cell();
+    unsigned char b = add_dump_test_cell();
+
+    /* the event queue is full when the dump posts its first event */
+    hold_replies();
+    sendString("d");
+    U1RXREG = '\n';
+    _U1RXInterrupt();
+    for(int i = 0; i != 62; ++i)
+        event_post(EVENT_BUTTON, 0);
+    event_dispatch_all();
+
+    std::string reply = held_replies() + dispatch_and_collect(5);
+    EXPECT_THAT(reply, StrEq("d"));
+    EXPECT_THAT(config_dump.active, Eq(1));
+
+    on_update(0);
+    reply = held_replies() + dispatch_and_collect(5);
+    EXPECT_THAT(reply, StrEq(dump_line(a) + dump_line(b) + version_line()));
+    EXPECT_THAT(config_dump.active, Eq(0));
+
+    /* a dump that is making progress isn't restarted */
+    sendString("d\n");
+    dispatch_and_collect(1);
+    unsigned char generation = config_dump.generation;
+    on_update(0);
+    EXPECT_THAT(config_dump.generation, Eq(generation));
+    reply = dispatch_and_collect(5);
+    EXPECT_THAT(reply, StrEq(dump_line(b) + version_line()));
+
+    model_cell_remove_all();
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(uart_rx_fss, sweep_streams_requested_number_of_points)
+{
+    model_cell_remove_all();
+    unsigned char id = model_cell_add();
+    model_set_open_circuit_voltage(id, 6 * 65536);
+    model_set_short_circuit_current(id, 3 * 65536);
+    model_set_thermal_voltage(id, 65536);
+    model_set_relative_solar_irradiation(id, 65536);
+
+    hold_replies();
+    sendString("#3s10\n");
+    EXPECT_THAT(held_replies(), StrEq("#3s10\n"));
+
+    /* points are sent a few at a time from the update event */
+    std::string points;
+    for(int i = 0; i != 10; ++i)
+    {
+        on_update(0);
+        points += held_replies();
+    }
+    EXPECT_THAT(sweep.running, Eq(0));
+    EXPECT_THAT(std::count(points.begin(), points.end(), '\n'), Eq(10));
+    EXPECT_THAT(points, StartsWith("p0I0U5"));
+    EXPECT_THAT(points, HasSubstr("p9I3000U"));
+
+    model_cell_remove_all();
+}
+
+TEST_F(uart_rx_fss, sweep_is_refused_without_cells)
+{
+    model_cell_remove_all();
+
+    hold_replies();
+    sendString("s10\n");
+    on_update(0);
+
+    EXPECT_THAT(held_replies(), StrEq("s0"));
+}
+
+TEST_F(uart_rx_fss, sweep_never_blocks_on_full_transmit_queue)
+{
+    model_cell_remove_all();
+    unsigned char id = model_cell_add();
+    model_set_open_circuit_voltage(id, 6 * 65536);
+    model_set_short_circuit_current(id, 3 * 65536);
+    model_set_thermal_voltage(id, 65536);
+    model_set_relative_solar_irradiation(id, 65536);
+
+    hold_replies();
+    sendString("s200\n");
+    for(int i = 0; i != 20; ++i)
+        on_update(0);
+
+    /* nothing was drained, so the queue filled up and the sweep waits */
+    EXPECT_THAT(sweep.running, Eq(1));
+    EXPECT_THAT(transmit_queue_free(), Lt(SWEEP_LINE_LENGTH));
+
+    held_replies();
+    sweep.running = 0;
+    model_cell_remove_all();
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(uart_rx_fss, regulator_settings_are_reported)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("g\n");
+
+    EXPECT_THAT(held_replies(), StrEq("gE0P500I10S0"));
+}
+
+TEST_F(uart_rx_fss, regulator_gains_and_enable_are_set)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("#3gE1P1250I2\n");
+
+    EXPECT_THAT(held_replies(), StrEq("#3gE1P1250I2S0\n"));
+    EXPECT_THAT(buck_regulator_is_enabled(), Eq(1));
+    EXPECT_THAT(buck_regulator_get_kp(), Eq(81920));
+    EXPECT_THAT(buck_regulator_get_ki(), Eq(131));
+    buck_regulator_enable(0);
+}
+
+TEST_F(uart_rx_fss, regulator_fields_left_out_are_kept)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("gP2000\n");
+    sendString("gI5\n");
+
+    EXPECT_THAT(held_replies(), StrEq("gE0P2000I10S0gE0P2000I5S0"));
+}
+
+TEST_F(uart_rx_fss, calibration_reports_coefficients)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("#5x\n");
+
+    EXPECT_THAT(held_replies(), StrEq("#5xU0,13520I29792,5280\n"));
+}
+
+TEST_F(uart_rx_fss, calibration_points_are_recorded_and_applied)
+{
+    buck_init();
+    calibration_reset();
+
+    hold_replies();
+    sendString("xI0\n");
+    sendString("xa\n");
+
+    /* the emulated readings are all 0, so that's where 0mA is now */
+    EXPECT_THAT(held_replies(), StrEq("xI1xa1"));
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+    EXPECT_THAT(coefficients.current_offset, Eq(0u));
+
+    sendString("xr\n");
+    held_replies();
+}
+
+TEST_F(uart_rx_fss, calibration_values_cover_the_whole_field)
+{
+    EXPECT_THAT(milli_to_q16(32767), Eq(2147418));
+    EXPECT_THAT(milli_to_q16(32768), Eq(2147483));
+    EXPECT_THAT(milli_to_q16(65535), Eq(4294901));
+}
+
+TEST_F(uart_rx_fss, regulator_gains_are_limited)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("gP99999\n");
+
+    EXPECT_THAT(held_replies(), StrEq("gE0P32767I10S0"));
+}
+
+TEST_F(uart_rx_fss, slew_rate_is_set)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("gS2500\n");
+
+    EXPECT_THAT(held_replies(), StrEq("gE0P500I10S2500"));
+    EXPECT_THAT(buck_get_slew_rate(), Eq(163840));
+    buck_set_slew_rate(0);
+}
+
+/* -------------------------------------------------------------------------- */
+void _ADCAN1Interrupt(void);
+
+TEST_F(uart_rx_fss, boot_times_are_reported)
+{
+    boot_timer_start();
+    TMR3HLD = 0;
+    TMR2 = 3685;
+    boot_mark(BOOT_CLOCK_LOCKED);
+    TMR2 = 3685 + 2520;
+    boot_mark(BOOT_ADC_READY);
+    T2CONbits.TON = 0;
+
+    hold_replies();
+    sendString("u\n");
+
+    EXPECT_THAT(held_replies(), StrEq("u1.000,1.042,-,-,-,-,-"));
+}
+
+TEST_F(uart_rx_fss, lcd_traffic_is_reported)
+{
+    hold_replies();
+    sendString("l\n");
+
+    EXPECT_THAT(held_replies(), MatchesRegex("l[0-9]+,[0-9]+"));
+}
+
+TEST_F(uart_rx_fss, transient_capture_is_armed_and_reported)
+{
+    buck_init();
+
+    hold_replies();
+    sendString("#2ta16D500\n");
+    sendString("t\n");
+    sendString("ta99\n");
+    sendString("tr\n");
+
+    EXPECT_THAT(held_replies(), StrEq("#2ta16\nt2ta31tr"));
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_IDLE));
+}
+
+TEST_F(uart_rx_fss, transient_capture_is_streamed_when_complete)
+{
+    buck_init();
+    ADCBUF0 = BUCK_DEFAULT_CURRENT_OFFSET >> 4;
+    ADCBUF1 = 1000;
+
+    hold_replies();
+    sendString("ta4\n");
+    sendString("tt\n");
+    EXPECT_THAT(held_replies(), StrEq("ta4tt"));
+    for(int i = 0; i != BUCK_TRANSIENT_DEPTH - 4; ++i)
+        _ADCAN1Interrupt();
+    event_dispatch_all();
+
+    std::string samples;
+    for(int i = 0; i != 40; ++i)
+    {
+        on_update(0);
+        samples += held_replies();
+    }
+
+    EXPECT_THAT(samples, StartsWith("qh28,0,4000\nq0U12893I0\n"));
+    EXPECT_THAT(samples, HasSubstr("q27U12893I0\nqe\n"));
+    EXPECT_THAT(std::count(samples.begin(), samples.end(), '\n'), Eq(30));
+    EXPECT_THAT(transient_upload.running, Eq(0));
+    EXPECT_THAT(buck_transient_get_state(), Eq(BUCK_TRANSIENT_IDLE));
+}
+
+/* -------------------------------------------------------------------------- */
+static void convert_window(uint16_t current, uint16_t voltage)
+{
+    ADCBUF0 = current;
+    ADCBUF1 = voltage;
+    for(int i = 0; i != 4; ++i)
+        _ADCAN1Interrupt();
+}
+
+TEST_F(uart_rx_fss, measurements_are_reported_from_window_statistics)
+{
+    buck_init();
+    buck_set_averaging(2);
+    convert_window(BUCK_DEFAULT_CURRENT_OFFSET >> 4, 1000);
+
+    hold_replies();
+    sendString("m\n");
+
+    EXPECT_THAT(held_replies(),
+                StrEq("mU12893I0P0.000E0.000R0,0L12893,0H12893,0"));
+}
+
+TEST_F(uart_rx_fss, measurements_are_streamed_every_n_windows)
+{
+    buck_init();
+    buck_set_averaging(2);
+
+    hold_replies();
+    sendString("m2\n");
+    EXPECT_THAT(held_replies(), StartsWith("mU0I0P0.000E0.000"));
+
+    convert_window(BUCK_DEFAULT_CURRENT_OFFSET >> 4, 1000);
+    on_update(0);
+    EXPECT_THAT(held_replies(), StrEq(""));
+    convert_window((BUCK_DEFAULT_CURRENT_OFFSET >> 4) + 200, 1000);
+    on_update(0);
+    EXPECT_THAT(held_replies(), StrEq("mU12893I1007P12.985E0.000\n"));
+    on_update(0);
+    EXPECT_THAT(held_replies(), StrEq(""));
+
+    sendString("m0\n");
+    held_replies();
+    convert_window(BUCK_DEFAULT_CURRENT_OFFSET >> 4, 1000);
+    convert_window(BUCK_DEFAULT_CURRENT_OFFSET >> 4, 1000);
+    on_update(0);
+    EXPECT_THAT(held_replies(), StrEq(""));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(uart_rx_fss, profile_keyframes_are_pushed_and_played)
+{
+    model_cell_remove_all();
+    unsigned char first = model_cell_add();
+    unsigned char second = model_cell_add();
+    profile_init();
+
+    hold_replies();
+    sendString("#1i0G1000\n");
+    sendString("i20G500,,250\n");
+    sendString("i\n");
+    sendString("ir\n");
+    EXPECT_THAT(held_replies(), StrEq("#1ik3\nik2i0,2ir1"));
+
+    event_post(EVENT_UPDATE, 0);
+    event_post(EVENT_UPDATE, 0);
+    event_dispatch_all();
+    EXPECT_THAT(model_get_relative_solar_irradiation(first), Eq(50 * 65536));
+    EXPECT_THAT(model_get_relative_solar_irradiation(second), Eq(25 * 65536));
+
+    sendString("is\n");
+    EXPECT_THAT(held_replies(), StrEq("is"));
+    model_cell_remove_all();
+}
+
+TEST_F(uart_rx_fss, profile_refuses_keyframes_when_full)
+{
+    profile_init();
+    profile_stop();
+
+    hold_replies();
+    for(int i = 0; i != PROFILE_DEPTH; ++i)
+        sendString("i10G1000\n");
+    held_replies();
+    sendString("i10G1000\n");
+    sendString("ir\n");
+    sendString("is\n");
+
+    EXPECT_THAT(held_replies(), StrEq("ifir1is"));
+}
+
+/* -------------------------------------------------------------------------- */
+static std::string panels_db_block(uint16_t offset, unsigned char count)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char buffer_str[BUFFER_LENGTH];
+    uint16_t crc = crc16(0xFFFF, offset);
+    std::string line = "fw";
+
+    str_nutoa(buffer_str, BUFFER_LENGTH - 1, offset);
+    line += buffer_str;
+    line += ",";
+    for(unsigned char i = 0; i != count; ++i)
+    {
+        uint16_t word = panels_db_image[offset + i];
+        for(int shift = 12; shift >= 0; shift -= 4)
+            line += hex[(word >> shift) & 0xF];
+        crc = crc16(crc, word);
+    }
+    str_nutoa(buffer_str, BUFFER_LENGTH - 1, crc);
+    return line + "," + buffer_str + "\n";
+}
+
+TEST_F(uart_rx_fss, panels_db_blocks_are_checked_against_their_crc)
+{
+    hold_replies();
+    sendString("fb57,100\n");
+    sendString("fw0,DB01001D000100010008000C00100012,46489\n");
+    sendString("fw8,00000000000000010002001200030401,11659\n");
+    sendString("fw8,00000000000000010002001200030401,11658\n");
+    sendString("f\n");
+
+    EXPECT_THAT(held_replies(), StrEq("fb1fw8fw8fw16f16,57,100"));
+    panels_db_upload_end();
+}
+
+TEST_F(uart_rx_fss, panels_db_upload_resumes_and_switches_to_the_new_image)
+{
+    uint16_t length = panels_db_image[1];
+    std::string status;
+    char buffer_str[BUFFER_LENGTH];
+    uint16_t offset;
+
+    str_nutoa(buffer_str, BUFFER_LENGTH - 1, length);
+    hold_replies();
+    sendString((std::string("fb") + buffer_str + ",123\n").c_str());
+    sendString(panels_db_block(0, 8).c_str());
+    EXPECT_THAT(held_replies(), StrEq("fb1fw8"));
+
+    /* connection lost, the host asks where to continue */
+    sendString("#3f\n");
+    EXPECT_THAT(held_replies(),
+                StrEq(std::string("#3f8,") + buffer_str + ",123\n"));
+
+    for(offset = 8; offset < length; offset += PANELS_DB_BLOCK_WORDS)
+        sendString(panels_db_block(offset, length - offset < 8 ?
+                                           length - offset : 8).c_str());
+    held_replies();
+    sendString("fc\n");
+    EXPECT_THAT(held_replies(), StrEq("fc1"));
+    EXPECT_THAT(panels_db_get_manufacturer_name(0), StrEq("Generic"));
+}
+
 /* -------------------------------------------------------------------------- */
 TEST_F(uart_transmit_queue, inserting_byte_when_tx_buffer_is_idle_sends_byte)
 {
@@ -5,11 +5,16 @@
  * Created on 18 October 2015, 14:34
  */
 
+#include "drv/boot.h"
 #include "drv/hw.h"
 #include "drv/leds.h"
 #include "core/event.h"
+#include "usr/calibration.h"
+#include "usr/journal.h"
 #include "usr/menu.h"
 #include "usr/panels_db.h"
+#include "usr/profile.h"
+#include "usr/setpoint.h"
 
 /* -------------------------------------------------------------------------- */
 #ifdef TESTING
@@ -18,10 +23,20 @@ void dspic_main(void)
 int main(void)
 #endif
 {
+    unsigned char cells;
+
     hw_init();
     drivers_init();
+    cells = journal_init();
+    calibration_init();
+    boot_mark(BOOT_CALIBRATION_LOADED);
     panels_db_init();
+    setpoint_init();
+    profile_init();
     menu_init();
+    if(cells)
+        menu_resume(cells);
+    boot_mark(BOOT_MENU_READY);
 
     while(1)
     {
@@ -0,0 +1,294 @@
+/*!
+ * @file calibration.c
+ *
+ * The four coefficients of struct buck_calibration_t are stored in the
+ * journal, which checks them and keeps the newest ones, see
+ * journal_save_calibration(). Without them the device isn't calibrated.
+ */
+
+#include <stdint.h>
+#include "usr/calibration.h"
+#include "usr/journal.h"
+#include "drv/buck.h"
+#include <stddef.h>
+
+/* Coefficients further than this from nominal mean a bad measurement */
+#define MIN_GAIN(nominal) ((nominal) / 2)
+#define MAX_GAIN(nominal) ((nominal) * 2)
+
+struct point_t
+{
+    uint16_t reading;           /* 12.4 */
+    _Q16 value;                 /* relative to the reference, see below */
+};
+
+struct channel_t
+{
+    struct point_t points[2];
+    unsigned char count;
+};
+
+static struct channel_t voltage_points;
+static struct channel_t current_points;
+
+/* -------------------------------------------------------------------------- */
+static void add_point(struct channel_t* channel, uint16_t reading, _Q16 value)
+{
+    /*
+     * Readings are converted and then scaled by the reference correction,
+     * which changes with AVdd. Storing the value as it would be without that
+     * correction keeps the fit independent of AVdd at the time.
+     */
+    value = (_Q16)(((int64_t)value << 16) / buck_get_reference_scale());
+
+    if(channel->count == 2)
+    {
+        channel->points[0] = channel->points[1];
+        channel->count = 1;
+    }
+    channel->points[channel->count].reading = reading;
+    channel->points[channel->count].value = value;
+    ++channel->count;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char fit(const struct channel_t* channel,
+                         uint16_t* offset,
+                         uint16_t* gain,
+                         uint16_t nominal_gain)
+{
+    const struct point_t* a = &channel->points[0];
+    const struct point_t* b = &channel->points[1];
+    int32_t new_gain = *gain;
+    int32_t new_offset;
+
+    if(channel->count == 0)
+        return 1;
+
+    if(channel->count == 2)
+    {
+        if(a->reading == b->reading)
+            return 0;
+        new_gain = (((int32_t)b->value - a->value) << BUCK_CALIBRATION_SHIFT) /
+                   ((int32_t)b->reading - a->reading);
+        if(new_gain < MIN_GAIN(nominal_gain) ||
+           new_gain > MAX_GAIN(nominal_gain))
+            return 0;
+    }
+
+    /* value = (reading - offset) * gain, solved for offset */
+    new_offset = (int32_t)a->reading -
+                 ((int32_t)a->value << BUCK_CALIBRATION_SHIFT) / new_gain;
+    if(new_offset < 0 || new_offset > 0xFFFF)
+        return 0;
+
+    *offset = (uint16_t)new_offset;
+    *gain = (uint16_t)new_gain;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void calibration_init(void)
+{
+    uint16_t record[JOURNAL_CALIBRATION_WORDS];
+    struct buck_calibration_t coefficients;
+
+    voltage_points.count = 0;
+    current_points.count = 0;
+
+    if(!journal_load_calibration(record))
+        return;
+
+    coefficients.voltage_offset = record[0];
+    coefficients.voltage_gain = record[1];
+    coefficients.current_offset = record[2];
+    coefficients.current_gain = record[3];
+    buck_set_calibration(&coefficients);
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char calibration_add_voltage_point(_Q16 voltage)
+{
+    add_point(&voltage_points, buck_get_voltage_reading(), voltage);
+    return voltage_points.count;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char calibration_add_current_point(_Q16 current)
+{
+    add_point(&current_points, buck_get_current_reading(), current);
+    return current_points.count;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char calibration_apply(void)
+{
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+
+    if(!fit(&voltage_points,
+            &coefficients.voltage_offset,
+            &coefficients.voltage_gain,
+            BUCK_DEFAULT_VOLTAGE_GAIN))
+        return 0;
+    if(!fit(&current_points,
+            &coefficients.current_offset,
+            &coefficients.current_gain,
+            BUCK_DEFAULT_CURRENT_GAIN))
+        return 0;
+
+    buck_set_calibration(&coefficients);
+    voltage_points.count = 0;
+    current_points.count = 0;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char calibration_save(void)
+{
+    uint16_t record[JOURNAL_CALIBRATION_WORDS];
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+
+    record[0] = coefficients.voltage_offset;
+    record[1] = coefficients.voltage_gain;
+    record[2] = coefficients.current_offset;
+    record[3] = coefficients.current_gain;
+    return journal_save_calibration(record);
+}
+
+/* -------------------------------------------------------------------------- */
+void calibration_reset(void)
+{
+    struct buck_calibration_t coefficients = {
+        BUCK_DEFAULT_VOLTAGE_OFFSET, BUCK_DEFAULT_VOLTAGE_GAIN,
+        BUCK_DEFAULT_CURRENT_OFFSET, BUCK_DEFAULT_CURRENT_GAIN
+    };
+    buck_set_calibration(&coefficients);
+    voltage_points.count = 0;
+    current_points.count = 0;
+    journal_save_calibration(NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+#include "drv/hw.h"
+#include "drv/flash.h"
+#include "core/event.h"
+
+using namespace ::testing;
+
+class calibration : public Test
+{
+    virtual void SetUp()
+    {
+        event_deinit();
+        flash_erase_page(FLASH_JOURNAL_PAGE_A);
+        flash_erase_page(FLASH_JOURNAL_PAGE_B);
+        journal_init();
+        buck_init();
+        buck_set_averaging(0);
+        calibration_reset();
+    }
+
+    virtual void TearDown()
+    {
+        calibration_reset();
+        flash_erase_page(FLASH_JOURNAL_PAGE_A);
+        flash_erase_page(FLASH_JOURNAL_PAGE_B);
+        event_deinit();
+    }
+};
+
+void _ADCAN0Interrupt(void);
+void _ADCAN1Interrupt(void);
+
+/* makes the buck driver's averaged readings equal to the given ADC codes */
+static void measure(uint16_t current, uint16_t voltage)
+{
+    ADCBUF0 = current;
+    _ADCAN0Interrupt();
+    ADCBUF1 = voltage;
+    _ADCAN1Interrupt();
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(calibration, two_points_fit_offset_and_gain)
+{
+    /* this unit reads 100 LSB high and 10% low on voltage */
+    measure(1862, 100);
+    calibration_add_voltage_point(0);
+    measure(1862, 100 + 1000);
+    EXPECT_THAT(calibration_add_voltage_point(1100 * 845), Eq(2));
+
+    EXPECT_THAT(calibration_apply(), Eq(1));
+
+    measure(1862, 600);
+    EXPECT_THAT(buck_get_voltage() / 65536.0, DoubleNear(550 * 845 / 65536.0, 0.01));
+}
+
+TEST_F(calibration, single_point_only_corrects_offset)
+{
+    measure(1900, 0);
+    calibration_add_current_point(0);
+
+    EXPECT_THAT(calibration_apply(), Eq(1));
+
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+    EXPECT_THAT(coefficients.current_offset, Eq(1900u << 4));
+    EXPECT_THAT(coefficients.current_gain, Eq(BUCK_DEFAULT_CURRENT_GAIN));
+    EXPECT_THAT(buck_get_current(), Eq(0));
+}
+
+TEST_F(calibration, implausible_gain_is_rejected)
+{
+    measure(1862, 1000);
+    calibration_add_voltage_point(0);
+    measure(1862, 1001);
+    calibration_add_voltage_point(20 * 65536);
+
+    EXPECT_THAT(calibration_apply(), Eq(0));
+
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+    EXPECT_THAT(coefficients.voltage_gain, Eq(BUCK_DEFAULT_VOLTAGE_GAIN));
+}
+
+TEST_F(calibration, saved_calibration_is_loaded_on_init)
+{
+    measure(1900, 0);
+    calibration_add_current_point(0);
+    calibration_apply();
+    EXPECT_THAT(calibration_save(), Eq(1));
+
+    buck_init();
+    calibration_init();
+
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+    EXPECT_THAT(coefficients.current_offset, Eq(1900u << 4));
+}
+
+TEST_F(calibration, reset_forgets_the_saved_calibration)
+{
+    measure(1900, 0);
+    calibration_add_current_point(0);
+    calibration_apply();
+    calibration_save();
+    calibration_reset();
+
+    buck_init();
+    calibration_init();
+
+    struct buck_calibration_t coefficients;
+    buck_get_calibration(&coefficients);
+    EXPECT_THAT(coefficients.current_offset, Eq(BUCK_DEFAULT_CURRENT_OFFSET));
+}
+
+#endif /* TESTING */
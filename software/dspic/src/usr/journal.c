@@ -0,0 +1,899 @@
+/*!
+ * @file journal.c
+ *
+ * Records are appended to one of two flash pages and never overwritten, so a
+ * page is only erased once it is full and every word of it wears evenly. When
+ * the active page is full, the other one is erased and the next record goes
+ * there. The newest record stays valid in the old page until then, so losing
+ * power at any point leaves at least one complete record behind.
+ *
+ * A record is a header followed by the cells and a checksum, all in words:
+ *
+ *   0      RECORD_MAGIC << 8 | number of cells
+ *   1      sequence number, the record with the highest one is the newest
+ *   2-3    global relative solar irradiation, low word first
+ *   4-5    global thermal voltage
+ *   6-13   voc, isc, vt and g of the first cell
+ *   ...
+ *   n-2    checksum over all words before it
+ *   n-1    padding, left erased
+ *
+ * Every part is an even number of words, flash is programmed in pairs.
+ *
+ * The settling delay means the last few seconds before a power cut would be
+ * lost, so on UVLO the interrupt appends a snapshot of the global parameters
+ * behind the newest record:
+ *
+ *   0      SNAPSHOT_MAGIC << 8
+ *   1      sequence number of the record it amends
+ *   2-3    global relative solar irradiation
+ *   4-5    global thermal voltage
+ *   6      checksum over all words before it
+ *   7      padding, left erased
+ *
+ * That's four double word writes, without any erasing: every record leaves
+ * room for a snapshot behind it, and the main loop prepares the words every
+ * update, so the interrupt only has to program them. Cells aren't part of it,
+ * walking them from the interrupt isn't safe. The menu flushes the journal
+ * when it swaps in a panel, and the host edits cells one at a time, which
+ * rarely happens right before a power cut. On boot, the last snapshot behind
+ * the newest record is applied on top of it.
+ *
+ * The calibration coefficients share the pages instead of taking one of
+ * their own, see journal_save_calibration():
+ *
+ *   0      CALIBRATION_MAGIC << 8 | 1, or | 0 if the calibration was reset
+ *   1-4    coefficients
+ *   5      padding, left erased
+ *   6      checksum over all words before it
+ *   7      padding, left erased
+ *
+ * The newest one is the last one in the page of the newest record. When the
+ * journal switches pages it is copied to the start of the new page, before
+ * the record that makes that page the newest.
+ */
+
+#include <stdint.h>
+#include "usr/journal.h"
+#include "usr/pv_model.h"
+#include "drv/flash.h"
+#include "core/event.h"
+#include <stddef.h>
+
+#define RECORD_MAGIC        0x1A
+#define SNAPSHOT_MAGIC      0x1B
+#define SNAPSHOT_WORDS      8
+#define CALIBRATION_MAGIC   0x1C
+#define CALIBRATION_WORDS   8
+#define HEADER_WORDS        6
+#define CELL_WORDS          8
+#define TRAILER_WORDS       2
+#define RECORD_WORDS(cells) \
+        (HEADER_WORDS + (cells) * CELL_WORDS + TRAILER_WORDS)
+
+/* Each word takes up two program address units */
+#define WORD_SIZE 2
+
+#define is_newer(a, b) ((int16_t)((a) - (b)) > 0)
+
+/* Everything a record is written for. The model version covers the cells */
+struct snapshot_t
+{
+    unsigned short version;
+    _Q16 g;
+    _Q16 vt;
+};
+
+struct journal_t
+{
+    flash_address_t page;          /* page records are appended to */
+    flash_address_t end;           /* first free address in that page */
+    uint16_t sequence;             /* of the newest record */
+    struct snapshot_t committed;   /* what the newest record holds */
+    struct snapshot_t pending;     /* last change seen */
+    unsigned short settle;         /* updates until pending is written */
+    volatile unsigned char writing; /* a record is being appended */
+};
+
+/*
+ * Snapshot words for the UVLO interrupt. The main loop fills the buffer the
+ * interrupt isn't pointed at and then switches over, so the interrupt never
+ * sees half of an update.
+ */
+struct uvlo_snapshot_t
+{
+    uint16_t words[2][SNAPSHOT_WORDS];
+    volatile unsigned char ready;  /* buffer index + 1, 0 = nothing to write */
+};
+
+/* appends to the start of page A until journal_init() found the newest */
+static struct journal_t journal = {FLASH_JOURNAL_PAGE_A, FLASH_JOURNAL_PAGE_A};
+static struct uvlo_snapshot_t uvlo;
+
+static void on_update(unsigned int arg);
+
+/* -------------------------------------------------------------------------- */
+static uint16_t checksum(uint16_t sum, const uint16_t* words, uint16_t count)
+{
+    while(count--)
+        sum = (uint16_t)((sum << 1) | (sum >> 15)) ^ *words++;
+    return sum;
+}
+
+/* -------------------------------------------------------------------------- */
+static void split(uint16_t* words, _Q16 value)
+{
+    words[0] = (uint16_t)value;
+    words[1] = (uint16_t)((uint32_t)value >> 16);
+}
+
+static _Q16 join(const uint16_t* words)
+{
+    return (_Q16)((uint32_t)words[1] << 16 | words[0]);
+}
+
+/* -------------------------------------------------------------------------- */
+static void take_snapshot(struct snapshot_t* snapshot)
+{
+    snapshot->version = model_get_version();
+    snapshot->g = model_get_global_relative_solar_irradiation();
+    snapshot->vt = model_get_global_thermal_voltage();
+}
+
+static unsigned char snapshot_equal(const struct snapshot_t* a,
+                                    const struct snapshot_t* b)
+{
+    return a->version == b->version && a->g == b->g && a->vt == b->vt;
+}
+
+/* -------------------------------------------------------------------------- */
+/*
+ * Returns the length of the record at the given address in words, or 0 if
+ * there is no record or the header is damaged. The record isn't checked.
+ */
+static uint16_t record_length(flash_address_t address, flash_address_t end)
+{
+    uint16_t header = flash_read_word(address);
+    uint16_t words;
+
+    if(header >> 8 == RECORD_MAGIC)
+        words = RECORD_WORDS(header & 0xFF);
+    else if(header == SNAPSHOT_MAGIC << 8)
+        words = SNAPSHOT_WORDS;
+    else if(header >> 8 == CALIBRATION_MAGIC)
+        words = CALIBRATION_WORDS;
+    else
+        return 0;
+
+    if(address + (flash_address_t)words * WORD_SIZE > end)
+        return 0;
+    return words;
+}
+
+static unsigned char record_is_valid(flash_address_t address, uint16_t words)
+{
+    uint16_t sum = 0;
+    uint16_t word;
+
+    for(words -= TRAILER_WORDS; words; --words, address += WORD_SIZE)
+    {
+        word = flash_read_word(address);
+        sum = checksum(sum, &word, 1);
+    }
+    return flash_read_word(address) == sum;
+}
+
+/* -------------------------------------------------------------------------- */
+/*
+ * Walks the records of a page and remembers the newest valid one, along with
+ * the last snapshot that amends it. Returns the first free address of the
+ * page. A damaged header makes the rest of the page unusable, it counts as
+ * full then.
+ */
+static flash_address_t scan_page(flash_address_t page,
+                                 flash_address_t* newest,
+                                 flash_address_t* snapshot,
+                                 unsigned char* found)
+{
+    flash_address_t address = page;
+    flash_address_t end = page + FLASH_PAGE_SIZE;
+    uint16_t words, sequence, magic;
+
+    while(address < end && flash_read_word(address) != 0xFFFF)
+    {
+        words = record_length(address, end);
+        if(!words)
+            return end;
+
+        magic = flash_read_word(address) >> 8;
+        if(magic != CALIBRATION_MAGIC && record_is_valid(address, words))
+        {
+            sequence = flash_read_word(address + WORD_SIZE);
+            if(magic == SNAPSHOT_MAGIC)
+            {
+                /* snapshots follow their record in the same page */
+                if(*found && page == journal.page &&
+                   sequence == journal.sequence)
+                    *snapshot = address;
+            }
+            else if(!*found || is_newer(sequence, journal.sequence))
+            {
+                *newest = address;
+                *snapshot = 0;
+                *found = 1;
+                journal.sequence = sequence;
+                journal.page = page;
+            }
+        }
+
+        address += (flash_address_t)words * WORD_SIZE;
+    }
+
+    return address;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Returns the newest calibration in a page, or 0 if there is none */
+static flash_address_t find_calibration(flash_address_t page)
+{
+    flash_address_t address = page, found = 0;
+    flash_address_t end = page + FLASH_PAGE_SIZE;
+    uint16_t words;
+
+    while(address < end && (words = record_length(address, end)) != 0)
+    {
+        if(flash_read_word(address) >> 8 == CALIBRATION_MAGIC &&
+           record_is_valid(address, words))
+            found = address;
+        address += (flash_address_t)words * WORD_SIZE;
+    }
+    return found;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char restore(flash_address_t address)
+{
+    uint16_t words[CELL_WORDS];
+    struct pv_cell_t cell;
+    unsigned char count, i;
+    _Q16 g, vt;
+
+    flash_read(address, words, HEADER_WORDS);
+    count = words[0] & 0xFF;
+    g = join(words + 2);
+    vt = join(words + 4);
+
+    address += HEADER_WORDS * WORD_SIZE;
+    for(i = 0; i != count; ++i, address += CELL_WORDS * WORD_SIZE)
+    {
+        flash_read(address, words, CELL_WORDS);
+        cell.voc = join(words + 0);
+        cell.isc = join(words + 2);
+        cell.vt = join(words + 4);
+        cell.g = join(words + 6);
+        if(!model_shadow_cell_add(&cell))
+        {
+            model_shadow_discard();
+            return 0;
+        }
+    }
+
+    if(count)
+        model_shadow_commit();
+    model_set_global_relative_solar_irradiation(g);
+    model_set_global_thermal_voltage(vt);
+    return count;
+}
+
+/* -------------------------------------------------------------------------- */
+static void restore_snapshot(flash_address_t address)
+{
+    uint16_t words[SNAPSHOT_WORDS];
+
+    flash_read(address, words, SNAPSHOT_WORDS);
+    model_set_global_relative_solar_irradiation(join(words + 2));
+    model_set_global_thermal_voltage(join(words + 4));
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char room_for_snapshot(void)
+{
+    return journal.end + SNAPSHOT_WORDS * WORD_SIZE <=
+           journal.page + FLASH_PAGE_SIZE;
+}
+
+/* -------------------------------------------------------------------------- */
+static void prepare_snapshot(const struct snapshot_t* now)
+{
+    /* only when there's something the newest record doesn't have */
+    if(!room_for_snapshot() || (now->g == journal.committed.g &&
+                                now->vt == journal.committed.vt))
+    {
+        uvlo.ready = 0;
+        return;
+    }
+
+    {
+        unsigned char index = (uvlo.ready == 1 ? 1 : 0);
+        uint16_t* words = uvlo.words[index];
+
+        words[0] = SNAPSHOT_MAGIC << 8;
+        words[1] = journal.sequence;
+        split(words + 2, now->g);
+        split(words + 4, now->vt);
+        words[6] = checksum(0, words, SNAPSHOT_WORDS - TRAILER_WORDS);
+        words[7] = 0xFFFF;
+        uvlo.ready = index + 1;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char append(const uint16_t* words, uint16_t count)
+{
+    if(!flash_write(journal.end, words, count))
+    {
+        /* whatever was programmed is garbage now, start over next time */
+        journal.end = journal.page + FLASH_PAGE_SIZE;
+        return 0;
+    }
+    journal.end += (flash_address_t)count * WORD_SIZE;
+    return 1;
+}
+
+static unsigned char append_record(void)
+{
+    uint16_t words[CELL_WORDS];
+    struct pv_cell_t cell;
+    unsigned short version;
+    unsigned char count = 0, id = 0, i;
+    flash_address_t calibration;
+    uint16_t sum;
+
+    while((id = model_cell_find_next(id, &cell, &version)) != 0)
+        ++count;
+    if(count > JOURNAL_MAX_CELLS)
+        return 1;
+
+    /* switch pages when full, the old one keeps the last record until the
+     * next switch. There has to be room for a snapshot behind the record */
+    if(journal.end + (flash_address_t)(RECORD_WORDS(count) + SNAPSHOT_WORDS) *
+       WORD_SIZE > journal.page + FLASH_PAGE_SIZE)
+    {
+        calibration = find_calibration(journal.page);
+        journal.page = journal.page == FLASH_JOURNAL_PAGE_A ?
+                FLASH_JOURNAL_PAGE_B : FLASH_JOURNAL_PAGE_A;
+        journal.end = journal.page;
+        if(!flash_erase_page(journal.page))
+        {
+            journal.end = journal.page + FLASH_PAGE_SIZE;
+            return 0;
+        }
+
+        /* a reset calibration doesn't need to be carried over */
+        if(calibration && flash_read_word(calibration) & 0xFF)
+        {
+            flash_read(calibration, words, CALIBRATION_WORDS);
+            if(!append(words, CALIBRATION_WORDS))
+                return 0;
+        }
+    }
+
+    words[0] = RECORD_MAGIC << 8 | count;
+    words[1] = journal.sequence + 1;
+    split(words + 2, model_get_global_relative_solar_irradiation());
+    split(words + 4, model_get_global_thermal_voltage());
+    sum = checksum(0, words, HEADER_WORDS);
+    if(!append(words, HEADER_WORDS))
+        return 0;
+
+    for(i = 0; i != count; ++i)
+    {
+        id = model_cell_find_next(id, &cell, &version);
+        split(words + 0, cell.voc);
+        split(words + 2, cell.isc);
+        split(words + 4, cell.vt);
+        split(words + 6, cell.g);
+        sum = checksum(sum, words, CELL_WORDS);
+        if(!append(words, CELL_WORDS))
+            return 0;
+    }
+
+    words[0] = sum;
+    words[1] = 0xFFFF;
+    if(!append(words, TRAILER_WORDS))
+        return 0;
+
+    ++journal.sequence;
+    return 1;
+}
+
+static unsigned char write_record(void)
+{
+    unsigned char result;
+
+    /* the UVLO interrupt must not append in between */
+    journal.writing = 1;
+    result = append_record();
+    journal.writing = 0;
+    return result;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char journal_init(void)
+{
+    flash_address_t newest = 0, snapshot = 0;
+    flash_address_t end_a, end_b;
+    unsigned char found = 0;
+    unsigned char cells = 0;
+
+    uvlo.ready = 0;
+    journal.writing = 0;
+    journal.page = FLASH_JOURNAL_PAGE_A;
+    journal.sequence = 0;
+    end_a = scan_page(FLASH_JOURNAL_PAGE_A, &newest, &snapshot, &found);
+    end_b = scan_page(FLASH_JOURNAL_PAGE_B, &newest, &snapshot, &found);
+    journal.end = (journal.page == FLASH_JOURNAL_PAGE_A ? end_a : end_b);
+
+    if(found)
+        cells = restore(newest);
+    if(snapshot)
+        restore_snapshot(snapshot);
+
+    take_snapshot(&journal.committed);
+    journal.pending = journal.committed;
+    journal.settle = 0;
+    event_register_listener(EVENT_UPDATE, on_update);
+
+    return cells;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char journal_flush(void)
+{
+    struct snapshot_t now;
+    take_snapshot(&now);
+
+    journal.pending = now;
+    journal.settle = 0;
+    if(snapshot_equal(&now, &journal.committed) && room_for_snapshot())
+        return 1;
+
+    uvlo.ready = 0;
+    if(!write_record())
+    {
+        /* try again later */
+        journal.settle = JOURNAL_SETTLE_UPDATES;
+        return 0;
+    }
+    journal.committed = now;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char journal_save_calibration(const uint16_t* coefficients)
+{
+    uint16_t words[CALIBRATION_WORDS];
+    unsigned char i, result;
+
+    words[0] = CALIBRATION_MAGIC << 8 | (coefficients != NULL);
+    for(i = 0; i != JOURNAL_CALIBRATION_WORDS; ++i)
+        words[1 + i] = coefficients ? coefficients[i] : 0xFFFF;
+    words[5] = 0xFFFF;
+    words[6] = checksum(0, words, CALIBRATION_WORDS - TRAILER_WORDS);
+    words[7] = 0xFFFF;
+
+    /* keep the room for a snapshot, moving to the other page if needed */
+    if(journal.end + (flash_address_t)(CALIBRATION_WORDS + SNAPSHOT_WORDS) *
+       WORD_SIZE > journal.page + FLASH_PAGE_SIZE)
+    {
+        journal.end = journal.page + FLASH_PAGE_SIZE;
+        journal_flush();
+        if(journal.end + (flash_address_t)(CALIBRATION_WORDS +
+           SNAPSHOT_WORDS) * WORD_SIZE > journal.page + FLASH_PAGE_SIZE)
+            return 0;
+    }
+
+    journal.writing = 1;
+    result = append(words, CALIBRATION_WORDS);
+    journal.writing = 0;
+    return result;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char journal_load_calibration(uint16_t* coefficients)
+{
+    flash_address_t address = find_calibration(journal.page);
+
+    if(!address || !(flash_read_word(address) & 0xFF))
+        return 0;
+    flash_read(address + WORD_SIZE, coefficients, JOURNAL_CALIBRATION_WORDS);
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void journal_uvlo(void)
+{
+    unsigned char ready = uvlo.ready;
+
+    /* a record being appended is newer anyway, the main loop finishes it */
+    if(!ready || journal.writing)
+        return;
+
+    /* prepare_snapshot() made sure it fits */
+    uvlo.ready = 0;
+    append(uvlo.words[ready - 1], SNAPSHOT_WORDS);
+}
+
+/* -------------------------------------------------------------------------- */
+static void on_update(unsigned int arg)
+{
+    struct snapshot_t now;
+    take_snapshot(&now);
+
+    prepare_snapshot(&now);
+
+    /* every change restarts the wait, so only the final value is written */
+    if(!snapshot_equal(&now, &journal.pending))
+    {
+        journal.pending = now;
+        journal.settle = JOURNAL_SETTLE_UPDATES;
+        return;
+    }
+
+    if(journal.settle)
+    {
+        if(--journal.settle == 0)
+            journal_flush();
+    }
+    /* an UVLO snapshot took the room behind the record, make new room */
+    else if(!room_for_snapshot())
+    {
+        journal_flush();
+        if(!room_for_snapshot())
+            journal.settle = JOURNAL_SETTLE_UPDATES;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+#include "drv/hw.h"
+
+using namespace ::testing;
+
+void _INT2Interrupt(void);
+
+class journal : public Test
+{
+    virtual void SetUp()
+    {
+        event_deinit();
+        model_cell_remove_all();
+        model_set_global_relative_solar_irradiation((_Q16)(100 * 65536));
+        model_set_global_thermal_voltage((_Q16)(293 * 65536));
+        flash_erase_page(FLASH_JOURNAL_PAGE_A);
+        flash_erase_page(FLASH_JOURNAL_PAGE_B);
+    }
+
+    virtual void TearDown()
+    {
+        /* other tests raise UVLO too */
+        uvlo.ready = 0;
+        model_cell_remove_all();
+        flash_erase_page(FLASH_JOURNAL_PAGE_A);
+        flash_erase_page(FLASH_JOURNAL_PAGE_B);
+        event_deinit();
+    }
+};
+
+/* cells go into the shadow panel, see model_shadow_commit() */
+static void add_cell(_Q16 voc)
+{
+    struct pv_cell_t cell = {voc, 3 * 65536, 273 * 65536, 100 * 65536};
+    model_shadow_cell_add(&cell);
+}
+
+static void run_updates(int count)
+{
+    for(int i = 0; i != count; ++i)
+    {
+        event_post(EVENT_UPDATE, 0);
+        event_dispatch_all();
+    }
+}
+
+static int count_records(flash_address_t page)
+{
+    int count = 0;
+    flash_address_t address = page;
+    uint16_t words;
+    while((words = record_length(address, page + FLASH_PAGE_SIZE)) != 0)
+    {
+        ++count;
+        address += words * WORD_SIZE;
+    }
+    return count;
+}
+
+/* simulates a power cycle */
+static unsigned char reboot(void)
+{
+    event_deinit();
+    model_cell_remove_all();
+    model_set_global_relative_solar_irradiation((_Q16)(100 * 65536));
+    return journal_init();
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(journal, nothing_is_restored_from_erased_flash)
+{
+    struct pv_cell_t cell;
+    unsigned short version;
+
+    EXPECT_THAT(journal_init(), Eq(0));
+    EXPECT_THAT(model_cell_find_next(0, &cell, &version), Eq(0));
+}
+
+TEST_F(journal, changes_are_written_once_settled)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    add_cell(12 * 65536);
+    model_shadow_commit();
+    model_set_global_relative_solar_irradiation((_Q16)(40 * 65536));
+
+    run_updates(JOURNAL_SETTLE_UPDATES);
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_A), Eq(0));
+    run_updates(1);
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_A), Eq(1));
+
+    EXPECT_THAT(reboot(), Eq(2));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(40 * 65536)));
+    EXPECT_THAT(model_get_panel_short_circuit_current(), Eq(3 * 65536));
+}
+
+TEST_F(journal, knob_twisting_is_coalesced)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+
+    for(int g = 100; g != 50; --g)
+    {
+        model_set_global_relative_solar_irradiation((_Q16)(g * 65536));
+        run_updates(10);
+    }
+    run_updates(JOURNAL_SETTLE_UPDATES + 1);
+
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_A), Eq(1));
+    reboot();
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(51 * 65536)));
+}
+
+TEST_F(journal, pages_are_swapped_when_full)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+
+    /* 16 words per record, 31 records per page and room for a snapshot */
+    for(int g = 1; g <= 40; ++g)
+    {
+        model_set_global_relative_solar_irradiation((_Q16)(g * 65536));
+        journal_flush();
+    }
+
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_A), Eq(31));
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_B), Eq(9));
+    reboot();
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(40 * 65536)));
+
+    /* the next record after the reboot lands behind the last one */
+    model_set_global_relative_solar_irradiation((_Q16)(41 * 65536));
+    journal_flush();
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_B), Eq(10));
+}
+
+TEST_F(journal, torn_record_is_ignored)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+    model_set_global_relative_solar_irradiation((_Q16)(70 * 65536));
+    journal_flush();
+
+    /* power lost after the header of the next record */
+    const uint16_t header[] = {RECORD_MAGIC << 8 | 1, 2, 0, 0, 0, 0};
+    flash_write(::journal.end, header, HEADER_WORDS);
+
+    EXPECT_THAT(reboot(), Eq(1));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(70 * 65536)));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(journal, calibration_is_carried_over_to_the_other_page)
+{
+    const uint16_t saved[JOURNAL_CALIBRATION_WORDS] = {1, 2, 3, 4};
+    uint16_t loaded[JOURNAL_CALIBRATION_WORDS];
+
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+    EXPECT_THAT(journal_save_calibration(saved), Ne(0));
+    for(int g = 1; g <= 40; ++g)
+    {
+        model_set_global_relative_solar_irradiation((_Q16)(g * 65536));
+        journal_flush();
+    }
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_B), Gt(0));
+
+    /* page A would be erased by the next switch */
+    flash_erase_page(FLASH_JOURNAL_PAGE_A);
+    EXPECT_THAT(reboot(), Eq(1));
+    ASSERT_THAT(journal_load_calibration(loaded), Ne(0));
+    EXPECT_THAT(loaded, ElementsAreArray(saved));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(40 * 65536)));
+}
+
+TEST_F(journal, newest_calibration_is_loaded)
+{
+    const uint16_t first[JOURNAL_CALIBRATION_WORDS] = {1, 2, 3, 4};
+    const uint16_t second[JOURNAL_CALIBRATION_WORDS] = {5, 6, 7, 8};
+    uint16_t loaded[JOURNAL_CALIBRATION_WORDS];
+
+    journal_init();
+    EXPECT_THAT(journal_load_calibration(loaded), Eq(0));
+    journal_save_calibration(first);
+    journal_save_calibration(second);
+
+    reboot();
+    ASSERT_THAT(journal_load_calibration(loaded), Ne(0));
+    EXPECT_THAT(loaded, ElementsAreArray(second));
+
+    journal_save_calibration(NULL);
+    reboot();
+    EXPECT_THAT(journal_load_calibration(loaded), Eq(0));
+}
+
+TEST_F(journal, torn_calibration_is_ignored)
+{
+    const uint16_t saved[JOURNAL_CALIBRATION_WORDS] = {1, 2, 3, 4};
+    uint16_t loaded[JOURNAL_CALIBRATION_WORDS];
+
+    journal_init();
+    journal_save_calibration(saved);
+
+    /* power lost after the first half of the next one */
+    const uint16_t words[] = {CALIBRATION_MAGIC << 8 | 1, 5, 6, 7};
+    flash_write(::journal.end, words, 4);
+
+    reboot();
+    ASSERT_THAT(journal_load_calibration(loaded), Ne(0));
+    EXPECT_THAT(loaded, ElementsAreArray(saved));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(journal, uvlo_saves_what_hasnt_settled_within_the_budget)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+    journal_flush();
+    model_set_global_relative_solar_irradiation((_Q16)(40 * 65536));
+    model_set_global_thermal_voltage((_Q16)(300 * 65536));
+    run_updates(1);
+
+    emulated_nvm_time_us = 0;
+    _INT2Interrupt();
+    EXPECT_THAT(emulated_nvm_time_us, Gt(0ul));
+    EXPECT_THAT(emulated_nvm_time_us, Le((unsigned long)JOURNAL_UVLO_BUDGET_US));
+
+    EXPECT_THAT(reboot(), Eq(1));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(40 * 65536)));
+    EXPECT_THAT(model_get_global_thermal_voltage(), Eq((_Q16)(300 * 65536)));
+}
+
+TEST_F(journal, uvlo_writes_nothing_without_changes)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+    journal_flush();
+    run_updates(1);
+
+    emulated_nvm_time_us = 0;
+    journal_uvlo();
+    EXPECT_THAT(emulated_nvm_time_us, Eq(0ul));
+}
+
+TEST_F(journal, uvlo_leaves_a_record_being_written_alone)
+{
+    journal_init();
+    model_set_global_relative_solar_irradiation((_Q16)(40 * 65536));
+    run_updates(1);
+
+    ::journal.writing = 1;
+    emulated_nvm_time_us = 0;
+    journal_uvlo();
+    ::journal.writing = 0;
+    EXPECT_THAT(emulated_nvm_time_us, Eq(0ul));
+}
+
+TEST_F(journal, snapshot_of_an_older_record_is_ignored)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+    journal_flush();
+    model_set_global_relative_solar_irradiation((_Q16)(40 * 65536));
+    run_updates(1);
+    journal_uvlo();
+
+    /* power came back and the change settled differently */
+    model_set_global_relative_solar_irradiation((_Q16)(60 * 65536));
+    journal_flush();
+
+    reboot();
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(60 * 65536)));
+}
+
+TEST_F(journal, torn_snapshot_is_ignored)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+    model_set_global_relative_solar_irradiation((_Q16)(70 * 65536));
+    journal_flush();
+
+    /* power lost after the first half of the snapshot */
+    const uint16_t words[] = {SNAPSHOT_MAGIC << 8, 1, 0, 0};
+    flash_write(::journal.end, words, 4);
+
+    EXPECT_THAT(reboot(), Eq(1));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(70 * 65536)));
+}
+
+TEST_F(journal, room_is_made_for_the_next_snapshot)
+{
+    journal_init();
+    add_cell(6 * 65536);
+    model_shadow_commit();
+
+    /* 31 records leave room for two snapshots */
+    for(int g = 1; g <= 31; ++g)
+    {
+        model_set_global_relative_solar_irradiation((_Q16)(g * 65536));
+        journal_flush();
+    }
+    for(int g = 50; g <= 51; ++g)
+    {
+        model_set_global_relative_solar_irradiation((_Q16)(g * 65536));
+        run_updates(1);
+        journal_uvlo();
+    }
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_A), Eq(33));
+
+    /* the page is full now, the first update moves on to the other one */
+    reboot();
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(51 * 65536)));
+    run_updates(1);
+    EXPECT_THAT(count_records(FLASH_JOURNAL_PAGE_B), Eq(1));
+    EXPECT_THAT(reboot(), Eq(1));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(),
+                Eq((_Q16)(51 * 65536)));
+}
+
+#endif /* TESTING */
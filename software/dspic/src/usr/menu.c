@@ -43,6 +43,9 @@
  *   Panel 2
  *   Panel 3
  *
+ * Both lists move by more than one item when the knob is twisted quickly.
+ * Twisting while holding the button down jumps from letter to letter.
+ *
  * STATE_NAVIGATE_GLOBAL_PARAMETERS lists the global parameters of the model
  * that can be changed.
  *   14.3V 1.0A 14.3W
@@ -76,15 +79,30 @@
 #include "usr/menu.h"
 #include "usr/panels_db.h"
 #include "usr/pv_model.h"
+#include "usr/journal.h"
 #include "drv/lcd.h"
 #include "drv/hw.h"
+#include "drv/button.h"
 #include "drv/buck.h"
 #include "drv/leds.h"
 #include "core/event.h"
 #include "core/string.h"
+#include "core/ram_budget.h"
 
 #include <stddef.h>
 
+/* Number of 10ms updates between refreshing the measurements on line 0 */
+#define MEASUREMENT_REFRESH_UPDATES 10
+
+/*
+ * Twists closer together than this many 10ms updates move the selection by
+ * more than one item, so long lists can be crossed in a few turns.
+ */
+#define FAST_TWIST_UPDATES          8
+#define FAST_TWIST_STRIDE           4
+#define FASTER_TWIST_UPDATES        4
+#define FASTER_TWIST_STRIDE         16
+
 /*!
  *
  */
@@ -135,11 +153,30 @@ struct menu_t
     };
 };
 
+/*
+ * What an item row of the LCD shows. The text isn't kept, a row is rendered
+ * again whenever its key changes and the LCD driver only sends the characters
+ * that differ from what is on the display, see menu_update().
+ */
+struct menu_row_t
+{
+    unsigned char state;        /* NO_STATE if the row is unknown */
+    unsigned char selected;
+    short context;              /* manufacturer or cell the list belongs to */
+    short item;
+    unsigned short version;     /* database or model version of the values */
+};
+
+#define NO_STATE 0xFF
+
 struct menu_t menu;
+static struct menu_row_t menu_rows[3];
+RAM_BUDGET_CHECK(menu_rows, sizeof(menu_rows), RAM_BUDGET_MENU_LINES);
 
 static void load_menu_navigate_manufacturers(void);
 static void handle_menu_switches(unsigned int button);
 static void menu_update(void);
+static void invalidate_lines(void);
 static void refresh_measurements(void);
 static void on_button(unsigned int button);
 static void on_update(unsigned int arg);
@@ -169,6 +206,20 @@ int panels_db_get_cell_count_test(int manufacturer, int panel);
 #   define panels_db_get_cell                      \
            panels_db_get_cell_test
 const struct pv_cell_t* panels_db_get_cell_test(int manufacturer, int panel, int cell);
+#   define panels_db_find_manufacturer             \
+           panels_db_find_manufacturer_test
+short panels_db_find_manufacturer_test(unsigned char letter);
+#   define panels_db_find_panel                    \
+           panels_db_find_panel_test
+short panels_db_find_panel_test(short manufacturer, unsigned char letter);
+#   define panels_db_get_version                   \
+           panels_db_get_version_test
+unsigned short panels_db_get_version_test(void);
+
+/* button overrides */
+#   define button_get_twist_interval               \
+           button_get_twist_interval_test
+unsigned char button_get_twist_interval_test(void);
 
 /* lcd overrides */
 #   define lcd_writeline                           \
@@ -177,6 +228,13 @@ void lcd_writeline_test(int line, const char* str);
 #   define lcd_reset                               \
            lcd_reset_test
 void lcd_reset_test(void);
+#   define lcd_line_begin                          \
+           lcd_line_begin_test
+struct str_sink_t* lcd_line_begin_test(struct lcd_line_t* line,
+                                       unsigned char lineN);
+#   define lcd_line_end                            \
+           lcd_line_end_test
+int lcd_line_end_test(struct lcd_line_t* line);
 
 /* pv_model overrides */
 #   define model_cell_begin_iteration              \
@@ -188,6 +246,20 @@ unsigned char model_cell_get_next_test();
 #   define model_cell_add                          \
            model_cell_add_test
 unsigned char model_cell_add_test(void);
+#   define model_shadow_cell_add                   \
+           model_shadow_cell_add_test
+unsigned char model_shadow_cell_add_test(const struct pv_cell_t* params);
+#   define model_shadow_commit                     \
+           model_shadow_commit_test
+void model_shadow_commit_test(void);
+#   define model_shadow_discard                    \
+           model_shadow_discard_test
+void model_shadow_discard_test(void);
+
+/* journal overrides */
+#   define journal_flush                           \
+           journal_flush_test
+unsigned char journal_flush_test(void);
 #   define model_get_global_thermal_voltage        \
            model_get_global_thermal_voltage_test
 _Q16 model_get_global_thermal_voltage_test();
@@ -218,14 +290,14 @@ _Q16 model_get_thermal_voltage_test(unsigned char cell_id);
 #   define model_get_relative_solar_irradiation    \
            model_get_relative_solar_irradiation_test
 _Q16 model_get_relative_solar_irradiation_test(unsigned char cell_id);
+#   define model_get_version                       \
+           model_get_version_test
+unsigned short model_get_version_test(void);
 
 /* buck regulator overrides */
-#   define buck_get_voltage                        \
-           buck_get_voltage_test
-_Q16 buck_get_voltage_test();
-#   define buck_get_current                        \
-           buck_get_current_test
-_Q16 buck_get_current_test();
+#   define buck_get_stats                          \
+           buck_get_stats_test
+void buck_get_stats_test(struct buck_stats_t* stats);
 
 
 #endif
@@ -239,45 +311,115 @@ void menu_init(void)
     menu.manufacturer = 0;
 
     lcd_reset();
+    invalidate_lines();
     load_menu_navigate_manufacturers();
     menu_update();
 
     event_register_listener(EVENT_BUTTON, on_button);
 }
 
+/* -------------------------------------------------------------------------- */
+static short navigation_stride(void)
+{
+    unsigned char interval = button_get_twist_interval();
+
+    if(interval < FASTER_TWIST_UPDATES)
+        return FASTER_TWIST_STRIDE;
+    if(interval < FAST_TWIST_UPDATES)
+        return FAST_TWIST_STRIDE;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char letter_of_item(short item)
+{
+    const char* name;
+
+    if(menu.state == STATE_NAVIGATE_MANUFACTURERS)
+        name = panels_db_get_manufacturer_name(item);
+    else
+        name = panels_db_get_panel_name(menu.manufacturer, item);
+    return panels_db_letter_index(name[0]);
+}
+
+static short find_letter(unsigned char letter)
+{
+    if(menu.state == STATE_NAVIGATE_MANUFACTURERS)
+        return panels_db_find_manufacturer(letter);
+    return panels_db_find_panel(menu.manufacturer, letter);
+}
+
+/*
+ * Twisting right while holding the button down jumps to the first item of
+ * the next letter. Twisting left jumps back to the first item of the current
+ * letter, or to the previous letter if it's already there. Only manufacturers
+ * and panels are sorted by name.
+ */
+static short jump_to_letter(unsigned int button)
+{
+    short item = menu.navigation.item;
+    short first;
+
+    if(menu.state != STATE_NAVIGATE_MANUFACTURERS &&
+       menu.state != STATE_NAVIGATE_PANELS)
+        return item;
+
+    if(button == BUTTON_PRESSED_TWISTED_RIGHT)
+    {
+        first = find_letter(letter_of_item(item) + 1);
+        return first < menu.navigation.max ? first : item;
+    }
+
+    first = find_letter(letter_of_item(item));
+    if(first < item || item == 0)
+        return first;
+    return find_letter(letter_of_item(item - 1));
+}
+
 /* -------------------------------------------------------------------------- */
 static void handle_item_selection(unsigned int button)
 {
+    short item = menu.navigation.item;
+    short scroll = menu.navigation.scroll;
+    short previous_item = item;
+
     /* no items to select? */
     if(menu.navigation.max == 0)
         return;
 
-    if(button == BUTTON_TWISTED_LEFT)
+    switch(button)
     {
-        /* clamp selection at item 0 */
-        if(menu.navigation.item != 0)
-            --menu.navigation.item;
-
-        /* scroll menu if we selected an item less than the scroll value */
-        if(menu.navigation.item < menu.navigation.scroll)
-            --menu.navigation.scroll;
-
-        menu_update();
-        return;
+        case BUTTON_TWISTED_LEFT:
+            item -= navigation_stride();
+            break;
+        case BUTTON_TWISTED_RIGHT:
+            item += navigation_stride();
+            break;
+        case BUTTON_PRESSED_TWISTED_LEFT:
+        case BUTTON_PRESSED_TWISTED_RIGHT:
+            item = jump_to_letter(button);
+            break;
+        default:
+            return;
     }
 
-    if(button == BUTTON_TWISTED_RIGHT)
-    {
-        /* clamp selection at max item - 1*/
-        if(menu.navigation.item != menu.navigation.max - 1)
-            ++menu.navigation.item;
+    /* clamp selection between item 0 and max item - 1 */
+    if(item < 0)
+        item = 0;
+    if(item >= menu.navigation.max)
+        item = menu.navigation.max - 1;
 
-        /* scroll menu if we selected the third item relative to the scroll value */
-        if(menu.navigation.item - menu.navigation.scroll >= 3)
-            ++menu.navigation.scroll;
+    /* scroll just far enough for the selection to be on one of the 3 lines */
+    if(item < scroll)
+        scroll = item;
+    if(item - scroll >= 3)
+        scroll = item - 2;
 
-        menu_update();
-    }
+    if(item == previous_item)
+        return;
+    menu.navigation.item = item;
+    menu.navigation.scroll = scroll;
+    menu_update();
 }
 
 /* -------------------------------------------------------------------------- */
@@ -318,42 +460,55 @@ static void load_menu_navigate_panels(void)
     menu.state = STATE_NAVIGATE_PANELS;
 }
 
-static void activate_selected_panel()
+static unsigned char build_shadow_panel(unsigned char cell_count)
 {
-    unsigned char cell_count, i;
-
-    /* disable buck for this process */
-    buck_disable();
+    unsigned char i;
+    for(i = 0; i != cell_count; ++i)
+    {
+        const struct pv_cell_t* cell = panels_db_get_cell(
+                menu.manufacturer,
+                menu.navigation.item,
+                i);
+        if(!model_shadow_cell_add(cell))
+            return 0;
+    }
+    return 1;
+}
 
-    /* clear existing cells */
-    model_cell_remove_all();
+static void activate_selected_panel()
+{
+    unsigned char cell_count;
 
     /* store cell count in menu state, as it's required by submenus */
     cell_count = panels_db_get_cell_count(menu.manufacturer,
                                           menu.navigation.item);
 
-    /* reset global parameters */
-    model_set_global_thermal_voltage((_Q16)(293 * 65536));
-    model_set_global_relative_solar_irradiation((_Q16)(100 * 65536));
-
     /*
-     * Copy parameters for each cell in the db and add them to a
-     * new cell in the active model
+     * Copy parameters for each cell in the db into the shadow model and swap
+     * it in once it's complete. The output keeps following the old panel
+     * until then and the buck slews over to the new one (see setpoint.c), so
+     * the device under test never sees the output drop.
      */
-    for(i = 0; i != cell_count; ++i)
+    if(!build_shadow_panel(cell_count))
     {
-        const struct pv_cell_t* cell = panels_db_get_cell(
-                menu.manufacturer,
-                menu.navigation.item,
-                i);
-        unsigned char cell_id = model_cell_add();
-        model_set_open_circuit_voltage(cell_id, cell->voc);
-        model_set_short_circuit_current(cell_id, cell->isc);
-        model_set_thermal_voltage(cell_id, cell->vt);
-        model_set_relative_solar_irradiation(cell_id, cell->g);
+        /*
+         * The heap can't hold both panels (about 6 cells together, see
+         * model_shadow_cell_add()), the old one has to go first
+         */
+        model_shadow_discard();
+        model_cell_remove_all();
+        build_shadow_panel(cell_count);
     }
+    model_shadow_commit();
+
+    /* reset global parameters */
+    model_set_global_thermal_voltage((_Q16)(293 * 65536));
+    model_set_global_relative_solar_irradiation((_Q16)(100 * 65536));
 
-    /* buck can now be enabled */
+    /* a UVLO snapshot can't hold the cells, write them right away */
+    journal_flush();
+
+    /* does nothing if the buck is running already */
     buck_enable();
 
     /*
@@ -447,6 +602,33 @@ static void load_menu_control_cell_temperature(void)
     menu.state = STATE_CONTROL_CELL_TEMPERATURE;
 }
 
+/* -------------------------------------------------------------------------- */
+void menu_resume(unsigned char cell_count)
+{
+    buck_enable();
+
+    load_menu_control_global_irradiation();
+    menu.cell.count = cell_count;
+
+    event_register_listener(EVENT_UPDATE, on_update);
+    refresh_measurements();
+    menu_update();
+}
+
+/* -------------------------------------------------------------------------- */
+void menu_panels_db_changed(void)
+{
+    invalidate_lines();
+
+    /* the model keeps the cells of a panel that is already running */
+    if(menu.state != STATE_NAVIGATE_MANUFACTURERS &&
+       menu.state != STATE_NAVIGATE_PANELS)
+        return;
+
+    load_menu_navigate_manufacturers();
+    menu_update();
+}
+
 /* -------------------------------------------------------------------------- */
 static void handle_menu_switches(unsigned int button)
 {
@@ -679,149 +861,205 @@ static void append_irradiation_of_cell(char* buffer, unsigned char cell_id)
 }
 
 /* -------------------------------------------------------------------------- */
-static void menu_update(void)
+static void invalidate_lines(void)
 {
-    char buffer[21];
-    int i;
+    unsigned char i;
+    for(i = 0; i != 3; ++i)
+        menu_rows[i].state = NO_STATE;
+}
 
-    /* First cell ID depends on how far we've scrolled */
-    unsigned char current_cell_id = model_cell_begin_iteration();
-    for(i = 0; i != menu.navigation.scroll; ++i)
-        current_cell_id = model_cell_get_next();
+/* -------------------------------------------------------------------------- */
+/* Sets what a row has to match to still show the right text */
+static void get_line_key(struct menu_row_t* key, short item)
+{
+    key->state = menu.state;
+    key->selected = item == menu.navigation.item;
+    key->item = item;
 
-    for(i = 0; i != 3; ++i)
+    switch(menu.state)
     {
-        short current_item = i + menu.navigation.scroll;
+        /* names only change with the whole database */
+        case STATE_NAVIGATE_MANUFACTURERS:
+            key->context = 0;
+            key->version = panels_db_get_version();
+            break;
+        case STATE_NAVIGATE_PANELS:
+            key->context = menu.manufacturer;
+            key->version = panels_db_get_version();
+            break;
+        default:
+            key->context = menu.cell.active_id;
+            key->version = model_get_version();
+            break;
+    }
+}
 
-        /* initialise buffer as empty string */
-        buffer[0] = '\0';
+static unsigned char line_matches(const struct menu_row_t* row,
+                                  const struct menu_row_t* key)
+{
+    return row->state == key->state &&
+           row->selected == key->selected &&
+           row->context == key->context &&
+           row->version == key->version &&
+           row->item == key->item;
+}
 
-        /*
-         * Set selection string.
-         * If the item is not selected we want two spaces.
-         * If the item is selected we want "> ".
-         * If the item is selected and being manipulated, we want "= ".
-         */
-        if(current_item == menu.navigation.item)
-            if(menu.state < STATE_CONTROL_GLOBAL_IRRADIATION)
-                str_append(buffer, 21, ">");
-            else
-                str_append(buffer, 21, "=");
-        else
-            str_append(buffer, 21, " ");
-
-        /* get item string */
-        switch(menu.state)
-        {
-            case STATE_NAVIGATE_MANUFACTURERS : {
-                const char* manufacturer;
-                if(current_item >= panels_db_get_manufacturer_count())
-                    break;
-                manufacturer = panels_db_get_manufacturer_name(current_item);
-                str_append(buffer, 21, manufacturer);
+/* -------------------------------------------------------------------------- */
+static void render_line(char* buffer, short current_item)
+{
+    /* the selection marker is filled in by menu_update() */
+    buffer[0] = ' ';
+    buffer[1] = '\0';
+
+    /* get item string */
+    switch(menu.state)
+    {
+        case STATE_NAVIGATE_MANUFACTURERS : {
+            const char* manufacturer;
+            if(current_item >= panels_db_get_manufacturer_count())
                 break;
-            }
+            manufacturer = panels_db_get_manufacturer_name(current_item);
+            str_append(buffer, 21, manufacturer);
+            break;
+        }
 
-            case STATE_NAVIGATE_PANELS : {
-                const char* panel;
-                if(current_item >= panels_db_get_panel_count(menu.manufacturer))
-                    break;
-                panel = panels_db_get_panel_name(menu.manufacturer,
-                                                 current_item);
-                str_append(buffer, 21, panel);
+        case STATE_NAVIGATE_PANELS : {
+            const char* panel;
+            if(current_item >= panels_db_get_panel_count(menu.manufacturer))
                 break;
+            panel = panels_db_get_panel_name(menu.manufacturer,
+                                             current_item);
+            str_append(buffer, 21, panel);
+            break;
+        }
+
+        case STATE_CONTROL_GLOBAL_IRRADIATION:
+        case STATE_CONTROL_GLOBAL_TEMPERATURE:
+        case STATE_NAVIGATE_GLOBAL_PARAMETERS:
+            if(current_item == 0)
+            {
+                str_append(buffer, 21, "Exposure ");
+                append_irradiation_of_cell(buffer, menu.cell.active_id);
+            } /*else if(current_item == 1)
+            {
+                str_append(buffer, 21, "Temp ");
+                append_temperature_of_cell(buffer, menu.cell.active_id);
+            } */else if(current_item == 1) {
+                str_append(buffer, 21, "Individual Cells");
             }
 
-            case STATE_CONTROL_GLOBAL_IRRADIATION:
-            case STATE_CONTROL_GLOBAL_TEMPERATURE:
-            case STATE_NAVIGATE_GLOBAL_PARAMETERS:
-                if(i == 0)
-                {
-                    str_append(buffer, 21, "Exposure ");
-                    append_irradiation_of_cell(buffer, menu.cell.active_id);
-                } /*else if(i == 1)
-                {
-                    str_append(buffer, 21, "Temp ");
-                    append_temperature_of_cell(buffer, menu.cell.active_id);
-                } */else if(i == 1) {
-                    str_append(buffer, 21, "Individual Cells");
-                }
+            break;
 
-                break;
+        case STATE_CONTROL_CELL_IRRADIATION:
+        case STATE_CONTROL_CELL_TEMPERATURE:
+        case STATE_NAVIGATE_CELL_PARAMETERS:
+            if(current_item == 0)
+            {
+                str_append(buffer, 21, "Exposure ");
+                append_irradiation_of_cell(buffer, menu.cell.active_id);
+            } /*else if(current_item == 1)
+            {
+                str_append(buffer, 21, "Rel. Temp ");
+                append_temperature_of_cell(buffer, menu.cell.active_id);
+            } */else if(current_item == 1) {
+                str_append(buffer, 21, "Go Back");
+            }
 
-            case STATE_CONTROL_CELL_IRRADIATION:
-            case STATE_CONTROL_CELL_TEMPERATURE:
-            case STATE_NAVIGATE_CELL_PARAMETERS:
-                if(i == 0)
-                {
-                    str_append(buffer, 21, "Exposure ");
-                    append_irradiation_of_cell(buffer, menu.cell.active_id);
-                } /*else if(i == 1)
-                {
-                    str_append(buffer, 21, "Rel. Temp ");
-                    append_temperature_of_cell(buffer, menu.cell.active_id);
-                } */else if(i == 1) {
-                    str_append(buffer, 21, "Go Back");
-                }
+            break;
 
+        case STATE_NAVIGATE_PANEL_CELLS: {
+            unsigned char current_cell_id;
+            if(current_item > menu.cell.count)
                 break;
+            if(current_item == 0)
+            {
+                str_append(buffer, 21, "Go Back");
+            } else
+            {
+                char* ptr = str_append(buffer, 21, "Cell ");
+                ptr = str_nitoa(ptr, 21 + buffer - ptr, current_item);
 
-            case STATE_NAVIGATE_PANEL_CELLS: {
-                if(current_item > menu.cell.count)
-                    break;
-                if(current_item == 0)
-                {
-                    str_append(buffer, 21, "Go Back");
-                } else
-                {
-                    char* ptr = str_append(buffer, 21, "Cell ");
-                    ptr = str_nitoa(ptr, 21 + buffer - ptr, current_item);
-
-                    current_cell_id = convert_index_to_cell_id(current_item - 1);
-
-                    /* add cell information */
-                    ptr = str_append(ptr, 21 + buffer - ptr, " (");
-                    append_irradiation_of_cell(ptr, current_cell_id);
-                    /*ptr = str_append(ptr, 21 + buffer - ptr, ",");
-                    append_temperature_of_cell(ptr, current_cell_id);*/
-                    str_append(ptr, 21 + buffer - ptr, ")");
-                    current_cell_id = model_cell_get_next();
-                }
+                current_cell_id = convert_index_to_cell_id(current_item - 1);
 
-                break;
+                /* add cell information */
+                ptr = str_append(ptr, 21 + buffer - ptr, " (");
+                append_irradiation_of_cell(ptr, current_cell_id);
+                /*ptr = str_append(ptr, 21 + buffer - ptr, ",");
+                append_temperature_of_cell(ptr, current_cell_id);*/
+                str_append(ptr, 21 + buffer - ptr, ")");
             }
 
-            default:
-                break;
+            break;
         }
 
-        /* write to LCD */
-        lcd_writeline(i + 1, buffer);
+        default:
+            break;
     }
+
 }
 
 /* -------------------------------------------------------------------------- */
-static void refresh_measurements(void)
+static char selection_marker(short current_item)
+{
+    /*
+     * If the item is not selected we want a space.
+     * If the item is selected we want ">".
+     * If the item is selected and being manipulated, we want "=".
+     */
+    if(current_item != menu.navigation.item)
+        return ' ';
+    if(menu.state < STATE_CONTROL_GLOBAL_IRRADIATION)
+        return '>';
+    return '=';
+}
+
+/* -------------------------------------------------------------------------- */
+/*
+ * Item rows are only rendered when what they show changed. Scrolling renders
+ * all three rows, but the LCD driver only sends the characters that differ,
+ * moving the selection renders the two rows whose marker changed.
+ */
+static void menu_update(void)
 {
-    char line[21], *lineptr;
+    struct menu_row_t key;
+    char text[21];
+    unsigned char row;
 
-    _Q16 voltage = buck_get_voltage();
-    _Q16 current = buck_get_current();
-    _Q16 power   = _Q16mpy(voltage, current);
+    for(row = 0; row != 3; ++row)
+    {
+        get_line_key(&key, row + menu.navigation.scroll);
+        if(line_matches(&menu_rows[row], &key))
+            continue;
+
+        render_line(text, key.item);
+        text[0] = selection_marker(key.item);
+        lcd_writeline(row + 1, text);
+        menu_rows[row] = key;
+    }
+}
 
-    lineptr = line;
+/* -------------------------------------------------------------------------- */
+static void refresh_measurements(void)
+{
+    struct lcd_line_t line;
+    struct str_sink_t* sink;
+    struct buck_stats_t stats;
 
-    /* Add voltage to line */
-    lineptr = str_q16itoa(lineptr, 6, voltage); /* 5 */
-    lineptr = str_append(lineptr, 3, "V ");     /* 7 */
-    /* Add current to line */
-    lineptr = str_q16itoa(lineptr, 7, current); /* 13 */
-    lineptr = str_append(lineptr, 3, "A ");     /* 15 */
-    /* Add power to line */
-    lineptr = str_q16itoa(lineptr, 5, power);   /* 19 */
-    lineptr = str_append(lineptr, 2, "W");      /* 20 */
+    /* means of the last window, the power is the mean of v * i */
+    buck_get_stats(&stats);
 
-    lcd_writeline(0, line);
+    /*
+     * Fixed widths keep the digits in place, so only the ones that change are
+     * sent. "-24.5V -5.50A 134.8W" fills all 20 columns.
+     */
+    sink = lcd_line_begin(&line, 0);
+    str_put_q16(sink, stats.voltage.mean, 5, 1);
+    str_put_string(sink, "V ");
+    str_put_q16(sink, stats.current.mean, 5, 2);
+    str_put_string(sink, "A ");
+    str_put_q16(sink, stats.power, 5, 1);
+    str_put_string(sink, "W");
+    lcd_line_end(&line);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -835,10 +1073,11 @@ static void on_button(unsigned int button)
 /* -------------------------------------------------------------------------- */
 static void on_update(unsigned int arg)
 {
-    static unsigned char counter = 0;
-    if(counter-- == 0)
+    /* the LCD only sends the digits that changed, so this can be frequent */
+    static unsigned char counter = 1;
+    if(--counter == 0)
     {
-        counter = 50;
+        counter = MEASUREMENT_REFRESH_UPDATES;
         refresh_measurements();
     }
 }
@@ -862,7 +1101,9 @@ int panels_db_get_manufacturer_count_test() {
 int panels_db_get_panel_count_test(int manufacturer) {
     return manufacturers[manufacturer].second.size();
 }
+int manufacturer_name_reads;
 const char* panels_db_get_manufacturer_name_test(int manufacturer) {
+    ++manufacturer_name_reads;
     return manufacturers[manufacturer].first.c_str();
 }
 const char* panels_db_get_panel_name_test(int manufacturer, int panel) {
@@ -871,6 +1112,30 @@ const char* panels_db_get_panel_name_test(int manufacturer, int panel) {
 int panels_db_get_cell_count_test(int manufacturer, int panel) {
     return 3;
 }
+short panels_db_find_manufacturer_test(unsigned char letter) {
+    short i;
+    for(i = 0; i != (short)manufacturers.size(); ++i)
+        if(panels_db_letter_index(manufacturers[i].first[0]) >= letter)
+            break;
+    return i;
+}
+unsigned short db_version_test;
+unsigned short panels_db_get_version_test(void) {
+    return db_version_test;
+}
+short panels_db_find_panel_test(short manufacturer, unsigned char letter) {
+    const std::vector<std::string>& panels = manufacturers[manufacturer].second;
+    short i;
+    for(i = 0; i != (short)panels.size(); ++i)
+        if(panels_db_letter_index(panels[i][0]) >= letter)
+            break;
+    return i;
+}
+
+/* -------------------------------------------------------------------------- */
+/* twists are slow unless a test says otherwise */
+unsigned char twist_interval;
+unsigned char button_get_twist_interval_test(void) { return twist_interval; }
 
 /* -------------------------------------------------------------------------- */
 /* set up active model API for testing. We use one default cell. */
@@ -884,14 +1149,21 @@ const struct pv_cell_t* panels_db_get_cell_test(int manufacturer, int panel, int
 }
 
 unsigned char model_cell_add() { return 1; }
+unsigned char model_shadow_cell_add_test(const struct pv_cell_t* params) { default_cell = *params; return 1; }
+void model_shadow_commit_test(void) {}
+void model_shadow_discard_test(void) {}
+int journal_flushes;
+unsigned char journal_flush_test(void) { ++journal_flushes; return 1; }
 unsigned char model_cell_begin_iteration_test() { return 1; }
 unsigned char model_cell_get_next_test() { return 0; }
 _Q16 model_get_global_thermal_voltage_test()                                      { return Q16_PARAM(273 + 20.0); }
 _Q16 model_get_global_relative_solar_irradiation_test()                           { return Q16_PARAM(99.9); }
-void model_set_open_circuit_voltage_test(unsigned char cell_id, _Q16 value)       { if(cell_id == 1) default_cell.voc = value;  }
-void model_set_short_circuit_current_test(unsigned char cell_id, _Q16 value)      { if(cell_id == 1) default_cell.isc = value;  }
-void model_set_thermal_voltage_test(unsigned char cell_id, _Q16 value)            { if(cell_id == 1) default_cell.vt  = value;  }
-void model_set_relative_solar_irradiation_test(unsigned char cell_id, _Q16 value) { if(cell_id == 1) default_cell.g   = value;  }
+unsigned short model_version_test;
+unsigned short model_get_version_test(void)                                       { return model_version_test; }
+void model_set_open_circuit_voltage_test(unsigned char cell_id, _Q16 value)       { ++model_version_test; if(cell_id == 1) default_cell.voc = value;  }
+void model_set_short_circuit_current_test(unsigned char cell_id, _Q16 value)      { ++model_version_test; if(cell_id == 1) default_cell.isc = value;  }
+void model_set_thermal_voltage_test(unsigned char cell_id, _Q16 value)            { ++model_version_test; if(cell_id == 1) default_cell.vt  = value;  }
+void model_set_relative_solar_irradiation_test(unsigned char cell_id, _Q16 value) { ++model_version_test; if(cell_id == 1) default_cell.g   = value;  }
 _Q16 model_get_open_circuit_voltage(unsigned char cell_id)                        { if(cell_id == 1) return default_cell.voc; else return 0; }
 _Q16 model_get_short_circuit_current(unsigned char cell_id)                       { if(cell_id == 1) return default_cell.isc; else return 0; }
 _Q16 model_get_thermal_voltage(unsigned char cell_id)                             { if(cell_id == 1) return default_cell.vt;  else return 0; }
@@ -899,8 +1171,13 @@ _Q16 model_get_relative_solar_irradiation(unsigned char cell_id)
 
 /* -------------------------------------------------------------------------- */
 /* re-implement buck API to return measurement values we can test */
-_Q16 buck_get_voltage_test(void) { return Q16_PARAM(-24.5); }
-_Q16 buck_get_current_test(void) { return Q16_PARAM(-5.5); }
+void buck_get_stats_test(struct buck_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->voltage.mean = Q16_PARAM(-24.5);
+    stats->current.mean = Q16_PARAM(-5.5);
+    stats->power = Q16_PARAM(134.75);
+}
 
 /* -------------------------------------------------------------------------- */
 /* adds all lines written to the LCD to a string instead */
@@ -914,6 +1191,26 @@ void lcd_writeline_test(int line, const char* str)
 
 void lcd_reset_test(void) {} /* do nothing */
 
+/* same for lines formatted in place */
+std::string lcd_line_text;
+static void lcd_line_put_test(struct str_sink_t* sink, char c)
+{
+    lcd_line_text += c;
+}
+struct str_sink_t* lcd_line_begin_test(struct lcd_line_t* line,
+                                       unsigned char lineN)
+{
+    line->sink.put = lcd_line_put_test;
+    line->line = lineN;
+    lcd_line_text.clear();
+    return &line->sink;
+}
+int lcd_line_end_test(struct lcd_line_t* line)
+{
+    lcd_writeline_test(line->line, lcd_line_text.c_str());
+    return lcd_line_text.size();
+}
+
 const char* MANUFACTURER_SELECTION_STRING = "\
 0: -Manufacturers-\n\
 1: >Manufacturer 1\n\
@@ -925,47 +1222,47 @@ const char* PANEL_SELECTION_STRING = "\
 2:  Panel 2\n\
 3:  Panel 3\n";
 const char* GLOBAL_PARAMETER_SELECTION_STRING1 = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1: >Exposure 100%\n\
 2:  Temp 20.0C\n\
 3:  Individual Cells\n";
 const char* GLOBAL_PARAMETER_SELECTION_STRING2 = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1:  Exposure 100%\n\
 2: >Temp 20.0C\n\
 3:  Individual Cells\n";
 const char* GLOBAL_IRRADIATION_STRING = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1: =Exposure 100%\n\
 2:  Temp 20.0C\n\
 3:  Individual Cells\n";
 const char* GLOBAL_TEMPERATURE_STRING = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1:  Exposure 100%\n\
 2: =Temp 20.0C\n\
 3:  Individual Cells\n";
 const char* CELL_SELECTION_STRING = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1: >Go Back\n\
 2:  Cell 1 (100% 99.9C)\n\
 3:  Cell 2 (100% 99.9C)\n";
 const char* CELL_PARAMETER_SELECTION_STRING1 = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1: >Exposure 100%\n\
 2:  Temp 99.9C\n\
 3:  Go Back\n";
 const char* CELL_PARAMETER_SELECTION_STRING2 = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1:  Exposure 100%\n\
 2: >Temp 99.9C\n\
 3:  Go Back\n";
 const char* CELL_IRRADIATION_STRING = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1: =Exposure 100%\n\
 2:  Temp 99.9C\n\
 3:  Go Back\n";
 const char* CELL_TEMPERATURE_STRING = "\
-0: -24.5V -5.500A 134W\n\
+0: -24.5V -5.50A 134.8W\n\
 1:  Exposure 100%\n\
 2: =Temp 99.9C\n\
 3:  Go Back\n";
@@ -976,6 +1273,8 @@ void twist_button_left() { on_button(BUTTON_TWISTED_LEFT); }
 void twist_button_right() { on_button(BUTTON_TWISTED_RIGHT); }
 void press_button() { on_button(BUTTON_PRESSED); on_button(BUTTON_RELEASED); }
 void press_button_longer() { on_button(BUTTON_PRESSED_LONGER); }
+void press_and_twist_left() { on_button(BUTTON_PRESSED_TWISTED_LEFT); }
+void press_and_twist_right() { on_button(BUTTON_PRESSED_TWISTED_RIGHT); }
 
 /* -------------------------------------------------------------------------- */
 /* These functions help navigate the menu more easily */
@@ -1110,6 +1409,8 @@ class oled_menu : public Test
             "No panels", std::vector<std::string>()
         ));
 
+        twist_interval = 255;
+        lcd_string.clear();
         event_deinit();
         menu_init();
     }
@@ -1243,6 +1544,161 @@ TEST_F(oled_menu, item_selection_left_clamps_correctly)
     EXPECT_THAT(menu.state, Eq(STATE_NAVIGATE_MANUFACTURERS));
 }
 
+TEST_F(oled_menu, fast_twists_skip_items)
+{
+    menu.navigation.item = 0;
+    menu.navigation.max = 100;
+    menu.navigation.scroll = 0;
+
+    twist_interval = 5;
+    twist_button_right();
+    EXPECT_THAT(menu.navigation.item, Eq(4));
+    EXPECT_THAT(menu.navigation.scroll, Eq(2));
+
+    twist_interval = 1;
+    twist_button_right();
+    EXPECT_THAT(menu.navigation.item, Eq(20));
+    EXPECT_THAT(menu.navigation.scroll, Eq(18));
+
+    twist_interval = 255;
+    twist_button_left();
+    EXPECT_THAT(menu.navigation.item, Eq(19));
+    EXPECT_THAT(menu.navigation.scroll, Eq(18));
+
+    /* the list ends stop fast twists too */
+    twist_interval = 0;
+    for(int i = 0; i != 10; ++i)
+        twist_button_right();
+    EXPECT_THAT(menu.navigation.item, Eq(99));
+    EXPECT_THAT(menu.navigation.scroll, Eq(97));
+    twist_button_left();
+    twist_button_left();
+    EXPECT_THAT(menu.navigation.item, Eq(67));
+    EXPECT_THAT(menu.navigation.scroll, Eq(67));
+}
+
+TEST_F(oled_menu, twisting_while_pressed_jumps_between_letters)
+{
+    /* "Manufacturer 1" to "Manufacturer 5", then "No panels" */
+    menu.navigation.item = 2;
+    press_and_twist_left();
+    EXPECT_THAT(menu.navigation.item, Eq(0));
+
+    press_and_twist_right();
+    EXPECT_THAT(menu.navigation.item, Eq(5));
+    EXPECT_THAT(menu.navigation.scroll, Eq(3));
+
+    /* there is no later letter */
+    press_and_twist_right();
+    EXPECT_THAT(menu.navigation.item, Eq(5));
+
+    press_and_twist_left();
+    EXPECT_THAT(menu.navigation.item, Eq(0));
+    EXPECT_THAT(menu.navigation.scroll, Eq(0));
+    press_and_twist_left();
+    EXPECT_THAT(menu.navigation.item, Eq(0));
+    EXPECT_THAT(menu.state, Eq(STATE_NAVIGATE_MANUFACTURERS));
+}
+
+TEST_F(oled_menu, twisting_while_pressed_jumps_between_panel_letters)
+{
+    manufacturers[0].second[3] = "X-Panel";
+    manufacturers[0].second[4] = "Y-Panel";
+    navigate_to_panel_selection();
+
+    press_and_twist_right();
+    EXPECT_THAT(menu.navigation.item, Eq(3));
+    press_and_twist_right();
+    EXPECT_THAT(menu.navigation.item, Eq(4));
+    press_and_twist_left();
+    EXPECT_THAT(menu.navigation.item, Eq(3));
+    EXPECT_THAT(menu.state, Eq(STATE_NAVIGATE_PANELS));
+}
+
+TEST_F(oled_menu, scrolling_renders_the_shifted_rows)
+{
+    twist_button_right();
+    twist_button_right();
+    manufacturer_name_reads = 0;
+    lcd_string.clear();
+
+    /* the LCD driver only sends the characters that changed */
+    twist_button_right();
+    EXPECT_THAT(manufacturer_name_reads, Eq(3));
+    EXPECT_THAT(lcd_string, StrEq("\
+1:  Manufacturer 2\n\
+2:  Manufacturer 3\n\
+3: >Manufacturer 4\n"));
+}
+
+TEST_F(oled_menu, lines_are_rendered_again_when_the_model_changes)
+{
+    menu_resume(2);
+    lcd_string.clear();
+    menu_update();
+    EXPECT_THAT(lcd_string, StrEq(""));
+
+    model_set_relative_solar_irradiation_test(1, Q16_PARAM(50));
+    menu_update();
+    EXPECT_THAT(lcd_string, Not(StrEq("")));
+}
+
+TEST_F(oled_menu, moving_the_selection_only_redraws_two_lines)
+{
+    lcd_string.clear();
+    twist_button_right();
+    EXPECT_THAT(lcd_string, StrEq("\
+1:  Manufacturer 1\n\
+2: >Manufacturer 2\n"));
+
+    /* nothing changes at the end of the list */
+    menu.navigation.item = 5;
+    menu.navigation.scroll = 3;
+    lcd_string.clear();
+    twist_button_right();
+    EXPECT_THAT(lcd_string, StrEq(""));
+}
+
+TEST_F(oled_menu, a_new_database_starts_over_from_the_first_manufacturer)
+{
+    press_button();
+    twist_button_right();
+    manufacturers[0].first = "Other 1";
+    lcd_string.clear();
+
+    ++db_version_test;
+    menu_panels_db_changed();
+    EXPECT_THAT(menu.state, Eq(STATE_NAVIGATE_MANUFACTURERS));
+    EXPECT_THAT(lcd_string, StrEq("\
+0: -Manufacturers-\n\
+1: >Other 1\n\
+2:  Manufacturer 2\n\
+3:  Manufacturer 3\n"));
+}
+
+TEST_F(oled_menu, names_are_rendered_again_when_the_database_changes)
+{
+    manufacturers[1].first = "Other 2";
+    lcd_string.clear();
+    menu_update();
+    EXPECT_THAT(lcd_string, StrEq(""));
+
+    ++db_version_test;
+    menu_update();
+    EXPECT_THAT(lcd_string, StrEq("\
+1: >Manufacturer 1\n\
+2:  Other 2\n\
+3:  Manufacturer 3\n"));
+}
+
+TEST_F(oled_menu, a_running_panel_keeps_its_menu_when_the_database_changes)
+{
+    menu_resume(2);
+    ++db_version_test;
+    menu_panels_db_changed();
+    EXPECT_THAT(menu.state, Eq(STATE_CONTROL_GLOBAL_IRRADIATION));
+}
+
 /* -------------------------------------------------------------------------- */
 /* Tests for state machine integrity */
 /* -------------------------------------------------------------------------- */
@@ -1265,6 +1721,24 @@ TEST_F(oled_menu, go_from_panel_menu_into_controlling_global_irradiation)
     EXPECT_THAT(lcd_string, StrEq(GLOBAL_IRRADIATION_STRING));
 }
 
+TEST_F(oled_menu, selecting_a_panel_journals_it_right_away)
+{
+    journal_flushes = 0;
+    press_button();
+    press_button();
+    EXPECT_THAT(menu.state, Eq(STATE_CONTROL_GLOBAL_IRRADIATION));
+    EXPECT_THAT(journal_flushes, Eq(1));
+}
+
+TEST_F(oled_menu, resuming_a_restored_panel_skips_the_selection)
+{
+    menu_resume(4);
+    EXPECT_THAT(menu.state, Eq(STATE_CONTROL_GLOBAL_IRRADIATION));
+    EXPECT_THAT(menu.cell.count, Eq(4));
+    EXPECT_THAT((unsigned)BUCK_EN, Eq(1u));
+    buck_disable();
+}
+
 TEST_F(oled_menu, go_from_controlling_global_irradiation_to_selecting_global_parameters)
 {
     navigate_to_global_irradiation();
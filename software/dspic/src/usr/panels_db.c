@@ -3,107 +3,259 @@
  * @author Alex Murray
  *
  * Created on 17 December 2015, 13:53
+ *
+ * The database is a single image at FLASH_PANELS_DB_PAGE, generated from a
+ * panel list by software/panels_db_gen. Everything in it is addressed by word
+ * offsets from the start of the image, so no lookup has to walk the tables:
+ *
+ *   header          PANELS_DB_MAGIC, length of the image in words, number
+ *                   of manufacturers, number of panels and the offsets of the
+ *                   manufacturer, panel, string and cell tables
+ *   index           PANELS_DB_INDEX_WORDS entries, the first manufacturer
+ *                   filed under each letter or a later one, see
+ *                   panels_db_letter_index()
+ *   manufacturers   name, index of the manufacturer's first panel. There is
+ *                   one more entry than there are manufacturers, the number
+ *                   of panels is the difference to the next entry
+ *   panels          name, offset of the cells, number of cells, delta format
+ *   strings         NUL terminated names, two characters per word, low byte
+ *                   first. Names are byte offsets into this table
+ *   cells           the first cell of a panel in full, voc, isc, vt and g,
+ *                   low word first. Every further cell is stored as signed
+ *                   differences to the first one, but only for the parameters
+ *                   set in the panel's delta mask, one word each, shifted
+ *                   left by the delta shift. Panels made of identical cells
+ *                   only store the first one
+ *   checksum        over all words before it
+ *
+ * Because cells are relative to the first cell of their panel rather than
+ * to the previous one, any cell decodes with a fixed number of reads.
+ *
+ * Manufacturers and the panels of each manufacturer are sorted by name, so
+ * the menu can jump from letter to letter. The index answers that in one
+ * read for manufacturers, panels are few enough per manufacturer to be
+ * found by bisecting their names.
+ *
+ * A new image is uploaded block by block into the erased region, see
+ * panels_db_upload_begin(). How far the upload got is kept in RAM, so a host
+ * that lost the connection can pick up where it left off.
  */
 
+#include <stdint.h>
 #include "usr/panels_db.h"
 #include "usr/pv_model.h"
-#include "drv/hw.h"
+#include "usr/menu.h"
+#include "drv/flash.h"
 #include <stddef.h>
 
-struct panel_t
+/* Each word takes up two program address units */
+#define WORD_SIZE 2
+
+/* Panel delta format word */
+#define DELTA_MASK(format)  ((format) & 0x0F)
+#define DELTA_SHIFT(format) (((format) >> 8) & 0x1F)
+
+/* Table offsets, all in words, copied out of the header */
+struct panels_db_t
 {
-    const char name[19];
-    struct pv_cell_t cells[4];
+    uint16_t manufacturers;
+    uint16_t panels;
+    uint16_t manufacturer_table;
+    uint16_t panel_table;
+    uint16_t strings;
 };
 
-struct manufacturer_t
+/* Image being uploaded, length is 0 if there is none */
+struct upload_t
 {
-    const char name[19];
-    struct panel_t panels[2];
+    uint16_t length;
+    uint16_t checksum;
+    uint16_t received;
 };
 
-#define CELL_PARAM(x) ((_Q16)(x * 65536))
-
-struct manufacturer_t database[] = {
-    { "Generic", {
-        { "Generic Panel 1", {
-            {CELL_PARAM(6), CELL_PARAM(3), CELL_PARAM(273), CELL_PARAM(100)},
-            {CELL_PARAM(6), CELL_PARAM(3), CELL_PARAM(273), CELL_PARAM(100)},
-            {CELL_PARAM(6), CELL_PARAM(3), CELL_PARAM(273), CELL_PARAM(100)},
-            {CELL_PARAM(6), CELL_PARAM(3), CELL_PARAM(273), CELL_PARAM(100)}
-        }},
-        { "Generic Panel 2", {
-            {CELL_PARAM(12), CELL_PARAM(3), CELL_PARAM(273), CELL_PARAM(100)},
-            {CELL_PARAM(12), CELL_PARAM(3), CELL_PARAM(273), CELL_PARAM(100)}
-        }}
-    }}
-};
+static struct panels_db_t db;
+static struct upload_t upload;
+static uint16_t version;
+static char name[PANELS_DB_MAX_NAME_LENGTH + 1];
+static struct pv_cell_t cell;
+
+/* -------------------------------------------------------------------------- */
+static uint16_t image_word(uint16_t offset)
+{
+    return flash_read_word(FLASH_PANELS_DB_PAGE +
+                           (flash_address_t)offset * WORD_SIZE);
+}
+
+/* -------------------------------------------------------------------------- */
+static uint16_t checksum(uint16_t sum, uint16_t word)
+{
+    return (uint16_t)((sum << 1) | (sum >> 15)) ^ word;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char image_is_valid(void)
+{
+    uint16_t length = image_word(1);
+    uint16_t sum = 0;
+    uint16_t offset;
+
+    if(image_word(0) != PANELS_DB_MAGIC ||
+       length <= PANELS_DB_HEADER_WORDS + PANELS_DB_INDEX_WORDS ||
+       length > FLASH_PANELS_DB_WORDS)
+        return 0;
+
+    for(offset = 0; offset != length - 1; ++offset)
+        sum = checksum(sum, image_word(offset));
+    return image_word(length - 1) == sum;
+}
+
+/* -------------------------------------------------------------------------- */
+static const char* copy_name(uint16_t byte_offset)
+{
+    unsigned char i;
+    uint16_t word;
+
+    for(i = 0; i != PANELS_DB_MAX_NAME_LENGTH; ++i, ++byte_offset)
+    {
+        word = image_word(db.strings + byte_offset / 2);
+        name[i] = (char)(byte_offset & 1 ? word >> 8 : word & 0xFF);
+        if(!name[i])
+            break;
+    }
+    name[i] = '\0';
+    return name;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned char name_letter(uint16_t byte_offset)
+{
+    uint16_t word = image_word(db.strings + byte_offset / 2);
+    return panels_db_letter_index(
+        (char)(byte_offset & 1 ? word >> 8 : word & 0xFF));
+}
+
+/* -------------------------------------------------------------------------- */
+static uint16_t first_panel(short manufacturer_id)
+{
+    return image_word(db.manufacturer_table +
+                      manufacturer_id * PANELS_DB_MANUFACTURER_WORDS + 1);
+}
+
+/* Returns the offset of the panel's entry in the panel table */
+static uint16_t panel_entry(short manufacturer_id, short panel_id)
+{
+    return db.panel_table +
+           (first_panel(manufacturer_id) + panel_id) * PANELS_DB_PANEL_WORDS;
+}
 
 /* -------------------------------------------------------------------------- */
 void panels_db_init(void)
 {
+    db.manufacturers = 0;
+    db.panels = 0;
+    if(!image_is_valid())
+        return;
 
+    db.manufacturers = image_word(2);
+    db.panels = image_word(3);
+    db.manufacturer_table = image_word(4);
+    db.panel_table = image_word(5);
+    db.strings = image_word(6);
 }
 
 /* -------------------------------------------------------------------------- */
 short panels_db_add_new_manufacturer(const char* name)
 {
-    return -1; /* not implemented in this version */
+    return -1; /* the image is replaced as a whole, see panels_db_gen */
 }
 
 /* -------------------------------------------------------------------------- */
 short panels_db_add_new_panel(short manufacturer_id,
                                  const char* name)
 {
-    return -1; /* not implemented in this version */
+    return -1; /* the image is replaced as a whole, see panels_db_gen */
 }
 
 /* -------------------------------------------------------------------------- */
 short panels_db_get_manufacturer_count(void)
 {
-    return sizeof(database) / sizeof(*database);
+    return db.manufacturers;
 }
 
 /* -------------------------------------------------------------------------- */
 const char* panels_db_get_manufacturer_name(short index)
 {
-    return database[index].name;
+    return copy_name(image_word(db.manufacturer_table +
+                                index * PANELS_DB_MANUFACTURER_WORDS));
 }
 
 /* -------------------------------------------------------------------------- */
 short panels_db_get_panel_count(short manufacturer_id)
 {
-    short i;
-    short count = 0;
-    for(i = 0; i != sizeof(database->panels) / sizeof(*database->panels); ++i)
-        if(*database[manufacturer_id].panels[i].name)
-            ++count;
-    return count;
+    if(manufacturer_id < 0 || manufacturer_id >= (short)db.manufacturers)
+        return 0;
+    return first_panel(manufacturer_id + 1) - first_panel(manufacturer_id);
 }
 
 /* -------------------------------------------------------------------------- */
 const char* panels_db_get_panel_name(short manufacturer_id,
                                      short panel_id)
 {
-    return database[manufacturer_id].panels[panel_id].name;
+    return copy_name(image_word(panel_entry(manufacturer_id, panel_id)));
 }
 
 /* -------------------------------------------------------------------------- */
 short panels_db_get_cell_count(short manufacturer_id,
                                short panel_id)
 {
-    short i;
-    short count = 0;
+    if(panel_id < 0 || panel_id >= panels_db_get_panel_count(manufacturer_id))
+        return 0;
+    return image_word(panel_entry(manufacturer_id, panel_id) + 2);
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char panels_db_letter_index(char c)
+{
+    unsigned char letter = (unsigned char)c;
 
-    for(i = 0;
-        i != sizeof(database->panels->cells) / sizeof(*database->panels->cells);
-        ++i)
+    if(letter >= 'a' && letter <= 'z')
+        letter -= 'a' - 'A';
+    if(letter < 'A')
+        return 0;
+    if(letter > 'Z')
+        return PANELS_DB_INDEX_WORDS - 1;
+    return letter - 'A' + 1;
+}
+
+/* -------------------------------------------------------------------------- */
+short panels_db_find_manufacturer(unsigned char letter)
+{
+    uint16_t manufacturer;
+
+    if(letter >= PANELS_DB_INDEX_WORDS || !db.manufacturers)
+        return db.manufacturers;
+    manufacturer = image_word(PANELS_DB_HEADER_WORDS + letter);
+    return manufacturer < db.manufacturers ? manufacturer : db.manufacturers;
+}
+
+/* -------------------------------------------------------------------------- */
+short panels_db_find_panel(short manufacturer_id,
+                           unsigned char letter)
+{
+    short low = 0;
+    short high = panels_db_get_panel_count(manufacturer_id);
+    short middle;
+
+    while(low != high)
     {
-        if(database[manufacturer_id].panels[panel_id].cells[i].voc)
-            ++count;
+        middle = low + (high - low) / 2;
+        if(name_letter(image_word(panel_entry(manufacturer_id, middle))) <
+           letter)
+            low = middle + 1;
+        else
+            high = middle;
     }
-
-    return count;
+    return low;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -111,7 +263,115 @@ const struct pv_cell_t* panels_db_get_cell(short manufacturer_id,
                                            short panel_id,
                                            short cell_id)
 {
-    return &database[manufacturer_id].panels[panel_id].cells[cell_id];
+    static const unsigned char deltas_per_cell[16] = {
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+    };
+    uint16_t entry = panel_entry(manufacturer_id, panel_id);
+    uint16_t data = image_word(entry + 1);
+    uint16_t format = image_word(entry + 3);
+    _Q16 params[4];
+    unsigned char i;
+
+    for(i = 0; i != 4; ++i, data += 2)
+        params[i] = (_Q16)((uint32_t)image_word(data + 1) << 16 |
+                           image_word(data));
+
+    if(cell_id)
+    {
+        data += (cell_id - 1) * deltas_per_cell[DELTA_MASK(format)];
+        for(i = 0; i != 4; ++i)
+            if(DELTA_MASK(format) & (1u << i))
+                params[i] += (_Q16)((int32_t)(int16_t)image_word(data++) <<
+                                    DELTA_SHIFT(format));
+    }
+
+    cell.voc = params[0];
+    cell.isc = params[1];
+    cell.vt = params[2];
+    cell.g = params[3];
+    return &cell;
+}
+
+/* -------------------------------------------------------------------------- */
+uint16_t panels_db_get_version(void)
+{
+    return version;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Lets the menu drop the names it shows, they are about to change */
+static void changed(void)
+{
+    ++version;
+    menu_panels_db_changed();
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char panels_db_upload_begin(uint16_t length, uint16_t checksum)
+{
+    unsigned char page;
+
+    upload.length = 0;
+    db.manufacturers = 0;
+    db.panels = 0;
+    changed();
+    if(length <= PANELS_DB_HEADER_WORDS + PANELS_DB_INDEX_WORDS ||
+       length > FLASH_PANELS_DB_WORDS)
+        return 0;
+
+    for(page = 0; page != FLASH_PANELS_DB_PAGES; ++page)
+        if(!flash_erase_page(FLASH_PANELS_DB_PAGE +
+                             (flash_address_t)page * FLASH_PAGE_SIZE))
+            return 0;
+
+    upload.length = length;
+    upload.checksum = checksum;
+    upload.received = 0;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char panels_db_upload_write(uint16_t offset,
+                                     const uint16_t* words,
+                                     unsigned char count)
+{
+    /* flash is programmed in pairs, only the last block may end in between */
+    if(!count || count > PANELS_DB_BLOCK_WORDS ||
+       offset != upload.received ||
+       (uint16_t)(upload.length - offset) < count ||
+       (count & 1 && offset + count != upload.length))
+        return 0;
+
+    if(!flash_write(FLASH_PANELS_DB_PAGE + (flash_address_t)offset * WORD_SIZE,
+                    words, count))
+        return 0;
+    upload.received += count;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void panels_db_upload_get_state(uint16_t* received,
+                                uint16_t* length,
+                                uint16_t* checksum)
+{
+    *received = upload.received;
+    *length = upload.length;
+    *checksum = upload.checksum;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char panels_db_upload_end(void)
+{
+    unsigned char complete = upload.length &&
+                             upload.received == upload.length;
+
+    upload.length = 0;
+    if(!complete)
+        return 0;
+
+    panels_db_init();
+    changed();
+    return db.manufacturers != 0;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -121,23 +381,189 @@ const struct pv_cell_t* panels_db_get_cell(short manufacturer_id,
 #ifdef TESTING
 
 #include "gmock/gmock.h"
+#include "usr/panels_db_image.h"
 
 using namespace ::testing;
 
-TEST(panels_db, get_manufacturers_count)
+class panels_db : public Test
+{
+public:
+    virtual void SetUp()
+    {
+        write_image(panels_db_image, FLASH_PANELS_DB_WORDS);
+    }
+
+    void write_image(const uint16_t* image, uint16_t words)
+    {
+        flash_erase_page(FLASH_PANELS_DB_PAGE);
+        flash_write(FLASH_PANELS_DB_PAGE, image, words);
+        panels_db_init();
+    }
+};
+
+/*
+ * One manufacturer "A" with a single panel "B" of three cells, which only
+ * differ in voc. Deltas are shifted by 4.
+ */
+#define TEST_IMAGE_WORDS (PANELS_DB_INDEX_WORDS + 29)
+
+static void build_test_image(uint16_t* image)
+{
+    static const uint16_t header[] = {
+        PANELS_DB_MAGIC, TEST_IMAGE_WORDS, 1, 1, 36, 40, 44, 46
+    };
+    static const uint16_t words[] = {
+        0, 0,                               /* "A", first panel 0 */
+        0, 1,                               /* end of panels */
+        2, 46, 3, 0x0401,                   /* "B", 3 cells, voc, << 4 */
+        'A', 'B',
+        0, 6, 0, 3, 0, 273, 0, 100,         /* first cell */
+        0x0100,                             /* voc + 0x1000 */
+        (uint16_t)-2                        /* voc - 0x20 */
+    };
+    uint16_t i, length = 0, sum = 0;
+
+    for(i = 0; i != sizeof(header) / sizeof(*header); ++i)
+        image[length++] = header[i];
+    /* "A" is filed under 1, anything after it comes after the last one */
+    for(i = 0; i != PANELS_DB_INDEX_WORDS; ++i)
+        image[length++] = i < 2 ? 0 : 1;
+    for(i = 0; i != sizeof(words) / sizeof(*words); ++i)
+        image[length++] = words[i];
+
+    for(i = 0; i != length; ++i)
+        sum = checksum(sum, image[i]);
+    image[length] = sum;
+}
+
+TEST_F(panels_db, get_manufacturers_count)
 {
     EXPECT_THAT(panels_db_get_manufacturer_count(), Eq(1));
 }
 
-TEST(panels_db, get_panel_count)
+TEST_F(panels_db, get_panel_count)
 {
     EXPECT_THAT(panels_db_get_panel_count(0), Eq(2));
 }
 
-TEST(panels_db, get_cell_count)
+TEST_F(panels_db, get_cell_count)
 {
     EXPECT_THAT(panels_db_get_cell_count(0, 0), Eq(4));
     EXPECT_THAT(panels_db_get_cell_count(0, 1), Eq(2));
 }
 
+TEST_F(panels_db, names_are_read_from_the_string_table)
+{
+    EXPECT_THAT(panels_db_get_manufacturer_name(0), StrEq("Generic"));
+    EXPECT_THAT(panels_db_get_panel_name(0, 1), StrEq("Generic Panel 2"));
+}
+
+TEST_F(panels_db, identical_cells_decode_to_the_first_cell)
+{
+    const struct pv_cell_t* cell = panels_db_get_cell(0, 1, 1);
+    EXPECT_THAT(cell->voc, Eq(12 * 65536));
+    EXPECT_THAT(cell->isc, Eq(3 * 65536));
+    EXPECT_THAT(cell->vt, Eq(273 * 65536));
+    EXPECT_THAT(cell->g, Eq(100 * 65536));
+}
+
+TEST_F(panels_db, cells_are_decoded_from_deltas)
+{
+    uint16_t image[TEST_IMAGE_WORDS];
+    build_test_image(image);
+    write_image(image, TEST_IMAGE_WORDS);
+
+    ASSERT_THAT(panels_db_get_manufacturer_count(), Eq(1));
+    EXPECT_THAT(panels_db_get_manufacturer_name(0), StrEq("A"));
+    EXPECT_THAT(panels_db_get_panel_name(0, 0), StrEq("B"));
+    ASSERT_THAT(panels_db_get_cell_count(0, 0), Eq(3));
+    EXPECT_THAT(panels_db_get_cell(0, 0, 0)->voc, Eq(0x60000));
+    EXPECT_THAT(panels_db_get_cell(0, 0, 2)->voc, Eq(0x60000 - 0x20));
+    EXPECT_THAT(panels_db_get_cell(0, 0, 1)->voc, Eq(0x61000));
+    EXPECT_THAT(panels_db_get_cell(0, 0, 1)->vt, Eq(273 * 65536));
+}
+
+TEST_F(panels_db, names_are_filed_under_their_first_letter)
+{
+    EXPECT_THAT(panels_db_letter_index('!'), Eq(0));
+    EXPECT_THAT(panels_db_letter_index('A'), Eq(1));
+    EXPECT_THAT(panels_db_letter_index('g'), Eq(7));
+    EXPECT_THAT(panels_db_letter_index('Z'), Eq(26));
+    EXPECT_THAT(panels_db_letter_index('~'), Eq(27));
+    EXPECT_THAT(panels_db_letter_index((char)0xC4), Eq(27));
+}
+
+TEST_F(panels_db, letters_are_looked_up_in_the_index)
+{
+    uint16_t image[TEST_IMAGE_WORDS];
+    build_test_image(image);
+    write_image(image, TEST_IMAGE_WORDS);
+
+    EXPECT_THAT(panels_db_find_manufacturer(0), Eq(0));
+    EXPECT_THAT(panels_db_find_manufacturer(panels_db_letter_index('A')), Eq(0));
+    EXPECT_THAT(panels_db_find_manufacturer(panels_db_letter_index('B')), Eq(1));
+    EXPECT_THAT(panels_db_find_manufacturer(PANELS_DB_INDEX_WORDS), Eq(1));
+    EXPECT_THAT(panels_db_find_panel(0, panels_db_letter_index('B')), Eq(0));
+    EXPECT_THAT(panels_db_find_panel(0, panels_db_letter_index('C')), Eq(1));
+}
+
+TEST_F(panels_db, panels_are_found_by_bisecting_their_names)
+{
+    EXPECT_THAT(panels_db_find_panel(0, panels_db_letter_index('F')), Eq(0));
+    EXPECT_THAT(panels_db_find_panel(0, panels_db_letter_index('G')), Eq(0));
+    EXPECT_THAT(panels_db_find_panel(0, panels_db_letter_index('H')), Eq(2));
+    EXPECT_THAT(panels_db_find_panel(1, 0), Eq(0));
+}
+
+TEST_F(panels_db, uploaded_image_replaces_the_database)
+{
+    uint16_t image[TEST_IMAGE_WORDS];
+    uint16_t received, length, checksum, offset;
+    build_test_image(image);
+
+    ASSERT_THAT(panels_db_upload_begin(TEST_IMAGE_WORDS,
+                                       image[TEST_IMAGE_WORDS - 1]), Ne(0));
+    EXPECT_THAT(panels_db_get_manufacturer_count(), Eq(0));
+    EXPECT_THAT(panels_db_upload_write(0, image, 8), Ne(0));
+    EXPECT_THAT(panels_db_upload_write(8, image + 8, 8), Ne(0));
+
+    /* blocks out of order, or odd ones before the end, are rejected */
+    EXPECT_THAT(panels_db_upload_write(56, image + 56, 1), Eq(0));
+    EXPECT_THAT(panels_db_upload_write(16, image + 16, 7), Eq(0));
+    panels_db_upload_get_state(&received, &length, &checksum);
+    EXPECT_THAT(received, Eq(16));
+    EXPECT_THAT(length, Eq(TEST_IMAGE_WORDS));
+    EXPECT_THAT(checksum, Eq(image[TEST_IMAGE_WORDS - 1]));
+
+    for(offset = 16; offset != 56; offset += 8)
+        EXPECT_THAT(panels_db_upload_write(offset, image + offset, 8), Ne(0));
+    EXPECT_THAT(panels_db_upload_write(56, image + 56, 1), Ne(0));
+    EXPECT_THAT(panels_db_upload_end(), Ne(0));
+    EXPECT_THAT(panels_db_get_panel_name(0, 0), StrEq("B"));
+    EXPECT_THAT(panels_db_get_cell(0, 0, 1)->voc, Eq(0x61000));
+}
+
+TEST_F(panels_db, incomplete_upload_leaves_the_database_empty)
+{
+    uint16_t image[TEST_IMAGE_WORDS];
+    build_test_image(image);
+
+    ASSERT_THAT(panels_db_upload_begin(TEST_IMAGE_WORDS,
+                                       image[TEST_IMAGE_WORDS - 1]), Ne(0));
+    EXPECT_THAT(panels_db_upload_write(0, image, 8), Ne(0));
+    EXPECT_THAT(panels_db_upload_end(), Eq(0));
+    EXPECT_THAT(panels_db_get_manufacturer_count(), Eq(0));
+}
+
+TEST_F(panels_db, damaged_image_reads_as_empty)
+{
+    uint16_t image[TEST_IMAGE_WORDS];
+    build_test_image(image);
+    image[48] ^= 1;
+    write_image(image, TEST_IMAGE_WORDS);
+
+    EXPECT_THAT(panels_db_get_manufacturer_count(), Eq(0));
+    EXPECT_THAT(panels_db_get_panel_count(0), Eq(0));
+}
+
 #endif /* TESTING */
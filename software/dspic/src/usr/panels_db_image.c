@@ -0,0 +1,29 @@
+/*!
+ * @file panels_db_image.c
+ *
+ * Built-in panel database. Generated by software/panels_db_gen from
+ * panels.csv, do not edit.
+ */
+
+#include "usr/panels_db_image.h"
+
+#if defined(TESTING) || defined(BENCHMARK)
+const uint16_t panels_db_image[FLASH_PANELS_DB_WORDS] = {
+#else
+/* sized to the whole region, so no code ends up in the unused part */
+const uint16_t __attribute__((space(prog), address(FLASH_PANELS_DB_PAGE),
+                              keep))
+    panels_db_image[FLASH_PANELS_DB_WORDS] = {
+#endif
+    0xDB02, 0x0055, 0x0001, 0x0002, 0x0024, 0x0028, 0x0030, 0x0044,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001,
+    0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001,
+    0x0001, 0x0001, 0x0001, 0x0001, 0x0000, 0x0000, 0x0000, 0x0002,
+    0x0008, 0x0044, 0x0004, 0x0000, 0x0018, 0x004C, 0x0002, 0x0000,
+    0x6547, 0x656E, 0x6972, 0x0063, 0x6547, 0x656E, 0x6972, 0x2063,
+    0x6150, 0x656E, 0x206C, 0x0031, 0x6547, 0x656E, 0x6972, 0x2063,
+    0x6150, 0x656E, 0x206C, 0x0032, 0x0000, 0x0006, 0x0000, 0x0003,
+    0x0000, 0x0111, 0x0000, 0x0064, 0x0000, 0x000C, 0x0000, 0x0003,
+    0x0000, 0x0111, 0x0000, 0x0064, 0x7372
+};
@@ -0,0 +1,317 @@
+/*!
+ * @file profile.c
+ *
+ * The keyframes are stored as they are received. When a segment starts, the
+ * values at both ends are converted to Q16 once, so each update only costs
+ * one division for the position within the segment and one multiply per
+ * channel. The panel is updated in a single pass and only cells whose
+ * irradiance changed get a new version, so a dump of the changes stays
+ * small while a profile is playing.
+ *
+ * The model is only evaluated once per update (see setpoint.c), so that is
+ * the rate the profile is sampled at. Keyframes still have millisecond
+ * timestamps and a segment shorter than an update is skipped over correctly.
+ */
+
+#include <libq.h>
+#include "usr/profile.h"
+#include "usr/pv_model.h"
+#include "core/event.h"
+#include "core/ram_budget.h"
+
+#define PROFILE_UPDATE_PERIOD 10        /* ms, one EVENT_UPDATE */
+#define PROFILE_CHANNELS (1 + PROFILE_CELLS)
+
+struct profile_t
+{
+    struct profile_keyframe_t ring[PROFILE_DEPTH];
+    unsigned char read;             /* keyframe the segment ends at */
+    unsigned char count;
+    unsigned char running;
+    uint16_t elapsed;               /* ms into the segment */
+    _Q16 start[PROFILE_CHANNELS];   /* global first, then the cells */
+    _Q16 delta[PROFILE_CHANNELS];   /* from start to the end */
+};
+
+static struct profile_t profile;
+RAM_BUDGET_CHECK(profile, sizeof(profile), RAM_BUDGET_PROFILE);
+
+static void on_update(unsigned int arg);
+
+/* -------------------------------------------------------------------------- */
+void profile_init(void)
+{
+    profile.read = 0;
+    profile.count = 0;
+    profile.running = 0;
+    event_register_listener(EVENT_UPDATE, on_update);
+}
+
+/* -------------------------------------------------------------------------- */
+/* The model takes irradiances in percent, 1000 permille are 100 * 65536 */
+static _Q16 permille_to_q16(uint16_t permille)
+{
+    return (_Q16)(((unsigned long)permille << 16) / 10);
+}
+
+/* -------------------------------------------------------------------------- */
+static void keyframe_values(const struct profile_keyframe_t* keyframe,
+                            _Q16* values)
+{
+    unsigned char i;
+
+    values[0] = permille_to_q16(keyframe->g);
+    for(i = 0; i != PROFILE_CELLS; ++i)
+        values[i + 1] = (keyframe->mask & (1 << i)) ?
+                permille_to_q16(keyframe->cell_g[i]) : values[0];
+}
+
+/* -------------------------------------------------------------------------- */
+static void apply(const _Q16* values)
+{
+    model_set_global_relative_solar_irradiation(values[0]);
+    model_set_panel_irradiation(values[0], values + 1, PROFILE_CELLS);
+}
+
+/* -------------------------------------------------------------------------- */
+static void pop_keyframe(void)
+{
+    profile.read = (profile.read + 1) % PROFILE_DEPTH;
+    --profile.count;
+}
+
+/* -------------------------------------------------------------------------- */
+static void begin_segment(void)
+{
+    _Q16 end[PROFILE_CHANNELS];
+    unsigned char i;
+
+    keyframe_values(&profile.ring[profile.read], end);
+    for(i = 0; i != PROFILE_CHANNELS; ++i)
+        profile.delta[i] = end[i] - profile.start[i];
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char profile_push(const struct profile_keyframe_t* keyframe)
+{
+    if(profile.count == PROFILE_DEPTH)
+        return 0;
+
+    profile.ring[(profile.read + profile.count) % PROFILE_DEPTH] = *keyframe;
+    ++profile.count;
+
+    /* the ring ran dry and playback was waiting at the last keyframe */
+    if(profile.running && profile.count == 1)
+        begin_segment();
+
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char profile_start(void)
+{
+    if(profile.count == 0)
+        return 0;
+
+    keyframe_values(&profile.ring[profile.read], profile.start);
+    apply(profile.start);
+    pop_keyframe();
+
+    profile.elapsed = 0;
+    profile.running = 1;
+    if(profile.count)
+        begin_segment();
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void profile_stop(void)
+{
+    profile.running = 0;
+    profile.count = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char profile_is_running(void)
+{
+    return profile.running;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char profile_get_free(void)
+{
+    return PROFILE_DEPTH - profile.count;
+}
+
+/* -------------------------------------------------------------------------- */
+static void on_update(unsigned int arg)
+{
+    _Q16 values[PROFILE_CHANNELS];
+    _Q16 fraction;
+    unsigned char i;
+
+    /* waiting for the host to push the next keyframe */
+    if(!profile.running || profile.count == 0)
+        return;
+
+    profile.elapsed += PROFILE_UPDATE_PERIOD;
+    while(profile.elapsed >= profile.ring[profile.read].dt)
+    {
+        profile.elapsed -= profile.ring[profile.read].dt;
+        for(i = 0; i != PROFILE_CHANNELS; ++i)
+            profile.start[i] += profile.delta[i];
+        pop_keyframe();
+
+        /* hold the last keyframe until more arrive */
+        if(profile.count == 0)
+        {
+            profile.elapsed = 0;
+            apply(profile.start);
+            return;
+        }
+        begin_segment();
+    }
+
+    fraction = (_Q16)(((unsigned long)profile.elapsed << 16) /
+                      profile.ring[profile.read].dt);
+    for(i = 0; i != PROFILE_CHANNELS; ++i)
+        values[i] = profile.start[i] + _Q16mpy(profile.delta[i], fraction);
+    apply(values);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+
+using namespace ::testing;
+
+class profile : public Test
+{
+    virtual void SetUp()
+    {
+        event_deinit();
+        model_cell_remove_all();
+        profile_init();
+    }
+
+    virtual void TearDown()
+    {
+        model_cell_remove_all();
+        event_deinit();
+    }
+};
+
+static void push_keyframe(uint16_t dt, uint16_t g)
+{
+    struct profile_keyframe_t keyframe = {dt, g, {0, 0, 0, 0}, 0};
+    profile_push(&keyframe);
+}
+
+static void run_updates(int count)
+{
+    for(int i = 0; i != count; ++i)
+        event_post(EVENT_UPDATE, 0);
+    event_dispatch_all();
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(profile, nothing_to_play_without_keyframes)
+{
+    EXPECT_THAT(profile_start(), Eq(0));
+    EXPECT_THAT(profile_get_free(), Eq(PROFILE_DEPTH));
+}
+
+TEST_F(profile, ramp_is_interpolated)
+{
+    unsigned char id = model_cell_add();
+    push_keyframe(0, 1000);
+    push_keyframe(100, 500);
+
+    profile_start();
+    EXPECT_THAT(model_get_relative_solar_irradiation(id), Eq(100 * 65536));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(), Eq(100 * 65536));
+
+    run_updates(5);
+    EXPECT_THAT(model_get_relative_solar_irradiation(id), Eq(75 * 65536));
+
+    run_updates(5);
+    EXPECT_THAT(model_get_relative_solar_irradiation(id), Eq(50 * 65536));
+    EXPECT_THAT(profile_is_running(), Eq(1));
+    EXPECT_THAT(profile_get_free(), Eq(PROFILE_DEPTH));
+}
+
+TEST_F(profile, short_segments_are_skipped_over)
+{
+    unsigned char id = model_cell_add();
+    push_keyframe(0, 1000);
+    push_keyframe(2, 0);
+    push_keyframe(4, 1000);
+    push_keyframe(24, 0);
+
+    profile_start();
+    run_updates(1);
+
+    /* 10ms is 4ms into the last segment */
+    EXPECT_THAT(model_get_relative_solar_irradiation(id) / 65536.0,
+                DoubleNear(100 - 100 / 6.0, 0.01));
+}
+
+TEST_F(profile, playback_resumes_when_keyframes_arrive_late)
+{
+    unsigned char id = model_cell_add();
+    push_keyframe(0, 1000);
+    profile_start();
+    run_updates(3);
+    EXPECT_THAT(model_get_relative_solar_irradiation(id), Eq(100 * 65536));
+
+    push_keyframe(20, 0);
+    run_updates(1);
+    EXPECT_THAT(model_get_relative_solar_irradiation(id), Eq(50 * 65536));
+}
+
+TEST_F(profile, cells_can_have_their_own_irradiance)
+{
+    unsigned char a = model_cell_add();
+    unsigned char b = model_cell_add();
+    struct profile_keyframe_t keyframe = {0, 1000, {0, 200, 0, 0}, 0x02};
+
+    profile_push(&keyframe);
+    profile_start();
+
+    EXPECT_THAT(model_get_relative_solar_irradiation(a), Eq(100 * 65536));
+    EXPECT_THAT(model_get_relative_solar_irradiation(b), Eq(20 * 65536));
+    EXPECT_THAT(model_get_global_relative_solar_irradiation(), Eq(100 * 65536));
+}
+
+TEST_F(profile, full_irradiance_is_what_the_panel_database_uses)
+{
+    /* panels_db and the menu load cells with g = 100 for full sun */
+    struct pv_cell_t params = {6 * 65536, 3 * 65536, 273 * 65536, 100 * 65536};
+    unsigned char db_cell = model_shadow_cell_add(&params);
+    model_shadow_commit();
+    _Q16 db_g = model_get_relative_solar_irradiation(db_cell);
+
+    struct profile_keyframe_t keyframe = {0, 0, {1000, 0, 0, 0}, 0x01};
+    profile_push(&keyframe);
+    profile_start();
+
+    EXPECT_THAT(model_get_relative_solar_irradiation(db_cell), Eq(db_g));
+    EXPECT_THAT(db_g, Eq(100 * 65536));
+}
+
+TEST_F(profile, full_ring_refuses_keyframes)
+{
+    struct profile_keyframe_t keyframe = {10, 1000, {0, 0, 0, 0}, 0};
+    for(int i = 0; i != PROFILE_DEPTH; ++i)
+        EXPECT_THAT(profile_push(&keyframe), Ne(0));
+
+    EXPECT_THAT(profile_push(&keyframe), Eq(0));
+    profile_stop();
+    EXPECT_THAT(profile_get_free(), Eq(PROFILE_DEPTH));
+}
+
+#endif /* TESTING */
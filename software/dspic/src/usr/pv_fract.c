@@ -0,0 +1,501 @@
+/*!
+ * @file pv_fract.c
+ *
+ * With _Q16, each bisection step of the model costs a division, an
+ * exponential and a multiplication, all of them library routines made of
+ * several 16x16 multiplies. Here, a step is one multiply on accumulator A
+ * and a compare.
+ *
+ * The bisection runs over u = (voc - vd) / voc in Q15 instead of over vd.
+ * Id(vd) < current is the same as exp((vd - voc) / vt) > T with
+ * T = g - current / isc, and as long as T > 0, taking -log2() of both sides
+ * gives u * k < -log2(T) with k = voc * log2(e) / vt. k is prepared per cell
+ * as a mantissa and a shift and T doesn't change during the bisection, so
+ * the logarithm is worked out once per call and scaled by the shift of k.
+ * This holds for any voc / vt and g, including the vt of 273V and g of 100
+ * the panels database uses.
+ *
+ * The DSP engine has to be configured as after reset: signed fractional
+ * multiplies, convergent rounding and saturation when storing an accumulator.
+ * The unit tests run the same code against the emulated builtins and compare
+ * it with the plain C version below.
+ */
+
+#include <stddef.h>
+#include "usr/pv_fract.h"
+#include "drv/hw.h"
+
+#if defined(TESTING) || defined(BENCHMARK)
+#   define ACCUMULATOR(name) accumulator_t name
+#else
+#   define ACCUMULATOR(name) register int name asm("A")
+#endif
+
+/* No prefetches and no write back of the other accumulator */
+#define mpy(a, b)       __builtin_mpy(a, b, NULL, NULL, 0, NULL, NULL, 0)
+#define mac(acc, a, b)  __builtin_mac(acc, a, b, NULL, NULL, 0, NULL, NULL, 0, \
+                                      NULL, 0)
+#define msc(acc, a, b)  __builtin_msc(acc, a, b, NULL, NULL, 0, NULL, NULL, 0, \
+                                      NULL, 0)
+
+#define BISECTION_STEPS 10
+
+#define LOG2_E_HALF     23637           /* log2(e) / 2, Q15 */
+#define Q16_LIMIT       ((_Q16)0x40000000L)
+
+/*
+ * log2(1 + f) = f + f * (C1 + f * (C2 + f * (C3 + f * (C4 + f * C5)))) for
+ * 0 <= f < 1, Q15. Adjusted after rounding to the coefficients, the result
+ * is off by less than 2.5 LSB.
+ */
+#define LOG2_C1         14494
+#define LOG2_C2         -23367
+#define LOG2_C3         14024
+#define LOG2_C4         -6836
+#define LOG2_C5         1686
+
+/* -------------------------------------------------------------------------- */
+/* Rounds a _Q16 value to shift fewer fraction bits, 0 if that doesn't fit */
+static int16_t to_fract(_Q16 value, unsigned char shift)
+{
+    uint32_t rounded;
+    if(value <= 0)
+        return 0;
+    rounded = ((uint32_t)value + (1UL << (shift - 1))) >> shift;
+    return rounded > 0x7FFF ? 0 : (int16_t)rounded;
+}
+
+/* n / d = mantissa * 2^exponent with the mantissa in [0.5, 1), Q15. Both
+ * have to be between 1 and 2^30. */
+static signed char normalise_quotient(uint32_t n, uint32_t d,
+                                      int16_t* mantissa)
+{
+    signed char exponent = 0;
+    uint16_t m = 0;
+    unsigned char i;
+
+    while(n >= d)
+    {
+        d <<= 1;
+        ++exponent;
+    }
+    while((n << 1) < d)
+    {
+        n <<= 1;
+        --exponent;
+    }
+    for(i = 0; i != 15; ++i)
+    {
+        n <<= 1;
+        m <<= 1;
+        if(n >= d)
+        {
+            n -= d;
+            m |= 1;
+        }
+    }
+
+    *mantissa = (int16_t)m;
+    return exponent;
+}
+
+/* Position of the highest set bit, value has to be positive */
+static unsigned char highest_bit(uint32_t value)
+{
+    unsigned char bit = 0;
+    unsigned char step;
+    for(step = 16; step; step >>= 1)
+    {
+        if(value >> step)
+        {
+            value >>= step;
+            bit += step;
+        }
+    }
+    return bit;
+}
+
+/* value * 2^-shift, saturated to 16 bits */
+static int16_t scale_saturated(int32_t value, signed char shift)
+{
+    if(shift >= 0)
+        value >>= shift;
+    else if(value > (0x7FFFL >> -shift))
+        return 0x7FFF;
+    else if(value < -(0x8000L >> -shift))
+        return -0x8000;
+    else
+        value = (int32_t)((uint32_t)value << -shift);
+
+    if(value > 0x7FFF)
+        return 0x7FFF;
+    if(value < -0x8000)
+        return -0x8000;
+    return (int16_t)value;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char pv_fract_prepare(struct pv_fract_cell_t* fract,
+                               const struct pv_cell_t* cell)
+{
+    int16_t mantissa;
+    signed char exponent;
+
+    if(!to_fract(cell->voc, 5))
+        return 0;
+    if(cell->isc <= 0 || cell->isc > Q16_LIMIT)
+        return 0;
+    if(cell->vt <= 0 || cell->vt > Q16_LIMIT)
+        return 0;
+    if(cell->g > Q16_LIMIT || cell->g < -Q16_LIMIT)
+        return 0;
+
+    /* current / isc in Q16 is current * inverse_isc >> isc_shift, the
+     * product of a Q5.11 current and a Q15 mantissa has 26 fraction bits */
+    exponent = normalise_quotient(65536, cell->isc, &fract->inverse_isc);
+    if(exponent > 10)
+        return 0;
+    fract->isc_shift = (unsigned char)(10 - exponent);
+
+    exponent = normalise_quotient((uint32_t)to_fract(cell->voc, 5) << 5,
+                                  cell->vt, &mantissa) + 1;
+    mantissa = (int16_t)((int32_t)mantissa * LOG2_E_HALF >> 15);
+    if(mantissa < 0x4000)
+    {
+        mantissa <<= 1;
+        --exponent;
+    }
+    fract->exponent = mantissa;
+    fract->exponent_shift = exponent;
+
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int16_t pv_fract_current(_Q16 current)
+{
+    if(current <= 0)
+        return 0;
+    if(current >= (16L << 16) - 16)
+        return 0x7FFF;
+    return (int16_t)((current + 16) >> 5);
+}
+
+/* -------------------------------------------------------------------------- */
+int16_t pv_fract_cell_voltage(const struct pv_fract_cell_t* fract,
+                              const struct pv_cell_t* cell,
+                              int16_t current)
+{
+    ACCUMULATOR(acc);
+    const int16_t voc = (int16_t)((cell->voc + 16) >> 5);
+    uint16_t u_min = 0, u_max = 0x8000;
+    int16_t threshold, u;
+    int32_t t;
+    unsigned char i;
+
+    /* t = g - current / isc, Q16 */
+    t = cell->g - ((int32_t)current * fract->inverse_isc >> fract->isc_shift);
+
+    /* threshold = -log2(t) / k, Q15 of the exponent's mantissa */
+    if(t <= 0)
+        threshold = 0x7FFF;
+    else
+    {
+        const unsigned char bit = highest_bit((uint32_t)t);
+        int16_t f, p;
+
+        /* t = (1 + f) * 2^(bit - 16) */
+        if(bit >= 15)
+            f = (int16_t)((t >> (bit - 15)) & 0x7FFF);
+        else
+            f = (int16_t)((t << (15 - bit)) & 0x7FFF);
+
+        acc = __builtin_lac(LOG2_C4, 0);
+        acc = mac(acc, LOG2_C5, f);
+        p = __builtin_sacr(acc, 0);
+        acc = __builtin_lac(LOG2_C3, 0);
+        acc = mac(acc, p, f);
+        p = __builtin_sacr(acc, 0);
+        acc = __builtin_lac(LOG2_C2, 0);
+        acc = mac(acc, p, f);
+        p = __builtin_sacr(acc, 0);
+        acc = __builtin_lac(LOG2_C1, 0);
+        acc = mac(acc, p, f);
+        p = __builtin_sacr(acc, 0);
+        acc = __builtin_lac(f, 0);
+        acc = mac(acc, p, f);
+        p = __builtin_sacr(acc, 0);
+
+        t = ((int32_t)(16 - bit) << 16) - ((int32_t)p << 1);
+        threshold = scale_saturated(t, fract->exponent_shift + 1);
+    }
+
+    for(i = 0; i != BISECTION_STEPS; ++i)
+    {
+        u = (int16_t)((u_min + u_max) >> 1);
+
+        /* u * k < -log2(t) means exp((vd - voc) / vt) > t */
+        acc = mpy(u, fract->exponent);
+        if(__builtin_sacr(acc, 0) < threshold)
+            u_min = u;
+        else
+            u_max = u;
+    }
+
+    /* vd = voc * (1 - u) */
+    u = (int16_t)((u_min + u_max) >> 1);
+    acc = __builtin_lac(voc, 0);
+    acc = msc(acc, voc, u);
+    return __builtin_sacr(acc, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include <math.h>
+#include "gmock/gmock.h"
+
+using namespace ::testing;
+
+/* -------------------------------------------------------------------------- */
+/*
+ * The kernel in plain C. 40-bit accumulator values are kept in 64-bit
+ * integers, fractional multiplies shift the product left by one.
+ */
+static int16_t reference_store(long long value)
+{
+    long long below = value & 0xFFFF;
+    if(below > 0x8000 || (below == 0x8000 && (value & 0x10000)))
+        value += 0x10000;
+    value -= below;
+    if(value > 0x7FFFFFFFLL)
+        return 0x7FFF;
+    if(value < -0x80000000LL)
+        return -0x8000;
+    return (int16_t)(value >> 16);
+}
+
+static int16_t reference_cell_voltage(const struct pv_fract_cell_t* fract,
+                                      const struct pv_cell_t* cell,
+                                      int16_t current)
+{
+    const int coefficients[] = {LOG2_C5, LOG2_C4, LOG2_C3, LOG2_C2, LOG2_C1};
+    const int voc = (cell->voc + 16) / 32;
+    long u_min = 0, u_max = 0x8000;
+    long long t, threshold;
+
+    t = cell->g - ((long long)current * fract->inverse_isc >>
+                   fract->isc_shift);
+    if(t <= 0)
+        threshold = 0x7FFF;
+    else
+    {
+        int bit = 0;
+        while(t >> (bit + 1))
+            ++bit;
+
+        int f = (int)((t << 15 >> bit) & 0x7FFF);
+        int p = coefficients[0];
+        for(int j = 1; j != 5; ++j)
+            p = reference_store(coefficients[j] * 65536LL + 2LL * p * f);
+        p = reference_store(f * 65536LL + 2LL * p * f);
+
+        double log = (16.0 - bit) * 65536 - 2.0 * p;
+        threshold = (long long)floor(ldexp(log,
+                                           -(fract->exponent_shift + 1)));
+        if(threshold > 0x7FFF)
+            threshold = 0x7FFF;
+        if(threshold < -0x8000)
+            threshold = -0x8000;
+    }
+
+    for(int i = 0; i != BISECTION_STEPS; ++i)
+    {
+        long u = (u_min + u_max) / 2;
+        if(reference_store(2LL * u * fract->exponent) < threshold)
+            u_min = u;
+        else
+            u_max = u;
+    }
+
+    return reference_store(voc * 65536LL - 2LL * voc * ((u_min + u_max) / 2));
+}
+
+/* The model in floating point, bisected the same way */
+static double model_cell_voltage(const struct pv_cell_t* cell, double current)
+{
+    double voc = cell->voc / 65536.0, isc = cell->isc / 65536.0;
+    double vt = cell->vt / 65536.0, g = cell->g / 65536.0;
+    double vd_min = 0, vd_max = voc;
+
+    for(int i = 0; i != BISECTION_STEPS; ++i)
+    {
+        double vd = (vd_min + vd_max) / 2;
+        if(isc * (g - exp((vd - voc) / vt)) < current)
+            vd_max = vd;
+        else
+            vd_min = vd;
+    }
+    return (vd_min + vd_max) / 2;
+}
+
+/* -------------------------------------------------------------------------- */
+class pv_fract : public Test
+{
+public:
+    unsigned long seed;
+
+    virtual void SetUp() { seed = 1; }
+    virtual void TearDown() {}
+
+    double random(double low, double high)
+    {
+        seed = seed * 1103515245UL + 12345UL;
+        return low + (high - low) * ((seed >> 8) & 0xFFFF) / 65535.0;
+    }
+
+    /*
+     * Cells like those of real panels, and some less likely ones: up to the
+     * vt of the panels database and beyond and g up to 100
+     */
+    struct pv_cell_t random_cell(void)
+    {
+        struct pv_cell_t cell;
+        bool odd = random(0, 1) < 0.25;
+        double voc = random(0.3, odd ? 15.9 : 0.8);
+        double vt = odd ? exp(random(log(0.02), log(400))) :
+                          random(0.02, 0.1);
+        cell.voc = (_Q16)(voc * 65536);
+        cell.isc = (_Q16)(random(0.1, odd ? 12 : 8) * 65536);
+        cell.vt = (_Q16)(vt * 65536);
+        cell.g = (_Q16)(random(0, odd ? 100 : 1) * 65536);
+        return cell;
+    }
+
+    /*
+     * A wrong step of the bisection costs one more step. Towards g * isc the
+     * voltage gets steep, a few LSB of current there are worth more than
+     * that.
+     */
+    void expect_model(const struct pv_cell_t* cell,
+                      const struct pv_fract_cell_t* fract, int i)
+    {
+        double tolerance = cell->voc / 65536.0 / 512 + 2 / 2048.0;
+        double current_tolerance = 4 / 2048.0;
+        for(double current = 0; current < 16; current += 0.037)
+        {
+            double high = model_cell_voltage(cell,
+                                             current - current_tolerance);
+            double low = model_cell_voltage(cell,
+                                            current + current_tolerance);
+            double voltage = pv_fract_cell_voltage(fract, cell,
+                pv_fract_current((_Q16)(current * 65536))) / 2048.0;
+            ASSERT_THAT(voltage, AllOf(Ge(low - tolerance),
+                                       Le(high + tolerance)))
+                << "cell " << i << ", current " << current;
+        }
+    }
+};
+
+/* -------------------------------------------------------------------------- */
+TEST_F(pv_fract, kernel_matches_reference_bit_for_bit)
+{
+    for(int i = 0; i != 200; ++i)
+    {
+        struct pv_cell_t cell = random_cell();
+        struct pv_fract_cell_t fract;
+        ASSERT_THAT(pv_fract_prepare(&fract, &cell), Eq(1));
+
+        for(long current = 0; current <= 0x7FFF; current += 61)
+            ASSERT_THAT(pv_fract_cell_voltage(&fract, &cell,
+                                              (int16_t)current),
+                        Eq(reference_cell_voltage(&fract, &cell,
+                                                  (int16_t)current)))
+                << "cell " << i << ", current " << current;
+        ASSERT_THAT(pv_fract_cell_voltage(&fract, &cell, 0x7FFF),
+                    Eq(reference_cell_voltage(&fract, &cell, 0x7FFF)));
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(pv_fract, kernel_follows_the_model)
+{
+    for(int i = 0; i != 200; ++i)
+    {
+        struct pv_cell_t cell = random_cell();
+        struct pv_fract_cell_t fract;
+        ASSERT_THAT(pv_fract_prepare(&fract, &cell), Eq(1));
+        expect_model(&cell, &fract, i);
+        if(HasFatalFailure())
+            return;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(pv_fract, cells_of_the_panels_database_are_evaluated)
+{
+    /* Two cells of the database, the default cell of the menu */
+    const struct pv_cell_t cells[] = {
+        {6 * 65536, 3 * 65536, 273 * 65536, 100 * 65536},
+        {12 * 65536, 3 * 65536, 273 * 65536, 100 * 65536},
+        {6 * 65536, 2 * 65536, (_Q16)(372.99 * 65536), 100 * 65536}
+    };
+    const _Q16 irradiation[] = {100 * 65536, 65536, 65536 / 2, 0};
+
+    for(int i = 0; i != 3; ++i)
+    {
+        for(int j = 0; j != 4; ++j)
+        {
+            struct pv_cell_t cell = cells[i];
+            struct pv_fract_cell_t fract;
+            cell.g = irradiation[j];
+            ASSERT_THAT(pv_fract_prepare(&fract, &cell), Eq(1));
+            expect_model(&cell, &fract, i);
+            if(HasFatalFailure())
+                return;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(pv_fract, cells_outside_the_formats_are_refused)
+{
+    struct pv_cell_t cell = {6 * 65536, 3 * 65536, 65536, 65536};
+    struct pv_fract_cell_t fract;
+    ASSERT_THAT(pv_fract_prepare(&fract, &cell), Eq(1));
+
+    cell.voc = 16 * 65536;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    cell.voc = 0;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    cell.voc = 6 * 65536;
+    cell.isc = 0;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    cell.isc = 65536 / 1100;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    cell.isc = 3 * 65536;
+    cell.vt = 0;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    /* the model's current would rise with the voltage */
+    cell.vt = -65536;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    cell.vt = 65536;
+    cell.g = 16385 * 65536;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+    cell.g = -16385 * 65536;
+    EXPECT_THAT(pv_fract_prepare(&fract, &cell), Eq(0));
+}
+
+/* -------------------------------------------------------------------------- */
+TEST_F(pv_fract, currents_saturate)
+{
+    EXPECT_THAT(pv_fract_current(-65536), Eq(0));
+    EXPECT_THAT(pv_fract_current(65536), Eq(2048));
+    EXPECT_THAT(pv_fract_current(16 * 65536), Eq(0x7FFF));
+    EXPECT_THAT(pv_fract_current(100 * 65536), Eq(0x7FFF));
+}
+
+#endif /* TESTING */
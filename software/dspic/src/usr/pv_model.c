@@ -11,16 +11,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include "usr/pv_model.h"
+#include "usr/pv_fract.h"
 
 struct cell_t
 {
     struct cell_t* next;
     unsigned char id;
+    unsigned char fractional;   /* params fit pv_fract_cell_voltage() */
+    unsigned short version;     /* model_version at the last change */
     struct pv_cell_t params;
+    struct pv_fract_cell_t fract;
 };
 
 static struct cell_t* active_panel = NULL;
 
+/* Panel being built by model_shadow_cell_add(), see model_shadow_commit() */
+static struct cell_t* shadow_panel = NULL;
+
+/* Incremented by every change to the panel, see model_get_version() */
+static unsigned short model_version = 0;
+
 static _Q16 global_vt = (_Q16)(293 * 65536);
 static _Q16 global_g  = (_Q16)(100 * 65536);
 
@@ -35,6 +45,13 @@ static unsigned char generate_unique_identifier(void)
 }
 
 
+/* -------------------------------------------------------------------------- */
+static void params_changed(struct cell_t* cell)
+{
+    cell->fractional = pv_fract_prepare(&cell->fract, &cell->params);
+    cell->version = ++model_version;
+}
+
 /* -------------------------------------------------------------------------- */
 static _Q16 Io_rel(const struct pv_cell_t* cell, const _Q16 vd)
 {
@@ -58,30 +75,78 @@ static _Q16 Iload(const _Q16 vd, const _Q16 I_is, const _Q16 U_is){
 }
 
 /* -------------------------------------------------------------------------- */
-_Q16 calc_voltage(const struct pv_cell_t* cell,
-                      const _Q16 U_is,
-                      const _Q16 I_is)
+/*
+ * Id() falls with rising vd, search for the vd where it meets the target
+ * current. The target is the load line through the measured point
+ * (U_is, I_is), or the fixed current I_is if U_is is 0.
+ */
+static _Q16 bisect_voltage(const struct pv_cell_t* cell,
+                           const _Q16 U_is,
+                           const _Q16 I_is)
 {
-    /*calculates the new voltage depending on the measured voltage and current
-     *voltage format: Q5.11
-     *current format: Q3.13 */
-    
     _Q16 vd_min = 0;
     _Q16 vd_max = cell->voc;
-    
-    uint16_t i; 
+
+    uint16_t i;
     for(i = 0; i < 10; i++){
         _Q16 vd = (vd_min + vd_max) >> 1;
-        if(Id(cell, vd) < Iload(vd, I_is, U_is)){
+        _Q16 target = U_is ? Iload(vd, I_is, U_is) : I_is;
+        if(Id(cell, vd) < target){
             vd_max = vd;
         }else{
             vd_min = vd;
         }
     }
-    
+
     return (vd_min + vd_max) >> 1;
 }
 
+/* -------------------------------------------------------------------------- */
+_Q16 calc_voltage(const struct pv_cell_t* cell,
+                      const _Q16 U_is,
+                      const _Q16 I_is)
+{
+    /*calculates the new voltage depending on the measured voltage and current
+     *voltage format: Q5.11
+     *current format: Q3.13 */
+    return bisect_voltage(cell, U_is, I_is);
+}
+
+/* -------------------------------------------------------------------------- */
+static _Q16 calc_cell_voltage(const struct pv_cell_t* cell, const _Q16 current)
+{
+    return bisect_voltage(cell, 0, current);
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 model_calc_panel_voltage(_Q16 current)
+{
+    struct cell_t* cell;
+    _Q16 voltage = 0;
+    int16_t fract_current = pv_fract_current(current);
+    for(cell = active_panel; cell; cell = cell->next)
+    {
+        if(cell->fractional)
+            voltage += (_Q16)pv_fract_cell_voltage(&cell->fract,
+                                                   &cell->params,
+                                                   fract_current) << 5;
+        else
+            voltage += calc_cell_voltage(&cell->params, current);
+    }
+    return voltage;
+}
+
+/* -------------------------------------------------------------------------- */
+_Q16 model_get_panel_short_circuit_current(void)
+{
+    struct cell_t* cell;
+    _Q16 isc = 0;
+    for(cell = active_panel; cell; cell = cell->next)
+        if(cell->params.isc > isc)
+            isc = cell->params.isc;
+    return isc;
+}
+
 /* -------------------------------------------------------------------------- */
 unsigned char model_cell_add(void)
 {
@@ -100,6 +165,7 @@ unsigned char model_cell_add(void)
     active_panel = cell;
     
     cell->id = generate_unique_identifier();
+    params_changed(cell);
     return cell->id;
 }
 
@@ -128,6 +194,7 @@ unsigned char model_cell_remove(unsigned char cell_id)
             
             /* Cell is unlinked, free to de-allocate */
             free(cell);
+            ++model_version;
             
             return 1;
         }
@@ -140,16 +207,51 @@ unsigned char model_cell_remove(unsigned char cell_id)
 }
 
 /* -------------------------------------------------------------------------- */
-void model_cell_remove_all(void)
+static void free_cells(struct cell_t* cell)
 {
-    while(active_panel)
+    while(cell)
     {
-        struct cell_t* next = active_panel->next;
-        free(active_panel);
-        active_panel = next;
+        struct cell_t* next = cell->next;
+        free(cell);
+        cell = next;
     }
 }
 
+/* -------------------------------------------------------------------------- */
+void model_cell_remove_all(void)
+{
+    free_cells(active_panel);
+    active_panel = NULL;
+    ++model_version;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned short model_get_version(void)
+{
+    return model_version;
+}
+
+/* -------------------------------------------------------------------------- */
+unsigned char model_cell_find_next(unsigned char after_id,
+                                   struct pv_cell_t* params,
+                                   unsigned short* version)
+{
+    struct cell_t* cell;
+    struct cell_t* found = NULL;
+
+    /* cells aren't sorted, look for the smallest ID larger than after_id */
+    for(cell = active_panel; cell; cell = cell->next)
+        if(cell->id > after_id && (!found || cell->id < found->id))
+            found = cell;
+
+    if(!found)
+        return 0;
+
+    *params = found->params;
+    *version = found->version;
+    return found->id;
+}
+
 /* -------------------------------------------------------------------------- */
 static struct cell_t* cell_iterator = NULL;
 unsigned char model_cell_begin_iteration(void)
@@ -170,6 +272,44 @@ unsigned char model_cell_get_next(void)
     return 0;
 }
 
+/* -------------------------------------------------------------------------- */
+unsigned char model_shadow_cell_add(const struct pv_cell_t* params)
+{
+    struct cell_t* cell = (struct cell_t*)malloc(sizeof(struct cell_t));
+    if(!cell)
+        return 0;
+
+    /* same order as model_cell_add(), so positions match after the swap */
+    cell->next = shadow_panel;
+    shadow_panel = cell;
+
+    cell->params = *params;
+    cell->id = generate_unique_identifier();
+    params_changed(cell);
+    return cell->id;
+}
+
+/* -------------------------------------------------------------------------- */
+void model_shadow_commit(void)
+{
+    struct cell_t* old_panel = active_panel;
+
+    /* the active panel is never seen half built */
+    active_panel = shadow_panel;
+    shadow_panel = NULL;
+    cell_iterator = NULL;
+    ++model_version;
+
+    free_cells(old_panel);
+}
+
+/* -------------------------------------------------------------------------- */
+void model_shadow_discard(void)
+{
+    free_cells(shadow_panel);
+    shadow_panel = NULL;
+}
+
 /* -------------------------------------------------------------------------- */
 void model_set_global_thermal_voltage(_Q16 vt)
 {
@@ -202,6 +342,7 @@ void model_set_open_circuit_voltage(unsigned char cell_id, _Q16 voc)
         if(cell->id == cell_id)
         {
             cell->params.voc = voc;
+            params_changed(cell);
             return;
         }
 }
@@ -214,6 +355,7 @@ void model_set_short_circuit_current(unsigned char cell_id, _Q16 isc)
         if(cell->id == cell_id)
         {
             cell->params.isc = isc;
+            params_changed(cell);
             return;
         }
 }
@@ -226,6 +368,7 @@ void model_set_thermal_voltage(unsigned char cell_id, _Q16 vt)
         if(cell->id == cell_id)
         {
             cell->params.vt = vt;
+            params_changed(cell);
             return;
         }
 }
@@ -238,10 +381,32 @@ void model_set_relative_solar_irradiation(unsigned char cell_id, _Q16 g)
         if(cell->id == cell_id)
         {
             cell->params.g = g;
+            params_changed(cell);
             return;
         }
 }
 
+/* -------------------------------------------------------------------------- */
+void model_set_panel_irradiation(_Q16 g, const _Q16* cell_g,
+                                 unsigned char count)
+{
+    struct cell_t* cell;
+    unsigned char position = 0;
+
+    /* cells are prepended, so the list runs from the last one added */
+    for(cell = active_panel; cell; cell = cell->next)
+        ++position;
+
+    for(cell = active_panel; cell; cell = cell->next)
+    {
+        _Q16 value = (--position < count ? cell_g[position] : g);
+        if(cell->params.g == value)
+            continue;
+        cell->params.g = value;
+        params_changed(cell);
+    }
+}
+
 /* -------------------------------------------------------------------------- */
 _Q16 model_get_open_circuit_voltage(unsigned char cell_id)
 {
@@ -305,4 +470,174 @@ TEST_F(pv_model, example_test)
     EXPECT_THAT(1, Eq(1));
 }
 
+/* -------------------------------------------------------------------------- */
+static unsigned char add_test_cell(double voc, double isc, double vt)
+{
+    unsigned char id = model_cell_add();
+    model_set_open_circuit_voltage(id, (_Q16)(voc * 65536));
+    model_set_short_circuit_current(id, (_Q16)(isc * 65536));
+    model_set_thermal_voltage(id, (_Q16)(vt * 65536));
+    model_set_relative_solar_irradiation(id, 65536);
+    return id;
+}
+
+TEST_F(pv_model, panel_voltage_is_sum_of_cell_voltages)
+{
+    model_cell_remove_all();
+    add_test_cell(6, 3, 1);
+    add_test_cell(6, 3, 1);
+
+    /* no current: close to the sum of the open circuit voltages */
+    EXPECT_THAT(model_calc_panel_voltage(0) / 65536.0, DoubleNear(12, 0.05));
+    /* past the short circuit current nothing is left */
+    EXPECT_THAT(model_calc_panel_voltage(3 * 65536), Lt(65536 / 50));
+
+    model_cell_remove_all();
+}
+
+static const struct cell_t* find_test_cell(unsigned char id)
+{
+    struct cell_t* cell;
+    for(cell = active_panel; cell; cell = cell->next)
+        if(cell->id == id)
+            return cell;
+    return NULL;
+}
+
+TEST_F(pv_model, cells_outside_fractional_formats_use_q16_model)
+{
+    model_cell_remove_all();
+    /* voc doesn't fit Q5.11 */
+    const struct cell_t* cell = find_test_cell(add_test_cell(20, 3, 1));
+    ASSERT_THAT(cell, NotNull());
+    EXPECT_THAT(cell->fractional, Eq(0));
+
+    for(_Q16 current = 0; current <= 4 * 65536; current += 65536 / 8)
+        EXPECT_THAT(model_calc_panel_voltage(current),
+                    Eq(calc_voltage(&cell->params, 0, current)))
+            << "current " << current / 65536.0;
+
+    /* in series with one that does */
+    const struct cell_t* fract = find_test_cell(add_test_cell(6, 3, 1));
+    ASSERT_THAT(fract, NotNull());
+    EXPECT_THAT(fract->fractional, Eq(1));
+    EXPECT_THAT(model_calc_panel_voltage(0) / 65536.0, DoubleNear(26, 0.05));
+
+    model_cell_remove_all();
+}
+
+TEST_F(pv_model, find_next_returns_cells_in_id_order)
+{
+    struct pv_cell_t params;
+    unsigned short version;
+
+    model_cell_remove_all();
+    unsigned char a = add_test_cell(1, 3, 1);
+    unsigned char b = add_test_cell(2, 3, 1);
+    unsigned char c = add_test_cell(3, 3, 1);
+    ASSERT_THAT(a, Lt(b));
+    ASSERT_THAT(b, Lt(c));
+
+    EXPECT_THAT(model_cell_find_next(0, &params, &version), Eq(a));
+    EXPECT_THAT(params.voc, Eq(1 * 65536));
+    EXPECT_THAT(model_cell_find_next(a, &params, &version), Eq(b));
+    EXPECT_THAT(params.voc, Eq(2 * 65536));
+
+    /* removing a cell in between doesn't break the cursor */
+    model_cell_remove(b);
+    EXPECT_THAT(model_cell_find_next(a, &params, &version), Eq(c));
+    EXPECT_THAT(model_cell_find_next(c, &params, &version), Eq(0));
+
+    model_cell_remove_all();
+}
+
+TEST_F(pv_model, changes_are_versioned)
+{
+    struct pv_cell_t params;
+    unsigned short version, before;
+
+    model_cell_remove_all();
+    unsigned char a = add_test_cell(1, 3, 1);
+    unsigned char b = add_test_cell(2, 3, 1);
+
+    before = model_get_version();
+    model_set_thermal_voltage(b, 2 * 65536);
+    EXPECT_THAT(model_get_version(), Gt(before));
+
+    model_cell_find_next(0, &params, &version);
+    EXPECT_THAT(version, Le(before));
+    model_cell_find_next(a, &params, &version);
+    EXPECT_THAT(version, Eq(model_get_version()));
+
+    model_cell_remove_all();
+}
+
+TEST_F(pv_model, panel_short_circuit_current_is_largest_of_cells)
+{
+    model_cell_remove_all();
+    add_test_cell(6, 3, 1);
+    add_test_cell(6, 5, 1);
+    add_test_cell(6, 2, 1);
+
+    EXPECT_THAT(model_get_panel_short_circuit_current(), Eq(5 * 65536));
+
+    model_cell_remove_all();
+}
+
+TEST_F(pv_model, panel_irradiation_only_versions_changed_cells)
+{
+    _Q16 cell_g[2] = {65536, 32768};
+    model_cell_remove_all();
+    unsigned char a = add_test_cell(6, 3, 1);
+    unsigned char b = add_test_cell(6, 3, 1);
+    unsigned char c = add_test_cell(6, 3, 1);
+
+    unsigned short before = model_get_version();
+    model_set_panel_irradiation(65536, cell_g, 2);
+
+    EXPECT_THAT(model_get_relative_solar_irradiation(a), Eq(65536));
+    EXPECT_THAT(model_get_relative_solar_irradiation(b), Eq(32768));
+    EXPECT_THAT(model_get_relative_solar_irradiation(c), Eq(65536));
+    EXPECT_THAT(model_get_version(), Eq((unsigned short)(before + 1)));
+
+    /* cells without a value of their own follow the global one */
+    model_set_panel_irradiation(16384, cell_g, 0);
+    EXPECT_THAT(model_get_relative_solar_irradiation(a), Eq(16384));
+    EXPECT_THAT(model_get_relative_solar_irradiation(b), Eq(16384));
+
+    model_cell_remove_all();
+}
+
+TEST_F(pv_model, shadow_panel_replaces_active_panel_on_commit)
+{
+    struct pv_cell_t params = {6 * 65536, 3 * 65536, 65536, 65536};
+    model_cell_remove_all();
+    unsigned char old_cell = add_test_cell(6, 5, 1);
+
+    unsigned char new_cell = model_shadow_cell_add(&params);
+    EXPECT_THAT(new_cell, Ne(0));
+    EXPECT_THAT(model_get_panel_short_circuit_current(), Eq(5 * 65536));
+
+    model_shadow_commit();
+    EXPECT_THAT(model_get_panel_short_circuit_current(), Eq(3 * 65536));
+    EXPECT_THAT(model_get_short_circuit_current(old_cell), Eq(0));
+    EXPECT_THAT(model_get_short_circuit_current(new_cell), Eq(3 * 65536));
+
+    model_cell_remove_all();
+}
+
+TEST_F(pv_model, discarded_shadow_panel_leaves_active_panel_alone)
+{
+    struct pv_cell_t params = {6 * 65536, 3 * 65536, 65536, 65536};
+    model_cell_remove_all();
+    add_test_cell(6, 5, 1);
+
+    model_shadow_cell_add(&params);
+    model_shadow_discard();
+    model_shadow_commit();
+
+    /* committing an empty shadow leaves an empty panel */
+    EXPECT_THAT(model_cell_begin_iteration(), Eq(0));
+}
+
 #endif /* TESTING */
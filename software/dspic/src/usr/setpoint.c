@@ -0,0 +1,83 @@
+/*!
+ * @file setpoint.c
+ *
+ * The model is far too slow to evaluate for every conversion, so it is
+ * evaluated once per update at the present operating point. The regulator in
+ * the ADC interrupt tracks the resulting target in between.
+ *
+ * The target jumps whenever the model changes, e.g. when switching panels.
+ * The buck slews the output at DEFAULT_SLEW_RATE instead, which is still much
+ * faster than an MPPT tracks but slow enough not to upset its input stage.
+ */
+
+#include "usr/setpoint.h"
+#include "usr/pv_model.h"
+#include "drv/buck.h"
+#include "core/event.h"
+
+#define DEFAULT_SLEW_RATE 65536         /* 1 V/ms */
+
+static void on_update(unsigned int arg);
+
+/* -------------------------------------------------------------------------- */
+void setpoint_init(void)
+{
+    buck_set_slew_rate(DEFAULT_SLEW_RATE);
+    event_register_listener(EVENT_UPDATE, on_update);
+}
+
+/* -------------------------------------------------------------------------- */
+static void on_update(unsigned int arg)
+{
+    _Q16 current = buck_get_current_fast();
+    if(current < 0)
+        current = 0;
+
+    buck_regulator_set_target(model_calc_panel_voltage(current));
+}
+
+/* -------------------------------------------------------------------------- */
+/* Unit Tests */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+#include "gmock/gmock.h"
+
+using namespace ::testing;
+
+class setpoint : public Test
+{
+    virtual void SetUp()
+    {
+        event_deinit();
+        buck_init();
+        model_cell_remove_all();
+        setpoint_init();
+    }
+
+    virtual void TearDown()
+    {
+        model_cell_remove_all();
+        event_deinit();
+    }
+};
+
+/* -------------------------------------------------------------------------- */
+TEST_F(setpoint, target_follows_model_on_update)
+{
+    unsigned char id = model_cell_add();
+    model_set_open_circuit_voltage(id, 12 * 65536);
+    model_set_short_circuit_current(id, 3 * 65536);
+    model_set_thermal_voltage(id, 65536);
+    model_set_relative_solar_irradiation(id, 65536);
+
+    event_post(EVENT_UPDATE, 0);
+    event_dispatch_all();
+
+    /* nothing measured yet, the model is at open circuit */
+    EXPECT_THAT(buck_regulator_get_target(), Eq(model_calc_panel_voltage(0)));
+    EXPECT_THAT(buck_regulator_get_target(), Gt(11 * 65536));
+}
+
+#endif /* TESTING */
@@ -0,0 +1,415 @@
+/*!
+ * @file datasheet.c
+ *
+ * Derives the cells of a panel from the values found on its datasheet. Each
+ * panel is one record with these fields:
+ *
+ *   manufacturer, panel  names
+ *   voc, isc             open circuit voltage [V] and short circuit current
+ *                        [A] of the panel at STC
+ *   vmp, imp             voltage and current at the maximum power point
+ *   cells                number of cells in series
+ *   voc_coeff, isc_coeff temperature coefficients of voc and isc [%/K],
+ *                        optional
+ *   temperature          cell temperature [°C] to derive the cells for,
+ *                        optional, 25 (STC) if left out
+ *
+ * Records are either CSV lines below a header line naming the columns, in
+ * any order, or the objects of a JSON array, e.g.
+ *
+ *   [{"manufacturer": "Generic", "panel": "GP-100", "voc": 21.6, ...}]
+ *
+ * The model (see calc_voltage()) describes a cell as
+ *
+ *   I = isc * (g - exp((V - voc) / vt))
+ *
+ * with g = 1 at full irradiation, as the cells the serial commands create
+ * start with. voc and isc are taken straight from the datasheet and vt is
+ * what puts the maximum power point where the datasheet has it:
+ *
+ *   vt = (vmp - voc) / ln(1 - imp / isc)
+ *
+ * all voltages per cell. vmp is below voc and imp below isc, so vt is
+ * positive and the current falls as the voltage rises, which the bisection
+ * of the model relies on. Vmp and imp follow the temperature with the same
+ * coefficients as voc and isc.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "panels_db_gen.h"
+
+#define MAX_FIELDS          16
+#define MAX_FIELD_LENGTH    64
+
+/* Datasheets are specified at 25 °C */
+#define STC_TEMPERATURE     25.0
+
+struct record_t
+{
+    char keys[MAX_FIELDS][MAX_FIELD_LENGTH];
+    char values[MAX_FIELDS][MAX_FIELD_LENGTH];
+    unsigned count;
+};
+
+/* -------------------------------------------------------------------------- */
+static const char* lookup(const struct record_t* record, const char* key)
+{
+    unsigned i;
+    for(i = 0; i != record->count; ++i)
+        if(!strcmp(record->keys[i], key))
+            return record->values[i];
+    return NULL;
+}
+
+static const char* text(const struct record_t* record, const char* key)
+{
+    static char message[MAX_LINE_LENGTH];
+    const char* value = lookup(record, key);
+    if(!value || !*value)
+    {
+        snprintf(message, sizeof(message), "\"%s\" is missing", key);
+        fail(message);
+    }
+    return value;
+}
+
+static double number(const struct record_t* record,
+                     const char* key,
+                     int required,
+                     double fallback)
+{
+    static char message[MAX_LINE_LENGTH];
+    const char* value = required ? text(record, key) : lookup(record, key);
+    char* end;
+    double result;
+
+    if(!value || !*value)
+        return fallback;
+    result = strtod(value, &end);
+    if(end == value || *end || !isfinite(result))
+    {
+        snprintf(message, sizeof(message), "\"%s\" is not a number", key);
+        fail(message);
+    }
+    return result;
+}
+
+static int32_t to_q16(double value)
+{
+    if(fabs(value) >= 32768.0)
+        fail("derived parameter out of range");
+    return (int32_t)lround(value * 65536.0);
+}
+
+/* -------------------------------------------------------------------------- */
+static void add_panel(struct database_t* db, const struct record_t* record)
+{
+    double dt = number(record, "temperature", 0, STC_TEMPERATURE) -
+                STC_TEMPERATURE;
+    double voltage_scale = 1.0 + number(record, "voc_coeff", 0, 0.0) * dt / 100;
+    double current_scale = 1.0 + number(record, "isc_coeff", 0, 0.0) * dt / 100;
+    double voc = number(record, "voc", 1, 0.0) * voltage_scale;
+    double isc = number(record, "isc", 1, 0.0) * current_scale;
+    double vmp = number(record, "vmp", 1, 0.0) * voltage_scale;
+    double imp = number(record, "imp", 1, 0.0) * current_scale;
+    double cells = number(record, "cells", 1, 0.0);
+    struct cell_t cell;
+
+    if(cells < 1 || cells > 255 || cells != floor(cells))
+        fail("cells has to be a whole number between 1 and 255");
+    if(!(voc > 0 && isc > 0 && vmp > 0 && vmp < voc && imp > 0 && imp < isc))
+        fail("expected 0 < vmp < voc and 0 < imp < isc");
+
+    cell.params[0] = to_q16(voc / cells);
+    cell.params[1] = to_q16(isc);
+    cell.params[2] = to_q16((vmp - voc) / cells / log(1.0 - imp / isc));
+    cell.params[3] = to_q16(1.0);
+    if(cell.params[2] <= 0)
+        fail("the derived cell's current doesn't fall with its voltage");
+    database_add_cells(db, text(record, "manufacturer"),
+                       text(record, "panel"), (long)cells, &cell);
+}
+
+/* -------------------------------------------------------------------------- */
+static void copy_field(char* destination, const char* source)
+{
+    if(strlen(source) >= MAX_FIELD_LENGTH)
+        fail("field too long");
+    strcpy(destination, source);
+}
+
+static void read_csv(struct database_t* db, FILE* in)
+{
+    char line[MAX_LINE_LENGTH];
+    char keys[MAX_FIELDS][MAX_FIELD_LENGTH];
+    unsigned key_count = 0, i;
+    struct record_t record;
+    char* cursor;
+
+    while(fgets(line, sizeof(line), in))
+    {
+        ++line_number;
+        cursor = trim(line);
+        if(!*cursor || *cursor == '#')
+            continue;
+
+        for(i = 0; cursor; ++i)
+        {
+            if(i == MAX_FIELDS)
+                fail("too many columns");
+            copy_field(key_count ? record.values[i] : keys[i],
+                       trim(strsep(&cursor, ",")));
+        }
+
+        if(!key_count)
+        {
+            key_count = i;
+            continue;
+        }
+        if(i != key_count)
+            fail("number of fields doesn't match the header");
+        for(i = 0; i != key_count; ++i)
+            strcpy(record.keys[i], keys[i]);
+        record.count = key_count;
+        add_panel(db, &record);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*
+ * Just enough JSON for an array of flat objects. Values are kept as text,
+ * nested arrays and objects are rejected.
+ */
+static const char* skip_space(const char* p)
+{
+    for(; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; ++p)
+        if(*p == '\n')
+            ++line_number;
+    return p;
+}
+
+static const char* expect(const char* p, char c)
+{
+    static char message[] = "expected ' '";
+    p = skip_space(p);
+    if(*p != c)
+    {
+        message[10] = c;
+        fail(message);
+    }
+    return p + 1;
+}
+
+static const char* read_string(const char* p, char* out)
+{
+    unsigned length = 0;
+
+    p = expect(p, '"');
+    for(; *p != '"'; ++p)
+    {
+        if(!*p || *p == '\n')
+            fail("unterminated string");
+        if(*p == '\\')
+        {
+            ++p;
+            if(*p == 'u')
+            {
+                /* names are plain ASCII on the display anyway */
+                if(strlen(p) < 5)
+                    fail("unterminated string");
+                p += 4;
+                out[length++] = '?';
+            }
+            else
+                out[length++] = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+        }
+        else
+            out[length++] = *p;
+        if(length == MAX_FIELD_LENGTH)
+            fail("field too long");
+    }
+    out[length] = '\0';
+    return p + 1;
+}
+
+static const char* read_value(const char* p, char* out)
+{
+    unsigned length = 0;
+
+    p = skip_space(p);
+    if(*p == '"')
+        return read_string(p, out);
+    if(*p == '{' || *p == '[')
+        fail("nested values aren't supported");
+    for(; *p && !strchr(",}] \t\r\n", *p); ++p)
+    {
+        out[length++] = *p;
+        if(length == MAX_FIELD_LENGTH)
+            fail("field too long");
+    }
+    out[length] = '\0';
+    if(!strcmp(out, "null"))
+        out[0] = '\0';
+    return p;
+}
+
+static void read_json(struct database_t* db, FILE* in)
+{
+    struct record_t record;
+    char* buffer = NULL;
+    size_t size = 0, length = 0;
+    const char* p;
+
+    do
+    {
+        size += 4096;
+        if(!(buffer = realloc(buffer, size + 1)))
+            fail("out of memory");
+        length += fread(buffer + length, 1, size - length, in);
+    } while(length == size);
+    buffer[length] = '\0';
+
+    line_number = 1;
+    p = skip_space(expect(buffer, '['));
+    if(*p == ']')
+        ++p;
+    else for(;;)
+    {
+        p = expect(p, '{');
+        record.count = 0;
+        p = skip_space(p);
+        if(*p == '}')
+            ++p;
+        else for(;;)
+        {
+            if(record.count == MAX_FIELDS)
+                fail("too many fields");
+            p = read_string(p, record.keys[record.count]);
+            p = expect(p, ':');
+            p = read_value(p, record.values[record.count++]);
+            p = skip_space(p);
+            if(*p == '}')
+            {
+                ++p;
+                break;
+            }
+            p = expect(p, ',');
+        }
+        add_panel(db, &record);
+        p = skip_space(p);
+        if(*p == ']')
+            break;
+        p = expect(p, ',');
+    }
+    free(buffer);
+}
+
+/* -------------------------------------------------------------------------- */
+void read_datasheets(struct database_t* db, FILE* in, int json)
+{
+    if(json)
+        read_json(db, in);
+    else
+        read_csv(db, in);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Tests, run with make test */
+/* -------------------------------------------------------------------------- */
+
+#ifdef TESTING
+
+static int failures = 0;
+
+static void check(int condition, const char* what)
+{
+    if(!condition)
+    {
+        fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+/* The model of calc_voltage() for all cells of a panel in series */
+static double panel_current(const struct panel_t* panel, double voltage)
+{
+    const int32_t* params = panel->cells[0].params;
+    double voc = params[0] / 65536.0, isc = params[1] / 65536.0;
+    double vt = params[2] / 65536.0, g = params[3] / 65536.0;
+    return isc * (g - exp((voltage / panel->count - voc) / vt));
+}
+
+/* The example of the README */
+static void test_derived_panel_follows_the_datasheet(void)
+{
+    static const char csv[] =
+        "manufacturer, panel, voc, isc, vmp, imp, cells, voc_coeff, isc_coeff\n"
+        "Generic, GP-100M, 21.6, 6.11, 18.0, 5.56, 36, -0.31, 0.05\n";
+    static struct database_t db;
+    const struct panel_t* panel;
+    double voltage, power, peak_power = 0, peak_voltage = 0;
+    FILE* in = fmemopen((void*)csv, sizeof(csv) - 1, "r");
+
+    read_datasheets(&db, in, 0);
+    fclose(in);
+    panel = &db.panels[0];
+
+    check(db.panel_count == 1 && panel->count == 36, "36 cells");
+    check(panel->cells[0].params[2] > 0, "vt is positive");
+    check(panel->cells[0].params[3] == 65536, "g is 1");
+    check(fabs(panel_current(panel, 0) - 6.11) < 0.01, "I(0) is isc");
+    check(fabs(panel_current(panel, 21.6)) < 0.01, "I(voc) is 0");
+    check(fabs(panel_current(panel, 18.0) - 5.56) < 0.01, "I(vmp) is imp");
+
+    for(voltage = 0; voltage < 21.6; voltage += 0.01)
+    {
+        power = voltage * panel_current(panel, voltage);
+        if(power > peak_power)
+        {
+            peak_power = power;
+            peak_voltage = voltage;
+        }
+    }
+    check(fabs(peak_voltage - 18.0) < 0.02 * 18.0, "P peaks at vmp");
+    check(fabs(peak_power - 18.0 * 5.56) < 0.01 * 18.0 * 5.56,
+          "P peaks at vmp * imp");
+}
+
+/* Each newline counts once, or errors point at the wrong line */
+static void test_json_lines_are_counted_once(void)
+{
+    static const char json[] =
+        "[\n"
+        "  {\"manufacturer\": \"Generic\", \"panel\": \"GP-100M\",\n"
+        "   \"voc\": 21.6, \"isc\": 6.11, \"vmp\": 18.0, \"imp\": 5.56,\n"
+        "   \"cells\": 36}\n"
+        "]\n";
+    static const char empty[] = "[\n\n]\n";
+    static struct database_t db, empty_db;
+    FILE* in = fmemopen((void*)json, sizeof(json) - 1, "r");
+
+    read_datasheets(&db, in, 1);
+    fclose(in);
+    check(db.panel_count == 1, "one panel from JSON");
+    check(line_number == 5, "JSON ends on line 5");
+
+    in = fmemopen((void*)empty, sizeof(empty) - 1, "r");
+    read_datasheets(&empty_db, in, 1);
+    fclose(in);
+    check(line_number == 3, "empty JSON array ends on line 3");
+}
+
+int main(void)
+{
+    input_name = "test";
+    test_derived_panel_follows_the_datasheet();
+    test_json_lines_are_counted_once();
+    if(failures)
+        return EXIT_FAILURE;
+    fprintf(stderr, "datasheet tests passed\n");
+    return EXIT_SUCCESS;
+}
+
+#endif /* TESTING */
@@ -0,0 +1,372 @@
+/*!
+ * @file image.c
+ *
+ * Collects the panels and encodes them into the image read by
+ * dspic/src/usr/panels_db.c, see there for the format.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "panels_db_gen.h"
+
+const char* input_name;
+unsigned line_number;
+
+/* -------------------------------------------------------------------------- */
+void fail(const char* message)
+{
+    fprintf(stderr, "%s:%u: %s\n", input_name, line_number, message);
+    exit(EXIT_FAILURE);
+}
+
+static void* grow(void* array, unsigned count, size_t size)
+{
+    array = realloc(array, (count + 1) * size);
+    if(!array)
+        fail("out of memory");
+    return array;
+}
+
+/* -------------------------------------------------------------------------- */
+static void copy_name(char* name, const char* field)
+{
+    if(!*field)
+        fail("empty name");
+    if(strlen(field) > PANELS_DB_MAX_NAME_LENGTH)
+        fprintf(stderr, "%s:%u: warning: \"%s\" is cut off after %d "
+                "characters\n", input_name, line_number, field,
+                PANELS_DB_MAX_NAME_LENGTH);
+    strncpy(name, field, PANELS_DB_MAX_NAME_LENGTH);
+    name[PANELS_DB_MAX_NAME_LENGTH] = '\0';
+}
+
+/* -------------------------------------------------------------------------- */
+void database_add_cells(struct database_t* db,
+                        const char* manufacturer,
+                        const char* panel_name,
+                        long count,
+                        const struct cell_t* cell)
+{
+    char name[PANELS_DB_MAX_NAME_LENGTH + 1];
+    struct panel_t* panel;
+    unsigned i;
+
+    copy_name(name, manufacturer);
+    if(!db->manufacturer_count ||
+       strcmp(db->manufacturers[db->manufacturer_count - 1].name, name))
+    {
+        for(i = 0; i != db->manufacturer_count; ++i)
+            if(!strcmp(db->manufacturers[i].name, name))
+                fail("panels of a manufacturer have to follow each other");
+        db->manufacturers = grow(db->manufacturers, db->manufacturer_count,
+                                 sizeof(*db->manufacturers));
+        strcpy(db->manufacturers[db->manufacturer_count].name, name);
+        db->manufacturers[db->manufacturer_count].first_panel = db->panel_count;
+        db->manufacturers[db->manufacturer_count].panel_count = 0;
+        ++db->manufacturer_count;
+    }
+
+    copy_name(name, panel_name);
+    panel = db->panel_count ? &db->panels[db->panel_count - 1] : NULL;
+    if(!panel ||
+       db->manufacturers[db->manufacturer_count - 1].first_panel ==
+           db->panel_count ||
+       strcmp(panel->name, name))
+    {
+        db->panels = grow(db->panels, db->panel_count, sizeof(*db->panels));
+        panel = &db->panels[db->panel_count++];
+        strcpy(panel->name, name);
+        panel->cells = NULL;
+        panel->count = 0;
+        ++db->manufacturers[db->manufacturer_count - 1].panel_count;
+    }
+
+    if(count < 1 || panel->count + count > 255)
+        fail("a panel has between 1 and 255 cells");
+    while(count--)
+    {
+        panel->cells = grow(panel->cells, panel->count, sizeof(*panel->cells));
+        panel->cells[panel->count++] = *cell;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Same as panels_db_letter_index() on the device */
+static unsigned letter_index(char c)
+{
+    unsigned char letter = (unsigned char)c;
+
+    if(letter >= 'a' && letter <= 'z')
+        letter -= 'a' - 'A';
+    if(letter < 'A')
+        return 0;
+    if(letter > 'Z')
+        return PANELS_DB_INDEX_WORDS - 1;
+    return letter - 'A' + 1;
+}
+
+/* By index letter first, so the device can bisect on it */
+static int compare_names(const char* a, const char* b)
+{
+    int difference = (int)letter_index(*a) - (int)letter_index(*b);
+    return difference ? difference : strcasecmp(a, b);
+}
+
+static int compare_manufacturers(const void* a, const void* b)
+{
+    return compare_names(((const struct manufacturer_t*)a)->name,
+                         ((const struct manufacturer_t*)b)->name);
+}
+
+static int compare_panels(const void* a, const void* b)
+{
+    return compare_names(((const struct panel_t*)a)->name,
+                         ((const struct panel_t*)b)->name);
+}
+
+static void sort_database(struct database_t* db)
+{
+    struct panel_t* panels = malloc(db->panel_count * sizeof(*panels));
+    struct manufacturer_t* manufacturer;
+    unsigned panel_count = 0, i;
+
+    if(!panels)
+        fail("out of memory");
+
+    qsort(db->manufacturers, db->manufacturer_count,
+          sizeof(*db->manufacturers), compare_manufacturers);
+    for(i = 0; i != db->manufacturer_count; ++i)
+    {
+        manufacturer = &db->manufacturers[i];
+        memcpy(panels + panel_count, db->panels + manufacturer->first_panel,
+               manufacturer->panel_count * sizeof(*panels));
+        qsort(panels + panel_count, manufacturer->panel_count,
+              sizeof(*panels), compare_panels);
+        manufacturer->first_panel = panel_count;
+        panel_count += manufacturer->panel_count;
+    }
+
+    free(db->panels);
+    db->panels = panels;
+}
+
+/* -------------------------------------------------------------------------- */
+static void emit(struct image_t* image, uint16_t word)
+{
+    if(image->length == FLASH_PANELS_DB_WORDS)
+    {
+        fprintf(stderr, "%s: the image doesn't fit into %d words\n",
+                input_name, FLASH_PANELS_DB_WORDS);
+        exit(EXIT_FAILURE);
+    }
+    image->words[image->length++] = word;
+}
+
+static uint16_t checksum(uint16_t sum, uint16_t word)
+{
+    return (uint16_t)((sum << 1) | (sum >> 15)) ^ word;
+}
+
+/*
+ * Finds which parameters differ from the first cell and the smallest shift
+ * that makes every difference fit into a signed word. The format word holds
+ * the shift in bits 8-12 and a mask of the parameters in bits 0-3.
+ */
+static uint16_t delta_format(const struct panel_t* panel)
+{
+    int64_t largest = 0, delta;
+    unsigned mask = 0, shift = 0, i, p;
+
+    for(i = 1; i != panel->count; ++i)
+        for(p = 0; p != 4; ++p)
+        {
+            delta = (int64_t)panel->cells[i].params[p] -
+                    panel->cells[0].params[p];
+            if(!delta)
+                continue;
+            mask |= 1u << p;
+            if(llabs(delta) > largest)
+                largest = llabs(delta);
+        }
+
+    /* one less than the largest word leaves room for rounding */
+    while((largest >> shift) > 32766)
+        ++shift;
+    if(shift > 15)
+    {
+        fprintf(stderr, "%s: cells of \"%s\" differ too much\n",
+                input_name, panel->name);
+        exit(EXIT_FAILURE);
+    }
+    if(shift)
+        fprintf(stderr, "warning: cells of \"%s\" are rounded to %g\n",
+                panel->name, ldexp(1.0, (int)shift - 16));
+    return (uint16_t)(shift << 8 | mask);
+}
+
+static void emit_cells(struct image_t* image, const struct panel_t* panel)
+{
+    unsigned shift = panel->format >> 8, i, p;
+    int64_t delta;
+
+    for(p = 0; p != 4; ++p)
+    {
+        emit(image, (uint16_t)panel->cells[0].params[p]);
+        emit(image, (uint16_t)((uint32_t)panel->cells[0].params[p] >> 16));
+    }
+    for(i = 1; i != panel->count; ++i)
+        for(p = 0; p != 4; ++p)
+            if(panel->format & (1u << p))
+            {
+                delta = (int64_t)panel->cells[i].params[p] -
+                        panel->cells[0].params[p];
+                if(shift)
+                    delta = (delta + ((int64_t)1 << (shift - 1))) >> shift;
+                emit(image, (uint16_t)(int16_t)delta);
+            }
+}
+
+/* -------------------------------------------------------------------------- */
+void build_image(struct image_t* image, struct database_t* db)
+{
+    uint16_t manufacturer_table, panel_table, string_table, cell_table;
+    uint16_t string_offset = 0, cell_offset, sum = 0;
+    unsigned string_bytes = 0, letter, i;
+
+    if(!db->manufacturer_count)
+    {
+        fprintf(stderr, "%s: no panels\n", input_name);
+        exit(EXIT_FAILURE);
+    }
+    sort_database(db);
+
+    /* the tables come in a fixed order, so all offsets are known up front */
+    for(i = 0; i != db->manufacturer_count; ++i)
+        string_bytes += strlen(db->manufacturers[i].name) + 1;
+    for(i = 0; i != db->panel_count; ++i)
+        string_bytes += strlen(db->panels[i].name) + 1;
+    manufacturer_table = PANELS_DB_HEADER_WORDS + PANELS_DB_INDEX_WORDS;
+    panel_table = (uint16_t)(manufacturer_table +
+            (db->manufacturer_count + 1) * PANELS_DB_MANUFACTURER_WORDS);
+    string_table = (uint16_t)(panel_table +
+            db->panel_count * PANELS_DB_PANEL_WORDS);
+    cell_table = (uint16_t)(string_table + (string_bytes + 1) / 2);
+
+    image->length = 0;
+    emit(image, PANELS_DB_MAGIC);
+    emit(image, 0);                                 /* length, see below */
+    emit(image, (uint16_t)db->manufacturer_count);
+    emit(image, (uint16_t)db->panel_count);
+    emit(image, manufacturer_table);
+    emit(image, panel_table);
+    emit(image, string_table);
+    emit(image, cell_table);
+
+    /* first manufacturer filed under each letter, or a later one */
+    for(letter = 0, i = 0; letter != PANELS_DB_INDEX_WORDS; ++letter)
+    {
+        while(i != db->manufacturer_count &&
+              letter_index(db->manufacturers[i].name[0]) < letter)
+            ++i;
+        emit(image, (uint16_t)i);
+    }
+
+    /* names are stored in table order, manufacturers first */
+    for(i = 0; i != db->manufacturer_count; ++i)
+    {
+        emit(image, string_offset);
+        emit(image, (uint16_t)db->manufacturers[i].first_panel);
+        string_offset += (uint16_t)strlen(db->manufacturers[i].name) + 1;
+    }
+    emit(image, 0);
+    emit(image, (uint16_t)db->panel_count);
+
+    cell_offset = cell_table;
+    for(i = 0; i != db->panel_count; ++i)
+    {
+        struct panel_t* panel = &db->panels[i];
+        panel->format = delta_format(panel);
+        emit(image, string_offset);
+        emit(image, cell_offset);
+        emit(image, (uint16_t)panel->count);
+        emit(image, panel->format);
+        string_offset += (uint16_t)strlen(panel->name) + 1;
+        cell_offset += PANELS_DB_CELL_WORDS + (panel->count - 1) *
+                       __builtin_popcount(panel->format & 0x0F);
+    }
+
+    /* string table, two characters per word, low byte first */
+    {
+        uint16_t word = 0;
+        unsigned byte = 0;
+        const char* name;
+        for(i = 0; i != db->manufacturer_count + db->panel_count; ++i)
+        {
+            name = i < db->manufacturer_count ?
+                   db->manufacturers[i].name :
+                   db->panels[i - db->manufacturer_count].name;
+            do
+            {
+                word |= (uint16_t)((unsigned char)*name << (byte & 1 ? 8 : 0));
+                if(byte++ & 1)
+                {
+                    emit(image, word);
+                    word = 0;
+                }
+            } while(*name++);
+        }
+        if(byte & 1)
+            emit(image, word);
+    }
+
+    for(i = 0; i != db->panel_count; ++i)
+        emit_cells(image, &db->panels[i]);
+
+    image->words[1] = (uint16_t)(image->length + 1);
+    for(i = 0; i != image->length; ++i)
+        sum = checksum(sum, image->words[i]);
+    emit(image, sum);
+}
+
+/* -------------------------------------------------------------------------- */
+void write_source(FILE* out, const struct image_t* image)
+{
+    unsigned i;
+
+    fprintf(out,
+        "/*!\n"
+        " * @file panels_db_image.c\n"
+        " *\n"
+        " * Built-in panel database. Generated by software/panels_db_gen from\n"
+        " * %s, do not edit.\n"
+        " */\n"
+        "\n"
+        "#include \"usr/panels_db_image.h\"\n"
+        "\n"
+        "#if defined(TESTING) || defined(BENCHMARK)\n"
+        "const uint16_t panels_db_image[FLASH_PANELS_DB_WORDS] = {\n"
+        "#else\n"
+        "/* sized to the whole region, so no code ends up in the unused part */\n"
+        "const uint16_t __attribute__((space(prog), address(FLASH_PANELS_DB_PAGE),\n"
+        "                              keep))\n"
+        "    panels_db_image[FLASH_PANELS_DB_WORDS] = {\n"
+        "#endif\n",
+        input_name);
+
+    for(i = 0; i != image->length; ++i)
+        fprintf(out, "%s0x%04X%s", i % 8 ? " " : "    ", image->words[i],
+                i + 1 == image->length ? "\n" : i % 8 == 7 ? ",\n" : ",");
+    fprintf(out, "};\n");
+}
+
+void write_binary(FILE* out, const struct image_t* image)
+{
+    unsigned i;
+    for(i = 0; i != image->length; ++i)
+    {
+        fputc(image->words[i] & 0xFF, out);
+        fputc(image->words[i] >> 8, out);
+    }
+}
@@ -0,0 +1,157 @@
+/*!
+ * @file panels_db_gen.c
+ *
+ * Builds the flash image of the panel database (see dspic/src/usr/panels_db.c
+ * for the format) and either writes it out or uploads it to the device.
+ *
+ * The built-in database comes from a cell list, panels.csv, where each line
+ * adds cells to a panel:
+ *
+ *   manufacturer, panel, cells, voc, isc, vt, g
+ *
+ * Lines of the same panel and panels of the same manufacturer have to follow
+ * each other, their order doesn't matter otherwise, the image is sorted by
+ * name. Empty lines and lines starting with # are skipped. With -d, the
+ * input holds datasheet values instead, see datasheet.c.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "panels_db_gen.h"
+
+/* -------------------------------------------------------------------------- */
+char* trim(char* field)
+{
+    char* end;
+    while(*field == ' ' || *field == '\t')
+        ++field;
+    end = field + strlen(field);
+    while(end != field && strchr(" \t\r\n", end[-1]))
+        *--end = '\0';
+    return field;
+}
+
+static int32_t parse_param(const char* field)
+{
+    char* end;
+    double value = strtod(field, &end);
+    if(end == field || *end || fabs(value) >= 32768.0)
+        fail("parameters have to be numbers between -32768 and 32768");
+    return (int32_t)lround(value * 65536.0);
+}
+
+/* -------------------------------------------------------------------------- */
+static void parse_line(struct database_t* db, char* line)
+{
+    char* fields[7];
+    struct cell_t cell;
+    unsigned i;
+
+    line = trim(line);
+    if(!*line || *line == '#')
+        return;
+
+    for(i = 0; i != 7; ++i)
+    {
+        fields[i] = trim(strsep(&line, ","));
+        if(!line && i != 6)
+            fail("expected manufacturer, panel, cells, voc, isc, vt, g");
+    }
+    if(line)
+        fail("too many fields");
+
+    for(i = 0; i != 4; ++i)
+        cell.params[i] = parse_param(fields[3 + i]);
+    database_add_cells(db, fields[0], fields[1],
+                       strtol(fields[2], NULL, 10), &cell);
+}
+
+void read_cell_list(struct database_t* db, FILE* in)
+{
+    char line[MAX_LINE_LENGTH];
+    while(fgets(line, sizeof(line), in))
+    {
+        ++line_number;
+        parse_line(db, line);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+#ifndef TESTING
+
+static int usage(void)
+{
+    fprintf(stderr,
+        "usage: panels_db_gen [-d] [-b] <input> <output>\n"
+        "       panels_db_gen [-d] -u <serial port> <input>\n"
+        "  -d  the input holds datasheet values, CSV or .json\n"
+        "  -b  write raw words instead of C source\n"
+        "  -u  upload the image to the device\n");
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+    static struct database_t db;
+    static struct image_t image;
+    const char* device = NULL;
+    const char* extension;
+    FILE* in;
+    FILE* out;
+    int binary = 0, datasheets = 0;
+
+    for(++argv, --argc; argc && **argv == '-'; ++argv, --argc)
+    {
+        if(!strcmp(*argv, "-b"))
+            binary = 1;
+        else if(!strcmp(*argv, "-d"))
+            datasheets = 1;
+        else if(!strcmp(*argv, "-u") && argc > 1)
+        {
+            device = *++argv;
+            --argc;
+        }
+        else
+            return usage();
+    }
+    if(argc != (device ? 1 : 2))
+        return usage();
+
+    input_name = argv[0];
+    if(!(in = fopen(input_name, "r")))
+    {
+        perror(input_name);
+        return EXIT_FAILURE;
+    }
+    if(datasheets)
+    {
+        extension = strrchr(input_name, '.');
+        read_datasheets(&db, in, extension && !strcmp(extension, ".json"));
+    }
+    else
+        read_cell_list(&db, in);
+    fclose(in);
+
+    build_image(&image, &db);
+    fprintf(stderr, "%u manufacturers, %u panels, %u of %d words\n",
+            db.manufacturer_count, db.panel_count, image.length,
+            FLASH_PANELS_DB_WORDS);
+
+    if(device)
+        return upload_image(device, &image) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    if(!(out = fopen(argv[1], binary ? "wb" : "w")))
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if(binary)
+        write_binary(out, &image);
+    else
+        write_source(out, &image);
+    fclose(out);
+    return EXIT_SUCCESS;
+}
+
+#endif /* TESTING */
@@ -0,0 +1,105 @@
+/*!
+ * @file panels_db_gen.h
+ *
+ * Shared between the parts of the panel database generator: the panel lists
+ * it reads, the image it builds from them and the upload to the device.
+ */
+
+#ifndef PANELS_DB_GEN_H
+#define PANELS_DB_GEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "drv/flash.h"
+#include "usr/panels_db.h"
+
+#define MAX_LINE_LENGTH 256
+
+struct cell_t
+{
+    int32_t params[4];          /* voc, isc, vt and g in Q16 */
+};
+
+struct panel_t
+{
+    char name[PANELS_DB_MAX_NAME_LENGTH + 1];
+    struct cell_t* cells;
+    unsigned count;
+    uint16_t format;            /* delta format, see build_image() */
+};
+
+struct manufacturer_t
+{
+    char name[PANELS_DB_MAX_NAME_LENGTH + 1];
+    unsigned first_panel;
+    unsigned panel_count;
+};
+
+struct database_t
+{
+    struct manufacturer_t* manufacturers;
+    unsigned manufacturer_count;
+    struct panel_t* panels;
+    unsigned panel_count;
+};
+
+struct image_t
+{
+    uint16_t words[FLASH_PANELS_DB_WORDS];
+    unsigned length;
+};
+
+/* Where the line being parsed came from, for error messages */
+extern const char* input_name;
+extern unsigned line_number;
+
+/*!
+ * @brief Prints the message along with the current input line and exits.
+ */
+void fail(const char* message);
+
+/*!
+ * @brief Removes leading and trailing white space in place.
+ */
+char* trim(char* field);
+
+/*!
+ * @brief Adds count identical cells to a panel. Panels are created on first
+ * use and have to be added in one go, as do the panels of a manufacturer.
+ */
+void database_add_cells(struct database_t* db,
+                        const char* manufacturer,
+                        const char* panel,
+                        long count,
+                        const struct cell_t* cell);
+
+/*!
+ * @brief Reads a cell list, one "manufacturer, panel, cells, voc, isc, vt,
+ * g" per line.
+ */
+void read_cell_list(struct database_t* db, FILE* in);
+
+/*!
+ * @brief Reads datasheet values from CSV with a header line or from a JSON
+ * array of objects, and derives the cells from them. See datasheet.c.
+ */
+void read_datasheets(struct database_t* db, FILE* in, int json);
+
+/*!
+ * @brief Encodes the database into the format read by panels_db.c. Sorts the
+ * manufacturers and panels first, the device relies on their order. Exits if
+ * it doesn't fit into the flash region.
+ */
+void build_image(struct image_t* image, struct database_t* db);
+
+void write_source(FILE* out, const struct image_t* image);
+void write_binary(FILE* out, const struct image_t* image);
+
+/*!
+ * @brief Sends the image to the device, resuming an earlier upload of the
+ * same image if the device still has it. See upload.c.
+ * @return Returns 0 on success.
+ */
+int upload_image(const char* device, const struct image_t* image);
+
+#endif /* PANELS_DB_GEN_H */
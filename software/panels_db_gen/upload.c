@@ -0,0 +1,252 @@
+/*!
+ * @file upload.c
+ *
+ * Streams an image to the device with the 'f' commands, see uart.c. Every
+ * command carries a sequence number, so its reply can be told apart from
+ * anything else the device sends, and the next block is only sent once the
+ * previous one was answered. Blocks are CRC checked by the device, a block
+ * that got lost or damaged is simply sent again.
+ *
+ * The device remembers how far an upload got. If it still holds the start of
+ * the same image (same length and checksum), the upload continues from the
+ * first missing word instead of starting over.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+#include "panels_db_gen.h"
+
+/* Per command, the device answers within a few ms unless a reply got lost */
+#define REPLY_TIMEOUT_MS    500
+#define MAX_ATTEMPTS        5
+
+struct port_t
+{
+    int fd;
+    unsigned char sequence;
+    char line[MAX_LINE_LENGTH];
+    unsigned length;
+};
+
+/* -------------------------------------------------------------------------- */
+static int open_port(struct port_t* port, const char* device)
+{
+    struct termios tio;
+
+    port->fd = open(device, O_RDWR | O_NOCTTY);
+    if(port->fd < 0 || tcgetattr(port->fd, &tio))
+    {
+        perror(device);
+        return -1;
+    }
+
+    /* 115200 8E1, the rate the device starts with */
+    cfmakeraw(&tio);
+    tio.c_cflag |= PARENB | CLOCAL | CREAD;
+    tio.c_cflag &= ~(PARODD | CSTOPB | CRTSCTS);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    if(tcsetattr(port->fd, TCSANOW, &tio))
+    {
+        perror(device);
+        return -1;
+    }
+    tcflush(port->fd, TCIOFLUSH);
+
+    port->sequence = 0;
+    port->length = 0;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/*
+ * Reads the reply to the current sequence number into reply, without the
+ * "#<n>" prefix. Returns -1 on timeout.
+ */
+static int read_reply(struct port_t* port, char* reply, size_t size)
+{
+    char prefix[8];
+    struct timeval timeout;
+    fd_set fds;
+    char c;
+
+    snprintf(prefix, sizeof(prefix), "#%u", port->sequence);
+    for(;;)
+    {
+        FD_ZERO(&fds);
+        FD_SET(port->fd, &fds);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = REPLY_TIMEOUT_MS * 1000;
+        if(select(port->fd + 1, &fds, NULL, NULL, &timeout) <= 0 ||
+           read(port->fd, &c, 1) != 1)
+            return -1;
+
+        if(c != '\n')
+        {
+            if(port->length < sizeof(port->line) - 1)
+                port->line[port->length++] = c;
+            continue;
+        }
+
+        /* sweep points, dumps and cell updates may come in between */
+        port->line[port->length] = '\0';
+        port->length = 0;
+        if(!strncmp(port->line, prefix, strlen(prefix)) &&
+           (port->line[strlen(prefix)] < '0' ||
+            port->line[strlen(prefix)] > '9'))
+        {
+            snprintf(reply, size, "%s", port->line + strlen(prefix));
+            return 0;
+        }
+    }
+}
+
+/* Sends a command and waits for its reply, retrying if there is none */
+static int transact(struct port_t* port,
+                    const char* command,
+                    char* reply,
+                    size_t size)
+{
+    char line[MAX_LINE_LENGTH];
+    int attempt;
+
+    for(attempt = 0; attempt != MAX_ATTEMPTS; ++attempt)
+    {
+        ++port->sequence;
+        snprintf(line, sizeof(line), "#%u%s\n", port->sequence, command);
+        if(write(port->fd, line, strlen(line)) != (ssize_t)strlen(line))
+        {
+            perror("write");
+            return -1;
+        }
+        if(!read_reply(port, reply, size))
+            return 0;
+    }
+
+    fprintf(stderr, "no reply to \"%s\"\n", command);
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+static uint16_t crc16(uint16_t crc, uint16_t word)
+{
+    unsigned bit;
+
+    crc ^= (word & 0xFF) << 8;
+    for(bit = 0; bit != 16; ++bit)
+    {
+        if(bit == 8)
+            crc ^= word & 0xFF00;
+        if(crc & 0x8000)
+            crc = (uint16_t)(crc << 1) ^ 0x1021;
+        else
+            crc = (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static void format_block(char* command,
+                         const struct image_t* image,
+                         unsigned offset,
+                         unsigned count)
+{
+    uint16_t crc = crc16(0xFFFF, (uint16_t)offset);
+    unsigned i;
+
+    command += sprintf(command, "fw%u,", offset);
+    for(i = 0; i != count; ++i)
+    {
+        command += sprintf(command, "%04X", image->words[offset + i]);
+        crc = crc16(crc, image->words[offset + i]);
+    }
+    sprintf(command, ",%u", crc);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Returns the first word to send, 0 if the upload has to start over */
+static long resume_offset(struct port_t* port, const struct image_t* image)
+{
+    char reply[MAX_LINE_LENGTH];
+    unsigned received, length, checksum;
+
+    if(transact(port, "f", reply, sizeof(reply)))
+        return -1;
+    if(sscanf(reply, "f%u,%u,%u", &received, &length, &checksum) == 3 &&
+       length == image->length &&
+       checksum == image->words[image->length - 1] &&
+       received <= length)
+        return received;
+    return 0;
+}
+
+int upload_image(const char* device, const struct image_t* image)
+{
+    char command[MAX_LINE_LENGTH];
+    char reply[MAX_LINE_LENGTH];
+    struct port_t port;
+    unsigned offset, count, received, stalled = 0;
+    long resume;
+
+    if(open_port(&port, device))
+        return -1;
+
+    if((resume = resume_offset(&port, image)) < 0)
+        goto fail;
+    offset = (unsigned)resume;
+    if(offset)
+        fprintf(stderr, "resuming at word %u\n", offset);
+    else
+    {
+        snprintf(command, sizeof(command), "fb%u,%u", image->length,
+                 image->words[image->length - 1]);
+        if(transact(&port, command, reply, sizeof(reply)) ||
+           strcmp(reply, "fb1"))
+        {
+            fprintf(stderr, "device refused the image\n");
+            goto fail;
+        }
+    }
+
+    while(offset != image->length)
+    {
+        count = image->length - offset;
+        count = count < PANELS_DB_BLOCK_WORDS ? count : PANELS_DB_BLOCK_WORDS;
+        format_block(command, image, offset, count);
+        if(transact(&port, command, reply, sizeof(reply)) ||
+           sscanf(reply, "fw%u", &received) != 1)
+            goto fail;
+
+        /* the device says where it wants to continue */
+        if(received == offset)
+        {
+            if(++stalled == MAX_ATTEMPTS)
+            {
+                fprintf(stderr, "block at word %u keeps failing\n", offset);
+                goto fail;
+            }
+            continue;
+        }
+        stalled = 0;
+        offset = received;
+        fprintf(stderr, "\r%u of %u words", offset, image->length);
+    }
+    fprintf(stderr, "\n");
+
+    if(transact(&port, "fc", reply, sizeof(reply)) || strcmp(reply, "fc1"))
+    {
+        fprintf(stderr, "device rejected the image\n");
+        goto fail;
+    }
+    close(port.fd);
+    return 0;
+
+fail:
+    fprintf(stderr, "upload failed, run again to resume\n");
+    close(port.fd);
+    return -1;
+}
@@ -1,5 +1,9 @@
 #include "models/comport.h"
 
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+
 // ----------------------------------------------------------------------------
 // C code for handling port open/close on linux
 // ----------------------------------------------------------------------------
@@ -15,7 +19,49 @@
 #include <termios.h>
 #include <sys/stat.h>
 
-static int open_port(const char* fd_name)
+/*
+ * Baud rates the device can negotiate, indexed the same way as the firmware's
+ * baud_brg_table in uart.c. Index 0 is what the device uses after a reset.
+ */
+static const speed_t baud_rates[] = {
+    B115200,
+    B230400,
+    B500000,
+    B1000000,
+    B1500000
+};
+static const int baud_rate_count = sizeof(baud_rates) / sizeof(*baud_rates);
+
+/*
+ * Every received byte takes up a slot in the device's 64 entry event queue
+ * until the main loop gets to it. Keep the unacknowledged part of the pipeline
+ * well below that, the timer and button events need room too.
+ */
+static const int max_bytes_in_flight = 40;
+
+/* How long the device has to answer the oldest command in flight */
+static const int command_timeout_ms = 500;
+
+/*
+ * The device switches to a new baud rate on its next 10ms update after the
+ * acknowledgement has left and waits BAUD_CONFIRM_TIMEOUT (500ms) for a "k".
+ */
+static const int device_update_period_ms = 10;
+static const int baud_confirm_timeout_ms = 500;
+
+static void set_port_baud_rate(int fd, int index)
+{
+    struct termios options;
+    tcgetattr(fd, &options);
+    cfsetispeed(&options, baud_rates[index]);
+    cfsetospeed(&options, baud_rates[index]);
+
+    /* wait for pending output to leave at the old rate and drop any input
+     * that was received at the old rate */
+    tcsetattr(fd, TCSAFLUSH, &options);
+}
+
+static int open_port(const char* fd_name, int baud_rate_index)
 {
     int fd = open(fd_name, O_RDWR | O_NOCTTY | O_NDELAY);
     if(fd == -1)
@@ -36,8 +82,8 @@ static int open_port(const char* fd_name)
         tcgetattr(fd, &options);
 
         /* baud rate */
-        cfsetispeed(&options, B115200);
-        cfsetospeed(&options, B115200);
+        cfsetispeed(&options, baud_rates[baud_rate_index]);
+        cfsetospeed(&options, baud_rates[baud_rate_index]);
 
         /* raw mode */
         cfmakeraw(&options);
@@ -91,7 +137,7 @@ ListenerThread::ListenerThread(QObject* parent, int fd) :
 // ----------------------------------------------------------------------------
 void ListenerThread::run()
 {
-    char buf;
+    char buf[256];
     isRunning = true;
 
     while(isRunning)
@@ -106,11 +152,16 @@ void ListenerThread::run()
             break;
         }
 
-        // File handle is valid, read one byte and emit it (if the byte is
-        // available of course). read() is non-blocking and could return
-        // nothing.
-        if(read(this->fd, &buf, 1) != -1)
-            emit byteReceived(buf);
+        // File handle is valid, read everything that has arrived and emit it.
+        // read() is non-blocking and could return nothing. Reading more than
+        // one byte per iteration is required for the higher baud rates, at
+        // 1.5 Mbaud 750 bytes arrive during the sleep below.
+        ssize_t len = read(this->fd, buf, sizeof(buf));
+        if(len > 0)
+        {
+            emit bytesReceived(QByteArray(buf, len));
+            continue;
+        }
 
         // Prevent 100% CPU
         this->msleep(5);
@@ -132,8 +183,15 @@ void ListenerThread::exit()
 // ----------------------------------------------------------------------------
 COMPort::COMPort() :
     listenerThread(nullptr),
-    fd(0)
+    fd(0),
+    baudRateIndex(0),
+    bytesInFlight(0),
+    nextSequenceNumber(0),
+    isReceivingFrame(false)
 {
+    this->commandTimer.setSingleShot(true);
+    this->connect(&this->commandTimer, SIGNAL(timeout()),
+                  this,                SLOT(onCommandTimeout()));
 }
 
 // ----------------------------------------------------------------------------
@@ -158,6 +216,8 @@ void COMPort::close()
 {
     this->stopListenerThread();
     this->closeFileDescriptor();
+    this->queuedCommands.clear();
+    this->dropCommandsInFlight();
 
     this->portName = "";
 }
@@ -165,19 +225,206 @@ void COMPort::close()
 // ----------------------------------------------------------------------------
 bool COMPort::send(const char* data)
 {
-    if(this->fd <= 0 || write(fd, data, 1) == -1)
+    size_t len = strlen(data);
+    if(this->fd <= 0 || write(fd, data, len) == -1)
     {
         // write failed, try to re-open connection
         if(!this->attemptReOpen())
             return false;
         // maybe it's open again?
-        if(write(fd, data, 1) == -1)
+        if(write(fd, data, len) == -1)
             return false;
     }
 
     return true;
 }
 
+// ----------------------------------------------------------------------------
+int COMPort::negotiateBaudRate()
+{
+    if(this->fd <= 0)
+        return -1;
+
+    // The device only ever starts at the default rate. If we're (still) at a
+    // previously negotiated rate, check whether the device is too.
+    if(this->baudRateIndex != 0 && !this->waitForReply("k", "k"))
+        this->setBaudRateIndex(0);
+
+    // try the fastest rate first and work our way down
+    for(int index = baud_rate_count - 1; index > this->baudRateIndex; --index)
+    {
+        QByteArray request = "b" + QByteArray::number(index) + "\n";
+        QByteArray acknowledge = "b" + QByteArray::number(index);
+        if(!this->waitForReply(request, acknowledge))
+            continue;
+
+        // device switches on its next update after the acknowledgement was
+        // sent. It has to see a "k" at the new rate or it falls back after
+        // 500ms. A "k" that arrives before the switch gets garbled, so give
+        // it one update and keep asking until the device would give up.
+        int oldIndex = this->baudRateIndex;
+        this->setBaudRateIndex(index);
+        QThread::msleep(2 * device_update_period_ms);
+        QElapsedTimer elapsed;
+        elapsed.start();
+        while(elapsed.elapsed() < baud_confirm_timeout_ms - 100)
+            if(this->waitForReply("k", "k", 50))
+                return this->baudRateIndex;
+
+        // didn't work, wait for the device to fall back too
+        this->setBaudRateIndex(oldIndex);
+        QThread::msleep(600);
+    }
+
+    return this->baudRateIndex;
+}
+
+// ----------------------------------------------------------------------------
+int COMPort::getBaudRateIndex() const
+{
+    return this->baudRateIndex;
+}
+
+// ----------------------------------------------------------------------------
+void COMPort::setBaudRateIndex(int index)
+{
+    this->baudRateIndex = index;
+    if(this->fd > 0)
+        set_port_baud_rate(this->fd, index);
+    this->replyBuffer.clear();
+}
+
+// ----------------------------------------------------------------------------
+bool COMPort::waitForReply(const QByteArray& request, const QByteArray& reply,
+                           int timeoutMs)
+{
+    // Replies arrive through the listener thread, so spin an event loop until
+    // the expected reply was received or we time out.
+    this->replyBuffer.clear();
+    if(!this->send(request.constData()))
+        return false;
+
+    QEventLoop loop;
+    QTimer timeout;
+    timeout.setSingleShot(true);
+    this->connect(&timeout, SIGNAL(timeout()), &loop, SLOT(quit()));
+    this->connect(this, SIGNAL(replyBufferChanged()), &loop, SLOT(quit()));
+    timeout.start(timeoutMs);
+    while(timeout.isActive() && !this->replyBuffer.contains(reply))
+        loop.exec();
+
+    return this->replyBuffer.contains(reply);
+}
+
+// ----------------------------------------------------------------------------
+int COMPort::sendCommand(const QByteArray& command)
+{
+    Command cmd;
+    cmd.sequenceNumber = this->nextSequenceNumber;
+    cmd.frame = "#" + QByteArray::number(cmd.sequenceNumber) + command + "\n";
+    this->nextSequenceNumber = (this->nextSequenceNumber + 1) & 0xFF;
+
+    this->queuedCommands.enqueue(cmd);
+    this->sendQueuedCommands();
+
+    return cmd.sequenceNumber;
+}
+
+// ----------------------------------------------------------------------------
+void COMPort::sendQueuedCommands()
+{
+    while(!this->queuedCommands.isEmpty())
+    {
+        // always let at least one command through, even if it's larger than
+        // the window
+        const Command& next = this->queuedCommands.head();
+        if(!this->commandsInFlight.isEmpty() &&
+           this->bytesInFlight + next.frame.size() > max_bytes_in_flight)
+            break;
+
+        Command cmd = this->queuedCommands.dequeue();
+        if(!this->send(cmd.frame.constData()))
+        {
+            emit commandLost(cmd.sequenceNumber);
+            continue;
+        }
+
+        this->bytesInFlight += cmd.frame.size();
+        this->commandsInFlight.append(cmd);
+        if(!this->commandTimer.isActive())
+            this->commandTimer.start(command_timeout_ms);
+    }
+}
+
+// ----------------------------------------------------------------------------
+void COMPort::processReplyFrame(const QByteArray& frame)
+{
+    // frame is "<n><reply>" without the leading '#' and the trailing newline
+    int digits = 0;
+    while(digits < frame.size() && frame[digits] >= '0' && frame[digits] <= '9')
+        ++digits;
+
+    // "#b<index>" without a sequence number: the device saw too many
+    // receive errors and is going back to a slower rate
+    if(digits == 0 && frame.startsWith('b'))
+    {
+        bool ok;
+        int index = frame.mid(1).toInt(&ok);
+        if(ok && index >= 0 && index < baud_rate_count)
+            this->setBaudRateIndex(index);
+        return;
+    }
+    if(digits == 0)
+        return;
+    int sequenceNumber = frame.left(digits).toInt();
+
+    // unknown number, probably a late reply to something we gave up on
+    bool isInFlight = false;
+    for(const Command& cmd : this->commandsInFlight)
+        if(cmd.sequenceNumber == sequenceNumber)
+            isInFlight = true;
+    if(!isInFlight)
+        return;
+
+    // The device answers in order. Anything before this reply got lost on
+    // the way (e.g. a framing error on the device side).
+    while(!this->commandsInFlight.isEmpty())
+    {
+        Command cmd = this->commandsInFlight.takeFirst();
+        this->bytesInFlight -= cmd.frame.size();
+        if(cmd.sequenceNumber == sequenceNumber)
+            break;
+        emit commandLost(cmd.sequenceNumber);
+    }
+
+    if(this->commandsInFlight.isEmpty())
+        this->commandTimer.stop();
+    else
+        this->commandTimer.start(command_timeout_ms);
+
+    emit replyReceived(sequenceNumber, frame.mid(digits));
+
+    this->sendQueuedCommands();
+}
+
+// ----------------------------------------------------------------------------
+void COMPort::dropCommandsInFlight()
+{
+    this->commandTimer.stop();
+    while(!this->commandsInFlight.isEmpty())
+        emit commandLost(this->commandsInFlight.takeFirst().sequenceNumber);
+    this->bytesInFlight = 0;
+}
+
+// ----------------------------------------------------------------------------
+void COMPort::onCommandTimeout()
+{
+    // The device stopped answering. Writes are only ever dropped, never
+    // resent, the caller knows best whether repeating a command is safe.
+    this->dropCommandsInFlight();
+    this->sendQueuedCommands();
+}
+
 // ----------------------------------------------------------------------------
 void COMPort::startListenerThread()
 {
@@ -185,9 +432,9 @@ void COMPort::startListenerThread()
         this->stopListenerThread();
 
     this->listenerThread = new ListenerThread(this, this->fd);
-    this->connect(listenerThread, SIGNAL(byteReceived(char)),
-                  this,           SLOT(onByteReceived(char)));
-    this->connect(listenerThread, SIGNAL(fileDescriptorUnexpectedlyClosed()),
+    this->connect(listenerThread, SIGNAL(bytesReceived(QByteArray)),
+                  this,           SLOT(onBytesReceived(QByteArray)));
+    this->connect(listenerThread, SIGNAL(fileDescriptorInvalidated()),
                   this,           SLOT(onFileDescriptorUnexpectedlyClosed()));
     this->listenerThread->start();
 }
@@ -219,7 +466,10 @@ bool COMPort::openFileDescriptor()
     if(this->fd > 0)
         this->closeFileDescriptor();
 
-    if((this->fd = open_port(this->portName.toLatin1().data())) == -1)
+    // re-opening keeps the last negotiated rate, negotiateBaudRate() checks
+    // whether the device still agrees
+    if((this->fd = open_port(this->portName.toLatin1().data(),
+                             this->baudRateIndex)) == -1)
         return false;
 
     return true;
@@ -247,16 +497,39 @@ bool COMPort::attemptReOpen()
 }
 
 // ----------------------------------------------------------------------------
-void COMPort::onByteReceived(char data)
+void COMPort::onBytesReceived(QByteArray data)
 {
-    char buf[2];
-    *buf = data;
-    buf[1] = '\0';
-    emit dataReceived(buf);
+    // keep the last few bytes around for negotiateBaudRate()
+    this->replyBuffer.append(data);
+    if(this->replyBuffer.size() > 64)
+        this->replyBuffer.remove(0, this->replyBuffer.size() - 64);
+    emit replyBufferChanged();
+
+    // pick out replies to sequenced commands, see sendCommand()
+    for(char c : data)
+    {
+        if(c == '#')
+        {
+            this->replyFrame.clear();
+            this->isReceivingFrame = true;
+        }
+        else if(this->isReceivingFrame && c == '\n')
+        {
+            this->isReceivingFrame = false;
+            this->processReplyFrame(this->replyFrame);
+        }
+        else if(this->isReceivingFrame)
+            this->replyFrame.append(c);
+    }
+
+    // QByteArray::constData() is always null-terminated
+    emit dataReceived(data.constData());
 }
 
 // ----------------------------------------------------------------------------
 void COMPort::onFileDescriptorUnexpectedlyClosed()
 {
     this->closeFileDescriptor();
+    this->isReceivingFrame = false;
+    this->dropCommandsInFlight();
 }
@@ -1,15 +1,19 @@
 #ifndef COM_UNIX_H
 #define COM_UNIX_H
 
+#include <QByteArray>
+#include <QList>
+#include <QQueue>
 #include <QString>
 #include <QThread>
+#include <QTimer>
 
 class ListenerThread : public QThread
 {
     Q_OBJECT
 
 signals:
-    void byteReceived(char byte);
+    void bytesReceived(QByteArray bytes);
     void fileDescriptorInvalidated();
 
 public:
@@ -29,6 +33,21 @@ class COMPort : public QObject
 
 signals:
     void dataReceived(const char* data);
+    void replyBufferChanged();
+
+    /*!
+     * \brief Emitted when the device answered a command sent with
+     * sendCommand(). The reply doesn't include the "#<n>" prefix or the
+     * trailing newline and is empty for commands that only get acknowledged.
+     */
+    void replyReceived(int sequenceNumber, QByteArray reply);
+
+    /*!
+     * \brief Emitted when a command sent with sendCommand() was never
+     * answered, either because a later command was answered first or because
+     * the device didn't respond in time.
+     */
+    void commandLost(int sequenceNumber);
 
 public:
     COMPort();
@@ -38,9 +57,36 @@ public:
     void close();
     bool send(const char* data);
 
+    /*!
+     * \brief Agrees on the highest baud rate both ends can handle.
+     *
+     * Starts with the fastest rate and falls back to slower rates if the
+     * device doesn't respond at the new rate. The result is remembered and
+     * used again when the port is re-opened.
+     * \note Blocks for up to a few seconds.
+     * \return Returns the index of the negotiated rate (0 = 115200 baud), or
+     * -1 if the port isn't open.
+     */
+    int negotiateBaudRate();
+    int getBaudRateIndex() const;
+
+    /*!
+     * \brief Queues a command for the device and returns immediately.
+     *
+     * The command is framed as "#<n><command>\n" and sent as soon as it fits
+     * into the window of unacknowledged bytes, so many commands can be in
+     * flight at once without overflowing the device's receive queue. The
+     * reply is reported through replyReceived() with the same sequence
+     * number.
+     * \param command A single command without terminator, e.g. "c3E80".
+     * \return Returns the sequence number (0-255) assigned to the command.
+     */
+    int sendCommand(const QByteArray& command);
+
 private slots:
-    void onByteReceived(char data);
+    void onBytesReceived(QByteArray data);
     void onFileDescriptorUnexpectedlyClosed();
+    void onCommandTimeout();
 
 private:
     void setPortName(const QString& portName);
@@ -49,10 +95,32 @@ private:
     bool openFileDescriptor();
     void closeFileDescriptor();
     bool attemptReOpen();
+    void setBaudRateIndex(int index);
+    bool waitForReply(const QByteArray& request, const QByteArray& reply,
+                      int timeoutMs = 200);
+    void sendQueuedCommands();
+    void processReplyFrame(const QByteArray& frame);
+    void dropCommandsInFlight();
+
+    struct Command
+    {
+        int sequenceNumber;
+        QByteArray frame;
+    };
 
     ListenerThread* listenerThread;
     int fd;
+    int baudRateIndex;
     QString portName;
+    QByteArray replyBuffer;
+
+    QQueue<Command> queuedCommands;
+    QList<Command> commandsInFlight;
+    int bytesInFlight;
+    int nextSequenceNumber;
+    QByteArray replyFrame;
+    bool isReceivingFrame;
+    QTimer commandTimer;
 };
 
 #endif // COM_UNIX_H
@@ -0,0 +1,134 @@
+#include "models/devicesweep.h"
+#include "models/comport.h"
+#include "models/pvarray.h"
+
+#include <cmath>
+
+// ----------------------------------------------------------------------------
+DeviceSweep::DeviceSweep(QObject* parent, COMPort* port) :
+    QObject(parent),
+    m_Port(port),
+    m_SequenceNumber(-1),
+    m_ExpectedPoints(0),
+    m_ReceivedPoints(0),
+    m_IsReceivingPoint(false)
+{
+    this->connect(m_Port, SIGNAL(replyReceived(int,QByteArray)),
+                  this,   SLOT(onReplyReceived(int,QByteArray)));
+    this->connect(m_Port, SIGNAL(commandLost(int)),
+                  this,   SLOT(onCommandLost(int)));
+    this->connect(m_Port, SIGNAL(dataReceived(const char*)),
+                  this,   SLOT(onDataReceived(const char*)));
+}
+
+// ----------------------------------------------------------------------------
+void DeviceSweep::start(int points)
+{
+    m_Samples.clear();
+    m_Samples.resize(points);
+    m_IsReceived.fill(false, points);
+    m_ExpectedPoints = 0;
+    m_ReceivedPoints = 0;
+    m_SequenceNumber = m_Port->sendCommand("s" + QByteArray::number(points));
+}
+
+// ----------------------------------------------------------------------------
+double DeviceSweep::calculateDeviation(const PVArray& pvarray) const
+{
+    double openCircuitVoltage = pvarray.calculateVoltage(0);
+    if(openCircuitVoltage <= 0.0)
+        return 0.0;
+
+    double deviation = 0.0;
+    for(const QPointF& sample : m_Samples)
+    {
+        double difference = std::fabs(pvarray.calculateVoltage(sample.y()) - sample.x());
+        deviation = (difference > deviation ? difference : deviation);
+    }
+
+    return deviation / openCircuitVoltage;
+}
+
+// ----------------------------------------------------------------------------
+void DeviceSweep::onReplyReceived(int sequenceNumber, QByteArray reply)
+{
+    if(sequenceNumber != m_SequenceNumber)
+        return;
+    m_SequenceNumber = -1;
+
+    // "s0" means the device refused, e.g. because it has no cells
+    m_ExpectedPoints = reply.mid(1).toInt();
+    if(!reply.startsWith('s') || m_ExpectedPoints != m_Samples.size())
+    {
+        m_ExpectedPoints = 0;
+        emit failed();
+    }
+}
+
+// ----------------------------------------------------------------------------
+void DeviceSweep::onCommandLost(int sequenceNumber)
+{
+    if(sequenceNumber != m_SequenceNumber)
+        return;
+    m_SequenceNumber = -1;
+    emit failed();
+}
+
+// ----------------------------------------------------------------------------
+void DeviceSweep::onDataReceived(const char* data)
+{
+    // Points arrive as unsolicited "p...\n" lines and can be split across
+    // several reads. No other message contains a 'p'.
+    for(; *data; ++data)
+    {
+        if(*data == 'p')
+        {
+            m_Line.clear();
+            m_IsReceivingPoint = true;
+        }
+        else if(m_IsReceivingPoint && *data == '\n')
+        {
+            m_IsReceivingPoint = false;
+            this->processPoint(m_Line);
+        }
+        else if(m_IsReceivingPoint)
+            m_Line.append(*data);
+    }
+}
+
+// ----------------------------------------------------------------------------
+void DeviceSweep::processPoint(const QByteArray& line)
+{
+    // line is "<index>I<milliamps>U<millivolts>"
+    if(m_ExpectedPoints == 0)
+        return;
+
+    int currentPos = line.indexOf('I');
+    int voltagePos = line.indexOf('U');
+    if(currentPos < 1 || voltagePos < currentPos)
+        return;
+
+    int index = line.left(currentPos).toInt();
+    if(index < 0 || index >= m_Samples.size())
+        return;
+
+    double current = line.mid(currentPos + 1, voltagePos - currentPos - 1).toInt() * 0.001;
+    double voltage = line.mid(voltagePos + 1).toInt() * 0.001;
+    m_Samples[index] = QPointF(voltage, current);
+    if(!m_IsReceived[index])
+    {
+        m_IsReceived[index] = true;
+        ++m_ReceivedPoints;
+    }
+
+    // the last point ends the sweep, anything missing by then was lost
+    if(index == m_Samples.size() - 1)
+    {
+        bool isComplete = (m_ReceivedPoints == m_ExpectedPoints);
+        m_ExpectedPoints = 0;
+        if(isComplete)
+            emit finished(m_Samples);
+        else
+            emit failed();
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef DEVICE_SWEEP_H
+#define DEVICE_SWEEP_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QPointF>
+#include <QVector>
+
+class COMPort;
+class PVArray;
+
+/*!
+ * \brief Asks the device to evaluate its own fixed point model and collects
+ * the resulting I-V curve.
+ *
+ * The device answers "s<points>" and then streams one
+ * "p<index>I<milliamps>U<millivolts>" line per point. Comparing the result
+ * with PVArray shows whether the two models still agree.
+ */
+class DeviceSweep : public QObject
+{
+    Q_OBJECT
+
+signals:
+    /*!
+     * \brief Emitted once all points were received. Samples are (V, I) pairs,
+     * ordered by rising current. If a point got lost on the way, failed() is
+     * emitted instead.
+     */
+    void finished(const QVector<QPointF>& samples);
+    void failed();
+
+public:
+    DeviceSweep(QObject* parent, COMPort* port);
+
+    /*!
+     * \brief Starts a new sweep. Any sweep in progress is abandoned.
+     * \param points Number of points between 0A and the largest short circuit
+     * current, 2-255.
+     */
+    void start(int points);
+
+    const QVector<QPointF>& getSamples() const
+        { return m_Samples; }
+
+    /*!
+     * \brief Compares the device's curve with the host's model.
+     * \return Returns the largest voltage difference relative to the open
+     * circuit voltage of the host model, e.g. 0.01 for 1%.
+     */
+    double calculateDeviation(const PVArray& pvarray) const;
+
+private slots:
+    void onReplyReceived(int sequenceNumber, QByteArray reply);
+    void onCommandLost(int sequenceNumber);
+    void onDataReceived(const char* data);
+
+private:
+    void processPoint(const QByteArray& line);
+
+    COMPort* m_Port;
+    int m_SequenceNumber;
+    int m_ExpectedPoints;
+    int m_ReceivedPoints;
+    bool m_IsReceivingPoint;
+    QByteArray m_Line;
+    QVector<QPointF> m_Samples;
+    QVector<bool> m_IsReceived;
+};
+
+#endif // DEVICE_SWEEP_H
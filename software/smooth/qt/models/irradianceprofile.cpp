@@ -0,0 +1,166 @@
+#include "models/irradianceprofile.h"
+#include "models/comport.h"
+
+#include <QFile>
+#include <QTimer>
+
+// the device's ring holds 4 keyframes, start playing once it's full
+static const int KEYFRAMES_BEFORE_START = 4;
+// the device takes at least one 10ms update to make room again
+static const int RETRY_INTERVAL = 50;
+
+// ----------------------------------------------------------------------------
+IrradianceProfile::IrradianceProfile(QObject* parent, COMPort* port) :
+    QObject(parent),
+    m_Port(port),
+    m_RetryTimer(new QTimer(this)),
+    m_SequenceNumber(-1),
+    m_NextKeyframe(0),
+    m_IsPlaying(false)
+{
+    m_RetryTimer->setSingleShot(true);
+    m_RetryTimer->setInterval(RETRY_INTERVAL);
+
+    this->connect(m_RetryTimer, SIGNAL(timeout()),
+                  this,         SLOT(pushNextKeyframe()));
+    this->connect(m_Port, SIGNAL(replyReceived(int,QByteArray)),
+                  this,   SLOT(onReplyReceived(int,QByteArray)));
+    this->connect(m_Port, SIGNAL(commandLost(int)),
+                  this,   SLOT(onCommandLost(int)));
+}
+
+// ----------------------------------------------------------------------------
+bool IrradianceProfile::loadCSV(const QString& fileName)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QVector<Keyframe> keyframes;
+    while(!file.atEnd())
+    {
+        QByteArray line = file.readLine().trimmed();
+        if(line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        QList<QByteArray> fields = line.split(',');
+        if(fields.size() < 2)
+            return false;
+
+        Keyframe keyframe;
+        bool timeOk, irradianceOk;
+        keyframe.time = fields[0].toInt(&timeOk);
+        keyframe.irradiance = fields[1].toDouble(&irradianceOk) * 0.01;
+        if(!timeOk || !irradianceOk)
+            return false;
+        if(!keyframes.isEmpty() && keyframe.time < keyframes.last().time)
+            return false;
+
+        for(int i = 2; i < fields.size(); ++i)
+        {
+            bool ok;
+            double cell = fields[i].trimmed().toDouble(&ok);
+            keyframe.cells.push_back(ok ? cell * 0.01 : -1.0);
+        }
+
+        keyframes.push_back(keyframe);
+    }
+
+    m_Keyframes = keyframes;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+void IrradianceProfile::start()
+{
+    m_RetryTimer->stop();
+    m_NextKeyframe = 0;
+    m_IsPlaying = false;
+    m_Port->sendCommand("is");
+    this->pushNextKeyframe();
+}
+
+// ----------------------------------------------------------------------------
+void IrradianceProfile::stop()
+{
+    m_RetryTimer->stop();
+    m_SequenceNumber = -1;
+    m_NextKeyframe = m_Keyframes.size();
+    m_Port->sendCommand("is");
+}
+
+// ----------------------------------------------------------------------------
+QByteArray IrradianceProfile::formatKeyframe(int index) const
+{
+    // "i<dt>G<permille>[,<permille>...]", cells that follow the global
+    // irradiance are left empty
+    const Keyframe& keyframe = m_Keyframes[index];
+    int dt = (index == 0 ? 0 : keyframe.time - m_Keyframes[index - 1].time);
+
+    QByteArray command = "i" + QByteArray::number(dt) +
+                         "G" + QByteArray::number(qRound(keyframe.irradiance * 1000));
+
+    int last = keyframe.cells.size() - 1;
+    while(last >= 0 && keyframe.cells[last] < 0.0)
+        --last;
+    for(int i = 0; i <= last; ++i)
+    {
+        command += ",";
+        if(keyframe.cells[i] >= 0.0)
+            command += QByteArray::number(qRound(keyframe.cells[i] * 1000));
+    }
+
+    return command;
+}
+
+// ----------------------------------------------------------------------------
+void IrradianceProfile::pushNextKeyframe()
+{
+    if(m_NextKeyframe >= m_Keyframes.size())
+        return;
+
+    m_SequenceNumber = m_Port->sendCommand(this->formatKeyframe(m_NextKeyframe));
+}
+
+// ----------------------------------------------------------------------------
+void IrradianceProfile::onReplyReceived(int sequenceNumber, QByteArray reply)
+{
+    if(sequenceNumber != m_SequenceNumber)
+        return;
+    m_SequenceNumber = -1;
+
+    if(reply == "if")
+    {
+        m_RetryTimer->start();
+        return;
+    }
+    if(!reply.startsWith("ik"))
+    {
+        emit failed();
+        return;
+    }
+
+    ++m_NextKeyframe;
+    bool allSent = (m_NextKeyframe == m_Keyframes.size());
+    if(!m_IsPlaying && (m_NextKeyframe == KEYFRAMES_BEFORE_START || allSent))
+    {
+        m_Port->sendCommand("ir");
+        m_IsPlaying = true;
+    }
+
+    if(allSent)
+        emit finished();
+    else if(reply.mid(2).toInt() > 0)
+        this->pushNextKeyframe();
+    else
+        m_RetryTimer->start();
+}
+
+// ----------------------------------------------------------------------------
+void IrradianceProfile::onCommandLost(int sequenceNumber)
+{
+    if(sequenceNumber != m_SequenceNumber)
+        return;
+    m_SequenceNumber = -1;
+    emit failed();
+}
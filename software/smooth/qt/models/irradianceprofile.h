@@ -0,0 +1,77 @@
+#ifndef IRRADIANCE_PROFILE_H
+#define IRRADIANCE_PROFILE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+class COMPort;
+class QTimer;
+
+/*!
+ * \brief Streams an irradiance profile to the device, which plays it back in
+ * real time.
+ *
+ * The device only holds a few keyframes, so they are pushed one command at a
+ * time while it plays. Each "i..." keyframe is answered with the number of
+ * free slots, "if" means the ring is full and the keyframe is sent again a
+ * little later.
+ */
+class IrradianceProfile : public QObject
+{
+    Q_OBJECT
+
+signals:
+    /*!
+     * \brief Emitted once the last keyframe was accepted by the device.
+     */
+    void finished();
+    void failed();
+
+public:
+    struct Keyframe
+    {
+        int time;               // ms since the start of the profile
+        double irradiance;      // relative, 1.0 = 100%
+        QVector<double> cells;  // per cell, negative to follow irradiance
+    };
+
+    IrradianceProfile(QObject* parent, COMPort* port);
+
+    /*!
+     * \brief Loads a profile from a CSV file with one keyframe per line:
+     * "<ms>,<percent>[,<cell 0 percent>,<cell 1 percent>,...]". Empty cell
+     * fields follow the global irradiance, lines starting with '#' are
+     * ignored. Times have to be ascending.
+     */
+    bool loadCSV(const QString& fileName);
+
+    void setKeyframes(const QVector<Keyframe>& keyframes)
+        { m_Keyframes = keyframes; }
+    const QVector<Keyframe>& getKeyframes() const
+        { return m_Keyframes; }
+
+    /*!
+     * \brief Replaces whatever the device is playing with this profile.
+     */
+    void start();
+    void stop();
+
+private slots:
+    void onReplyReceived(int sequenceNumber, QByteArray reply);
+    void onCommandLost(int sequenceNumber);
+    void pushNextKeyframe();
+
+private:
+    QByteArray formatKeyframe(int index) const;
+
+    COMPort* m_Port;
+    QTimer* m_RetryTimer;
+    QVector<Keyframe> m_Keyframes;
+    int m_SequenceNumber;
+    int m_NextKeyframe;
+    bool m_IsPlaying;
+};
+
+#endif // IRRADIANCE_PROFILE_H
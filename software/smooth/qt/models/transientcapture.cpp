@@ -0,0 +1,144 @@
+#include "models/transientcapture.h"
+#include "models/comport.h"
+
+// ----------------------------------------------------------------------------
+TransientCapture::TransientCapture(QObject* parent, COMPort* port) :
+    QObject(parent),
+    m_Port(port),
+    m_SequenceNumber(-1),
+    m_TriggerIndex(0),
+    m_ReceivedSamples(0),
+    m_SampleRate(0.0),
+    m_IsReceivingLine(false)
+{
+    this->connect(m_Port, SIGNAL(replyReceived(int,QByteArray)),
+                  this,   SLOT(onReplyReceived(int,QByteArray)));
+    this->connect(m_Port, SIGNAL(commandLost(int)),
+                  this,   SLOT(onCommandLost(int)));
+    this->connect(m_Port, SIGNAL(dataReceived(const char*)),
+                  this,   SLOT(onDataReceived(const char*)));
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::arm(int preTrigger, double currentStep)
+{
+    QByteArray command = "ta" + QByteArray::number(preTrigger);
+    if(currentStep > 0.0)
+        command += "D" + QByteArray::number(qRound(currentStep * 1000));
+
+    m_VoltageSamples.clear();
+    m_CurrentSamples.clear();
+    m_SampleRate = 0.0;
+    m_SequenceNumber = m_Port->sendCommand(command);
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::trigger()
+{
+    m_Port->sendCommand("tt");
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::onReplyReceived(int sequenceNumber, QByteArray reply)
+{
+    if(sequenceNumber != m_SequenceNumber)
+        return;
+    m_SequenceNumber = -1;
+
+    if(reply.startsWith("ta"))
+        emit armed();
+    else
+        emit failed();
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::onCommandLost(int sequenceNumber)
+{
+    if(sequenceNumber != m_SequenceNumber)
+        return;
+    m_SequenceNumber = -1;
+    emit failed();
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::onDataReceived(const char* data)
+{
+    // Samples arrive as unsolicited "q...\n" lines and can be split across
+    // several reads. No other message contains a 'q'.
+    for(; *data; ++data)
+    {
+        if(*data == 'q')
+        {
+            m_Line.clear();
+            m_IsReceivingLine = true;
+        }
+        else if(m_IsReceivingLine && *data == '\n')
+        {
+            m_IsReceivingLine = false;
+            this->processLine(m_Line);
+        }
+        else if(m_IsReceivingLine)
+            m_Line.append(*data);
+    }
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::processLine(const QByteArray& line)
+{
+    if(line.startsWith('h'))
+        this->processHeader(line.mid(1));
+    else if(line == "e")
+    {
+        // a header and every sample have to have made it
+        if(m_SampleRate > 0.0 &&
+           !m_VoltageSamples.isEmpty() &&
+           m_ReceivedSamples == m_VoltageSamples.size())
+            emit finished();
+        else
+            emit failed();
+        m_SampleRate = 0.0;
+    }
+    else
+        this->processSample(line);
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::processHeader(const QByteArray& header)
+{
+    // header is "<length>,<trigger>,<rate>"
+    QList<QByteArray> fields = header.split(',');
+    if(fields.size() != 3)
+        return;
+
+    int length = fields[0].toInt();
+    m_TriggerIndex = fields[1].toInt();
+    m_SampleRate = fields[2].toDouble();
+    m_ReceivedSamples = 0;
+
+    m_VoltageSamples.fill(QPointF(), length);
+    m_CurrentSamples.fill(QPointF(), length);
+}
+
+// ----------------------------------------------------------------------------
+void TransientCapture::processSample(const QByteArray& sample)
+{
+    // sample is "<index>U<millivolts>I<milliamps>"
+    if(m_SampleRate <= 0.0)
+        return;
+
+    int voltagePos = sample.indexOf('U');
+    int currentPos = sample.indexOf('I');
+    if(voltagePos < 1 || currentPos < voltagePos)
+        return;
+
+    int index = sample.left(voltagePos).toInt();
+    if(index < 0 || index >= m_VoltageSamples.size())
+        return;
+
+    double time = (index - m_TriggerIndex) * 1000.0 / m_SampleRate;
+    double voltage = sample.mid(voltagePos + 1, currentPos - voltagePos - 1).toInt() * 0.001;
+    double current = sample.mid(currentPos + 1).toInt() * 0.001;
+    m_VoltageSamples[index] = QPointF(time, voltage);
+    m_CurrentSamples[index] = QPointF(time, current);
+    ++m_ReceivedSamples;
+}
@@ -0,0 +1,76 @@
+#ifndef TRANSIENT_CAPTURE_H
+#define TRANSIENT_CAPTURE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QPointF>
+#include <QVector>
+
+class COMPort;
+
+/*!
+ * \brief Arms the device's transient capture and collects the samples once
+ * it has triggered.
+ *
+ * The device records voltage and current into a small ring at the ADC rate.
+ * It triggers on a current step, on request or on UVLO and then streams the
+ * window as "qh<length>,<trigger>,<rate>", one "q<index>U<millivolts>I<milliamps>"
+ * line per sample and a final "qe".
+ */
+class TransientCapture : public QObject
+{
+    Q_OBJECT
+
+signals:
+    /*!
+     * \brief Emitted once all samples were received. Samples are (t, V) and
+     * (t, I) pairs, t is in milliseconds relative to the trigger.
+     */
+    void finished();
+    void armed();
+    void failed();
+
+public:
+    TransientCapture(QObject* parent, COMPort* port);
+
+    /*!
+     * \brief Arms the capture. A capture that wasn't uploaded yet is dropped.
+     * \param preTrigger Samples to keep from before the trigger, 0-31.
+     * \param currentStep Triggers on a current step of this many amps between
+     * two samples. 0 only triggers on trigger() and UVLO.
+     */
+    void arm(int preTrigger, double currentStep);
+
+    const QVector<QPointF>& getVoltageSamples() const
+        { return m_VoltageSamples; }
+    const QVector<QPointF>& getCurrentSamples() const
+        { return m_CurrentSamples; }
+
+public slots:
+    /*!
+     * \brief Triggers an armed capture right away.
+     */
+    void trigger();
+
+private slots:
+    void onReplyReceived(int sequenceNumber, QByteArray reply);
+    void onCommandLost(int sequenceNumber);
+    void onDataReceived(const char* data);
+
+private:
+    void processLine(const QByteArray& line);
+    void processHeader(const QByteArray& header);
+    void processSample(const QByteArray& sample);
+
+    COMPort* m_Port;
+    int m_SequenceNumber;
+    int m_TriggerIndex;
+    int m_ReceivedSamples;
+    double m_SampleRate;
+    bool m_IsReceivingLine;
+    QByteArray m_Line;
+    QVector<QPointF> m_VoltageSamples;
+    QVector<QPointF> m_CurrentSamples;
+};
+
+#endif // TRANSIENT_CAPTURE_H
@@ -23,10 +23,14 @@ SOURCES +=  main.cpp \
             widgets/bat6widget.cpp \
             widgets/characteristicscurve2dwidget.cpp \
             widgets/characteristicscurve3dwidget.cpp \
+            widgets/transientplotwidget.cpp \
             models/pvcell.cpp \
             models/pvchain.cpp \
             models/pvarray.cpp \
             models/comport.cpp \
+            models/devicesweep.cpp \
+            models/transientcapture.cpp \
+            models/irradianceprofile.cpp \
             models/dummycurrentandvoltagesensor.cpp \
             plot/pvmodelfunctionbase.cpp \
             plot/ivcharacteristicscurve3d.cpp \
@@ -40,11 +44,15 @@ HEADERS  += widgets/mainwindow.h \
             widgets/bat6widget.h \
             widgets/characteristicscurve2dwidget.h \
             widgets/characteristicscurve3dwidget.h \
+            widgets/transientplotwidget.h \
             widgets/pvarrayplotwidgetbase.h \
             models/pvcell.h \
             models/pvchain.h \
             models/pvarray.h \
             models/comport.h \
+            models/devicesweep.h \
+            models/transientcapture.h \
+            models/irradianceprofile.h \
             models/dummycurrentandvoltagesensor.h \
             tools/Lambda.h \
             plot/pvmodelfunctionbase.h \
@@ -6,11 +6,15 @@
 #include "widgets/cellwidget.h"
 #include "widgets/characteristicscurve2dwidget.h"
 #include "widgets/characteristicscurve3dwidget.h"
+#include "widgets/transientplotwidget.h"
 
 #include "models/pvarray.h"
 #include "models/pvchain.h"
 #include "models/pvcell.h"
 #include "models/dummycurrentandvoltagesensor.h"
+#include "models/devicesweep.h"
+#include "models/transientcapture.h"
+#include "models/irradianceprofile.h"
 
 #include "tools/Lambda.h"
 
@@ -22,6 +26,7 @@
 #include <QSpacerItem>
 #include <QTableWidget>
 #include <QScrollArea>
+#include <QFileDialog>
 
 // ----------------------------------------------------------------------------
 BAT6Widget::BAT6Widget(QWidget *parent) :
@@ -31,7 +36,15 @@ BAT6Widget::BAT6Widget(QWidget *parent) :
     m_Console(new ConsoleWidget(this)),
     m_cc2d(new CharacteristicsCurve2DWidget(this)),
     m_cc3d(new CharacteristicsCurve3DWidget(this)),
-    m_AddCellButton(new QPushButton("Add Cell"))
+    m_AddCellButton(new QPushButton("Add Cell")),
+    m_DeviceSweepButton(new QPushButton("Compare With Device")),
+    m_DeviceSweep(new DeviceSweep(this, m_Console->getCOMPort())),
+    m_TransientArmButton(new QPushButton("Arm Transient Capture")),
+    m_TransientTriggerButton(new QPushButton("Trigger")),
+    m_TransientCapture(new TransientCapture(this, m_Console->getCOMPort())),
+    m_TransientPlot(new TransientPlotWidget(this)),
+    m_PlayProfileButton(new QPushButton("Play Irradiance Profile...")),
+    m_IrradianceProfile(new IrradianceProfile(this, m_Console->getCOMPort()))
 {
     ui->setupUi(this);
 
@@ -61,6 +74,18 @@ BAT6Widget::BAT6Widget(QWidget *parent) :
     // button for adding cells
     m_CellWidgetContainer->layout()->addWidget(m_AddCellButton);
 
+    // button for overlaying the device's own I-V curve
+    ui->group_box_controls->layout()->addWidget(m_DeviceSweepButton);
+
+    // buttons for capturing transients, the device triggers on a current
+    // step by itself
+    ui->group_box_controls->layout()->addWidget(m_TransientArmButton);
+    ui->group_box_controls->layout()->addWidget(m_TransientTriggerButton);
+    m_TransientTriggerButton->setEnabled(false);
+
+    // button for streaming a recorded or synthetic irradiance profile
+    ui->group_box_controls->layout()->addWidget(m_PlayProfileButton);
+
     // add 3D plot
     ui->group_box_plots->setLayout(new QHBoxLayout);
     ui->group_box_plots->layout()->addWidget(m_cc3d);
@@ -68,6 +93,10 @@ BAT6Widget::BAT6Widget(QWidget *parent) :
     // add 2D plot
     ui->group_box_plots->layout()->addWidget(m_cc2d);
     m_cc2d->setSizePolicy(QSizePolicy::Policy::Expanding, QSizePolicy::Policy::Expanding);
+    // add transient plot, hidden until something was captured
+    ui->group_box_plots->layout()->addWidget(m_TransientPlot);
+    m_TransientPlot->setSizePolicy(QSizePolicy::Policy::Expanding, QSizePolicy::Policy::Expanding);
+    m_TransientPlot->hide();
 
     // create model with no cells
     m_PVArray = QSharedPointer<PVArray>(new PVArray);
@@ -90,6 +119,28 @@ BAT6Widget::BAT6Widget(QWidget *parent) :
     // signals
     this->connect(m_AddCellButton, SIGNAL(released()), this, SLOT(onAddCellButtonReleased()));
     this->connect(ui->slider_global_exposure, SIGNAL(valueChanged(int)), this, SLOT(onGlobalExposureChanged(int)));
+    this->connect(m_DeviceSweepButton, SIGNAL(released()), this, SLOT(onDeviceSweepButtonReleased()));
+    this->connect(m_DeviceSweep, SIGNAL(finished(QVector<QPointF>)), this, SLOT(onDeviceSweepFinished()));
+    this->connect(m_DeviceSweep, SIGNAL(failed()), new Lambda([this]() {
+        m_DeviceSweepButton->setEnabled(true);
+    }, this), SLOT(call()));
+    this->connect(m_TransientArmButton, SIGNAL(released()), this, SLOT(onTransientArmButtonReleased()));
+    this->connect(m_TransientTriggerButton, SIGNAL(released()), m_TransientCapture, SLOT(trigger()));
+    this->connect(m_TransientCapture, SIGNAL(armed()), new Lambda([this]() {
+        m_TransientTriggerButton->setEnabled(true);
+    }, this), SLOT(call()));
+    this->connect(m_TransientCapture, SIGNAL(finished()), this, SLOT(onTransientCaptureFinished()));
+    this->connect(m_PlayProfileButton, SIGNAL(released()), this, SLOT(onPlayProfileButtonReleased()));
+    this->connect(m_IrradianceProfile, SIGNAL(finished()), new Lambda([this]() {
+        m_PlayProfileButton->setEnabled(true);
+    }, this), SLOT(call()));
+    this->connect(m_IrradianceProfile, SIGNAL(failed()), new Lambda([this]() {
+        m_PlayProfileButton->setEnabled(true);
+    }, this), SLOT(call()));
+    this->connect(m_TransientCapture, SIGNAL(failed()), new Lambda([this]() {
+        m_TransientArmButton->setEnabled(true);
+        m_TransientTriggerButton->setEnabled(false);
+    }, this), SLOT(call()));
 
     this->addCell();
 }
@@ -279,6 +330,53 @@ void BAT6Widget::onVoltageMeasured(double voltage)
     ui->line_edit_measured_power->setText(QString::number(ui->line_edit_measured_current->text().toDouble() * voltage));
 }
 
+// ----------------------------------------------------------------------------
+void BAT6Widget::onDeviceSweepButtonReleased()
+{
+    m_DeviceSweepButton->setEnabled(false);
+    m_DeviceSweep->start(128);
+}
+
+// ----------------------------------------------------------------------------
+void BAT6Widget::onDeviceSweepFinished()
+{
+    // more than 2% of the open circuit voltage means the fixed point model
+    // lost precision somewhere
+    bool diverges = m_DeviceSweep->calculateDeviation(*m_PVArray) > 0.02;
+    m_cc2d->setDeviceCurve(m_DeviceSweep->getSamples(), diverges);
+    m_DeviceSweepButton->setEnabled(true);
+}
+
+// ----------------------------------------------------------------------------
+void BAT6Widget::onTransientArmButtonReleased()
+{
+    // a quarter of the window before the trigger, trigger on 0.5A steps
+    m_TransientArmButton->setEnabled(false);
+    m_TransientCapture->arm(16, 0.5);
+}
+
+// ----------------------------------------------------------------------------
+void BAT6Widget::onTransientCaptureFinished()
+{
+    m_TransientPlot->setSamples(m_TransientCapture->getVoltageSamples(),
+                                m_TransientCapture->getCurrentSamples());
+    m_TransientPlot->show();
+    m_TransientArmButton->setEnabled(true);
+    m_TransientTriggerButton->setEnabled(false);
+}
+
+// ----------------------------------------------------------------------------
+void BAT6Widget::onPlayProfileButtonReleased()
+{
+    QString fileName = QFileDialog::getOpenFileName(this, "Play Irradiance Profile",
+                                                    QString(), "Profiles (*.csv)");
+    if(fileName.isEmpty() || !m_IrradianceProfile->loadCSV(fileName))
+        return;
+
+    m_PlayProfileButton->setEnabled(false);
+    m_IrradianceProfile->start();
+}
+
 // ----------------------------------------------------------------------------
 void BAT6Widget::onCurrentMeasured(double current)
 {
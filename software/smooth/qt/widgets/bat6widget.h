@@ -15,6 +15,10 @@ class CharacteristicsCurve2DWidget;
 class CharacteristicsCurve3DWidget;
 class QPushButton;
 class PVArray;
+class DeviceSweep;
+class TransientCapture;
+class TransientPlotWidget;
+class IrradianceProfile;
 
 class BAT6Widget : public QWidget
 {
@@ -43,6 +47,11 @@ private slots:
     void onGlobalExposureChanged(int value);
     void onVoltageMeasured(double voltage);
     void onCurrentMeasured(double current);
+    void onDeviceSweepButtonReleased();
+    void onDeviceSweepFinished();
+    void onTransientArmButtonReleased();
+    void onTransientCaptureFinished();
+    void onPlayProfileButtonReleased();
 
 private:
     QScopedPointer<Ui::BAT6Widget> ui;
@@ -55,6 +64,14 @@ private:
     CharacteristicsCurve2DWidget* m_cc2d;
     CharacteristicsCurve3DWidget* m_cc3d;
     QPushButton* m_AddCellButton;
+    QPushButton* m_DeviceSweepButton;
+    DeviceSweep* m_DeviceSweep;
+    QPushButton* m_TransientArmButton;
+    QPushButton* m_TransientTriggerButton;
+    TransientCapture* m_TransientCapture;
+    TransientPlotWidget* m_TransientPlot;
+    QPushButton* m_PlayProfileButton;
+    IrradianceProfile* m_IrradianceProfile;
 };
 
 #endif // BAT6_WIDGET_H
@@ -19,7 +19,8 @@
 CharacteristicsCurve2DWidget::CharacteristicsCurve2DWidget(QWidget* parent) :
     QwtPlot(parent),
     m_IVCurve(new QwtPlotCurve),
-    m_PowerCurve(new QwtPlotCurve)
+    m_PowerCurve(new QwtPlotCurve),
+    m_DeviceCurve(new QwtPlotCurve)
 {
     this->setTitle("IV Characteristic Curve and Power");
 
@@ -36,6 +37,10 @@ CharacteristicsCurve2DWidget::CharacteristicsCurve2DWidget(QWidget* parent) :
     m_PowerCurve->setAxes(QwtPlot::xBottom, QwtPlot::yRight);
     m_PowerCurve->setPen(QPen(QColor(255, 0, 0)));
 
+    // I-V curve calculated by the device, hidden until a sweep was received
+    m_DeviceCurve->setTitle(QString("Device Model"));
+    m_DeviceCurve->setPen(QPen(QColor(0, 160, 0), 0, Qt::DashLine));
+
     // set axis titles
     this->setAxisTitle(QwtPlot::yLeft, QString("Current (I)"));
     this->setAxisTitle(QwtPlot::yRight, QString("Power (W)"));
@@ -105,6 +110,24 @@ void CharacteristicsCurve2DWidget::autoScale()
     this->setAxisScale(QwtPlot::yRight, powerCurve->boundingRect().y(), powerCurve->boundingRect().height());
 }
 
+// ----------------------------------------------------------------------------
+void CharacteristicsCurve2DWidget::setDeviceCurve(const QVector<QPointF>& samples, bool diverges)
+{
+    m_DeviceCurve->setSamples(samples);
+    if(diverges)
+    {
+        m_DeviceCurve->setTitle(QString("Device Model (diverges)"));
+        m_DeviceCurve->setPen(QPen(QColor(255, 128, 0), 2, Qt::DashLine));
+    }
+    else
+    {
+        m_DeviceCurve->setTitle(QString("Device Model"));
+        m_DeviceCurve->setPen(QPen(QColor(0, 160, 0), 0, Qt::DashLine));
+    }
+    m_DeviceCurve->attach(this);
+    this->replot();
+}
+
 // ----------------------------------------------------------------------------
 void CharacteristicsCurve2DWidget::replot()
 {
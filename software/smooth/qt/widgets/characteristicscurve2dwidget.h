@@ -6,6 +6,8 @@
 #include <QSharedPointer>
 #include <QMap>
 #include <QString>
+#include <QPointF>
+#include <QVector>
 #include <qwt/qwt_plot.h>
 #include <qwt/qwt_plot_curve.h>
 
@@ -21,6 +23,13 @@ public:
 
     void autoScale();
 
+    /*!
+     * \brief Overlays the I-V curve the device's own model produced.
+     * \param samples (V, I) pairs as received from the device.
+     * \param diverges Highlights the curve if it doesn't match the host's model.
+     */
+    void setDeviceCurve(const QVector<QPointF>& samples, bool diverges);
+
     virtual void addPVArray(const QString &name, QSharedPointer<PVArray> pvarray) override;
     virtual void removePVArray(const QString &name) override;
     virtual void replot() override;
@@ -28,6 +37,7 @@ public:
 private:
     QwtPlotCurve* m_IVCurve;
     QwtPlotCurve* m_PowerCurve;
+    QwtPlotCurve* m_DeviceCurve;
 };
 
 #endif // CHARACTERISTICCURVE2DWIDGET_H
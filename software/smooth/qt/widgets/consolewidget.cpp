@@ -47,7 +47,8 @@ ConsoleWidget::ConsoleWidget(QWidget *parent)
     p.setColor(QPalette::Text, Qt::green);
     setPalette(p);
 
-    com.open("/dev/ttyUSB0");
+    if(com.open("/dev/ttyUSB0"))
+        com.negotiateBaudRate();
     this->connect(&com, SIGNAL(dataReceived(const char*)), this, SLOT(onDataReceived(const char*)));
 }
 
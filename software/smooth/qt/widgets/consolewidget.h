@@ -49,6 +49,8 @@ public:
     explicit ConsoleWidget(QWidget *parent = 0);
     void putData(const QByteArray &data);
     void setLocalEchoEnabled(bool set);
+    COMPort* getCOMPort()
+        { return &com; }
 
 protected:
     virtual void keyPressEvent(QKeyEvent *e);
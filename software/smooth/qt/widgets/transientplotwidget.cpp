@@ -0,0 +1,68 @@
+#include "widgets/transientplotwidget.h"
+
+#include <qwt/qwt_plot_curve.h>
+#include <qwt/qwt_plot_grid.h>
+#include <qwt/qwt_plot_legenditem.h>
+#include <qwt/qwt_plot_marker.h>
+
+#include <QColor>
+
+// ----------------------------------------------------------------------------
+TransientPlotWidget::TransientPlotWidget(QWidget* parent) :
+    QwtPlot(parent),
+    m_VoltageCurve(new QwtPlotCurve),
+    m_CurrentCurve(new QwtPlotCurve),
+    m_TriggerMarker(new QwtPlotMarker)
+{
+    this->setTitle("Transient");
+
+    m_VoltageCurve->attach(this);
+    m_VoltageCurve->setTitle(QString("Voltage"));
+    m_VoltageCurve->setPen(QPen(QColor(0, 0, 255)));
+
+    this->enableAxis(QwtPlot::yRight);
+    m_CurrentCurve->attach(this);
+    m_CurrentCurve->setTitle(QString("Current"));
+    m_CurrentCurve->setAxes(QwtPlot::xBottom, QwtPlot::yRight);
+    m_CurrentCurve->setPen(QPen(QColor(255, 0, 0)));
+
+    // the trigger is always at t = 0
+    m_TriggerMarker->setLineStyle(QwtPlotMarker::VLine);
+    m_TriggerMarker->setLinePen(QPen(Qt::darkGray, 0, Qt::DashLine));
+    m_TriggerMarker->setXValue(0.0);
+    m_TriggerMarker->attach(this);
+
+    this->setAxisTitle(QwtPlot::yLeft, QString("Voltage (V)"));
+    this->setAxisTitle(QwtPlot::yRight, QString("Current (A)"));
+    this->setAxisTitle(QwtPlot::xBottom, QString("Time (ms)"));
+
+    QwtPlotGrid* grid = new QwtPlotGrid;
+    grid->setMajorPen(QPen(Qt::black, 0, Qt::DotLine));
+    grid->setMinorPen(QPen(Qt::gray, 0 , Qt::DotLine));
+    grid->attach(this);
+
+    QwtPlotLegendItem* legend = new QwtPlotLegendItem();
+    legend->attach(this);
+    legend->setAlignment(Qt::Alignment(Qt::AlignRight | Qt::AlignTop));
+    legend->setMaxColumns(1);
+
+    this->setCanvasBackground(QColor(Qt::white));
+    this->replot();
+}
+
+// ----------------------------------------------------------------------------
+TransientPlotWidget::~TransientPlotWidget()
+{
+}
+
+// ----------------------------------------------------------------------------
+void TransientPlotWidget::setSamples(const QVector<QPointF>& voltage,
+                                     const QVector<QPointF>& current)
+{
+    m_VoltageCurve->setSamples(voltage);
+    m_CurrentCurve->setSamples(current);
+    this->setAxisAutoScale(QwtPlot::xBottom);
+    this->setAxisAutoScale(QwtPlot::yLeft);
+    this->setAxisAutoScale(QwtPlot::yRight);
+    this->replot();
+}
@@ -0,0 +1,33 @@
+#ifndef TRANSIENTPLOTWIDGET_H
+#define TRANSIENTPLOTWIDGET_H
+
+#include <QPointF>
+#include <QVector>
+#include <qwt/qwt_plot.h>
+
+class QwtPlotCurve;
+class QwtPlotMarker;
+
+/*!
+ * \brief Scope-like view of a transient captured by the device. Voltage is
+ * on the left axis, current on the right, time in milliseconds relative to
+ * the trigger.
+ */
+class TransientPlotWidget : public QwtPlot
+{
+    Q_OBJECT
+
+public:
+    TransientPlotWidget(QWidget* parent=nullptr);
+    ~TransientPlotWidget();
+
+    void setSamples(const QVector<QPointF>& voltage,
+                    const QVector<QPointF>& current);
+
+private:
+    QwtPlotCurve* m_VoltageCurve;
+    QwtPlotCurve* m_CurrentCurve;
+    QwtPlotMarker* m_TriggerMarker;
+};
+
+#endif // TRANSIENTPLOTWIDGET_H
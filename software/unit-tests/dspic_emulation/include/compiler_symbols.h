@@ -3,3 +3,34 @@
 
 void __builtin_write_OSCCONL(volatile unsigned short x);
 void __builtin_write_OSCCONH(volatile unsigned short x);
+
+unsigned int __builtin_tblrdl(unsigned int offset);
+unsigned int __builtin_tblrdh(unsigned int offset);
+void __builtin_tblwtl(unsigned int offset, unsigned int data);
+void __builtin_tblwth(unsigned int offset, unsigned int data);
+void __builtin_write_NVM(void);
+
+/* Time the NVM controller spent on operations, see compiler_symbols.cpp */
+extern unsigned long emulated_nvm_time_us;
+
+/*
+ * DSP engine, see compiler_symbols.cpp. On the device the accumulators are
+ * declared as register int a asm("A"), here they're 64-bit integers holding
+ * the 40-bit value. Prefetches and write backs aren't emulated, pass NULL.
+ */
+typedef long long accumulator_t;
+
+accumulator_t __builtin_mpy(int a, int b,
+                            int** xptr, int* xval, int xincr,
+                            int** yptr, int* yval, int yincr);
+accumulator_t __builtin_mac(accumulator_t accum, int a, int b,
+                            int** xptr, int* xval, int xincr,
+                            int** yptr, int* yval, int yincr,
+                            int* awb, int awb_accum);
+accumulator_t __builtin_msc(accumulator_t accum, int a, int b,
+                            int** xptr, int* xval, int xincr,
+                            int** yptr, int* yval, int yincr,
+                            int* awb, int awb_accum);
+accumulator_t __builtin_lac(int value, int shift);
+int __builtin_sac(accumulator_t accum, int shift);
+int __builtin_sacr(accumulator_t accum, int shift);
@@ -9,3 +9,4 @@
 #define _K   (1 << (_Q - 1))
 
 _Q16 _Q16mpy(_Q16 a, _Q16 b);
+_Q16 _Q16exp(_Q16 x);
@@ -1,4 +1,194 @@
 #include "compiler_symbols.h"
+#include "p33EP16GS506.h"
+#include <stddef.h>
 
 void __builtin_write_OSCCONL(volatile unsigned short x) {}
 void __builtin_write_OSCCONH(volatile unsigned short x) {}
+
+/*
+ * Program memory is emulated as an array of 24-bit instruction words, each
+ * taking up two program address units. Table writes to page 0xFA go to the
+ * two write latches, which __builtin_write_NVM() commits the same way the NVM
+ * controller does for the operation selected in NVMCONbits.NVMOP. Like real
+ * flash, programming can only clear bits.
+ *
+ * Every operation adds the time the NVM controller would be busy with it to
+ * emulated_nvm_time_us, so tests can check time budgets. The times are
+ * meant to be on the safe side of the double word programming and page erase
+ * times in the datasheet's electrical characteristics.
+ */
+#define PROGRAM_MEMORY_SIZE 0x2C00
+#define ERASE_PAGE_SIZE     0x400
+#define WRITE_LATCH_PAGE    0xFA
+#define ERASED              0xFFFFFFUL
+
+#define NVMOP_DOUBLE_WORD   0x1
+#define NVMOP_PAGE_ERASE    0x3
+
+#define DOUBLE_WORD_TIME_US 50
+#define PAGE_ERASE_TIME_US  25000
+
+unsigned long emulated_nvm_time_us = 0;
+
+static unsigned long program_memory[PROGRAM_MEMORY_SIZE / 2];
+static unsigned long write_latch[2] = {ERASED, ERASED};
+static bool program_memory_erased = false;
+
+static unsigned long* instruction_at(unsigned long address)
+{
+    if(!program_memory_erased)
+    {
+        for(unsigned long i = 0; i != PROGRAM_MEMORY_SIZE / 2; ++i)
+            program_memory[i] = ERASED;
+        program_memory_erased = true;
+    }
+
+    if(address >= PROGRAM_MEMORY_SIZE)
+        return NULL;
+    return &program_memory[address / 2];
+}
+
+static unsigned long table_address(unsigned int offset)
+{
+    return ((unsigned long)TBLPAG << 16) | (offset & 0xFFFF);
+}
+
+unsigned int __builtin_tblrdl(unsigned int offset)
+{
+    unsigned long* word = instruction_at(table_address(offset));
+    return word ? (unsigned int)(*word & 0xFFFF) : 0xFFFF;
+}
+
+unsigned int __builtin_tblrdh(unsigned int offset)
+{
+    unsigned long* word = instruction_at(table_address(offset));
+    return word ? (unsigned int)(*word >> 16) : 0xFF;
+}
+
+void __builtin_tblwtl(unsigned int offset, unsigned int data)
+{
+    if(TBLPAG != WRITE_LATCH_PAGE)
+        return;
+    unsigned long* latch = &write_latch[(offset >> 1) & 1];
+    *latch = (*latch & 0xFF0000UL) | (data & 0xFFFF);
+}
+
+void __builtin_tblwth(unsigned int offset, unsigned int data)
+{
+    if(TBLPAG != WRITE_LATCH_PAGE)
+        return;
+    unsigned long* latch = &write_latch[(offset >> 1) & 1];
+    *latch = (*latch & 0xFFFF) | ((unsigned long)(data & 0xFF) << 16);
+}
+
+void __builtin_write_NVM(void)
+{
+    unsigned long address = ((unsigned long)NVMADRU << 16) | NVMADR;
+
+    NVMCONbits.WRERR = 0;
+    if(!NVMCONbits.WREN)
+    {
+        NVMCONbits.WRERR = 1;
+        return;
+    }
+
+    if(NVMCONbits.NVMOP == NVMOP_PAGE_ERASE)
+    {
+        address &= ~(unsigned long)(ERASE_PAGE_SIZE - 1);
+        for(unsigned long i = 0; i != ERASE_PAGE_SIZE; i += 2)
+        {
+            unsigned long* word = instruction_at(address + i);
+            if(word)
+                *word = ERASED;
+        }
+        emulated_nvm_time_us += PAGE_ERASE_TIME_US;
+    }
+    else if(NVMCONbits.NVMOP == NVMOP_DOUBLE_WORD)
+    {
+        for(unsigned long i = 0; i != 2; ++i)
+        {
+            unsigned long* word = instruction_at((address & ~3UL) + i * 2);
+            if(word)
+                *word &= write_latch[i];
+        }
+        emulated_nvm_time_us += DOUBLE_WORD_TIME_US;
+    }
+    else
+    {
+        NVMCONbits.WRERR = 1;
+    }
+
+    write_latch[0] = ERASED;
+    write_latch[1] = ERASED;
+    NVMCONbits.WR = 0;
+}
+
+/*
+ * The DSP engine as configured after reset: signed fractional multiplies,
+ * i.e. the product is shifted left by one, convergent rounding and saturation
+ * when storing an accumulator. The accumulators themselves aren't saturated
+ * and wrap at 40 bits. Shifts are right shifts, negative ones shift left.
+ */
+static accumulator_t wrap_40_bits(long long value)
+{
+    return (accumulator_t)((unsigned long long)value << 24) >> 24;
+}
+
+static long long shift_accumulator(accumulator_t accum, int shift)
+{
+    return shift >= 0 ? accum >> shift : accum * (1LL << -shift);
+}
+
+static int store_accumulator(long long value)
+{
+    if(value > 0x7FFFFFFFLL)
+        return 0x7FFF;
+    if(value < -0x80000000LL)
+        return -0x8000;
+    return (int)(value >> 16);
+}
+
+accumulator_t __builtin_mpy(int a, int b,
+                            int** xptr, int* xval, int xincr,
+                            int** yptr, int* yval, int yincr)
+{
+    return wrap_40_bits(2LL * (short)a * (short)b);
+}
+
+accumulator_t __builtin_mac(accumulator_t accum, int a, int b,
+                            int** xptr, int* xval, int xincr,
+                            int** yptr, int* yval, int yincr,
+                            int* awb, int awb_accum)
+{
+    return wrap_40_bits(accum + 2LL * (short)a * (short)b);
+}
+
+accumulator_t __builtin_msc(accumulator_t accum, int a, int b,
+                            int** xptr, int* xval, int xincr,
+                            int** yptr, int* yval, int yincr,
+                            int* awb, int awb_accum)
+{
+    return wrap_40_bits(accum - 2LL * (short)a * (short)b);
+}
+
+accumulator_t __builtin_lac(int value, int shift)
+{
+    return wrap_40_bits(shift_accumulator((long long)(short)value * 65536,
+                                          shift));
+}
+
+int __builtin_sac(accumulator_t accum, int shift)
+{
+    return store_accumulator(shift_accumulator(accum, shift));
+}
+
+int __builtin_sacr(accumulator_t accum, int shift)
+{
+    long long value = shift_accumulator(accum, shift);
+    long long below = value & 0xFFFF;
+
+    /* ties go to the even result */
+    if(below > 0x8000 || (below == 0x8000 && (value & 0x10000)))
+        value += 0x10000;
+    return store_accumulator(value - below);
+}
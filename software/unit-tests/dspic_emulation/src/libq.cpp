@@ -1,5 +1,6 @@
 #include "libq.h"
 #include <stddef.h>
+#include <math.h>
 
 _Q16 _Q16mpy(_Q16 x, _Q16 y)
 {
@@ -13,3 +14,8 @@ _Q16 _Q16mpy(_Q16 x, _Q16 y)
     int result = (result_high << 16) + result_mid + (result_low >> 16);
     return (_Q16)result;
 }
+
+_Q16 _Q16exp(_Q16 x)
+{
+    return (_Q16)(exp(x / 65536.0) * 65536.0);
+}
@@ -18,10 +18,12 @@ public:
         /* prevent waiting for ADC cores */
         ADCON5Lbits.C0RDY = 1;
         ADCON5Lbits.C1RDY = 1;
+        ADCON5Lbits.SHRRDY = 1;
         ADCAL0Lbits.CAL0RDY = 1;
         ADCAL0Lbits.CAL0RDY = 1;
         ADCAL0Lbits.CAL1RDY = 1;
         ADCAL0Lbits.CAL1RDY = 1;
+        ADCAL1Hbits.CSHRRDY = 1;
 
         /* prevent waiting for I2C2 related stuff */
         I2C2CONLbits.SEN = 0;